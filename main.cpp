@@ -1,5 +1,14 @@
-﻿#include "glut.h" // GLUTライブラリ
+﻿#ifdef KOMLOY_SYSTEM_GLUT
+#include <GL/freeglut.h> // システムのfreeglut (CMakeでのビルド。glutGetProcAddress を含む)
+#else
+#include "glut.h" // GLUTライブラリ (同梱のWindows版)
+#include "freeglut_ext.h" // glutGetProcAddress (拡張関数の取得用)
+#endif
 #include <GL/gl.h> // OpenGLライブラリ
+#ifdef KOMLOY_HAVE_EGL
+#include <EGL/egl.h>    // ウィンドウなしのコンテキスト (--bench)
+#include <EGL/eglext.h> // サーフェスレスのプラットフォーム
+#endif
 #define _USE_MATH_DEFINES // WindowsでM_PIを使うため
 #include <math.h> // 数学関数
 #include <cmath> // C++の数学関数
@@ -7,6 +16,133 @@
 #include <iostream> // デバッグ用
 #include <random>    // 乱数生成エンジン (std::mt19937)
 #include <chrono>    // 乱数シード用
+#include <cstdint>   // 固定幅整数型 (ハッシュ計算用)
+#include <cstddef>   // ptrdiff_t (バッファサイズ型)
+#include <climits>   // INT_MIN
+#include <cfloat>    // FLT_MAX
+#include <algorithm> // std::sort
+#include <thread>    // セクター生成用のバックグラウンドスレッド
+#include <mutex>     // スレッド間の受け渡し
+#include <condition_variable> // ワーカースレッドの起床通知
+#include <cstdio>    // スナップショットの書き出し
+#include <cstdlib>   // malloc/free
+#include <cstring>   // memcpy
+#include <string>    // ファイルパス
+#include <sstream>   // 乱数生成器の状態の直列化
+#include <atomic>    // インスタンスバッファへの並列な書き込み位置
+#include <utility>   // std::exchange
+#include <tuple>     // std::tie (CPUの描画のランタンの並べ替え)
+#include <coroutine> // ジョブシステムのタスク (C++20)
+#include <new>       // std::bad_alloc (確保の計測)
+#include <cerrno>    // errno (コマンドライン引数の数値の範囲外)
+#include <limits>    // std::numeric_limits (コマンドライン引数の数値の範囲)
+#include <type_traits> // std::is_floating_point (コマンドライン引数の数値の型)
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h> // SSE2 (コンパクトなランタン状態の一括変換)
+#define USE_SSE2
+#endif
+#ifdef _WIN32
+#include <windows.h> // スナップショットのメモリマップ (MapViewOfFile)
+#else
+#include <fcntl.h>    // open
+#include <sys/mman.h> // スナップショットのメモリマップ (mmap)
+#include <sys/stat.h> // fstat
+#include <unistd.h>   // close
+#endif
+
+// --- メモリの計測 ---
+// ヒープの確保をサブシステムごとのタグで数える。数えるのは trackedAlloc と TrackedVector を通した確保だけで、
+// KOMLOY_TRACK_ALL_ALLOCATIONS のビルドでは operator new を経由する全ても other に数える。確保の先頭に大きさとタグを置くので、解放にはポインタだけを渡す
+enum MemoryTag { MEMORY_SIM, MEMORY_RENDER, MEMORY_STARS, MEMORY_WORLD, MEMORY_OTHER, MEMORY_TAG_COUNT };
+// オーバーレイでも使うのでASCIIの名前 (GLUTのビットマップフォントは日本語を描けない)
+const char* const MEMORY_TAG_NAMES[MEMORY_TAG_COUNT] = { "sim", "render", "stars", "world", "other" };
+
+struct MemoryHeader {
+    size_t bytes; // 要求された大きさ
+    MemoryTag tag; // 確保したサブシステム
+};
+
+const size_t MEMORY_HEADER_SIZE = alignof(std::max_align_t); // 先頭に置く領域 (後ろの整列を malloc と同じに保つ)
+static_assert(sizeof(MemoryHeader) <= MEMORY_HEADER_SIZE, "MemoryHeader must fit in the allocation header");
+
+// タグごとの確保の集計 (静的領域なのでゼロで始まり、どのスレッドからも更新される)
+struct MemoryCounters {
+    std::atomic<int64_t> liveBytes; // 確保中のバイト数
+    std::atomic<int64_t> peakBytes; // 確保中のバイト数の最大
+    std::atomic<uint64_t> allocations; // 起動からの確保回数
+};
+
+MemoryCounters memoryCounters[MEMORY_TAG_COUNT];
+
+// タグを付けて確保する関数 (失敗したらnullptr)
+void* trackedAlloc(MemoryTag tag, size_t bytes) {
+    void* block = malloc(bytes + MEMORY_HEADER_SIZE);
+    if (!block) {
+        return nullptr;
+    }
+    MemoryHeader header = { bytes, tag };
+    memcpy(block, &header, sizeof(header));
+    MemoryCounters& counters = memoryCounters[tag];
+    int64_t live = counters.liveBytes.fetch_add(static_cast<int64_t>(bytes), std::memory_order_relaxed) + static_cast<int64_t>(bytes);
+    int64_t peak = counters.peakBytes.load(std::memory_order_relaxed);
+    while (live > peak && !counters.peakBytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {
+    }
+    counters.allocations.fetch_add(1, std::memory_order_relaxed);
+    return static_cast<char*>(block) + MEMORY_HEADER_SIZE;
+}
+
+// trackedAlloc で確保した領域を解放する関数 (nullptrなら何もしない)
+void trackedFree(void* p) {
+    if (!p) {
+        return;
+    }
+    char* block = static_cast<char*>(p) - MEMORY_HEADER_SIZE;
+    MemoryHeader header;
+    memcpy(&header, block, sizeof(header));
+    memoryCounters[header.tag].liveBytes.fetch_sub(static_cast<int64_t>(header.bytes), std::memory_order_relaxed);
+    free(block);
+}
+
+// 確保をタグに数える標準コンテナ用のアロケータ
+template <typename T, MemoryTag Tag>
+struct TrackedAllocator {
+    typedef T value_type;
+
+    TrackedAllocator() = default;
+    template <typename U>
+    TrackedAllocator(const TrackedAllocator<U, Tag>&) {}
+
+    T* allocate(size_t n) {
+        void* p = trackedAlloc(Tag, n * sizeof(T));
+        if (!p) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(p);
+    }
+    void deallocate(T* p, size_t) { trackedFree(p); }
+
+    template <typename U>
+    struct rebind { typedef TrackedAllocator<U, Tag> other; };
+    bool operator==(const TrackedAllocator&) const { return true; }
+    bool operator!=(const TrackedAllocator&) const { return false; }
+};
+
+template <typename T, MemoryTag Tag>
+using TrackedVector = std::vector<T, TrackedAllocator<T, Tag>>;
+
+#ifdef KOMLOY_TRACK_ALL_ALLOCATIONS
+// タグのない確保 (標準ライブラリやワーカーに渡す処理など) も全て other に数える。new[] と delete[] もこれらを通る。
+// 全ての確保にヘッダーと原子的な集計が加わるので、調査用のビルドだけで有効にする
+void* operator new(size_t bytes) {
+    void* p = trackedAlloc(MEMORY_OTHER, bytes);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+void operator delete(void* p) noexcept { trackedFree(p); }
+void operator delete(void* p, size_t) noexcept { trackedFree(p); }
+#endif
 
 // カメラ変数
 float cameraX = 0.0f;     // カメラX座標
@@ -16,13 +152,349 @@ float cameraRotationY = 0.0f; // カメラのヨー (水平回転)
 float cameraAngleX = 0.0f; // カメラのピッチ (垂直回転) - 初期値は正面
 float lastMouseX, lastMouseY; // マウスの最終座標
 bool mouseDragging = false; // マウスドラッグ中か
+int mousePressX = 0, mousePressY = 0; // 左ボタンを押した座標 (ほとんど動かさずに離したらランタンを選択する)
 
-// キーボード状態配列
+// キーボード状態配列 (シミュレーションが入力イベントから更新する。GLUTのコールバックは直接書き換えない)
 bool keyStates[256] = { false }; // 通常キー用
 bool specialKeyStates[256] = { false }; // 特殊キー (GLUT_KEY_UPなど)用
 
+// --- 入力イベントのキュー ---
+// GLUTのコールバック (生産側) はキーと視点の操作をイベントとしてキューに積むだけで、
+// シミュレーション (消費側) がティックの始めに取り出してキーの状態とカメラの向きに反映する。
+// 生産側と消費側が1つずつなので、読み書きの位置を原子的に進めるだけでロックなしに受け渡せる
+enum InputEventType {
+    INPUT_KEY_DOWN, // 通常キーの押し下げ
+    INPUT_KEY_UP, // 通常キーの離し
+    INPUT_SPECIAL_DOWN, // 特殊キーの押し下げ
+    INPUT_SPECIAL_UP, // 特殊キーの離し
+    INPUT_LOOK // マウスのドラッグによる視点の回転
+};
+
+struct InputEvent {
+    uint8_t type; // InputEventType
+    uint8_t key; // キーの番号 (キーのイベント)
+    float yaw, pitch; // 視点の回転量 (度, INPUT_LOOK)
+};
+
+const size_t INPUT_QUEUE_CAPACITY = 256; // キューの長さ (2の累乗。1ティックに届くマウスの移動より十分に長い)
+const size_t INPUT_QUEUE_RELEASE_RESERVE = 16; // キーを離すイベントのためだけに空けておく数 (離すイベントを捨てるとキーが押されたままになる)
+
+// 生産側と消費側が1つずつの、固定長の環状バッファのキュー
+struct InputQueue {
+    InputEvent events[INPUT_QUEUE_CAPACITY];
+    std::atomic<size_t> head{ 0 }; // 次に読む位置 (消費側だけが進める)
+    std::atomic<size_t> tail{ 0 }; // 次に書く位置 (生産側だけが進める)
+    std::atomic<uint32_t> dropped{ 0 }; // 満杯で積めなかったイベントの数 (起動からの累計。メモリのオーバーレイに表示する)
+
+    // イベントを積む (満杯ならfalse)。キーを離す以外のイベントは、予備の INPUT_QUEUE_RELEASE_RESERVE 個を残して満杯とみなす
+    bool push(const InputEvent& event) {
+        bool release = event.type == INPUT_KEY_UP || event.type == INPUT_SPECIAL_UP;
+        size_t limit = release ? INPUT_QUEUE_CAPACITY : INPUT_QUEUE_CAPACITY - INPUT_QUEUE_RELEASE_RESERVE;
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) >= limit) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        events[t & (INPUT_QUEUE_CAPACITY - 1)] = event;
+        tail.store(t + 1, std::memory_order_release); // イベントを書き終えてから消費側に見せる
+        return true;
+    }
+
+    // 最も古いイベントを取り出す (空ならfalse)
+    bool pop(InputEvent& event) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        event = events[h & (INPUT_QUEUE_CAPACITY - 1)];
+        head.store(h + 1, std::memory_order_release); // 読み終えてから生産側に場所を返す
+        return true;
+    }
+};
+
+InputQueue inputQueue; // GLUTのコールバックからシミュレーションへの入力
+float pendingLookYaw = 0.0f, pendingLookPitch = 0.0f; // キューが満杯で積めなかった視点の回転 (次に積めたイベントに足す。生産側だけが使う)
+
+// --- ベクトル・行列・四元数 ---
+// 行列はOpenGLと同じ列優先で、glLoadMatrixf にそのまま渡せる
+
+struct Vec3 {
+    float x, y, z;
+};
+
+inline Vec3 operator+(const Vec3& a, const Vec3& b) { return { a.x + b.x, a.y + b.y, a.z + b.z }; }
+inline Vec3 operator-(const Vec3& a, const Vec3& b) { return { a.x - b.x, a.y - b.y, a.z - b.z }; }
+inline Vec3 operator*(const Vec3& a, float s) { return { a.x * s, a.y * s, a.z * s }; }
+inline float dot(const Vec3& a, const Vec3& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+inline Vec3 cross(const Vec3& a, const Vec3& b) { return { a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x }; }
+inline Vec3 normalize(const Vec3& v) { return v * (1.0f / std::sqrt(dot(v, v))); }
+
+// 4x4行列 (列優先。m[列 * 4 + 行])
+struct alignas(16) Mat4 {
+    float m[16];
+
+    static Mat4 identity() {
+        Mat4 r = {};
+        r.m[0] = r.m[5] = r.m[10] = r.m[15] = 1.0f;
+        return r;
+    }
+};
+
+// 行列の積 a * b (列ごとに a の列を b の要素倍して足し合わせる)
+inline Mat4 operator*(const Mat4& a, const Mat4& b) {
+    Mat4 r;
+#ifdef USE_SSE2
+    __m128 c0 = _mm_load_ps(a.m), c1 = _mm_load_ps(a.m + 4), c2 = _mm_load_ps(a.m + 8), c3 = _mm_load_ps(a.m + 12);
+    for (int j = 0; j < 4; ++j) {
+        const float* col = b.m + j * 4;
+        __m128 v = _mm_mul_ps(c0, _mm_set1_ps(col[0]));
+        v = _mm_add_ps(v, _mm_mul_ps(c1, _mm_set1_ps(col[1])));
+        v = _mm_add_ps(v, _mm_mul_ps(c2, _mm_set1_ps(col[2])));
+        v = _mm_add_ps(v, _mm_mul_ps(c3, _mm_set1_ps(col[3])));
+        _mm_store_ps(r.m + j * 4, v);
+    }
+#else
+    for (int j = 0; j < 4; ++j) {
+        for (int i = 0; i < 4; ++i) {
+            r.m[j * 4 + i] = a.m[i] * b.m[j * 4] + a.m[4 + i] * b.m[j * 4 + 1] + a.m[8 + i] * b.m[j * 4 + 2] + a.m[12 + i] * b.m[j * 4 + 3];
+        }
+    }
+#endif
+    return r;
+}
+
+// 平行移動行列
+inline Mat4 translationMatrix(const Vec3& t) {
+    Mat4 r = Mat4::identity();
+    r.m[12] = t.x; r.m[13] = t.y; r.m[14] = t.z;
+    return r;
+}
+
+// 逆行列 (余因子展開。特異な行列には単位行列を返す)
+inline Mat4 inverse(const Mat4& a) {
+    const float* m = a.m;
+    Mat4 r;
+    float* inv = r.m;
+    inv[0] = m[5] * m[10] * m[15] - m[5] * m[11] * m[14] - m[9] * m[6] * m[15] + m[9] * m[7] * m[14] + m[13] * m[6] * m[11] - m[13] * m[7] * m[10];
+    inv[4] = -m[4] * m[10] * m[15] + m[4] * m[11] * m[14] + m[8] * m[6] * m[15] - m[8] * m[7] * m[14] - m[12] * m[6] * m[11] + m[12] * m[7] * m[10];
+    inv[8] = m[4] * m[9] * m[15] - m[4] * m[11] * m[13] - m[8] * m[5] * m[15] + m[8] * m[7] * m[13] + m[12] * m[5] * m[11] - m[12] * m[7] * m[9];
+    inv[12] = -m[4] * m[9] * m[14] + m[4] * m[10] * m[13] + m[8] * m[5] * m[14] - m[8] * m[6] * m[13] - m[12] * m[5] * m[10] + m[12] * m[6] * m[9];
+    inv[1] = -m[1] * m[10] * m[15] + m[1] * m[11] * m[14] + m[9] * m[2] * m[15] - m[9] * m[3] * m[14] - m[13] * m[2] * m[11] + m[13] * m[3] * m[10];
+    inv[5] = m[0] * m[10] * m[15] - m[0] * m[11] * m[14] - m[8] * m[2] * m[15] + m[8] * m[3] * m[14] + m[12] * m[2] * m[11] - m[12] * m[3] * m[10];
+    inv[9] = -m[0] * m[9] * m[15] + m[0] * m[11] * m[13] + m[8] * m[1] * m[15] - m[8] * m[3] * m[13] - m[12] * m[1] * m[11] + m[12] * m[3] * m[9];
+    inv[13] = m[0] * m[9] * m[14] - m[0] * m[10] * m[13] - m[8] * m[1] * m[14] + m[8] * m[2] * m[13] + m[12] * m[1] * m[10] - m[12] * m[2] * m[9];
+    inv[2] = m[1] * m[6] * m[15] - m[1] * m[7] * m[14] - m[5] * m[2] * m[15] + m[5] * m[3] * m[14] + m[13] * m[2] * m[7] - m[13] * m[3] * m[6];
+    inv[6] = -m[0] * m[6] * m[15] + m[0] * m[7] * m[14] + m[4] * m[2] * m[15] - m[4] * m[3] * m[14] - m[12] * m[2] * m[7] + m[12] * m[3] * m[6];
+    inv[10] = m[0] * m[5] * m[15] - m[0] * m[7] * m[13] - m[4] * m[1] * m[15] + m[4] * m[3] * m[13] + m[12] * m[1] * m[7] - m[12] * m[3] * m[5];
+    inv[14] = -m[0] * m[5] * m[14] + m[0] * m[6] * m[13] + m[4] * m[1] * m[14] - m[4] * m[2] * m[13] - m[12] * m[1] * m[6] + m[12] * m[2] * m[5];
+    inv[3] = -m[1] * m[6] * m[11] + m[1] * m[7] * m[10] + m[5] * m[2] * m[11] - m[5] * m[3] * m[10] - m[9] * m[2] * m[7] + m[9] * m[3] * m[6];
+    inv[7] = m[0] * m[6] * m[11] - m[0] * m[7] * m[10] - m[4] * m[2] * m[11] + m[4] * m[3] * m[10] + m[8] * m[2] * m[7] - m[8] * m[3] * m[6];
+    inv[11] = -m[0] * m[5] * m[11] + m[0] * m[7] * m[9] + m[4] * m[1] * m[11] - m[4] * m[3] * m[9] - m[8] * m[1] * m[7] + m[8] * m[3] * m[5];
+    inv[15] = m[0] * m[5] * m[10] - m[0] * m[6] * m[9] - m[4] * m[1] * m[10] + m[4] * m[2] * m[9] + m[8] * m[1] * m[6] - m[8] * m[2] * m[5];
+    float det = m[0] * inv[0] + m[1] * inv[4] + m[2] * inv[8] + m[3] * inv[12];
+    if (det == 0.0f) {
+        return Mat4::identity();
+    }
+    float invDet = 1.0f / det;
+    for (int i = 0; i < 16; ++i) {
+        inv[i] *= invDet;
+    }
+    return r;
+}
+
+// 原点から forward の向きを見るビュー行列 (視点を原点にした gluLookAt。forward と up は直交する単位ベクトル)
+inline Mat4 lookDirectionMatrix(const Vec3& forward, const Vec3& up) {
+    Vec3 side = cross(forward, up);
+    Vec3 top = cross(side, forward);
+    Mat4 r = Mat4::identity();
+    r.m[0] = side.x; r.m[4] = side.y; r.m[8] = side.z;
+    r.m[1] = top.x; r.m[5] = top.y; r.m[9] = top.z;
+    r.m[2] = -forward.x; r.m[6] = -forward.y; r.m[10] = -forward.z;
+    return r;
+}
+
+// 透視投影行列 (gluPerspective と同じ)
+inline Mat4 perspectiveMatrix(float fovYDegrees, float aspect, float nearZ, float farZ) {
+    float f = 1.0f / std::tan(fovYDegrees * static_cast<float>(M_PI) / 360.0f);
+    Mat4 r = {};
+    r.m[0] = f / aspect;
+    r.m[5] = f;
+    r.m[10] = (farZ + nearZ) / (nearZ - farZ);
+    r.m[11] = -1.0f;
+    r.m[14] = 2.0f * farZ * nearZ / (nearZ - farZ);
+    return r;
+}
+
+// 回転を表す単位四元数
+struct Quat {
+    float x, y, z, w;
+
+    // 軸周りの回転 (軸は単位ベクトル、角度は度)
+    static Quat axisAngle(const Vec3& axis, float degrees) {
+        float half = degrees * static_cast<float>(M_PI) / 360.0f;
+        float s = std::sin(half);
+        return { axis.x * s, axis.y * s, axis.z * s, std::cos(half) };
+    }
+};
+
+// 四元数の積 (b を回してから a を回す)
+inline Quat operator*(const Quat& a, const Quat& b) {
+    return {
+        a.w * b.x + a.x * b.w + a.y * b.z - a.z * b.y,
+        a.w * b.y - a.x * b.z + a.y * b.w + a.z * b.x,
+        a.w * b.z + a.x * b.y - a.y * b.x + a.z * b.w,
+        a.w * b.w - a.x * b.x - a.y * b.y - a.z * b.z
+    };
+}
+
+// 逆回転 (単位四元数の共役)
+inline Quat conjugate(const Quat& q) { return { -q.x, -q.y, -q.z, q.w }; }
+
+// 四元数でベクトルを回す
+inline Vec3 rotate(const Quat& q, const Vec3& v) {
+    Vec3 u = { q.x, q.y, q.z };
+    Vec3 t = cross(u, v) * 2.0f;
+    return v + t * q.w + cross(u, t);
+}
+
+// 四元数から回転行列を作る
+inline Mat4 rotationMatrix(const Quat& q) {
+    Mat4 r = Mat4::identity();
+    float xx = q.x * q.x, yy = q.y * q.y, zz = q.z * q.z;
+    float xy = q.x * q.y, xz = q.x * q.z, yz = q.y * q.z;
+    float wx = q.w * q.x, wy = q.w * q.y, wz = q.w * q.z;
+    r.m[0] = 1.0f - 2.0f * (yy + zz); r.m[1] = 2.0f * (xy + wz); r.m[2] = 2.0f * (xz - wy);
+    r.m[4] = 2.0f * (xy - wz); r.m[5] = 1.0f - 2.0f * (xx + zz); r.m[6] = 2.0f * (yz + wx);
+    r.m[8] = 2.0f * (xz + wy); r.m[9] = 2.0f * (yz - wx); r.m[10] = 1.0f - 2.0f * (xx + yy);
+    return r;
+}
+
+// 視錐台の6平面 (SoA。法線は内側向きで、内側の点は nx*x + ny*y + nz*z + d >= 0)
+// 4平面ずつSIMDで判定できるよう8要素分を持ち、余りは常に内側になる平面で埋める
+struct Frustum {
+    alignas(16) float nx[8], ny[8], nz[8], d[8];
+
+    // 軸に平行な箱が視錐台と交わる可能性があるか (各平面について最も内側の頂点だけを調べる)
+    bool intersectsBox(const Vec3& lo, const Vec3& hi) const {
+#ifdef USE_SSE2
+        const __m128 zero = _mm_setzero_ps();
+        for (int i = 0; i < 8; i += 4) {
+            __m128 px = _mm_load_ps(nx + i), py = _mm_load_ps(ny + i), pz = _mm_load_ps(nz + i);
+            __m128 mx = _mm_cmpge_ps(px, zero), my = _mm_cmpge_ps(py, zero), mz = _mm_cmpge_ps(pz, zero);
+            __m128 x = _mm_or_ps(_mm_and_ps(mx, _mm_set1_ps(hi.x)), _mm_andnot_ps(mx, _mm_set1_ps(lo.x)));
+            __m128 y = _mm_or_ps(_mm_and_ps(my, _mm_set1_ps(hi.y)), _mm_andnot_ps(my, _mm_set1_ps(lo.y)));
+            __m128 z = _mm_or_ps(_mm_and_ps(mz, _mm_set1_ps(hi.z)), _mm_andnot_ps(mz, _mm_set1_ps(lo.z)));
+            __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, x), _mm_mul_ps(py, y)), _mm_add_ps(_mm_mul_ps(pz, z), _mm_load_ps(d + i)));
+            if (_mm_movemask_ps(_mm_cmplt_ps(distance, zero))) {
+                return false;
+            }
+        }
+#else
+        for (int i = 0; i < 6; ++i) {
+            float x = nx[i] >= 0.0f ? hi.x : lo.x;
+            float y = ny[i] >= 0.0f ? hi.y : lo.y;
+            float z = nz[i] >= 0.0f ? hi.z : lo.z;
+            if (nx[i] * x + ny[i] * y + nz[i] * z + d[i] < 0.0f) {
+                return false;
+            }
+        }
+#endif
+        return true;
+    }
+};
+
+// カメラ - 位置と向きから、ビュー・投影・ビュー投影行列と視錐台を求めて保持する。
+// 姿勢や投影が変わったときだけ作り直すので、同じフレーム内で何度読んでも三角関数を計算し直さない
+class Camera {
+public:
+    // 位置と向き (ヨーとピッチ、度) を設定する。変わっていなければ何もしない
+    void setPose(const Vec3& position, float yawDegrees, float pitchDegrees) {
+        if (yawDegrees != yaw || pitchDegrees != pitch) {
+            yaw = yawDegrees;
+            pitch = pitchDegrees;
+            // ヨーは-Z方向の正面から右回り、ピッチは上向きが正
+            orientation = Quat::axisAngle({ 0.0f, 1.0f, 0.0f }, -yaw) * Quat::axisAngle({ 1.0f, 0.0f, 0.0f }, pitch);
+            rotationView = rotationMatrix(conjugate(orientation));
+            float yawRad = yaw * static_cast<float>(M_PI) / 180.0f;
+            flatForward = { std::sin(yawRad), 0.0f, -std::cos(yawRad) };
+            flatRight = { std::cos(yawRad), 0.0f, std::sin(yawRad) };
+            dirty = true;
+        }
+        if (position.x != eye.x || position.y != eye.y || position.z != eye.z) {
+            eye = position;
+            dirty = true;
+        }
+    }
+
+    // 透視投影を設定する (gluPerspective と同じ引数)
+    void setPerspective(float fovYDegrees, float aspect, float nearZ, float farZ) {
+        projectionMatrix = perspectiveMatrix(fovYDegrees, aspect, nearZ, farZ);
+        dirty = true;
+    }
+
+    const Vec3& position() const { return eye; }
+    Vec3 forward() const { return rotate(orientation, { 0.0f, 0.0f, -1.0f }); } // 視線方向
+    const Vec3& groundForward() const { return flatForward; } // 水平面上の前方 (移動用)
+    const Vec3& groundRight() const { return flatRight; } // 水平面上の右方向 (移動用)
+    const Mat4& skyView() const { return rotationView; } // 回転だけのビュー行列 (無限遠の星用)
+    const Mat4& projection() const { return projectionMatrix; }
+    const Mat4& view() { rebuild(); return viewMatrix; }
+    const Mat4& viewProjection() { rebuild(); return viewProjectionMatrix; }
+    const Frustum& frustum() { rebuild(); return frustumPlanes; }
+
+private:
+    // 姿勢か投影が変わっていれば、ビュー行列・ビュー投影行列・視錐台を作り直す
+    void rebuild() {
+        if (!dirty) {
+            return;
+        }
+        dirty = false;
+        viewMatrix = rotationView * translationMatrix(eye * -1.0f);
+        viewProjectionMatrix = projectionMatrix * viewMatrix;
+
+        // ビュー投影行列の行の和・差から6平面を取り出す (左, 右, 下, 上, 手前, 奥)
+        const float* m = viewProjectionMatrix.m;
+        for (int i = 0; i < 6; ++i) {
+            int row = i / 2;
+            float sign = (i % 2 == 0) ? 1.0f : -1.0f;
+            float a = m[3] + sign * m[row];
+            float b = m[7] + sign * m[4 + row];
+            float c = m[11] + sign * m[8 + row];
+            float e = m[15] + sign * m[12 + row];
+            float length = std::sqrt(a * a + b * b + c * c);
+            frustumPlanes.nx[i] = a / length;
+            frustumPlanes.ny[i] = b / length;
+            frustumPlanes.nz[i] = c / length;
+            frustumPlanes.d[i] = e / length;
+        }
+        for (int i = 6; i < 8; ++i) {
+            frustumPlanes.nx[i] = frustumPlanes.ny[i] = frustumPlanes.nz[i] = 0.0f;
+            frustumPlanes.d[i] = 1.0f;
+        }
+    }
+
+    Vec3 eye = { 0.0f, 0.0f, 0.0f }; // 位置
+    float yaw = NAN, pitch = NAN; // 向き (度。NaNは未設定)
+    Quat orientation = { 0.0f, 0.0f, 0.0f, 1.0f }; // 向き
+    Vec3 flatForward = { 0.0f, 0.0f, -1.0f }, flatRight = { 1.0f, 0.0f, 0.0f }; // 水平面上の前方・右方向
+    Mat4 rotationView = Mat4::identity(); // 回転だけのビュー行列
+    Mat4 projectionMatrix = Mat4::identity(); // 投影行列
+    Mat4 viewMatrix = Mat4::identity(); // ビュー行列
+    Mat4 viewProjectionMatrix = Mat4::identity(); // ビュー投影行列
+    Frustum frustumPlanes = {}; // 視錐台
+    bool dirty = true; // 行列・視錐台を作り直す必要があるか
+};
+
+Camera camera; // カメラ変数から求めた行列と視錐台
+
+// カメラ変数の現在の値をカメラに反映する関数 (変わっていなければ何も計算しない)
+void syncCamera() {
+    camera.setPose({ cameraX, cameraY, cameraZ }, cameraRotationY, cameraAngleX);
+}
+
 // 乱数生成器設定
-std::mt19937 rng(std::chrono::steady_clock::now().time_since_epoch().count()); // シード設定
+uint32_t rngSeed = static_cast<uint32_t>(std::chrono::steady_clock::now().time_since_epoch().count()); // シード (--seedで固定可能)
+std::mt19937 rng(rngSeed); // シード設定
 
 // 指定範囲でランダムな浮動小数点数を生成するヘルパー関数
 float getRandomFloat(float min, float max) {
@@ -32,6 +504,346 @@ float getRandomFloat(float min, float max) {
     return min + (max - min) * random_0_to_1;
 }
 
+// 整数を混ぜ合わせるハッシュ関数 (乱数状態を消費しない決定的な擬似乱数用)
+uint32_t hashUint(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x7feb352dU;
+    h ^= h >> 15;
+    h *= 0x846ca68bU;
+    h ^= h >> 16;
+    return h;
+}
+
+// 2次元の整数座標とソルトからハッシュ値を生成する関数
+uint32_t hashCoords(int x, int z, uint32_t salt) {
+    return hashUint(static_cast<uint32_t>(x) * 0x9e3779b1U ^ hashUint(static_cast<uint32_t>(z) + salt));
+}
+
+// ハッシュ値を [min, max] の浮動小数点数に変換する関数
+float hashToRange(uint32_t h, float min, float max) {
+    return min + (max - min) * (static_cast<float>(h >> 8) / 16777215.0f); // 上位24ビットを使用
+}
+
+// --- GL 1.5以降の拡張関数 ---
+// Windowsのgl.hはOpenGL 1.1までしか宣言しないため、必要な定数・型を補い、関数は実行時に取得する
+#ifndef APIENTRY
+#define APIENTRY
+#endif
+#ifndef GL_VERSION_1_5
+typedef ptrdiff_t GLsizeiptr;
+typedef ptrdiff_t GLintptr;
+#endif
+#ifndef GL_VERSION_2_0
+typedef char GLchar;
+#endif
+#ifndef GL_ARRAY_BUFFER
+#define GL_ARRAY_BUFFER 0x8892
+#define GL_ELEMENT_ARRAY_BUFFER 0x8893
+#define GL_STREAM_DRAW 0x88E0
+#define GL_STATIC_DRAW 0x88E4
+#define GL_DYNAMIC_DRAW 0x88E8
+#endif
+#ifndef GL_MAP_WRITE_BIT
+#define GL_MAP_WRITE_BIT 0x0002
+#define GL_MAP_INVALIDATE_BUFFER_BIT 0x0008
+#endif
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+#ifndef GL_SYNC_GPU_COMMANDS_COMPLETE
+typedef struct __GLsync* GLsync;
+typedef uint64_t GLuint64;
+#define GL_SYNC_FLUSH_COMMANDS_BIT 0x00000001
+#define GL_SYNC_GPU_COMMANDS_COMPLETE 0x9117
+#define GL_TIMEOUT_EXPIRED 0x911B
+#define GL_WAIT_FAILED 0x911D
+#endif
+#ifndef GL_VERTEX_SHADER
+#define GL_FRAGMENT_SHADER 0x8B30
+#define GL_VERTEX_SHADER 0x8B31
+#define GL_COMPILE_STATUS 0x8B81
+#define GL_LINK_STATUS 0x8B82
+#define GL_INFO_LOG_LENGTH 0x8B84
+#endif
+#ifndef GL_TEXTURE0
+#define GL_TEXTURE0 0x84C0
+#define GL_CLAMP_TO_EDGE 0x812F
+#endif
+#ifndef GL_DEPTH_COMPONENT24
+#define GL_DEPTH_COMPONENT24 0x81A6
+#endif
+#ifndef GL_TEXTURE_MAX_LEVEL
+#define GL_TEXTURE_MAX_LEVEL 0x813D
+#endif
+#ifndef GL_TEXTURE_CUBE_MAP
+#define GL_TEXTURE_WRAP_R 0x8072
+#define GL_TEXTURE_CUBE_MAP 0x8513
+#define GL_TEXTURE_CUBE_MAP_POSITIVE_X 0x8515
+#endif
+#ifndef GL_FRAMEBUFFER
+#define GL_READ_FRAMEBUFFER 0x8CA8
+#define GL_DRAW_FRAMEBUFFER 0x8CA9
+#define GL_FRAMEBUFFER_COMPLETE 0x8CD5
+#define GL_COLOR_ATTACHMENT0 0x8CE0
+#define GL_DEPTH_ATTACHMENT 0x8D00
+#define GL_FRAMEBUFFER 0x8D40
+#endif
+#ifndef GL_TIME_ELAPSED
+#define GL_QUERY_RESULT 0x8866
+#define GL_QUERY_RESULT_AVAILABLE 0x8867
+#define GL_TIME_ELAPSED 0x88BF
+#endif
+#ifndef GL_VERTICES_SUBMITTED_ARB
+#define GL_VERTICES_SUBMITTED_ARB 0x82EE
+#endif
+#ifndef GL_RASTERIZER_DISCARD
+#define GL_RASTERIZER_DISCARD 0x8C89
+#endif
+
+typedef void (APIENTRY* GLGenBuffersFunc)(GLsizei n, GLuint* buffers);
+typedef void (APIENTRY* GLDeleteBuffersFunc)(GLsizei n, const GLuint* buffers);
+typedef void (APIENTRY* GLBindBufferFunc)(GLenum target, GLuint buffer);
+typedef void (APIENTRY* GLBufferDataFunc)(GLenum target, GLsizeiptr size, const void* data, GLenum usage);
+typedef void (APIENTRY* GLBufferSubDataFunc)(GLenum target, GLintptr offset, GLsizeiptr size, const void* data);
+typedef void* (APIENTRY* GLMapBufferRangeFunc)(GLenum target, GLintptr offset, GLsizeiptr length, GLbitfield access);
+typedef GLboolean(APIENTRY* GLUnmapBufferFunc)(GLenum target);
+typedef void (APIENTRY* GLBufferStorageFunc)(GLenum target, GLsizeiptr size, const void* data, GLbitfield flags);
+typedef GLsync(APIENTRY* GLFenceSyncFunc)(GLenum condition, GLbitfield flags);
+typedef GLenum(APIENTRY* GLClientWaitSyncFunc)(GLsync sync, GLbitfield flags, GLuint64 timeout);
+typedef void (APIENTRY* GLDeleteSyncFunc)(GLsync sync);
+typedef GLuint(APIENTRY* GLCreateShaderFunc)(GLenum type);
+typedef void (APIENTRY* GLShaderSourceFunc)(GLuint shader, GLsizei count, const GLchar* const* string, const GLint* length);
+typedef void (APIENTRY* GLCompileShaderFunc)(GLuint shader);
+typedef void (APIENTRY* GLGetShaderivFunc)(GLuint shader, GLenum pname, GLint* params);
+typedef void (APIENTRY* GLGetShaderInfoLogFunc)(GLuint shader, GLsizei bufSize, GLsizei* length, GLchar* infoLog);
+typedef void (APIENTRY* GLDeleteShaderFunc)(GLuint shader);
+typedef GLuint(APIENTRY* GLCreateProgramFunc)();
+typedef void (APIENTRY* GLAttachShaderFunc)(GLuint program, GLuint shader);
+typedef void (APIENTRY* GLBindAttribLocationFunc)(GLuint program, GLuint index, const GLchar* name);
+typedef void (APIENTRY* GLLinkProgramFunc)(GLuint program);
+typedef void (APIENTRY* GLGetProgramivFunc)(GLuint program, GLenum pname, GLint* params);
+typedef void (APIENTRY* GLGetProgramInfoLogFunc)(GLuint program, GLsizei bufSize, GLsizei* length, GLchar* infoLog);
+typedef void (APIENTRY* GLUseProgramFunc)(GLuint program);
+typedef GLint(APIENTRY* GLGetUniformLocationFunc)(GLuint program, const GLchar* name);
+typedef void (APIENTRY* GLUniform1iFunc)(GLint location, GLint v0);
+typedef void (APIENTRY* GLUniform1fFunc)(GLint location, GLfloat v0);
+typedef void (APIENTRY* GLVertexAttribPointerFunc)(GLuint index, GLint size, GLenum type, GLboolean normalized, GLsizei stride, const void* pointer);
+typedef void (APIENTRY* GLEnableVertexAttribArrayFunc)(GLuint index);
+typedef void (APIENTRY* GLDisableVertexAttribArrayFunc)(GLuint index);
+typedef void (APIENTRY* GLVertexAttribDivisorFunc)(GLuint index, GLuint divisor);
+typedef void (APIENTRY* GLDrawArraysInstancedFunc)(GLenum mode, GLint first, GLsizei count, GLsizei instancecount);
+typedef void (APIENTRY* GLUniform2fFunc)(GLint location, GLfloat v0, GLfloat v1);
+typedef void (APIENTRY* GLUniform3fFunc)(GLint location, GLfloat v0, GLfloat v1, GLfloat v2);
+typedef void (APIENTRY* GLUniform4fFunc)(GLint location, GLfloat v0, GLfloat v1, GLfloat v2, GLfloat v3);
+typedef void (APIENTRY* GLUniformMatrix4fvFunc)(GLint location, GLsizei count, GLboolean transpose, const GLfloat* value);
+typedef void (APIENTRY* GLActiveTextureFunc)(GLenum texture);
+typedef void (APIENTRY* GLGenFramebuffersFunc)(GLsizei n, GLuint* framebuffers);
+typedef void (APIENTRY* GLDeleteFramebuffersFunc)(GLsizei n, const GLuint* framebuffers);
+typedef void (APIENTRY* GLBindFramebufferFunc)(GLenum target, GLuint framebuffer);
+typedef void (APIENTRY* GLFramebufferTexture2DFunc)(GLenum target, GLenum attachment, GLenum textarget, GLuint texture, GLint level);
+typedef GLenum(APIENTRY* GLCheckFramebufferStatusFunc)(GLenum target);
+typedef void (APIENTRY* GLGenerateMipmapFunc)(GLenum target);
+typedef void (APIENTRY* GLBlitFramebufferFunc)(GLint srcX0, GLint srcY0, GLint srcX1, GLint srcY1, GLint dstX0, GLint dstY0, GLint dstX1, GLint dstY1, GLbitfield mask, GLenum filter);
+typedef void (APIENTRY* GLGenQueriesFunc)(GLsizei n, GLuint* ids);
+typedef void (APIENTRY* GLDeleteQueriesFunc)(GLsizei n, const GLuint* ids);
+typedef void (APIENTRY* GLBeginQueryFunc)(GLenum target, GLuint id);
+typedef void (APIENTRY* GLEndQueryFunc)(GLenum target);
+typedef void (APIENTRY* GLGetQueryObjectivFunc)(GLuint id, GLenum pname, GLint* params);
+typedef void (APIENTRY* GLGetQueryObjectui64vFunc)(GLuint id, GLenum pname, GLuint64* params);
+
+GLGenBuffersFunc pglGenBuffers = nullptr;
+GLDeleteBuffersFunc pglDeleteBuffers = nullptr;
+GLBindBufferFunc pglBindBuffer = nullptr;
+GLBufferDataFunc pglBufferData = nullptr;
+GLBufferSubDataFunc pglBufferSubData = nullptr;
+GLMapBufferRangeFunc pglMapBufferRange = nullptr;
+GLUnmapBufferFunc pglUnmapBuffer = nullptr;
+GLBufferStorageFunc pglBufferStorage = nullptr;
+GLFenceSyncFunc pglFenceSync = nullptr;
+GLClientWaitSyncFunc pglClientWaitSync = nullptr;
+GLDeleteSyncFunc pglDeleteSync = nullptr;
+GLCreateShaderFunc pglCreateShader = nullptr;
+GLShaderSourceFunc pglShaderSource = nullptr;
+GLCompileShaderFunc pglCompileShader = nullptr;
+GLGetShaderivFunc pglGetShaderiv = nullptr;
+GLGetShaderInfoLogFunc pglGetShaderInfoLog = nullptr;
+GLDeleteShaderFunc pglDeleteShader = nullptr;
+GLCreateProgramFunc pglCreateProgram = nullptr;
+GLAttachShaderFunc pglAttachShader = nullptr;
+GLBindAttribLocationFunc pglBindAttribLocation = nullptr;
+GLLinkProgramFunc pglLinkProgram = nullptr;
+GLGetProgramivFunc pglGetProgramiv = nullptr;
+GLGetProgramInfoLogFunc pglGetProgramInfoLog = nullptr;
+GLUseProgramFunc pglUseProgram = nullptr;
+GLGetUniformLocationFunc pglGetUniformLocation = nullptr;
+GLUniform1iFunc pglUniform1i = nullptr;
+GLUniform1fFunc pglUniform1f = nullptr;
+GLVertexAttribPointerFunc pglVertexAttribPointer = nullptr;
+GLEnableVertexAttribArrayFunc pglEnableVertexAttribArray = nullptr;
+GLDisableVertexAttribArrayFunc pglDisableVertexAttribArray = nullptr;
+GLVertexAttribDivisorFunc pglVertexAttribDivisor = nullptr;
+GLDrawArraysInstancedFunc pglDrawArraysInstanced = nullptr;
+GLUniform2fFunc pglUniform2f = nullptr;
+GLUniform3fFunc pglUniform3f = nullptr;
+GLUniform4fFunc pglUniform4f = nullptr;
+GLUniformMatrix4fvFunc pglUniformMatrix4fv = nullptr;
+GLActiveTextureFunc pglActiveTexture = nullptr;
+GLGenFramebuffersFunc pglGenFramebuffers = nullptr;
+GLDeleteFramebuffersFunc pglDeleteFramebuffers = nullptr;
+GLBindFramebufferFunc pglBindFramebuffer = nullptr;
+GLFramebufferTexture2DFunc pglFramebufferTexture2D = nullptr;
+GLCheckFramebufferStatusFunc pglCheckFramebufferStatus = nullptr;
+GLBlitFramebufferFunc pglBlitFramebuffer = nullptr;
+GLGenerateMipmapFunc pglGenerateMipmap = nullptr;
+GLGenQueriesFunc pglGenQueries = nullptr;
+GLDeleteQueriesFunc pglDeleteQueries = nullptr;
+GLBeginQueryFunc pglBeginQuery = nullptr;
+GLEndQueryFunc pglEndQuery = nullptr;
+GLGetQueryObjectivFunc pglGetQueryObjectiv = nullptr;
+GLGetQueryObjectui64vFunc pglGetQueryObjectui64v = nullptr;
+
+bool hasVertexBuffers = false; // VBOが使用可能か
+bool hasMapBufferRange = false; // バッファを直接書き込み用にマップできるか
+bool hasPersistentMapping = false; // バッファを永続的にマップしたまま使えるか (GL_ARB_buffer_storage + フェンス)
+bool hasShaders = false; // GLSLシェーダーが使用可能か
+bool hasInstancing = false; // インスタンス描画が使用可能か
+bool hasFramebuffers = false; // テクスチャへの描画 (FBO) とフレームバッファ間のコピーが使用可能か
+bool hasTimerQueries = false; // GPUの処理時間を計測できるか
+bool hasVertexCountQueries = false; // 描画で送られた頂点数を数えられるか (GL_ARB_pipeline_statistics_query)
+bool headlessContext = false; // GLUTのウィンドウではなくEGLで作ったコンテキストか (--bench)
+
+// 関数ポインタを名前で取得するヘルパー
+template <typename Func>
+bool loadGLProc(Func& func, const char* name) {
+#ifdef KOMLOY_HAVE_EGL
+    if (headlessContext) {
+        func = reinterpret_cast<Func>(eglGetProcAddress(name));
+        return func != nullptr;
+    }
+#endif
+    func = reinterpret_cast<Func>(glutGetProcAddress(name));
+    return func != nullptr;
+}
+
+// コンテキストのOpenGLバージョンが指定以上か調べる関数
+bool hasGLVersion(int major, int minor) {
+    const char* version = reinterpret_cast<const char*>(glGetString(GL_VERSION));
+    int actualMajor = 0, actualMinor = 0;
+    if (!version || sscanf(version, "%d.%d", &actualMajor, &actualMinor) != 2) {
+        return false;
+    }
+    return actualMajor > major || (actualMajor == major && actualMinor >= minor);
+}
+
+// 拡張機能がサポートされているか調べる関数
+bool hasGLExtension(const char* name) {
+    const char* extensions = reinterpret_cast<const char*>(glGetString(GL_EXTENSIONS));
+    if (!extensions) {
+        return false;
+    }
+    size_t length = strlen(name);
+    for (const char* p = strstr(extensions, name); p; p = strstr(p + length, name)) {
+        if ((p == extensions || p[-1] == ' ') && (p[length] == ' ' || p[length] == '\0')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 拡張関数を取得する関数 (GLコンテキスト作成後に呼び出す)
+// GLXなどは未対応の関数にも非nullptrを返すため、バージョンか拡張文字列も確認する
+void loadGLExtensions() {
+    hasVertexBuffers = hasGLVersion(1, 5) &&
+        loadGLProc(pglGenBuffers, "glGenBuffers") &&
+        loadGLProc(pglDeleteBuffers, "glDeleteBuffers") &&
+        loadGLProc(pglBindBuffer, "glBindBuffer") &&
+        loadGLProc(pglBufferData, "glBufferData") &&
+        loadGLProc(pglBufferSubData, "glBufferSubData");
+    hasMapBufferRange = hasVertexBuffers && (hasGLVersion(3, 0) || hasGLExtension("GL_ARB_map_buffer_range")) &&
+        loadGLProc(pglMapBufferRange, "glMapBufferRange") &&
+        loadGLProc(pglUnmapBuffer, "glUnmapBuffer");
+    hasPersistentMapping = hasMapBufferRange &&
+        (hasGLVersion(4, 4) || (hasGLExtension("GL_ARB_buffer_storage") && (hasGLVersion(3, 2) || hasGLExtension("GL_ARB_sync")))) &&
+        loadGLProc(pglBufferStorage, "glBufferStorage") &&
+        loadGLProc(pglFenceSync, "glFenceSync") &&
+        loadGLProc(pglClientWaitSync, "glClientWaitSync") &&
+        loadGLProc(pglDeleteSync, "glDeleteSync");
+    hasShaders = hasVertexBuffers && hasGLVersion(2, 0) &&
+        loadGLProc(pglCreateShader, "glCreateShader") &&
+        loadGLProc(pglShaderSource, "glShaderSource") &&
+        loadGLProc(pglCompileShader, "glCompileShader") &&
+        loadGLProc(pglGetShaderiv, "glGetShaderiv") &&
+        loadGLProc(pglGetShaderInfoLog, "glGetShaderInfoLog") &&
+        loadGLProc(pglDeleteShader, "glDeleteShader") &&
+        loadGLProc(pglCreateProgram, "glCreateProgram") &&
+        loadGLProc(pglAttachShader, "glAttachShader") &&
+        loadGLProc(pglBindAttribLocation, "glBindAttribLocation") &&
+        loadGLProc(pglLinkProgram, "glLinkProgram") &&
+        loadGLProc(pglGetProgramiv, "glGetProgramiv") &&
+        loadGLProc(pglGetProgramInfoLog, "glGetProgramInfoLog") &&
+        loadGLProc(pglUseProgram, "glUseProgram") &&
+        loadGLProc(pglGetUniformLocation, "glGetUniformLocation") &&
+        loadGLProc(pglUniform1i, "glUniform1i") &&
+        loadGLProc(pglUniform1f, "glUniform1f") &&
+        loadGLProc(pglVertexAttribPointer, "glVertexAttribPointer") &&
+        loadGLProc(pglEnableVertexAttribArray, "glEnableVertexAttribArray") &&
+        loadGLProc(pglDisableVertexAttribArray, "glDisableVertexAttribArray");
+    if (hasShaders && (hasGLVersion(3, 3) || (hasGLExtension("GL_ARB_instanced_arrays") && hasGLExtension("GL_ARB_draw_instanced")))) {
+        bool core = hasGLVersion(3, 3);
+        hasInstancing = loadGLProc(pglVertexAttribDivisor, core ? "glVertexAttribDivisor" : "glVertexAttribDivisorARB") &&
+            loadGLProc(pglDrawArraysInstanced, core ? "glDrawArraysInstanced" : "glDrawArraysInstancedARB");
+    }
+    hasFramebuffers = hasShaders && (hasGLVersion(3, 0) || hasGLExtension("GL_ARB_framebuffer_object")) &&
+        loadGLProc(pglUniform2f, "glUniform2f") &&
+        loadGLProc(pglUniform3f, "glUniform3f") &&
+        loadGLProc(pglUniform4f, "glUniform4f") &&
+        loadGLProc(pglUniformMatrix4fv, "glUniformMatrix4fv") &&
+        loadGLProc(pglActiveTexture, "glActiveTexture") &&
+        loadGLProc(pglGenFramebuffers, "glGenFramebuffers") &&
+        loadGLProc(pglDeleteFramebuffers, "glDeleteFramebuffers") &&
+        loadGLProc(pglBindFramebuffer, "glBindFramebuffer") &&
+        loadGLProc(pglFramebufferTexture2D, "glFramebufferTexture2D") &&
+        loadGLProc(pglCheckFramebufferStatus, "glCheckFramebufferStatus") &&
+        loadGLProc(pglBlitFramebuffer, "glBlitFramebuffer") &&
+        loadGLProc(pglGenerateMipmap, "glGenerateMipmap");
+    hasTimerQueries = (hasGLVersion(3, 3) || hasGLExtension("GL_ARB_timer_query")) &&
+        loadGLProc(pglGenQueries, "glGenQueries") &&
+        loadGLProc(pglDeleteQueries, "glDeleteQueries") &&
+        loadGLProc(pglBeginQuery, "glBeginQuery") &&
+        loadGLProc(pglEndQuery, "glEndQuery") &&
+        loadGLProc(pglGetQueryObjectiv, "glGetQueryObjectiv") &&
+        loadGLProc(pglGetQueryObjectui64v, "glGetQueryObjectui64v");
+    hasVertexCountQueries = hasTimerQueries && (hasGLVersion(4, 6) || hasGLExtension("GL_ARB_pipeline_statistics_query"));
+
+    if (!hasVertexBuffers) {
+        std::cout << "VBOが使用できないため、クライアント側頂点配列で描画します" << std::endl;
+    }
+    if (!hasInstancing) {
+        std::cout << "インスタンス描画が使用できないため、ランタンを1個ずつ描画します" << std::endl;
+    }
+    if (!hasFramebuffers) {
+        std::cout << "FBOが使用できないため、ウィンドウの解像度で直接描画します" << std::endl;
+    }
+}
+
+// draw() が送る頂点数を数える関数 (表示リストや即時モードの頂点も含む。数えられなければ0)
+template <typename Draw>
+uint64_t countSubmittedVertices(Draw draw) {
+    if (!hasVertexCountQueries) {
+        return 0;
+    }
+    GLuint query = 0;
+    pglGenQueries(1, &query);
+    pglBeginQuery(GL_VERTICES_SUBMITTED_ARB, query);
+    draw();
+    pglEndQuery(GL_VERTICES_SUBMITTED_ARB);
+    GLuint64 submitted = 0;
+    pglGetQueryObjectui64v(query, GL_QUERY_RESULT, &submitted);
+    pglDeleteQueries(1, &query);
+    return submitted;
+}
+
 struct Object {
     float x, y, z; // 位置
     float r, g, b; // 色
@@ -44,15 +856,278 @@ std::vector<Object> objects; // シーン内の静的オブジェクト (現在
 struct KomLoyLantern {
     float x, y, z; // 位置
     float velX, velY, velZ; // 移動速度
-    float currentFlameAnimation; // 個別の炎アニメーション時間
-    float corePulsation; // 個別の炎の核の脈動値
+    float flamePhase; // 個別の炎アニメーションの位相 (炎の状態はこれと共通の時刻だけで決まる)
+    uint32_t cycle; // 打ち上げ回数 (再出現のたびに増え、次の出現位置のシードになる)
 };
 
-std::vector<KomLoyLantern> lanterns; // 複数のランタンを保持するベクター
-const int NUM_LANTERNS = 1500; // 生成するランタンの数
+// セクター - 空間を区切ったチャンクで、それぞれが自分のランタンを所有する
+struct Sector {
+    int sx, sz; // セクター座標
+};
+
+typedef TrackedVector<Sector, MEMORY_WORLD> SectorList; // セクターの並び
+typedef TrackedVector<KomLoyLantern, MEMORY_WORLD> SectorLanterns; // 1セクター分のランタン
+
+// バックグラウンドスレッドからメインスレッドへ渡すセクターの変更
+struct SectorUpdate {
+    bool activate; // trueなら有効化、falseなら無効化
+    int sx, sz; // セクター座標
+    uint64_t tick; // ランタンを生成した時点のシミュレーションティック
+    SectorLanterns block; // 有効化するセクターのランタン
+};
+
+// ランタンのSoA配列の種類 (全て4バイト要素)
+enum LanternArray {
+    LANTERN_X, LANTERN_Y, LANTERN_Z,
+    LANTERN_VEL_X, LANTERN_VEL_Y, LANTERN_VEL_Z,
+    LANTERN_FLAME_PHASE,
+    LANTERN_CYCLE, LANTERN_BASE_TICK,
+    LANTERN_ARRAY_COUNT
+};
+
+const size_t LANTERN_ARRAY_ALIGNMENT = 64; // 各配列の先頭をキャッシュライン境界に揃える
+
+// 全ての有効なランタンの状態 (SoA)。セクターごとに LANTERNS_PER_SECTOR 個の連続したブロックで並ぶ
+// (ブロック i は activeSectors[i] が所有する)。
+// 等速で動くので、位置は基準ティックでの値だけを持ち、任意のティックの位置は 位置 + 速度 × 経過ティック で求める。
+// 全配列は一つの領域に固定の間隔で並び、スナップショットファイル内のレイアウトとそのまま一致する
+// (compactLanterns のときは count と capacity だけを使い、状態は compactLanternPool が持つ)
+struct LanternPool {
+    size_t count = 0; // 有効なランタン数
+    size_t capacity = 0; // 各配列の要素数 (最大セクター数 × セクターあたりの数)
+    size_t stride = 0; // 配列同士の間隔 (バイト)
+    float* x = nullptr; float* y = nullptr; float* z = nullptr; // 基準ティックでの位置
+    float* velX = nullptr; float* velY = nullptr; float* velZ = nullptr; // 移動速度
+    float* flamePhase = nullptr; // 個別の炎アニメーションの位相
+    uint32_t* cycle = nullptr; // 打ち上げ回数
+    uint32_t* baseTick = nullptr; // 位置の基準ティック (下位32ビット。出現または有効化した時点)
+    void* allocation = nullptr; // 自分で確保した領域 (マップしたスナップショットを使う場合はnullptr)
+
+    // i番目のランタンの tick 時点の状態を値として取り出す
+    KomLoyLantern get(size_t i, uint64_t tick) const {
+        float age = static_cast<float>(static_cast<uint32_t>(tick) - baseTick[i]);
+        return { x[i] + velX[i] * age, y[i] + velY[i] * age, z[i] + velZ[i] * age,
+            velX[i], velY[i], velZ[i], flamePhase[i], cycle[i] };
+    }
+
+    // i番目のランタンに tick 時点の状態を書き込む
+    void set(size_t i, const KomLoyLantern& l, uint64_t tick) {
+        x[i] = l.x; y[i] = l.y; z[i] = l.z;
+        velX[i] = l.velX; velY[i] = l.velY; velZ[i] = l.velZ;
+        flamePhase[i] = l.flamePhase;
+        cycle[i] = l.cycle;
+        baseTick[i] = static_cast<uint32_t>(tick);
+    }
+};
+
+LanternPool lanternPool; // 有効なランタン
+SectorList activeSectors; // 有効なセクター
+
+const float SECTOR_SIZE = 25.0f; // セクター1辺の長さ
+const int LANTERNS_PER_SECTOR = 94; // セクターあたりのランタン数 (従来の100x100範囲に約1500個と同じ密度)
+const int SECTOR_ACTIVE_RADIUS = 2; // カメラのセクターから各方向にこの距離までを有効化
+const int SECTOR_KEEP_RADIUS = 3; // この距離を超えたセクターを無効化 (境界での往復を防ぐ余裕)
+const float LANTERN_LAUNCH_Y = 0.0f; // ランタンが打ち上がる高さ (地面のすぐ上)
+const float LANTERN_CEILING_Y = 39.25f; // ランタンが消えて再出現する高さ
+const float LANTERN_MIN_RISE_SPEED = 0.01f; // 上昇速度の下限 (ティックあたり)
+const float LANTERN_MAX_RISE_SPEED = 0.03f; // 上昇速度の上限 (ティックあたり)
+const float LANTERN_MAX_DRIFT_SPEED = 0.005f; // 水平方向の漂流速度の上限 (ティックあたり)
+// 打ち上げから天井までにランタンが出現位置から水平に離れうる最大距離 (セクターの境界箱の余白)
+const float LANTERN_MAX_DRIFT = LANTERN_MAX_DRIFT_SPEED * (LANTERN_CEILING_Y - LANTERN_LAUNCH_Y) / LANTERN_MIN_RISE_SPEED;
+const float LANTERN_BOUNDS_MARGIN = 1.0f; // ランタンの中心から形状の端までの余白
+
+uint32_t worldSeed = 0; // 世界全体のシード (セクターごとのシードの元)
+uint64_t simTick = 0; // シミュレーションのティック数
+bool synchronousStreaming = false; // trueならセクターをティック内で同期的に生成する (再生時の決定性のため)
+
+const float FLAME_ANIMATION_SPEED = 0.05f; // 1ティックあたりの炎アニメーション時間の進み
+
+// 全ランタン共通の炎の時刻 (ティックから求め、2πで折り返す)
+float flameTime() {
+    return static_cast<float>(std::fmod(FLAME_ANIMATION_SPEED * static_cast<double>(simTick), 2.0 * M_PI));
+}
+
+// 炎の核の脈動値 (ランタンの位相と共通の時刻だけで決まるので、描画するランタンについてだけ求めればよい)
+float flameCorePulsation(float flamePhase, float time) {
+    return (sin(flamePhase + time) + 1.0f) * 0.5f;
+}
+
+const float SECTOR_RECHECK_DISTANCE = SECTOR_SIZE * 0.25f; // カメラがこれだけ動いたらセクターの範囲を確認し直す
+float sectorCheckX = 1e30f, sectorCheckZ = 1e30f; // 最後にセクターの範囲を確認したカメラ位置 (初期値は最初のティックで必ず確認するため)
+
+// 同時に有効になり得る最大セクター数 (保持範囲の正方形)
+const int MAX_ACTIVE_SECTORS = (SECTOR_KEEP_RADIUS * 2 + 1) * (SECTOR_KEEP_RADIUS * 2 + 1);
+
+// コンパクトなランタン状態のSoA配列の種類 (全て2バイト要素、打ち上げ回数だけは別に4バイト)
+enum CompactLanternArray {
+    COMPACT_SPAWN_X, COMPACT_SPAWN_Z,
+    COMPACT_VEL_X, COMPACT_VEL_Y, COMPACT_VEL_Z,
+    COMPACT_BASE_TIME, COMPACT_PHASE,
+    COMPACT_ARRAY_COUNT
+};
+
+// 大量のランタン用のコンパクトな状態 (SoA、1ランタンあたり18バイト。通常は32バイト)。
+// 出現位置はセクター原点からの16ビット固定小数点、速度は半精度浮動小数点、出現時刻と炎の位相は16ビット整数で持ち、
+// 現在位置は 出現位置 + 速度 × (現在時刻 - 出現時刻) で求める (時刻は16ビットで折り返すので差は周期より短い限り正しい)。
+// ブロックの並びと所有セクターは LanternPool と同じ (count と capacity は lanternPool のものを使う)
+struct CompactLanternPool {
+    size_t stride = 0; // 2バイト配列同士の間隔 (バイト)
+    int16_t* spawnX = nullptr; int16_t* spawnZ = nullptr; // 出現位置 (セクター原点から, 1/COMPACT_POSITION_SCALE単位)
+    uint16_t* velX = nullptr; uint16_t* velY = nullptr; uint16_t* velZ = nullptr; // 移動速度 (半精度)
+    uint16_t* baseTime = nullptr; // 出現時刻 (1/COMPACT_TIME_SCALEティック単位で65536ごとに折り返す)
+    uint16_t* phase = nullptr; // 炎アニメーションの位相 (1周 = 65536)
+    uint32_t* cycle = nullptr; // 打ち上げ回数
+    void* allocation = nullptr; // 確保した領域
+};
+
+const float COMPACT_POSITION_SCALE = 1024.0f; // 出現位置の固定小数点の1単位 = 1/1024 (範囲は±32)
+const float COMPACT_TIME_SCALE = 16.0f; // 時刻の1単位 = 1/16ティック (最長の打ち上げ周期 3925ティックが折り返し内に入る)
+const float COMPACT_PHASE_SCALE = 65536.0f / (2.0f * static_cast<float>(M_PI)); // ラジアンから位相の単位へ
+
+bool compactLanterns = false; // trueならランタンの状態をコンパクトな形式で持つ
+CompactLanternPool compactLanternPool; // コンパクトな形式のランタン (compactLanterns のときだけ使用)
+
+// ランタンの再出現の予約
+struct RespawnEvent {
+    uint64_t tick; // 天井を越えるティック
+    int sx, sz; // 予約時の所有セクター (ブロックが移動・無効化されていたら無視する)
+    uint32_t index; // ランタンの番号
+    uint32_t cycle; // 予約時の打ち上げ回数 (既に再出現済みなら無視する)
+};
+
+const int RESPAWN_WHEEL_SLOTS = 4096; // タイマーホイールの枠数 (2の累乗。最長の打ち上げ周期 3925ティックより長くする)
+
+// 再出現の予約を、ティックごとの枠に振り分けて持つタイマーホイール。
+// 予約も取り出しも枠への追加と走査だけで済み、1ティックに触れるのはそのティックに天井を越えるランタンの予約だけになる。
+// 枠の数より先の予約も同じ枠に入れ、周回ごとにティックを確かめて次の周回へ持ち越す
+class RespawnWheel {
+public:
+    // 全ての予約を捨て、次に取り出すティックを設定する。
+    // 近い枠ほど予約が多く、1ティックあたりの再出現数 (lanterns × 平均上昇速度 / 上昇する高さ) に近づく。
+    // 枠の容量は取り出しのたびに枠の間を巡り、いずれはどれもこの量まで育つので、初めからその1.25倍を確保して
+    // 定常状態に入るまでのティックごとの確保をなくす
+    void reset(uint64_t nextTick, size_t lanterns) {
+        const float riseRate = (LANTERN_MIN_RISE_SPEED + LANTERN_MAX_RISE_SPEED) * 0.5f / (LANTERN_CEILING_Y - LANTERN_LAUNCH_Y);
+        size_t perSlot = static_cast<size_t>(lanterns * riseRate * 1.25f) + 4;
+        for (auto& slot : slots) {
+            slot.clear();
+            slot.reserve(perSlot);
+        }
+        due.reserve(perSlot);
+        current = nextTick;
+    }
+
+    // 予約を追加する (既に取り出し済みのティックの予約は次のティックに回す)
+    void schedule(RespawnEvent event) {
+        event.tick = std::max(event.tick, current);
+        slots[event.tick & (RESPAWN_WHEEL_SLOTS - 1)].push_back(event);
+    }
+
+    // tick までに期限が来た予約を順に fn に渡す (fn の中から schedule を呼んでもよい)
+    template <typename Fn>
+    void advance(uint64_t tick, Fn&& fn) {
+        while (current <= tick) {
+            uint64_t slotTick = current++;
+            due.clear();
+            due.swap(slots[slotTick & (RESPAWN_WHEEL_SLOTS - 1)]);
+            for (const RespawnEvent& event : due) {
+                if (event.tick > slotTick) {
+                    slots[event.tick & (RESPAWN_WHEEL_SLOTS - 1)].push_back(event); // 次の周回へ持ち越す
+                }
+                else {
+                    fn(event);
+                }
+            }
+        }
+    }
+
+private:
+    TrackedVector<RespawnEvent, MEMORY_SIM> slots[RESPAWN_WHEEL_SLOTS]; // ティックごとの予約
+    TrackedVector<RespawnEvent, MEMORY_SIM> due; // 取り出し中の枠 (確保した容量を使い回す)
+    uint64_t current = 0; // 次に取り出すティック
+};
+
+RespawnWheel respawnWheel; // 再出現の予約
+
+// スナップショット (シミュレーション全体の状態を保存するバイナリファイル)
+// ファイル先頭のヘッダーに各セクションのオフセットを持ち、ランタンのSoA配列はLanternPoolと同じレイアウトで格納する。
+// 読み込み時はファイルをコピーオンライトでマップし、ランタン配列はコピーせずにそのまま使用する
+const char SNAPSHOT_MAGIC[8] = { 'K', 'O', 'M', 'L', 'O', 'Y', 'S', 'S' };
+const uint32_t SNAPSHOT_VERSION = 4; // レイアウトを変えたら上げる
+const uint32_t SNAPSHOT_ENDIAN_TAG = 0x01020304; // バイト順の確認用
+const size_t SNAPSHOT_PAGE_ALIGNMENT = 4096; // ランタン配列をページ境界から始める
+
+struct SnapshotHeader {
+    char magic[8]; // "KOMLOYSS"
+    uint32_t version; // フォーマットのバージョン
+    uint32_t endianTag; // SNAPSHOT_ENDIAN_TAG
+    uint64_t fileSize; // ファイル全体のサイズ
+    // カメラ
+    float cameraX, cameraY, cameraZ;
+    float cameraRotationY, cameraAngleX;
+    // 世界
+    uint32_t worldSeed;
+    uint64_t simTick;
+    uint32_t sectorSize10; // SECTOR_SIZE × 10 (パラメータ不一致の検出用)
+    uint32_t lanternsPerSector; // LANTERNS_PER_SECTOR
+    // 各セクション (オフセットはファイル先頭から)
+    uint64_t rngStateOffset, rngStateSize; // 乱数生成器の状態 (テキスト形式)
+    uint64_t sectorOffset, sectorCount; // 有効なセクター (int32 × 2)
+    uint64_t starOffset, starCount; // 星 (向きの16ビット整数 × 4)
+    uint64_t flamePolygonOffset, flamePolygonCount; // 炎のポリゴン (float × 5)
+    uint64_t lanternOffset, lanternCount, lanternCapacity, lanternStride; // ランタンのSoA配列
+    uint8_t reserved[64]; // 将来の拡張用
+};
+
+std::string snapshotLoadPath; // 起動時に読み込むスナップショット (--load-snapshot)
+std::string snapshotSavePath = "komloy.snapshot"; // 'k'キーで保存するスナップショット (--save-snapshot)
+void* snapshotMapping = nullptr; // マップ中のスナップショット
+size_t snapshotMappingSize = 0; // マップ中のスナップショットのサイズ
+
+// 入力ジャーナル (ティックごとの入力を記録し、ウィンドウなしで再生するためのバイナリログ)
+// ヘッダーの後にティックごとのレコードが続く。レコードは1バイトのフラグ (下位4ビットが移動キー) と、
+// 視点が前のティックから変化したときだけヨーとピッチ (float × 2) を持つ。記録を終えるときは JOURNAL_END のフラグと
+// 最後のティックの後の状態チェックサム (uint64) を書き、再生の結果が記録したセッションと一致するかを確かめられるようにする
+const char JOURNAL_MAGIC[8] = { 'K', 'O', 'M', 'L', 'O', 'Y', 'I', 'J' };
+const uint32_t JOURNAL_VERSION = 1;
+const uint8_t JOURNAL_KEY_UP = 1 << 0; // ↑キー
+const uint8_t JOURNAL_KEY_DOWN = 1 << 1; // ↓キー
+const uint8_t JOURNAL_KEY_LEFT = 1 << 2; // ←キー
+const uint8_t JOURNAL_KEY_RIGHT = 1 << 3; // →キー
+const uint8_t JOURNAL_ANGLES = 1 << 4; // 視点の角度が続く
+const uint8_t JOURNAL_END = 1 << 7; // 記録の終わり (状態チェックサムが続く。途中で強制終了したジャーナルには無い)
+
+struct JournalHeader {
+    char magic[8]; // "KOMLOYIJ"
+    uint32_t version; // フォーマットのバージョン
+    uint32_t rngSeed; // 乱数生成器のシード
+    uint32_t worldSeed; // 記録開始時の世界のシード (スナップショットから始めた場合の確認用)
+    uint32_t reserved;
+    uint64_t startTick; // 記録開始時のティック
+    float cameraX, cameraY, cameraZ; // 記録開始時のカメラ位置
+    float cameraRotationY, cameraAngleX; // 記録開始時の視点
+    float padding;
+};
+
+// 記録中のジャーナル (終了時にファイルを閉じる)
+struct InputJournal {
+    FILE* file = nullptr;
+    float lastRotationY = 0.0f, lastAngleX = 0.0f; // 直前に記録した視点
+
+    ~InputJournal() {
+        if (file) {
+            fclose(file);
+        }
+    }
+};
+
+std::string journalRecordPath; // 入力を記録するファイル (--record)
+std::string journalReplayPath; // ヘッドレスで再生するファイル (--replay)
+InputJournal inputJournal; // 記録中のジャーナル
 
 // ランタンの静的パーツ用ディスプレイリスト
-GLuint lanternDisplayList;
+GLuint lanternDisplayList = 0; // ランタンの静的パーツ (最初に使うときに作る)
+uint64_t lanternDisplayListVertices = 0; // 表示リストの頂点数 (GPUメモリの見積もり用。数えられなければ0)
 
 struct FlamePolygon {
     float scale_x, scale_y; // スケール
@@ -61,14 +1136,42 @@ struct FlamePolygon {
     float animation_offset; // 各ポリゴン固有のアニメーションオフセット
 };
 
-std::vector<FlamePolygon> flamePolygons; // 炎の一般的な形状/挙動を定義
+TrackedVector<FlamePolygon, MEMORY_SIM> flamePolygons; // 炎の一般的な形状/挙動を定義
 
 // 星空の変数
+// 星は無限遠にあるので位置ではなく単位球上の向きだけを持ち、符号付き正規化の16ビット整数に詰める。
+// w は常に STAR_W_ONE で、固定機能では (x, y, z, 1) の点として、シェーダーでは向きとして読む
 struct Star {
-    float x, y, z; // 星の位置
+    int16_t x, y, z, w; // 星の向き (-32767〜32767 が -1〜1)
 };
-std::vector<Star> stars; // 星のベクター
-const int NUM_STARS = 1000; // 星の数
+TrackedVector<Star, MEMORY_STARS> stars; // 星のベクター
+const int NUM_STARS = 1000; // 星の数 (既定値)
+const int16_t STAR_W_ONE = 32767; // 向きの成分の 1.0 (w にも入れて同次座標の 1 にする)
+int starCount = NUM_STARS; // 生成する星の数 (--stars)
+
+// 地面チャンクの頂点 (位置と焼き込み済みの色)
+struct GroundVertex {
+    float x, y, z; // チャンク原点からの相対位置
+    GLubyte r, g, b, a; // 一度だけ計算される色のばらつき
+};
+
+// 地面チャンク - カメラ周辺にストリーミングされる静的グリッドメッシュ
+struct GroundChunk {
+    int cx, cz; // チャンク座標
+    GLuint vbo; // 頂点バッファ (VBOが使えない場合は0)
+    TrackedVector<GroundVertex, MEMORY_WORLD> vertices; // VBOが使えない場合のクライアント側頂点配列
+};
+
+const float GROUND_Y = -1.0f; // 地面の高さ
+const float GROUND_CHUNK_SIZE = 100.0f; // チャンク1辺の長さ
+const int GROUND_CHUNK_RES = 32; // チャンク1辺あたりの分割数 (炎による頂点ライティングに足りる密度)
+const int GROUND_CHUNK_RADIUS = 5; // カメラのチャンクから各方向に保持するチャンク数 (遠方クリッピング面をカバー)
+const int GROUND_CHUNK_VERTS = (GROUND_CHUNK_RES + 1) * (GROUND_CHUNK_RES + 1); // チャンクあたりの頂点数
+
+TrackedVector<GroundChunk, MEMORY_WORLD> groundChunks; // チャンクのプール (数は固定で、移動時は再利用する)
+TrackedVector<GLushort, MEMORY_WORLD> groundIndices; // 全チャンク共通のインデックス
+GLuint groundIndexBuffer = 0; // 共通インデックスバッファ
+int groundCenterX = INT_MIN, groundCenterZ = INT_MIN; // 現在ストリーミングの中心になっているチャンク
 
 // 関数プロトタイプ (宣言)
 void drawFlame(float flameAnimTime, float corePulse); // 炎を描画
@@ -77,8 +1180,96 @@ void drawLanternFrame(); // ランタンのフレームを描画
 void drawLanternCover(); // ランタンのカバーを描画
 void drawLanternRoof(); // ランタンの屋根を描画
 void drawSingleLantern(const KomLoyLantern& l); // 個々のランタンを描画
+void ensureLanternDisplayList(); // ランタンの静的パーツのディスプレイリストがなければ作る
+void startJobSystem(); // ワーカースレッドを起動
+void initLanternBatching(); // ランタンの一括描画を準備
+void drawLanterns(); // 全てのランタンを描画
+struct DynamicResolution;
+void initDynamicResolution(DynamicResolution& dr); // 動的解像度のシェーダーとクエリを準備
+void resizeDynamicResolution(DynamicResolution& dr, int width, int height); // 描画先をウィンドウの大きさで作り直す
+void beginSceneFrame(DynamicResolution& dr); // 縮小した描画先にシーンの描画を始める
+void resolveSceneFrame(DynamicResolution& dr); // シーンを履歴に混ぜて画面に拡大する
+bool lanternGlowActive(); // 炎のグローを描画できる状態か
+void renderLanternGlow(size_t count, size_t farFirst, size_t farCount); // 炎と核を縮小したバッファに描いてぼかし、シーンに加算する
+bool lanternImpostorsActive(); // 遠くのランタンをインポスターで描けるか
+void drawLanternImpostors(size_t firstInstance, size_t count); // インスタンスの区画の範囲をインポスターで描く
+void buildGroundChunk(GroundChunk& chunk, int cx, int cz); // 地面チャンクの頂点を生成
+void initGround(); // 地面チャンクのプールを作成
+void updateGroundChunks(float centerX, float centerZ); // 地面チャンクをストリーミング
 void drawGround(); // 地面を描画
 void drawStars(); // 星を描画
+uint32_t lanternSlotSeed(int sx, int sz, int slot); // セクター内スロットのシード
+void placeLanternCycle(KomLoyLantern& l, int sx, int sz, uint32_t seed, uint32_t cycle, float age); // 打ち上げ周期の位置に配置
+void evaluateLantern(KomLoyLantern& l, int sx, int sz, int slot, uint64_t tick); // 指定ティックのランタン状態を生成
+void advanceLantern(KomLoyLantern& l, int sx, int sz, int slot, float dt); // ランタンを進める
+void applySectorUpdates(); // 生成済みのセクター変更を反映
+void allocateLanternPool(LanternPool& pool, size_t capacity); // ランタン配列を確保
+void bindLanternPool(LanternPool& pool, void* base, size_t capacity); // 配列ポインタを領域に割り当て
+void allocateCompactLanternPool(size_t capacity); // コンパクトなランタン配列を確保
+KomLoyLantern loadLantern(size_t i); // i番目のランタンを取り出す (保存形式によらない)
+void storeLantern(size_t i, const KomLoyLantern& l); // i番目のランタンに書き込む (保存形式によらない)
+void scheduleLanternBlock(size_t block); // ブロック内のランタンの再出現を予約
+void respawnLanterns(); // 天井を越えたランタンを再出現させる
+struct LanternInstance;
+void evaluateLanternInstances(size_t begin, size_t end, LanternInstance* instances); // ランタンの現在位置をインスタンスデータに書き込む (instances は begin 番目の書き込み先)
+void unpackCompactLanterns(size_t begin, size_t end, LanternInstance* instances); // コンパクトなランタンをインスタンスデータに展開 (instances は begin 番目の書き込み先)
+bool saveSnapshot(const std::string& path); // スナップショットを保存
+bool loadSnapshot(const std::string& path); // スナップショットを読み込み
+void initSimulation(); // シミュレーションの状態を準備
+void simulateTick(); // 1ティック進める
+bool startJournalRecording(const std::string& path); // 入力の記録を開始
+void finishJournalRecording(); // 記録の終わりと状態チェックサムを書いて閉じる
+void recordTickInput(); // このティックの入力を記録
+int runReplay(const std::string& path); // ジャーナルをヘッドレスで再生
+int runCompactBenchmark(size_t count); // 通常とコンパクトな形式の更新速度を比較
+int runBvhBenchmark(size_t count); // BVHの更新と問い合わせの速度を計測
+int runMicroBenchmarks(); // 描画ヘルパーと更新処理を1つずつ計測 (--bench)
+int runMemoryReport(size_t count); // ランタン数を増やしたときのメモリの上限を調べる (--memory-report)
+int runGoldenTests(const std::string& directory); // 基準画像のシーンを描いて比べる (--golden)
+int runCpuRender(const std::string& directory); // GLを使わずにCPUでシーンを描いて画像に書き出す (--cpu-render)
+void renderScene(); // シーンを描画する (バッファの入れ替えなし)
+void reshape(int w, int h); // ウィンドウの大きさに合わせて投影と描画先を作り直す
+
+// 球を即時モードで描く関数 (glutSolidSphere と同じ分割)。
+// GLUTの図形関数は glutInit の後でしか使えず、ウィンドウのないヘッドレスのコンテキスト (--bench) では呼べないので自前で描く
+void drawSolidSphere(float radius, int slices, int stacks) {
+    for (int j = 0; j < stacks; ++j) {
+        glBegin(GL_QUAD_STRIP);
+        for (int i = 0; i <= slices; ++i) {
+            float phi = 2.0f * M_PI * (float)i / (float)slices; // 方位角
+            for (int k = j + 1; k >= j; --k) {
+                float theta = M_PI * (float)k / (float)stacks; // 極角
+                float nx = sin(theta) * cos(phi), ny = cos(theta), nz = sin(theta) * sin(phi);
+                glNormal3f(nx, ny, nz);
+                glVertex3f(nx * radius, ny * radius, nz * radius);
+            }
+        }
+        glEnd();
+    }
+}
+
+// 原点を中心とする立方体を即時モードで描く関数 (glutSolidCube と同じ。理由は drawSolidSphere と同じ)
+void drawSolidCube(float size) {
+    const float h = size * 0.5f;
+    // 面ごとの法線と、外から見て反時計回りの4隅
+    const float faces[6][3] = { { 1, 0, 0 }, { -1, 0, 0 }, { 0, 1, 0 }, { 0, -1, 0 }, { 0, 0, 1 }, { 0, 0, -1 } };
+    const float corners[6][4][3] = {
+        { { 1, -1, 1 }, { 1, -1, -1 }, { 1, 1, -1 }, { 1, 1, 1 } },
+        { { -1, -1, -1 }, { -1, -1, 1 }, { -1, 1, 1 }, { -1, 1, -1 } },
+        { { -1, 1, 1 }, { 1, 1, 1 }, { 1, 1, -1 }, { -1, 1, -1 } },
+        { { -1, -1, -1 }, { 1, -1, -1 }, { 1, -1, 1 }, { -1, -1, 1 } },
+        { { -1, -1, 1 }, { 1, -1, 1 }, { 1, 1, 1 }, { -1, 1, 1 } },
+        { { 1, -1, -1 }, { -1, -1, -1 }, { -1, 1, -1 }, { 1, 1, -1 } },
+    };
+    glBegin(GL_QUADS);
+    for (int f = 0; f < 6; ++f) {
+        glNormal3f(faces[f][0], faces[f][1], faces[f][2]);
+        for (const auto& c : corners[f]) {
+            glVertex3f(c[0] * h, c[1] * h, c[2] * h);
+        }
+    }
+    glEnd();
+}
 
 // 炎を描画する関数 (個々のランタンのアニメーション時間を使用)
 void drawFlame(float flameAnimTime, float corePulse) {
@@ -107,7 +1298,7 @@ void drawFlame(float flameAnimTime, float corePulse) {
     GLfloat emission[] = { coreR, coreG * 0.7f, coreB * 0.5f, 1.0f }; // 温かい黄色の光
     glMaterialfv(GL_FRONT, GL_EMISSION, emission);
 
-    glutSolidSphere(0.5, 10, 10); // 核を球体として描画
+    drawSolidSphere(0.5f, 10, 10); // 核を球体として描画
 
     // 他のオブジェクトが発光しないようにエミッションをリセット
     GLfloat no_emission[] = { 0.0f, 0.0f, 0.0f, 1.0f };
@@ -235,7 +1426,7 @@ void drawLanternFrame() {
     glPushMatrix();
     glTranslatef(0.0f, -0.6f - 0.1f, 0.0f); // 底のリングの下
     glScalef(baseRadius * 0.8f, frameThickness * 3.0f, baseRadius * 0.8f); // 平らな四角
-    glutSolidCube(1.0);
+    drawSolidCube(1.0f);
     glPopMatrix();
 
     // ユーザーの要望により、他の垂直柱や上部リングはなし。
@@ -330,6 +1521,29 @@ void drawLanternRoof() {
     glEnable(GL_LIGHTING); // ライティングを再有効化
 }
 
+// ランタンの静的パーツのディスプレイリストを、最初に必要になったときに作る関数
+// (インスタンス描画ではインポスターのアトラスを描くときにしか使わないので、起動時には作らない)
+void ensureLanternDisplayList() {
+    if (lanternDisplayList) {
+        return;
+    }
+    lanternDisplayList = glGenLists(1); // ディスプレイリストの一意なIDを生成
+    glNewList(lanternDisplayList, GL_COMPILE); // コマンドのリストへのコンパイルを開始
+    // 単一のランタンの静的コンポーネントをローカル原点 (0,0,0) で描画
+    drawLanternFrame();
+    drawLanternCover();
+    drawLanternRoof();
+    drawHook();
+    glEndList(); // ディスプレイリストのコンパイルを終了
+
+    // GPUメモリの見積もり用に頂点数を数えておく (ラスタライズせずに捨てる)
+    lanternDisplayListVertices = countSubmittedVertices([] {
+        glEnable(GL_RASTERIZER_DISCARD);
+        glCallList(lanternDisplayList);
+        glDisable(GL_RASTERIZER_DISCARD);
+    });
+}
+
 // 個々のランタンを描画する関数 (KomLoyLanternオブジェクトを使用)
 void drawSingleLantern(const KomLoyLantern& l) {
     glPushMatrix();
@@ -339,72 +1553,3929 @@ void drawSingleLantern(const KomLoyLantern& l) {
     glCallList(lanternDisplayList);
 
     // 炎はランタンごとに動的なので別途描画
-    drawFlame(l.currentFlameAnimation, l.corePulsation);
+    float time = flameTime();
+    drawFlame(l.flamePhase + time, flameCorePulsation(l.flamePhase, time));
 
     glPopMatrix();
 }
 
-// 地面を描画する関数 (夜空に合う色に調整)
-void drawGround() {
-    glEnable(GL_LIGHTING); // 地面はシーンのライティングの影響を受ける
+// --- ジョブシステム ---
+// C++20のコルーチンで書いたタスクを、スレッドごとの両端キューで仕事を盗み合いながら全コアで実行する。
+// 依存関係は co_await で表し、待っている間スレッドは別のタスクを実行する。各スレッドは自分のキューの末尾から取り出し
+// (最後に積んだ、キャッシュに残っている子タスクから)、空なら他のスレッドのキューの先頭から盗む。
+// メインスレッド (GLUTのスレッド) はキュー0を持ち、JobHandle の完了を待つ間だけタスクの実行を手伝う
+const int MAX_JOB_THREADS = 16; // メインスレッドを含むスレッド数の上限
+const size_t JOB_QUEUE_CAPACITY = 1024; // スレッドごとのキューの長さ (溢れたタスクは積まずにその場で実行する)
+const size_t MIN_PARALLEL_COUNT = 4096; // これより少ない要素は分割しない
+const size_t TASK_FRAME_SIZE = 1024; // 使い回すコルーチンのフレームの大きさ (これより大きいフレームは都度確保する)
+const uintptr_t JOB_DONE = 0; // JobHandle の状態: 完了 (または未起動)
+const uintptr_t JOB_RUNNING = 1; // JobHandle の状態: 実行中で待ち手なし (それ以外の値は待っているコルーチンのアドレス)
 
-    glPushMatrix();
-    // 地面をカメラの初期Y座標より下に配置
-    glTranslatef(0.0f, -1.0f, 0.0f); // 地面の高さを調整
+std::mutex taskFrameMutex; // 空きフレームのリストの保護
+void* freeTaskFrames = nullptr; // 空きフレームのリスト (各フレームの先頭に次の空きへのポインタを置く)
+thread_local int jobThreadIndex = 0; // このスレッドのキューの番号 (ワーカー以外のスレッドは0)
 
-    float groundSize = 500.0f; // 地面の広さ
+// コルーチンのフレームを確保する関数 (毎フレーム作るタスクで確保が続かないよう、解放したフレームを使い回す)
+void* allocateTaskFrame(size_t size) {
+    if (size <= TASK_FRAME_SIZE) {
+        std::lock_guard<std::mutex> lock(taskFrameMutex);
+        if (freeTaskFrames) {
+            void* frame = freeTaskFrames;
+            freeTaskFrames = *static_cast<void**>(frame);
+            return frame;
+        }
+    }
+    void* frame = trackedAlloc(MEMORY_OTHER, std::max(size, TASK_FRAME_SIZE));
+    if (!frame) {
+        throw std::bad_alloc();
+    }
+    return frame;
+}
 
-    // 法線は常に上向き
-    glNormal3f(0.0f, 1.0f, 0.0f);
+// コルーチンのフレームを空きリストに戻す関数
+void freeTaskFrame(void* frame, size_t size) {
+    if (size > TASK_FRAME_SIZE) {
+        trackedFree(frame);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(taskFrameMutex);
+    *static_cast<void**>(frame) = freeTaskFrames;
+    freeTaskFrames = frame;
+}
 
-    glBegin(GL_QUADS);
-    // 夜空に合うように暗い緑色に調整し、わずかなバリエーションを加える
-    float r_base = 0.08f; // 暗い緑の赤成分
-    float g_base = 0.15f; // 暗い緑の緑成分
-    float b_base = 0.08f; // 暗い緑の青成分
+// 起動したジョブの完了の印。コルーチンからは co_await で、メインスレッドからは JobSystem::wait で待つ
+// (co_await で待てるコルーチンは1つだけ)
+struct JobHandle {
+    std::atomic<uintptr_t> state{ JOB_DONE };
 
-    // 色のランダムなばらつきを非常に小さくして、統一感を出す
-    float r_offset = getRandomFloat(-0.01f, 0.01f);
-    float g_offset = getRandomFloat(-0.01f, 0.01f);
-    float b_offset = getRandomFloat(-0.01f, 0.01f);
+    bool done() const { return state.load(std::memory_order_acquire) == JOB_DONE; }
 
-    glColor3f(r_base + r_offset, g_base + g_offset, b_base + b_offset);
+    // 完了を記録し、待っていたコルーチンがあれば返す (なければ何もしないコルーチン)
+    std::coroutine_handle<> complete() {
+        uintptr_t previous = state.exchange(JOB_DONE, std::memory_order_acq_rel);
+        if (previous == JOB_DONE || previous == JOB_RUNNING) {
+            return std::noop_coroutine();
+        }
+        return std::coroutine_handle<>::from_address(reinterpret_cast<void*>(previous));
+    }
 
-    // 大きな四角形として地面を描画
-    glVertex3f(-groundSize, 0.0f, -groundSize);
-    glVertex3f(groundSize, 0.0f, -groundSize);
-    glVertex3f(groundSize, 0.0f, groundSize);
-    glVertex3f(-groundSize, 0.0f, groundSize);
-    glEnd();
-    glPopMatrix();
-}
+    bool await_ready() const { return done(); }
+    bool await_suspend(std::coroutine_handle<> waiter) {
+        uintptr_t expected = JOB_RUNNING;
+        return state.compare_exchange_strong(expected, reinterpret_cast<uintptr_t>(waiter.address()), std::memory_order_acq_rel);
+    }
+    void await_resume() const {}
+};
 
-// 星を描画する関数
-void drawStars() {
-    glDisable(GL_LIGHTING); // 星は自己発光
-    glDepthMask(GL_FALSE); // 星は「背景」なのでデプスバッファに書き込まない
-    glPointSize(1.5f); // 星のサイズ
+// ジョブシステムで実行するコルーチン。作っただけでは始まらず、co_await したタスクの続きとして、
+// または JobSystem::launch で始まる。終わると co_await した側を同じスレッドで再開する
+class Task {
+public:
+    struct promise_type {
+        std::coroutine_handle<> continuation; // 完了したら再開するタスク (co_await した側)
+        JobHandle* handle = nullptr; // 完了を知らせる印 (launch で始めた場合)
 
-    glColor3f(0.8f, 0.8f, 1.0f); // 白から薄い青色の星
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        struct FinalAwaiter {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> coroutine) noexcept {
+                promise_type& promise = coroutine.promise();
+                if (promise.continuation) {
+                    return promise.continuation;
+                }
+                return promise.handle ? promise.handle->complete() : std::noop_coroutine(); // この後フレームは破棄されうる
+            }
+            void await_resume() noexcept {}
+        };
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+        static void* operator new(size_t size) { return allocateTaskFrame(size); }
+        static void operator delete(void* frame, size_t size) { freeTaskFrame(frame, size); }
+    };
 
-    glBegin(GL_POINTS);
-    for (const auto& star : stars) {
-        glVertex3f(star.x, star.y, star.z);
+    Task() = default;
+    explicit Task(std::coroutine_handle<promise_type> coroutine) : coroutine(coroutine) {}
+    Task(Task&& other) noexcept : coroutine(std::exchange(other.coroutine, nullptr)) {}
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            reset();
+            coroutine = std::exchange(other.coroutine, nullptr);
+        }
+        return *this;
     }
-    glEnd();
+    ~Task() { reset(); }
 
-    glDepthMask(GL_TRUE); // デプス書き込みを再有効化
-    glEnable(GL_LIGHTING); // ライティングを再有効化
-}
+    // フレームを破棄する (完了しているか、始まっていないこと)
+    void reset() {
+        if (coroutine) {
+            coroutine.destroy();
+            coroutine = nullptr;
+        }
+    }
 
-// 初期化関数
-void init() {
-    glClearColor(0.0f, 0.0f, 0.1f, 1.0f); // 夜空用の濃い青色の背景
-    glEnable(GL_DEPTH_TEST); // 正しい3Dレンダリングのためのデプステストを有効化
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    gluPerspective(45.0, 800.0 / 600.0, 0.1, 500.0); // 遠くのランタンのために遠方クリッピング面を拡大
-    glMatrixMode(GL_MODELVIEW);
+    // co_await したタスクの続きとしてこのスレッドで実行し、終わったら待っていた側に戻る
+    bool await_ready() const noexcept { return !coroutine; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> waiter) noexcept {
+        coroutine.promise().continuation = waiter;
+        return coroutine;
+    }
+    void await_resume() const noexcept {}
+
+    std::coroutine_handle<promise_type> coroutine;
+};
+
+template <typename Fn>
+Task parallelTask(size_t count, const Fn& fn);
+template <typename Fn>
+Task parallelEachTask(size_t count, const Fn& fn);
+
+// ワーカースレッドと、スレッドごとのタスクのキュー
+class JobSystem {
+public:
+    ~JobSystem() { stop(); }
+
+    // ワーカースレッドを開始する (メインスレッドも待つ間に手伝うので、合計 workerCount + 1 並列)
+    void start(int workerCount) {
+        workerCount = std::min(workerCount, MAX_JOB_THREADS - 1);
+        stopping = false;
+        threads = workerCount + 1; // ワーカーが盗む相手を数えるので、起動する前に決めておく
+        workers.reserve(workerCount);
+        for (int i = 0; i < workerCount; ++i) {
+            workers.emplace_back(&JobSystem::workerLoop, this, i + 1);
+        }
+    }
+
+    // ワーカースレッドを停止する (終了時に呼ばれる)
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        workers.clear();
+        threads = 1;
+    }
+
+    // 並列数 (メインスレッドを含む)
+    int threadCount() const {
+        return threads;
+    }
+
+    // 再開を待つコルーチンをこのスレッドのキューの末尾に積む (他のスレッドが先頭から盗んで実行できる)
+    void push(std::coroutine_handle<> job) {
+        JobQueue& queue = queues[jobThreadIndex];
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tail - queue.head < JOB_QUEUE_CAPACITY) {
+                queue.jobs[queue.tail++ % JOB_QUEUE_CAPACITY] = job;
+                job = nullptr;
+            }
+        }
+        if (job) {
+            job.resume(); // キューが溢れたらその場で実行する
+            return;
+        }
+        queuedJobs.fetch_add(1);
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        if (sleepers > 0) {
+            wake.notify_one();
+        }
+    }
+
+    // タスクを始め、完了したら handle に知らせる (呼び出し元は handle が完了するまで task を持っておく)
+    void launch(Task& task, JobHandle& handle) {
+        handle.state.store(JOB_RUNNING, std::memory_order_relaxed);
+        task.coroutine.promise().handle = &handle;
+        push(task.coroutine);
+    }
+
+    // handle が完了するまで、キューのタスクを実行しながら待つ
+    void wait(const JobHandle& handle) {
+        while (!handle.done()) {
+            if (!runOne(jobThreadIndex)) {
+                std::this_thread::yield(); // 残りは他のスレッドが実行中
+            }
+        }
+    }
+
+    // タスクを実行して完了まで待つ関数 (タスクの外からの同期的な呼び出し用)
+    void run(Task task) {
+        JobHandle handle;
+        launch(task, handle);
+        wait(handle);
+    }
+
+    // [0, count) をスレッド数のスライスに分け、各スライスの [begin, end) に対して fn を並列に呼び出して完了まで待つ
+    // (タスクの中からは co_await parallelTask(count, fn) を使う)
+    template <typename Fn>
+    void parallelFor(size_t count, const Fn& fn) {
+        if (threads <= 1 || count < MIN_PARALLEL_COUNT) {
+            fn(0, count);
+            return;
+        }
+        run(parallelTask(count, fn));
+    }
+
+    // [0, count) の各番号 i に対して fn(i) を並列に呼び出して完了まで待つ。空いたスレッドが次の番号を取るので、
+    // 要素ごとの重さが大きく違っても偏らない (画面のタイルのように数百個の重い要素向け。少なくても分割する)
+    template <typename Fn>
+    void parallelForEach(size_t count, const Fn& fn) {
+        if (threads <= 1 || count <= 1) {
+            for (size_t i = 0; i < count; ++i) {
+                fn(i);
+            }
+            return;
+        }
+        run(parallelEachTask(count, fn));
+    }
+
+private:
+    // スレッドごとのキュー (固定長の環状バッファ。[head, tail) に積まれている)
+    struct JobQueue {
+        std::mutex mutex;
+        std::coroutine_handle<> jobs[JOB_QUEUE_CAPACITY];
+        size_t head = 0, tail = 0;
+    };
+
+    // 自分のキューの末尾か、他のスレッドのキューの先頭からタスクを1つ取り出して実行する (なければfalse)
+    bool runOne(int self) {
+        std::coroutine_handle<> job;
+        {
+            JobQueue& queue = queues[self];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tail != queue.head) {
+                job = queue.jobs[--queue.tail % JOB_QUEUE_CAPACITY];
+            }
+        }
+        int threads = threadCount();
+        for (int i = 1; !job && i < threads; ++i) {
+            JobQueue& victim = queues[(self + i) % threads];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (victim.tail != victim.head) {
+                job = victim.jobs[victim.head++ % JOB_QUEUE_CAPACITY];
+            }
+        }
+        if (!job) {
+            return false;
+        }
+        queuedJobs.fetch_sub(1);
+        job.resume();
+        return true;
+    }
+
+    // ワーカースレッドの本体
+    void workerLoop(int index) {
+        jobThreadIndex = index;
+        while (true) {
+            if (runOne(index)) {
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            ++sleepers;
+            wake.wait(lock, [this] { return stopping || queuedJobs.load() > 0; });
+            --sleepers;
+            if (stopping) {
+                return;
+            }
+        }
+    }
+
+    JobQueue queues[MAX_JOB_THREADS]; // スレッドごとのキュー (0はメインスレッド)
+    std::vector<std::thread> workers; // ワーカースレッド
+    int threads = 1; // 並列数 (メインスレッドを含む)
+    std::atomic<int> queuedJobs{ 0 }; // 全てのキューに積まれているタスクの数
+    std::mutex sleepMutex; // 眠っているワーカーの起床の保護
+    std::condition_variable wake; // ワーカーの起床通知
+    int sleepers = 0; // 眠っているワーカーの数
+    bool stopping = false; // 終了要求
+};
+
+JobSystem jobSystem; // シミュレーションと描画データの準備を実行するワーカー
+
+// 全ての子タスクの完了を数える
+struct JoinCounter {
+    std::atomic<size_t> remaining{ 0 }; // 完了していない子タスクの数 (+1 は待つ側が起動を終えるまでの分)
+    std::coroutine_handle<> waiter; // 全て終わったら再開するタスク
+};
+
+// 子タスクの完了を数え、最後の1つなら待っている側に移る awaitable
+struct JoinArrival {
+    JoinCounter& join;
+    bool await_ready() noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<>) noexcept {
+        std::coroutine_handle<> waiter = join.waiter; // 数えた後は待つ側がフレームを破棄しうるので先に読む
+        return join.remaining.fetch_sub(1, std::memory_order_acq_rel) == 1 ? waiter : std::noop_coroutine();
+    }
+    void await_resume() noexcept {}
+};
+
+// 子タスクを実行して完了を数えるタスク (最後に止まったまま、WhenAll が破棄する)
+Task joinTask(Task& task, JoinCounter& join) {
+    co_await task;
+    co_await JoinArrival{ join };
+}
+
+// 複数のタスクをキューに積んで並列に実行し、全て終わったら再開する awaitable (count は MAX_JOB_THREADS まで)
+class WhenAll {
+public:
+    WhenAll(Task* tasks, size_t count) : tasks(tasks), count(std::min<size_t>(count, MAX_JOB_THREADS)) {}
+
+    bool await_ready() const { return count == 0; }
+    bool await_suspend(std::coroutine_handle<> waiter) {
+        join.waiter = waiter;
+        join.remaining.store(count + 1, std::memory_order_relaxed);
+        for (size_t i = 0; i < count; ++i) {
+            joins[i] = joinTask(tasks[i], join);
+            jobSystem.push(joins[i].coroutine);
+        }
+        // 自分の分を数え、既に全て終わっていれば止まらずに続ける
+        return join.remaining.fetch_sub(1, std::memory_order_acq_rel) != 1;
+    }
+    void await_resume() const {}
+
+private:
+    Task* tasks;
+    size_t count;
+    JoinCounter join;
+    Task joins[MAX_JOB_THREADS];
+};
+
+// スライスの [begin, end) に対して fn を呼び出すタスク
+template <typename Fn>
+Task parallelSlice(const Fn& fn, size_t begin, size_t end) {
+    fn(begin, end);
+    co_return;
+}
+
+// [0, count) をスレッド数のスライスに分けて並列に処理するタスク (fn は完了まで呼び出し元が持っておく)
+template <typename Fn>
+Task parallelTask(size_t count, const Fn& fn) {
+    size_t slices = static_cast<size_t>(jobSystem.threadCount());
+    if (slices <= 1 || count < MIN_PARALLEL_COUNT) {
+        fn(0, count);
+        co_return;
+    }
+    Task tasks[MAX_JOB_THREADS];
+    for (size_t s = 0; s < slices; ++s) {
+        tasks[s] = parallelSlice(fn, count * s / slices, count * (s + 1) / slices);
+    }
+    co_await WhenAll(tasks, slices);
+}
+
+// 共通の番号 next を1つずつ取りながら、count 未満の番号に対して fn を呼び出すタスク
+template <typename Fn>
+Task parallelEachSlice(const Fn& fn, std::atomic<size_t>& next, size_t count) {
+    for (size_t i = next.fetch_add(1, std::memory_order_relaxed); i < count; i = next.fetch_add(1, std::memory_order_relaxed)) {
+        fn(i);
+    }
+    co_return;
+}
+
+// [0, count) の各番号をスレッドが1つずつ取り合って並列に処理するタスク (fn は完了まで呼び出し元が持っておく)
+template <typename Fn>
+Task parallelEachTask(size_t count, const Fn& fn) {
+    std::atomic<size_t> next(0);
+    size_t slices = std::min(static_cast<size_t>(jobSystem.threadCount()), count);
+    Task tasks[MAX_JOB_THREADS];
+    for (size_t s = 0; s < slices; ++s) {
+        tasks[s] = parallelEachSlice(fn, next, count);
+    }
+    co_await WhenAll(tasks, slices);
+}
+
+// --- ランタンの一括描画 ---
+// 本体・核・炎の形状は全ランタンで共通なので、メッシュとしてVBOに一度だけ作る。
+// 毎フレームはランタンごとの位置と炎の位相だけをインスタンスデータとして書き込み、部位ごとに1回のインスタンス描画で全ランタンを描く
+
+// ランタンのメッシュの頂点
+struct MeshVertex {
+    float x, y, z; // ランタンのローカル座標
+    float nx, ny, nz; // 法線 (核のライティング用)
+    GLubyte r, g, b, a; // 色
+    float pulseWeight; // 核の脈動で緑成分が明るくなる量 (炎の基点用)
+};
+
+typedef TrackedVector<MeshVertex, MEMORY_RENDER> MeshVertices; // メッシュの頂点 (三角形リスト)
+
+// ランタンごとのインスタンスデータ
+struct LanternInstance {
+    float x, y, z; // 位置
+    float phase; // 炎アニメーションの位相 (脈動値は頂点シェーダーで共通の時刻から求める)
+};
+
+// ランタンの部位 (描画順)。炎は重ねた三角形の束か、グローを使う場合は視点を向く1枚の四角形で描く
+enum LanternPart { PART_BODY, PART_CORE, PART_FLAME, PART_FLAME_QUAD, LANTERN_PART_COUNT };
+
+// 共通の頂点バッファ内での部位ごとの範囲
+struct MeshRange {
+    GLint first; // 先頭の頂点
+    GLsizei count; // 頂点数
+};
+
+// シェーダーの頂点属性の番号
+enum LanternAttribute { ATTRIB_POSITION, ATTRIB_NORMAL, ATTRIB_COLOR, ATTRIB_PULSE_WEIGHT, ATTRIB_INSTANCE };
+
+MeshVertices lanternMeshVertices; // 全部位のメッシュ (三角形リスト)
+MeshRange lanternMeshRanges[LANTERN_PART_COUNT]; // 部位ごとの範囲
+GLuint lanternMeshBuffer = 0; // メッシュの頂点バッファ
+
+// インスタンスデータのリングバッファ。永続的にマップした1つのバッファを3区画に分け、
+// シミュレーションが区画 N に書き込む間、GPUは前のティックの区画を読む。区画の再利用前にはフェンスで描画の完了を待つ。
+// 永続マップが使えない場合は1区画のみを使い、毎回バッファを作り直して (孤立化) glBufferSubData で送る
+const int INSTANCE_RING_REGIONS = 3;
+
+struct InstanceRing {
+    GLuint buffer = 0; // バッファ
+    bool persistent = false; // 永続マップを使用中か
+    LanternInstance* mapped = nullptr; // 永続マップの先頭
+    TrackedVector<LanternInstance, MEMORY_RENDER> staging; // 永続マップが使えない場合の書き込み先
+    size_t regionCapacity = 0; // 区画あたりのランタン数
+    GLsync fences[INSTANCE_RING_REGIONS] = {}; // 各区画を最後に読んだ描画の完了フェンス
+    int writeRegion = 0; // 次に書き込む区画
+    int readyRegion = -1; // 最後に書き終えた区画 (描画に使う)
+    size_t readyCount = 0; // その区画の先頭から並ぶ (形状で描く) ランタン数
+    size_t readyFarCount = 0; // その区画の末尾に並ぶ (インポスターで描く) 遠くのランタン数
+};
+
+InstanceRing instanceRing; // ランタンのインスタンスデータ
+TrackedVector<size_t, MEMORY_RENDER> visibleLanternBlocks; // 視錐台と交わるセクターのブロック (描画ごとに集め直す)
+const float IMPOSTOR_DISTANCE = 40.0f; // これより遠いランタンはインポスター (アトラスの絵を貼った四角形) で描く
+GLuint lanternProgram = 0; // インスタンス描画用のシェーダー
+GLint lanternPartUniform = -1; // 描画中の部位
+GLint lanternFlameTimeUniform = -1; // 炎の時刻
+bool instancedLanterns = false; // インスタンス描画を使うか
+
+// インスタンス描画用の頂点シェーダー (固定機能の描画結果に合わせる)
+const char* LANTERN_VERTEX_SHADER = R"(
+#version 120
+attribute vec3 position;
+attribute vec3 normal;
+attribute vec4 color;
+attribute float pulseWeight;
+attribute vec4 instance; // xyz: ランタンの位置, w: 炎アニメーションの位相
+uniform int part; // 0: 本体, 1: 核, 2: 炎, 3: 炎の四角形
+uniform float flameTime; // 全ランタン共通の炎の時刻
+varying vec4 vColor;
+varying vec2 vQuad; // 炎の四角形内の位置 (-1〜1)
+
+void main() {
+    vec3 local = position;
+    vec4 c = color;
+    float pulse = (sin(instance.w + flameTime) + 1.0) * 0.5; // 炎の核の脈動値
+    if (part == 1) {
+        // 核: 脈動に合わせて縦長の球を拡大し、発光色 + 視点座標系で真上からの光で照らす
+        float s = 0.1 + pulse * 0.05;
+        vec3 scale = vec3(s, s * 1.5, s);
+        local = position * scale + vec3(0.0, -0.65, 0.0);
+        vec3 core = vec3(1.0, 0.4 + pulse * 0.6, 0.1);
+        vec3 emission = vec3(core.r, core.g * 0.7, core.b * 0.5);
+        vec3 n = normalize(gl_NormalMatrix * (normal / scale));
+        float diffuse = max(n.y, 0.0);
+        c = vec4(min(emission + core * (vec3(0.3, 0.3, 0.35) + vec3(0.3, 0.3, 0.4) * diffuse), 1.0), 1.0);
+    }
+    else if (part == 2) {
+        c.g += pulse * pulseWeight; // 炎の基点は核の脈動で明るくなる
+    }
+    else if (part == 3) {
+        // 炎の四角形: 中心を視点座標系に移し、法線のxyに入れた角の位置だけ画面に平行に広げる
+        vec4 eye = gl_ModelViewMatrix * vec4(position + instance.xyz, 1.0);
+        eye.xy += normal.xy * vec2(0.22, 0.4);
+        gl_Position = gl_ProjectionMatrix * eye;
+        vQuad = normal.xy;
+        vColor = vec4(1.0, 0.4 + pulse * 0.3, 0.1, 1.0);
+        return;
+    }
+    gl_Position = gl_ModelViewProjectionMatrix * vec4(local + instance.xyz, 1.0);
+    vColor = c;
+    vQuad = vec2(0.0);
+}
+)";
+
+// インスタンス描画用のフラグメントシェーダー
+const char* LANTERN_FRAGMENT_SHADER = R"(
+#version 120
+uniform int part;
+varying vec4 vColor;
+varying vec2 vQuad;
+
+void main() {
+    if (part == 3) {
+        // 炎の四角形: 下が丸く上が細くなるしずく形に減衰させ、先端ほど黄色くする
+        float t = vQuad.y * 0.5 + 0.5; // 基点0 → 先端1
+        float width = mix(1.0, 0.15, t * t);
+        float d = length(vec2(vQuad.x / width, vQuad.y));
+        float a = clamp(1.0 - d, 0.0, 1.0);
+        vec3 c = mix(vColor.rgb, vec3(1.0, 1.0, 0.5), t);
+        gl_FragColor = vec4(c, a * a * 0.9);
+        return;
+    }
+    gl_FragColor = vColor;
+}
+)";
+
+// メッシュに頂点を1つ追加する関数
+void addMeshVertex(MeshVertices& mesh, float x, float y, float z, const float color[4], float nx = 0.0f, float ny = 1.0f, float nz = 0.0f, float pulseWeight = 0.0f) {
+    MeshVertex v;
+    v.x = x; v.y = y; v.z = z;
+    v.nx = nx; v.ny = ny; v.nz = nz;
+    v.r = static_cast<GLubyte>(color[0] * 255.0f + 0.5f);
+    v.g = static_cast<GLubyte>(color[1] * 255.0f + 0.5f);
+    v.b = static_cast<GLubyte>(color[2] * 255.0f + 0.5f);
+    v.a = static_cast<GLubyte>(color[3] * 255.0f + 0.5f);
+    v.pulseWeight = pulseWeight;
+    mesh.push_back(v);
+}
+
+// 高さ y0 から y1 までの円筒側面 (半径 r0 → r1) を三角形で追加する関数 (GL_QUAD_STRIPと同じ形状)
+void addMeshCylinder(MeshVertices& mesh, float r0, float r1, float y0, float y1, int segments, const float color[4]) {
+    for (int i = 0; i < segments; ++i) {
+        float a0 = 2.0f * M_PI * (float)i / (float)segments;
+        float a1 = 2.0f * M_PI * (float)(i + 1) / (float)segments;
+        addMeshVertex(mesh, r0 * cos(a0), y0, r0 * sin(a0), color);
+        addMeshVertex(mesh, r1 * cos(a0), y1, r1 * sin(a0), color);
+        addMeshVertex(mesh, r0 * cos(a1), y0, r0 * sin(a1), color);
+        addMeshVertex(mesh, r0 * cos(a1), y0, r0 * sin(a1), color);
+        addMeshVertex(mesh, r1 * cos(a0), y1, r1 * sin(a0), color);
+        addMeshVertex(mesh, r1 * cos(a1), y1, r1 * sin(a1), color);
+    }
+}
+
+// 高さ y の円盤を三角形で追加する関数 (GL_TRIANGLE_FANと同じ形状)
+void addMeshDisc(MeshVertices& mesh, float r, float y, int segments, const float color[4]) {
+    for (int i = 0; i < segments; ++i) {
+        float a0 = 2.0f * M_PI * (float)i / (float)segments;
+        float a1 = 2.0f * M_PI * (float)(i + 1) / (float)segments;
+        addMeshVertex(mesh, 0.0f, y, 0.0f, color);
+        addMeshVertex(mesh, r * cos(a0), y, r * sin(a0), color);
+        addMeshVertex(mesh, r * cos(a1), y, r * sin(a1), color);
+    }
+}
+
+// ランタン本体 (drawLanternFrame, drawLanternCover, drawLanternRoof, drawHook と同じ形状) のメッシュを作る関数
+void buildLanternBodyMesh(MeshVertices& mesh) {
+    // 底のリング (竹の濃い茶色)
+    const float frameColor[4] = { 0.4f, 0.2f, 0.0f, 1.0f };
+    addMeshCylinder(mesh, 0.35f, 0.35f, -0.6f, -0.6f + 0.015f, 30, frameColor);
+
+    // バーナーの土台 (底のリングの下の平らな四角)
+    const float burnerColor[4] = { 0.6f, 0.4f, 0.0f, 1.0f };
+    float hx = 0.35f * 0.8f * 0.5f, hy = 0.015f * 3.0f * 0.5f, cy = -0.7f;
+    const float corners[8][3] = {
+        { -hx, cy - hy, -hx }, { hx, cy - hy, -hx }, { hx, cy - hy, hx }, { -hx, cy - hy, hx },
+        { -hx, cy + hy, -hx }, { hx, cy + hy, -hx }, { hx, cy + hy, hx }, { -hx, cy + hy, hx },
+    };
+    const int faces[6][4] = { { 0, 1, 2, 3 }, { 4, 7, 6, 5 }, { 0, 4, 5, 1 }, { 1, 5, 6, 2 }, { 2, 6, 7, 3 }, { 3, 7, 4, 0 } };
+    for (const auto& f : faces) {
+        const int tri[6] = { f[0], f[1], f[2], f[0], f[2], f[3] };
+        for (int k : tri) {
+            addMeshVertex(mesh, corners[k][0], corners[k][1], corners[k][2], burnerColor);
+        }
+    }
+
+    // 紙のカバー (わずかに先細りの円筒)
+    const float paperColor[4] = { 1.0f, 0.9f, 0.7f, 1.0f };
+    const int stacks = 20;
+    for (int j = 0; j < stacks; ++j) {
+        float r1 = 0.34f + (0.33f - 0.34f) * (float)j / (float)stacks;
+        float r2 = 0.34f + (0.33f - 0.34f) * (float)(j + 1) / (float)stacks;
+        float y1 = -0.6f + (float)j / (float)stacks * 1.2f;
+        float y2 = -0.6f + (float)(j + 1) / (float)stacks * 1.2f;
+        addMeshCylinder(mesh, r1, r2, y1, y2, 40, paperColor);
+    }
+
+    // 平らな屋根
+    const float roofColor[4] = { 1.0f, 0.9f, 0.7f, 0.95f };
+    addMeshDisc(mesh, 0.35f, 0.6f + 0.02f, 30, roofColor);
+    addMeshDisc(mesh, 0.35f, 0.6f, 30, roofColor);
+    addMeshCylinder(mesh, 0.35f, 0.35f, 0.6f, 0.6f + 0.02f, 30, roofColor);
+
+    // フック
+    const float hookColor[4] = { 0.3f, 0.3f, 0.3f, 1.0f };
+    float hookY = 0.5f + 0.1f / 2.0f + 0.1f;
+    addMeshDisc(mesh, 0.02f, hookY + 0.05f, 16, hookColor);
+    addMeshDisc(mesh, 0.02f, hookY - 0.05f, 16, hookColor);
+    addMeshCylinder(mesh, 0.02f, 0.02f, hookY - 0.05f, hookY + 0.05f, 16, hookColor);
+}
+
+// 炎の核 (半径0.5の球、glutSolidSphere(0.5, 10, 10) 相当) のメッシュを作る関数。拡大と色はシェーダーで行う
+void buildLanternCoreMesh(MeshVertices& mesh) {
+    const float white[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+    const int slices = 10, stacks = 10;
+    auto point = [&](int i, int j) {
+        float theta = M_PI * (float)j / (float)stacks; // 極角
+        float phi = 2.0f * M_PI * (float)i / (float)slices; // 方位角
+        float nx = sin(theta) * cos(phi), ny = cos(theta), nz = sin(theta) * sin(phi);
+        addMeshVertex(mesh, nx * 0.5f, ny * 0.5f, nz * 0.5f, white, nx, ny, nz);
+    };
+    for (int j = 0; j < stacks; ++j) {
+        for (int i = 0; i < slices; ++i) {
+            point(i, j); point(i, j + 1); point(i + 1, j);
+            point(i + 1, j); point(i, j + 1); point(i + 1, j + 1);
+        }
+    }
+}
+
+// 揺らめく炎のポリゴン (drawFlame と同じ形状) のメッシュを作る関数
+void buildLanternFlameMesh(MeshVertices& mesh) {
+    for (const auto& p : flamePolygons) {
+        float rot = p.rotation * M_PI / 180.0f;
+        for (int i = 0; i < 10; ++i) {
+            // より有機的な見た目のためにY軸周りにランダムな揺れで回転
+            float yaw = (i * 18.0f + sin(p.animation_offset * 3.0f) * 5.0f) * M_PI / 180.0f;
+            float tipColor[4] = { 1.0f, 1.0f, 0.5f, p.alpha * (0.8f - 0.5f * (float)i / 9.0f) };
+            float baseColor[4] = { 1.0f, 0.4f, 0.1f, p.alpha * (0.2f + 0.3f * (float)i / 9.0f) };
+            const float local[3][2] = { { 0.0f, 0.75f }, { -0.2f, 0.0f }, { 0.2f, 0.0f } }; // 先端, 左下, 右下 (XY平面)
+            for (int k = 0; k < 3; ++k) {
+                // Y軸回転 → 縮小 → Z軸回転 → 核の中心へ平行移動 (drawFlameの行列の積と同じ順)
+                float x = local[k][0] * cos(yaw), y = local[k][1], z = -local[k][0] * sin(yaw);
+                x *= p.scale_x * 0.8f;
+                y *= p.scale_y * 0.8f;
+                float rx = x * cos(rot) - y * sin(rot);
+                float ry = x * sin(rot) + y * cos(rot);
+                if (k == 0) {
+                    addMeshVertex(mesh, rx, ry - 0.65f, z, tipColor);
+                }
+                else {
+                    addMeshVertex(mesh, rx, ry - 0.65f, z, baseColor, 0.0f, 1.0f, 0.0f, 0.3f);
+                }
+            }
+        }
+    }
+}
+
+// 炎の四角形のメッシュを作る関数。頂点は全て炎の中心に置き、角の位置 (-1〜1) を法線のxyに入れる (視点を向ける広げ方はシェーダーで行う)
+void buildLanternFlameQuadMesh(MeshVertices& mesh) {
+    const float white[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+    const float corners[6][2] = { { -1.0f, -1.0f }, { 1.0f, -1.0f }, { 1.0f, 1.0f }, { -1.0f, -1.0f }, { 1.0f, 1.0f }, { -1.0f, 1.0f } };
+    for (const auto& corner : corners) {
+        addMeshVertex(mesh, 0.0f, -0.35f, 0.0f, white, corner[0], corner[1], 0.0f);
+    }
+}
+
+// シェーダーをコンパイルする関数 (失敗したら0)
+GLuint compileShader(GLenum type, const char* source) {
+    GLuint shader = pglCreateShader(type);
+    pglShaderSource(shader, 1, &source, nullptr);
+    pglCompileShader(shader);
+    GLint ok = 0;
+    pglGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+    if (!ok) {
+        char log[1024];
+        pglGetShaderInfoLog(shader, sizeof(log), nullptr, log);
+        std::cout << "シェーダーのコンパイルに失敗しました: " << log << std::endl;
+        pglDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+// 頂点・フラグメントシェーダーをリンクしてプログラムを作る関数 (attributes は属性番号順の名前、失敗したら0)
+GLuint linkProgram(const char* vertexSource, const char* fragmentSource, const std::vector<const char*>& attributes) {
+    GLuint vs = compileShader(GL_VERTEX_SHADER, vertexSource);
+    GLuint fs = compileShader(GL_FRAGMENT_SHADER, fragmentSource);
+    if (!vs || !fs) {
+        return 0;
+    }
+    GLuint program = pglCreateProgram();
+    pglAttachShader(program, vs);
+    pglAttachShader(program, fs);
+    for (size_t i = 0; i < attributes.size(); ++i) {
+        pglBindAttribLocation(program, static_cast<GLuint>(i), attributes[i]);
+    }
+    pglLinkProgram(program);
+    pglDeleteShader(vs);
+    pglDeleteShader(fs);
+    GLint ok = 0;
+    pglGetProgramiv(program, GL_LINK_STATUS, &ok);
+    if (!ok) {
+        char log[1024];
+        pglGetProgramInfoLog(program, sizeof(log), nullptr, log);
+        std::cout << "シェーダーのリンクに失敗しました: " << log << std::endl;
+        return 0;
+    }
+    return program;
+}
+
+// インスタンスデータのリングバッファを作成する関数
+void initInstanceRing(InstanceRing& ring, size_t capacity) {
+    ring.regionCapacity = capacity;
+    pglGenBuffers(1, &ring.buffer);
+    pglBindBuffer(GL_ARRAY_BUFFER, ring.buffer);
+    if (hasPersistentMapping) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        GLsizeiptr size = sizeof(LanternInstance) * capacity * INSTANCE_RING_REGIONS;
+        pglBufferStorage(GL_ARRAY_BUFFER, size, nullptr, flags);
+        ring.mapped = static_cast<LanternInstance*>(pglMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags));
+        ring.persistent = ring.mapped != nullptr;
+    }
+    if (!ring.persistent) {
+        pglBufferData(GL_ARRAY_BUFFER, sizeof(LanternInstance) * capacity, nullptr, GL_STREAM_DRAW);
+        ring.staging.resize(capacity);
+    }
+    pglBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// 次の区画への書き込みを開始する関数 (GPUがその区画を読み終えるまで待つ)
+LanternInstance* beginInstanceWrite(InstanceRing& ring) {
+    if (!ring.persistent) {
+        return ring.staging.data();
+    }
+    GLsync& fence = ring.fences[ring.writeRegion];
+    if (fence) {
+        while (pglClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ULL) == GL_TIMEOUT_EXPIRED) {
+            // 3区画あれば通常は待たない。GPUが2フレーム以上遅れているときだけここで止まる
+        }
+        pglDeleteSync(fence);
+        fence = nullptr;
+    }
+    return ring.mapped + ring.writeRegion * ring.regionCapacity;
+}
+
+// 区画への書き込みを終え、描画に使う区画にする関数 (区画の先頭に count 個、末尾に farCount 個を書き込んだ)
+void endInstanceWrite(InstanceRing& ring, size_t count, size_t farCount) {
+    if (!ring.persistent) {
+        // 前フレームの描画を待たないよう、古い内容を孤立化させてから送る
+        pglBindBuffer(GL_ARRAY_BUFFER, ring.buffer);
+        pglBufferData(GL_ARRAY_BUFFER, sizeof(LanternInstance) * ring.regionCapacity, nullptr, GL_STREAM_DRAW);
+        pglBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(LanternInstance) * count, ring.staging.data());
+        size_t farFirst = ring.regionCapacity - farCount;
+        pglBufferSubData(GL_ARRAY_BUFFER, sizeof(LanternInstance) * farFirst, sizeof(LanternInstance) * farCount, ring.staging.data() + farFirst);
+        pglBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    ring.readyRegion = ring.persistent ? ring.writeRegion : 0;
+    ring.readyCount = count;
+    ring.readyFarCount = farCount;
+    ring.writeRegion = (ring.writeRegion + 1) % INSTANCE_RING_REGIONS;
+}
+
+// 描画に使った区画にフェンスを置く関数 (シミュレーションが上書きする前に完了を待てるように)
+void fenceInstanceRead(InstanceRing& ring) {
+    if (!ring.persistent || ring.readyRegion < 0) {
+        return;
+    }
+    GLsync& fence = ring.fences[ring.readyRegion];
+    if (fence) {
+        pglDeleteSync(fence); // 同じ区画を再描画した場合は新しいフェンスに置き換える
+    }
+    fence = pglFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+// --- 遮蔽カリング ---
+// 近くのランタンの本体を低解像度のデプスバッファにCPUで描き、その最大値の階層 (HiZ) で奥のランタンが完全に隠れているか調べる。
+// 遮蔽物には前フレームで見えていた近くのランタンの位置を使う (1フレームで動く距離は遮蔽物を縮める余白に収まる)。
+// 地面 (y=0) は、その上にいる視点から見て、その上にあるランタンを隠せないので遮蔽物にしない
+const int OCCLUSION_WIDTH = 256, OCCLUSION_HEIGHT = 192; // 最も細かい階層のピクセル数
+const int OCCLUSION_LEVELS = 7; // 階層の数 (256x192 → 4x3)
+const float OCCLUDER_DISTANCE = 20.0f; // この距離以内のランタンを次のフレームの遮蔽物にする
+const size_t MAX_OCCLUDERS = 1024; // 遮蔽物の最大数
+const float OCCLUDER_RADIUS = 0.28f; // 遮蔽物とする本体内部の球の半径 (本体の半径0.33から、1フレームの移動分を引いた余白)
+const float OCCLUDER_OFFSETS[3] = { -0.3f, 0.0f, 0.3f }; // 本体の高さ方向に並べる遮蔽球の中心 (ランタンの中心から)
+const float LANTERN_BOUNDING_RADIUS = 0.85f; // 形状・炎を含むランタン全体の境界球の半径
+
+struct OcclusionBuffer {
+    TrackedVector<float, MEMORY_RENDER> levels[OCCLUSION_LEVELS]; // 各階層の遮蔽物の奥行き (視点からの距離。階層1以降は子の最大値)
+    Mat4 view; // 描いたときのビュー行列
+    float projectX = 1.0f, projectY = 1.0f; // 投影行列の拡大率 (m[0], m[5])
+    float nearZ = 0.1f; // 手前のクリッピング面
+    bool valid = false; // 遮蔽物が1つ以上描かれているか
+    TrackedVector<Vec3, MEMORY_RENDER> occluders; // このフレームで描く遮蔽物 (前フレームで見えていた近くのランタン)
+    TrackedVector<Vec3, MEMORY_RENDER> nextOccluders; // 次のフレームの遮蔽物 (ワーカーが並列に書き込む)
+    std::atomic<size_t> nextOccluderCount{ 0 };
+};
+
+OcclusionBuffer occlusionBuffer; // 遮蔽カリング用のデプス
+bool disableOcclusion = false; // trueなら遮蔽カリングを行わない (--no-occlusion)
+
+// 前フレームの遮蔽物を現在のカメラから低解像度のデプスバッファに描き、階層を作る関数 (メインスレッドで、ランタンの評価前に呼び出す)
+void buildOcclusionBuffer(OcclusionBuffer& ob) {
+    size_t count = std::min(ob.nextOccluderCount.load(), MAX_OCCLUDERS);
+    ob.occluders.assign(ob.nextOccluders.begin(), ob.nextOccluders.begin() + count);
+    ob.nextOccluders.resize(MAX_OCCLUDERS);
+    ob.nextOccluderCount = 0;
+
+    ob.view = camera.view();
+    ob.projectX = camera.projection().m[0];
+    ob.projectY = camera.projection().m[5];
+    ob.valid = false;
+    TrackedVector<float, MEMORY_RENDER>& depth = ob.levels[0];
+    depth.assign(OCCLUSION_WIDTH * OCCLUSION_HEIGHT, FLT_MAX);
+    const float* m = ob.view.m;
+    const float inscribed = 1.0f / std::sqrt(2.0f); // 投影した円に内接する正方形の半分の大きさの比
+    for (const Vec3& p : ob.occluders) {
+        for (float offset : OCCLUDER_OFFSETS) {
+            float y = p.y + offset;
+            float vx = m[0] * p.x + m[4] * y + m[8] * p.z + m[12];
+            float vy = m[1] * p.x + m[5] * y + m[9] * p.z + m[13];
+            float z = -(m[2] * p.x + m[6] * y + m[10] * p.z + m[14]);
+            if (z - OCCLUDER_RADIUS <= ob.nearZ) {
+                continue;
+            }
+            // 球の投影 (半径は少なくとも r / z) に内接する正方形のうち、完全に覆うピクセルだけを塗る
+            float cx = (vx * ob.projectX / z * 0.5f + 0.5f) * OCCLUSION_WIDTH;
+            float cy = (vy * ob.projectY / z * 0.5f + 0.5f) * OCCLUSION_HEIGHT;
+            float hx = OCCLUDER_RADIUS * ob.projectX / z * inscribed * 0.5f * OCCLUSION_WIDTH;
+            float hy = OCCLUDER_RADIUS * ob.projectY / z * inscribed * 0.5f * OCCLUSION_HEIGHT;
+            int x0 = std::max(0, static_cast<int>(std::ceil(cx - hx)));
+            int x1 = std::min(OCCLUSION_WIDTH, static_cast<int>(std::floor(cx + hx)));
+            int y0 = std::max(0, static_cast<int>(std::ceil(cy - hy)));
+            int y1 = std::min(OCCLUSION_HEIGHT, static_cast<int>(std::floor(cy + hy)));
+            float farDepth = z + OCCLUDER_RADIUS; // 塗った範囲の遮蔽物の最も奥
+            for (int py = y0; py < y1; ++py) {
+                float* row = &depth[py * OCCLUSION_WIDTH];
+                for (int px = x0; px < x1; ++px) {
+                    row[px] = std::min(row[px], farDepth);
+                    ob.valid = true;
+                }
+            }
+        }
+    }
+    if (!ob.valid) {
+        return;
+    }
+
+    // 子の4ピクセルの最大値 (最も奥) を親にする
+    int width = OCCLUSION_WIDTH, height = OCCLUSION_HEIGHT;
+    for (int level = 1; level < OCCLUSION_LEVELS; ++level) {
+        const TrackedVector<float, MEMORY_RENDER>& child = ob.levels[level - 1];
+        int childWidth = width;
+        width /= 2;
+        height /= 2;
+        TrackedVector<float, MEMORY_RENDER>& parent = ob.levels[level];
+        parent.resize(width * height);
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                const float* c = &child[(y * 2) * childWidth + x * 2];
+                parent[y * width + x] = std::max(std::max(c[0], c[1]), std::max(c[childWidth], c[childWidth + 1]));
+            }
+        }
+    }
+}
+
+// ランタンの境界球がデプスバッファの遮蔽物に完全に隠れているか調べる関数 (ワーカースレッドから並列に呼び出せる)
+bool lanternOccluded(const OcclusionBuffer& ob, const LanternInstance& l) {
+    const float* m = ob.view.m;
+    float vx = m[0] * l.x + m[4] * l.y + m[8] * l.z + m[12];
+    float vy = m[1] * l.x + m[5] * l.y + m[9] * l.z + m[13];
+    float z = -(m[2] * l.x + m[6] * l.y + m[10] * l.z + m[14]);
+    float nearest = z - LANTERN_BOUNDING_RADIUS;
+    if (nearest <= ob.nearZ) {
+        return false;
+    }
+    // 境界球を外接する画面上の四角形 (最も手前の奥行きで広げるので投影より大きい)
+    float cx = (vx * ob.projectX / z * 0.5f + 0.5f) * OCCLUSION_WIDTH;
+    float cy = (vy * ob.projectY / z * 0.5f + 0.5f) * OCCLUSION_HEIGHT;
+    float hx = LANTERN_BOUNDING_RADIUS * ob.projectX / nearest * 0.5f * OCCLUSION_WIDTH;
+    float hy = LANTERN_BOUNDING_RADIUS * ob.projectY / nearest * 0.5f * OCCLUSION_HEIGHT;
+    float x0 = cx - hx, x1 = cx + hx, y0 = cy - hy, y1 = cy + hy;
+    if (x0 < 0.0f || y0 < 0.0f || x1 >= OCCLUSION_WIDTH || y1 >= OCCLUSION_HEIGHT) {
+        return false; // 画面外にはみ出す部分は遮蔽物がないものとみなす
+    }
+    // 四角形の幅が4ピクセル以内になる階層を選び (読むのは最大5x5ピクセル)、その最大値より奥なら隠れている。
+    // 1ピクセル以内まで粗くすると、小さな遮蔽物が四角形の周りの余分な範囲まで覆えず、ほとんど隠れなくなる
+    int level = 0;
+    float extent = std::max(x1 - x0, y1 - y0);
+    while (level < OCCLUSION_LEVELS - 1 && extent > 4.0f) {
+        extent *= 0.5f;
+        ++level;
+    }
+    int width = OCCLUSION_WIDTH >> level, height = OCCLUSION_HEIGHT >> level;
+    float scale = 1.0f / static_cast<float>(1 << level);
+    int ix0 = static_cast<int>(x0 * scale), ix1 = std::min(static_cast<int>(x1 * scale), width - 1);
+    int iy0 = static_cast<int>(y0 * scale), iy1 = std::min(static_cast<int>(y1 * scale), height - 1);
+    const TrackedVector<float, MEMORY_RENDER>& depth = ob.levels[level];
+    for (int y = iy0; y <= iy1; ++y) {
+        for (int x = ix0; x <= ix1; ++x) {
+            if (depth[y * width + x] >= nearest) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// 見えたランタンのうち近いものを次のフレームの遮蔽物として記録する関数 (ワーカースレッドから並列に呼び出せる)
+void recordOccluder(OcclusionBuffer& ob, const LanternInstance& l, const Vec3& eye) {
+    float dx = l.x - eye.x, dy = l.y - eye.y, dz = l.z - eye.z;
+    if (dx * dx + dy * dy + dz * dz >= OCCLUDER_DISTANCE * OCCLUDER_DISTANCE) {
+        return;
+    }
+    size_t index = ob.nextOccluderCount.fetch_add(1);
+    if (index < ob.nextOccluders.size()) {
+        ob.nextOccluders[index] = { l.x, l.y, l.z };
+    }
+}
+
+// セクターのブロックのランタンが入りうる境界箱 (出現位置からの漂流と形状の大きさを含む) が視錐台と交わるか調べる関数
+bool lanternBlockVisible(size_t block) {
+    const Sector& sector = activeSectors[block];
+    const float pad = LANTERN_MAX_DRIFT + LANTERN_BOUNDS_MARGIN;
+    Vec3 lo = { sector.sx * SECTOR_SIZE - pad, LANTERN_LAUNCH_Y - LANTERN_BOUNDS_MARGIN, sector.sz * SECTOR_SIZE - pad };
+    Vec3 hi = { (sector.sx + 1) * SECTOR_SIZE + pad, LANTERN_CEILING_Y + LANTERN_BOUNDS_MARGIN, (sector.sz + 1) * SECTOR_SIZE + pad };
+    return camera.frustum().intersectsBox(lo, hi);
+}
+
+// 視錐台と交わるセクターのブロックを集める関数 (visibleLanternBlocks に入れる)
+void collectVisibleLanternBlocks() {
+    visibleLanternBlocks.clear();
+    size_t blocks = (lanternPool.count + LANTERNS_PER_SECTOR - 1) / LANTERNS_PER_SECTOR;
+    for (size_t b = 0; b < blocks; ++b) {
+        if (lanternBlockVisible(b)) {
+            visibleLanternBlocks.push_back(b);
+        }
+    }
+}
+
+size_t publishedNearCount = 0; // batchLanternInstancesTask が区画の先頭から書き込んだ数
+size_t publishedFarCount = 0; // batchLanternInstancesTask が区画の末尾から書き込んだ数
+
+// 視錐台と交わるセクターのブロックを集めるタスク
+Task cullLanternBlocksTask() {
+    collectVisibleLanternBlocks();
+    co_return;
+}
+
+// 前のフレームに記録した遮蔽物から遮蔽バッファを作るタスク (視錐台カリングと並列に実行できる)
+Task occlusionBufferTask() {
+    if (!disableOcclusion) {
+        buildOcclusionBuffer(occlusionBuffer);
+    }
+    co_return;
+}
+
+// 現在のティックの見えるランタンの位置を並列に求め、インスタンスバッファの区画 dst へ詰めて書き込むタスク
+// (位置は描画するときにだけ求め、シミュレーションのティックでは再出現以外にランタンを触らない)。
+// 遮蔽物に隠れたランタンは書き込まず、インポスターを使う場合はカメラから IMPOSTOR_DISTANCE 以内のランタンを区画の先頭から、
+// それより遠いランタンを末尾から詰める。書き込んだ数は publishedNearCount と publishedFarCount に入れる
+Task batchLanternInstancesTask(LanternInstance* dst) {
+    bool occlusion = !disableOcclusion;
+    const OcclusionBuffer& ob = occlusionBuffer;
+    bool cullOccluded = occlusion && ob.valid;
+    size_t count = std::min(visibleLanternBlocks.size() * LANTERNS_PER_SECTOR, instanceRing.regionCapacity);
+    const Vec3 eye = camera.position();
+    const float farSquared = lanternImpostorsActive() ? IMPOSTOR_DISTANCE * IMPOSTOR_DISTANCE : FLT_MAX;
+    std::atomic<size_t> nearCursor(0), farCursor(0);
+    // 詰める前の番号 [begin, end) をブロックごとに区切り、元のランタンの範囲から作業領域に書き込んでから振り分ける
+    auto batch = [&](size_t begin, size_t end) {
+        LanternInstance scratch[LANTERNS_PER_SECTOR]; // 隠れたランタンを除き、近い・遠いに振り分ける前の作業領域
+        while (begin < end) {
+            size_t block = visibleLanternBlocks[begin / LANTERNS_PER_SECTOR];
+            size_t offset = begin % LANTERNS_PER_SECTOR;
+            size_t length = std::min(end - begin, static_cast<size_t>(LANTERNS_PER_SECTOR) - offset);
+            size_t first = block * LANTERNS_PER_SECTOR + offset;
+            size_t last = std::min(first + length, lanternPool.count);
+            if (first < last) {
+                if (compactLanterns) {
+                    unpackCompactLanterns(first, last, scratch);
+                }
+                else {
+                    evaluateLanternInstances(first, last, scratch);
+                }
+                size_t kept = last - first;
+                if (occlusion) {
+                    kept = 0;
+                    for (size_t i = 0; i < last - first; ++i) {
+                        if (cullOccluded && lanternOccluded(ob, scratch[i])) {
+                            continue;
+                        }
+                        recordOccluder(occlusionBuffer, scratch[i], eye);
+                        scratch[kept++] = scratch[i];
+                    }
+                }
+                // 振り分けた分だけ先頭と末尾の書き込み位置をまとめて確保する (ブロックあたり2回の原子的な加算)
+                LanternInstance* split = std::partition(scratch, scratch + kept, [&](const LanternInstance& in) {
+                    float dx = in.x - eye.x, dy = in.y - eye.y, dz = in.z - eye.z;
+                    return dx * dx + dy * dy + dz * dz < farSquared;
+                });
+                size_t nearCount = split - scratch;
+                size_t farCount = kept - nearCount;
+                memcpy(dst + nearCursor.fetch_add(nearCount), scratch, sizeof(LanternInstance) * nearCount);
+                size_t farEnd = instanceRing.regionCapacity - farCursor.fetch_add(farCount);
+                memcpy(dst + farEnd - farCount, split, sizeof(LanternInstance) * farCount);
+            }
+            begin += length;
+        }
+    };
+    co_await parallelTask(count, batch);
+    publishedNearCount = nearCursor.load();
+    publishedFarCount = farCursor.load();
+}
+
+// 見えるランタンをインスタンスバッファの区画 dst に書き込むタスク (視錐台カリング ‖ 遮蔽バッファ → 書き込み)
+Task publishLanternInstancesTask(LanternInstance* dst) {
+    Task culling[2] = { cullLanternBlocksTask(), occlusionBufferTask() };
+    co_await WhenAll(culling, 2);
+    co_await batchLanternInstancesTask(dst);
+}
+
+// --- ランタンのBVH ---
+// 選択や範囲・近傍の問い合わせ用に、ランタンの中心を囲む境界箱の階層 (BVH) を持つ。
+// セクターのブロックごとに、そのときの位置で LANTERNS_PER_SECTOR 個を長い軸の中央値で半分ずつ分けた部分木を作り、
+// ブロックの根を葉とする全体の木をその上に作る。毎ティック、現在の位置から箱だけを下から作り直し (refit)、
+// 木の形はセクターの並びが変わったときにだけ作り直す。ランタンは速さが違い、天井から地面へ再出現もするので
+// 葉の箱はしだいに膨らむ。ブロックの葉の表面積の和が作ったときの BVH_REBUILD_GROWTH 倍を超えたら、そのブロックだけ作り直す
+const int BVH_LEAF_SIZE = 4; // 葉に入れるランタンの最大数
+const int BVH_BLOCK_NODES = 64; // ブロックの部分木に確保する節点数 (94個を4個以下まで半分ずつ分けると63)
+const float BVH_REBUILD_GROWTH = 2.0f; // 部分木を作り直す葉の表面積の増加率
+const float LANTERN_PICK_RADIUS = 0.45f; // 選択に使うランタンの球の半径 (本体と炎を覆う)
+const uint32_t BVH_BLOCK_NODE = 0x80000000u; // 節点の参照がブロックの部分木のものであることを示すビット
+
+struct BvhNode {
+    Vec3 lo, hi; // 子孫のランタンの中心を囲む箱
+    uint32_t first; // 葉なら order の先頭 (全体の木ではブロック番号)、内部節点なら右の子 (左の子は直後の節点)
+    uint32_t count; // 葉のランタン数 (全体の木ではブロック数の1)。0なら内部節点
+};
+
+struct LanternBvh {
+    SectorList sectors; // 木を作ったときのセクターの並び (変わったら作り直す)
+    TrackedVector<Vec3, MEMORY_WORLD> points; // 各ランタンの現在の中心 (lanternPool と同じ番号)
+    TrackedVector<uint32_t, MEMORY_WORLD> order; // 葉の並び順のランタン番号 (ブロックごとに LANTERNS_PER_SECTOR 個)
+    TrackedVector<BvhNode, MEMORY_WORLD> blockNodes; // ブロックごとの部分木 (BVH_BLOCK_NODES 個ずつ、深さ優先の順)
+    TrackedVector<int, MEMORY_WORLD> blockNodeCount; // 各ブロックの部分木の節点数
+    TrackedVector<float, MEMORY_WORLD> builtArea; // 各ブロックの部分木を作ったときの葉の表面積の和
+    TrackedVector<BvhNode, MEMORY_WORLD> topNodes; // ブロックの根を葉とする全体の木
+    uint64_t refitTick = UINT64_MAX; // 最後に箱を作り直したティック
+};
+
+LanternBvh lanternBvh; // 選択・問い合わせ用のBVH
+
+// 箱の表面積
+float boxArea(const Vec3& lo, const Vec3& hi) {
+    Vec3 d = hi - lo;
+    return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+// order[begin, end) のランタンを中央値で分けながら部分木の節点を nodes[next] 以降に深さ優先で作る関数 (作った節点の番号を返す)
+int buildBvhNodes(LanternBvh& bvh, BvhNode* nodes, int& next, uint32_t begin, uint32_t end) {
+    int index = next++;
+    BvhNode& node = nodes[index];
+    node.lo = node.hi = bvh.points[bvh.order[begin]];
+    for (uint32_t k = begin + 1; k < end; ++k) {
+        const Vec3& p = bvh.points[bvh.order[k]];
+        node.lo = { std::min(node.lo.x, p.x), std::min(node.lo.y, p.y), std::min(node.lo.z, p.z) };
+        node.hi = { std::max(node.hi.x, p.x), std::max(node.hi.y, p.y), std::max(node.hi.z, p.z) };
+    }
+    if (end - begin <= static_cast<uint32_t>(BVH_LEAF_SIZE)) {
+        node.first = begin;
+        node.count = end - begin;
+        return index;
+    }
+    // 箱の最も長い軸で、中央のランタンを境に分ける
+    Vec3 extent = node.hi - node.lo;
+    int axis = (extent.x >= extent.y && extent.x >= extent.z) ? 0 : (extent.y >= extent.z ? 1 : 2);
+    uint32_t mid = (begin + end) / 2;
+    const TrackedVector<Vec3, MEMORY_WORLD>& points = bvh.points;
+    std::nth_element(bvh.order.begin() + begin, bvh.order.begin() + mid, bvh.order.begin() + end, [&](uint32_t a, uint32_t b) {
+        return (&points[a].x)[axis] < (&points[b].x)[axis];
+    });
+    buildBvhNodes(bvh, nodes, next, begin, mid);
+    nodes[index].first = static_cast<uint32_t>(buildBvhNodes(bvh, nodes, next, mid, end));
+    nodes[index].count = 0;
+    return index;
+}
+
+// 深さ優先の順に並んだ節点の箱を、子から親へ作り直す関数 (葉は leafBox で求める)
+template <typename LeafBox>
+void refitBvhNodes(BvhNode* nodes, int count, LeafBox leafBox) {
+    for (int i = count - 1; i >= 0; --i) {
+        BvhNode& node = nodes[i];
+        if (node.count > 0) {
+            leafBox(node);
+            continue;
+        }
+        const BvhNode& left = nodes[i + 1];
+        const BvhNode& right = nodes[node.first];
+        node.lo = { std::min(left.lo.x, right.lo.x), std::min(left.lo.y, right.lo.y), std::min(left.lo.z, right.lo.z) };
+        node.hi = { std::max(left.hi.x, right.hi.x), std::max(left.hi.y, right.hi.y), std::max(left.hi.z, right.hi.z) };
+    }
+}
+
+// ブロックの部分木の箱を現在の位置で作り直し、葉の表面積の和を返す関数
+float refitBvhBlock(LanternBvh& bvh, size_t block) {
+    float area = 0.0f;
+    refitBvhNodes(&bvh.blockNodes[block * BVH_BLOCK_NODES], bvh.blockNodeCount[block], [&](BvhNode& leaf) {
+        leaf.lo = leaf.hi = bvh.points[bvh.order[leaf.first]];
+        for (uint32_t k = leaf.first + 1; k < leaf.first + leaf.count; ++k) {
+            const Vec3& p = bvh.points[bvh.order[k]];
+            leaf.lo = { std::min(leaf.lo.x, p.x), std::min(leaf.lo.y, p.y), std::min(leaf.lo.z, p.z) };
+            leaf.hi = { std::max(leaf.hi.x, p.x), std::max(leaf.hi.y, p.y), std::max(leaf.hi.z, p.z) };
+        }
+        area += boxArea(leaf.lo, leaf.hi);
+    });
+    return area;
+}
+
+// ブロックの部分木を現在の位置で作り直す関数
+void buildBvhBlock(LanternBvh& bvh, size_t block) {
+    uint32_t first = static_cast<uint32_t>(block * LANTERNS_PER_SECTOR);
+    for (uint32_t k = 0; k < static_cast<uint32_t>(LANTERNS_PER_SECTOR); ++k) {
+        bvh.order[first + k] = first + k;
+    }
+    int next = 0;
+    buildBvhNodes(bvh, &bvh.blockNodes[block * BVH_BLOCK_NODES], next, first, first + LANTERNS_PER_SECTOR);
+    bvh.blockNodeCount[block] = next;
+    bvh.builtArea[block] = refitBvhBlock(bvh, block);
+}
+
+// blocks[begin, end) のブロックの根を中央値で分けながら全体の木の節点を深さ優先で作る関数 (作った節点の番号を返す)
+int buildBvhTop(LanternBvh& bvh, std::vector<uint32_t>& blocks, size_t begin, size_t end) {
+    int index = static_cast<int>(bvh.topNodes.size());
+    bvh.topNodes.emplace_back();
+    if (end - begin == 1) {
+        const BvhNode& root = bvh.blockNodes[blocks[begin] * BVH_BLOCK_NODES];
+        bvh.topNodes[index] = { root.lo, root.hi, blocks[begin], 1 };
+        return index;
+    }
+    Vec3 lo = { FLT_MAX, FLT_MAX, FLT_MAX }, hi = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+    for (size_t k = begin; k < end; ++k) {
+        const BvhNode& root = bvh.blockNodes[blocks[k] * BVH_BLOCK_NODES];
+        Vec3 c = (root.lo + root.hi) * 0.5f;
+        lo = { std::min(lo.x, c.x), std::min(lo.y, c.y), std::min(lo.z, c.z) };
+        hi = { std::max(hi.x, c.x), std::max(hi.y, c.y), std::max(hi.z, c.z) };
+    }
+    Vec3 extent = hi - lo;
+    int axis = (extent.x >= extent.y && extent.x >= extent.z) ? 0 : (extent.y >= extent.z ? 1 : 2);
+    size_t mid = (begin + end) / 2;
+    std::nth_element(blocks.begin() + begin, blocks.begin() + mid, blocks.begin() + end, [&](uint32_t a, uint32_t b) {
+        const BvhNode& ra = bvh.blockNodes[a * BVH_BLOCK_NODES];
+        const BvhNode& rb = bvh.blockNodes[b * BVH_BLOCK_NODES];
+        return (&ra.lo.x)[axis] + (&ra.hi.x)[axis] < (&rb.lo.x)[axis] + (&rb.hi.x)[axis];
+    });
+    int left = buildBvhTop(bvh, blocks, begin, mid);
+    int right = buildBvhTop(bvh, blocks, mid, end);
+    const BvhNode& l = bvh.topNodes[left];
+    const BvhNode& r = bvh.topNodes[right];
+    bvh.topNodes[index] = { { std::min(l.lo.x, r.lo.x), std::min(l.lo.y, r.lo.y), std::min(l.lo.z, r.lo.z) },
+        { std::max(l.hi.x, r.hi.x), std::max(l.hi.y, r.hi.y), std::max(l.hi.z, r.hi.z) }, static_cast<uint32_t>(right), 0 };
+    return index;
+}
+
+// BVHを現在のティックのランタンの位置に合わせるタスク (同じティックに2回実行しても1回だけ計算する)。
+// セクターの並びが変わっていれば木を作り直し、そうでなければ箱だけを作り直す
+Task updateLanternBvhTask(LanternBvh& bvh) {
+    size_t blocks = lanternPool.count / LANTERNS_PER_SECTOR;
+    bool relayout = bvh.sectors.size() != blocks || !std::equal(bvh.sectors.begin(), bvh.sectors.end(), activeSectors.begin(),
+        [](const Sector& a, const Sector& b) { return a.sx == b.sx && a.sz == b.sz; });
+    if (!relayout && bvh.refitTick == simTick) {
+        co_return;
+    }
+    bvh.refitTick = simTick;
+    if (relayout) {
+        bvh.sectors.assign(activeSectors.begin(), activeSectors.begin() + blocks);
+        bvh.points.resize(blocks * LANTERNS_PER_SECTOR);
+        bvh.order.resize(blocks * LANTERNS_PER_SECTOR);
+        bvh.blockNodes.resize(blocks * BVH_BLOCK_NODES);
+        bvh.blockNodeCount.resize(blocks);
+        bvh.builtArea.resize(blocks);
+    }
+    // ランタンの範囲をスライスに分け、先頭がスライスに入るブロックを担当する
+    auto refit = [&](size_t begin, size_t end) {
+        LanternInstance scratch[LANTERNS_PER_SECTOR];
+        for (size_t b = (begin + LANTERNS_PER_SECTOR - 1) / LANTERNS_PER_SECTOR; b * LANTERNS_PER_SECTOR < end; ++b) {
+            size_t first = b * LANTERNS_PER_SECTOR;
+            if (compactLanterns) {
+                unpackCompactLanterns(first, first + LANTERNS_PER_SECTOR, scratch);
+            }
+            else {
+                evaluateLanternInstances(first, first + LANTERNS_PER_SECTOR, scratch);
+            }
+            for (int k = 0; k < LANTERNS_PER_SECTOR; ++k) {
+                bvh.points[first + k] = { scratch[k].x, scratch[k].y, scratch[k].z };
+            }
+            if (relayout || refitBvhBlock(bvh, b) > BVH_REBUILD_GROWTH * bvh.builtArea[b]) {
+                buildBvhBlock(bvh, b);
+            }
+        }
+    };
+    co_await parallelTask(blocks * LANTERNS_PER_SECTOR, refit);
+
+    if (relayout) {
+        bvh.topNodes.clear();
+        if (blocks > 0) {
+            std::vector<uint32_t> order(blocks);
+            for (size_t b = 0; b < blocks; ++b) {
+                order[b] = static_cast<uint32_t>(b);
+            }
+            bvh.topNodes.reserve(blocks * 2 - 1);
+            buildBvhTop(bvh, order, 0, blocks);
+        }
+        co_return;
+    }
+    refitBvhNodes(bvh.topNodes.data(), static_cast<int>(bvh.topNodes.size()), [&](BvhNode& leaf) {
+        const BvhNode& root = bvh.blockNodes[leaf.first * BVH_BLOCK_NODES];
+        leaf.lo = root.lo;
+        leaf.hi = root.hi;
+    });
+}
+
+// BVHを現在のティックのランタンの位置に合わせる関数 (タスクの外から使う同期版)
+void updateLanternBvh(LanternBvh& bvh) {
+    jobSystem.run(updateLanternBvhTask(bvh));
+}
+
+// BVHを近い順にたどる関数。boxKey(lo, hi) は箱の中のランタンへの距離の下限 (箱を飛ばすなら INFINITY)、
+// bound() はそれ以上遠い箱を飛ばす現在の上限で、葉のランタンごとに visit(番号) を呼ぶ
+template <typename BoxKey, typename Bound, typename Visit>
+void traverseLanternBvh(const LanternBvh& bvh, BoxKey boxKey, Bound bound, Visit visit) {
+    if (bvh.topNodes.empty()) {
+        return;
+    }
+    struct Entry {
+        uint32_t node; // 節点の参照 (BVH_BLOCK_NODE が立っていればブロックの部分木)
+        float key; // 箱までの距離の下限
+    };
+    Entry stack[64]; // 全体の木とブロックの部分木の深さの和に十分な大きさ
+    int top = 0;
+    const BvhNode& root = bvh.topNodes[0];
+    stack[top++] = { 0, boxKey(root.lo, root.hi) };
+    while (top > 0) {
+        Entry entry = stack[--top];
+        if (!(entry.key <= bound())) {
+            continue;
+        }
+        bool inBlock = (entry.node & BVH_BLOCK_NODE) != 0;
+        uint32_t index = entry.node & ~BVH_BLOCK_NODE;
+        const BvhNode& node = inBlock ? bvh.blockNodes[index] : bvh.topNodes[index];
+        if (node.count > 0) {
+            if (!inBlock) {
+                stack[top++] = { node.first * BVH_BLOCK_NODES | BVH_BLOCK_NODE, entry.key }; // ブロックの根は同じ箱
+                continue;
+            }
+            for (uint32_t k = node.first; k < node.first + node.count; ++k) {
+                visit(bvh.order[k]);
+            }
+            continue;
+        }
+        // 遠い子を先に積み、近い子から調べる
+        uint32_t flag = inBlock ? BVH_BLOCK_NODE : 0;
+        uint32_t leftIndex = index + 1, rightIndex = inBlock ? index - index % BVH_BLOCK_NODES + node.first : node.first;
+        const BvhNode& left = inBlock ? bvh.blockNodes[leftIndex] : bvh.topNodes[leftIndex];
+        const BvhNode& right = inBlock ? bvh.blockNodes[rightIndex] : bvh.topNodes[rightIndex];
+        Entry near = { leftIndex | flag, boxKey(left.lo, left.hi) };
+        Entry far = { rightIndex | flag, boxKey(right.lo, right.hi) };
+        if (far.key < near.key) {
+            std::swap(near, far);
+        }
+        stack[top++] = far;
+        stack[top++] = near;
+    }
+}
+
+// 点から箱までの距離の2乗
+float boxDistanceSquared(const Vec3& p, const Vec3& lo, const Vec3& hi) {
+    float dx = std::max(std::max(lo.x - p.x, p.x - hi.x), 0.0f);
+    float dy = std::max(std::max(lo.y - p.y, p.y - hi.y), 0.0f);
+    float dz = std::max(std::max(lo.z - p.z, p.z - hi.z), 0.0f);
+    return dx * dx + dy * dy + dz * dz;
+}
+
+// 光線 (origin + t * direction、direction は単位ベクトル) が t ≤ maxDistance で最初に当たるランタンを返す関数 (なければ -1)。
+// ランタンは中心から LANTERN_PICK_RADIUS の球とみなす
+long pickLantern(LanternBvh& bvh, const Vec3& origin, const Vec3& direction, float maxDistance, float* hitDistance = nullptr) {
+    updateLanternBvh(bvh);
+    Vec3 inverse = { 1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z };
+    float best = maxDistance;
+    long hit = -1;
+    const float r = LANTERN_PICK_RADIUS;
+    traverseLanternBvh(bvh,
+        [&](const Vec3& lo, const Vec3& hi) {
+            // 半径分広げた箱と光線のスラブ判定 (入る距離を返す)
+            float t0x = (lo.x - r - origin.x) * inverse.x, t1x = (hi.x + r - origin.x) * inverse.x;
+            float t0y = (lo.y - r - origin.y) * inverse.y, t1y = (hi.y + r - origin.y) * inverse.y;
+            float t0z = (lo.z - r - origin.z) * inverse.z, t1z = (hi.z + r - origin.z) * inverse.z;
+            float enter = std::max(std::max(std::min(t0x, t1x), std::min(t0y, t1y)), std::max(std::min(t0z, t1z), 0.0f));
+            float exit = std::min(std::min(std::max(t0x, t1x), std::max(t0y, t1y)), std::max(t0z, t1z));
+            return enter <= exit ? enter : INFINITY;
+        },
+        [&] { return best; },
+        [&](uint32_t i) {
+            Vec3 offset = bvh.points[i] - origin;
+            float along = dot(offset, direction);
+            float missSquared = dot(offset, offset) - along * along;
+            if (missSquared > r * r) {
+                return;
+            }
+            float t = along - std::sqrt(r * r - missSquared);
+            if (t < 0.0f) {
+                t = along + std::sqrt(r * r - missSquared); // 球の中から撃った場合は出る点
+            }
+            if (t >= 0.0f && t < best) {
+                best = t;
+                hit = static_cast<long>(i);
+            }
+        });
+    if (hit >= 0 && hitDistance) {
+        *hitDistance = best;
+    }
+    return hit;
+}
+
+// 中心が球 (center, radius) の中にあるランタンの番号を result に入れる関数
+void queryLanternsInRange(LanternBvh& bvh, const Vec3& center, float radius, std::vector<size_t>& result) {
+    updateLanternBvh(bvh);
+    result.clear();
+    const float radiusSquared = radius * radius;
+    traverseLanternBvh(bvh,
+        [&](const Vec3& lo, const Vec3& hi) { return boxDistanceSquared(center, lo, hi); },
+        [&] { return radiusSquared; },
+        [&](uint32_t i) {
+            Vec3 d = bvh.points[i] - center;
+            if (dot(d, d) <= radiusSquared) {
+                result.push_back(i);
+            }
+        });
+}
+
+// 中心が point に近い順に k 個のランタンの番号を result に入れる関数
+void queryNearestLanterns(LanternBvh& bvh, const Vec3& point, size_t k, std::vector<size_t>& result) {
+    updateLanternBvh(bvh);
+    result.clear();
+    if (k == 0) {
+        return;
+    }
+    std::vector<std::pair<float, size_t>> heap; // これまでに見つけた近い k 個 (最も遠いものが先頭の最大ヒープ)
+    heap.reserve(k + 1);
+    traverseLanternBvh(bvh,
+        [&](const Vec3& lo, const Vec3& hi) { return boxDistanceSquared(point, lo, hi); },
+        [&] { return heap.size() < k ? INFINITY : heap.front().first; },
+        [&](uint32_t i) {
+            Vec3 d = bvh.points[i] - point;
+            float distanceSquared = dot(d, d);
+            if (heap.size() == k) {
+                if (distanceSquared >= heap.front().first) {
+                    return;
+                }
+                std::pop_heap(heap.begin(), heap.end());
+                heap.pop_back();
+            }
+            heap.emplace_back(distanceSquared, i);
+            std::push_heap(heap.begin(), heap.end());
+        });
+    std::sort_heap(heap.begin(), heap.end());
+    for (const auto& entry : heap) {
+        result.push_back(entry.second);
+    }
+}
+
+// ウィンドウ座標 (x, y) の下にあるランタンを返す関数 (なければ -1)
+long pickLanternAt(int x, int y, float* hitDistance = nullptr) {
+    int width = glutGet(GLUT_WINDOW_WIDTH), height = glutGet(GLUT_WINDOW_HEIGHT);
+    if (width <= 0 || height <= 0) {
+        return -1;
+    }
+    // 画面の点を手前と奥のクリッピング面に逆投影して光線にする
+    syncCamera();
+    Mat4 inverseViewProjection = inverse(camera.viewProjection());
+    float ndcX = 2.0f * (x + 0.5f) / width - 1.0f;
+    float ndcY = 1.0f - 2.0f * (y + 0.5f) / height;
+    auto unproject = [&](float ndcZ) {
+        const float* m = inverseViewProjection.m;
+        float w = m[3] * ndcX + m[7] * ndcY + m[11] * ndcZ + m[15];
+        return Vec3{ (m[0] * ndcX + m[4] * ndcY + m[8] * ndcZ + m[12]) / w,
+            (m[1] * ndcX + m[5] * ndcY + m[9] * ndcZ + m[13]) / w,
+            (m[2] * ndcX + m[6] * ndcY + m[10] * ndcZ + m[14]) / w };
+    };
+    Vec3 nearPoint = unproject(-1.0f), farPoint = unproject(1.0f);
+    Vec3 ray = farPoint - nearPoint;
+    float length = std::sqrt(dot(ray, ray));
+    return pickLantern(lanternBvh, nearPoint, ray * (1.0f / length), length, hitDistance);
+}
+
+// --- フレームのジョブ ---
+// ティックのシミュレーション (セクターの反映 → 再出現) と、フレームの描画データの準備
+// (ティックの完了 → BVHの更新 ‖ (視錐台カリング ‖ 遮蔽バッファ → インスタンスの書き込み)) をタスクの依存関係で組む。
+// タイマーはティックのジョブを起動するだけで戻り、表示は描画データのジョブを起動して星と地面を描いてから
+// 「描画データの準備完了」を待ってランタンを送る。GLの呼び出し (区画の確保と確定を含む) は全てGLUTのスレッドに残す
+Task tickTask; // 実行中 (または最後に実行した) ティックのタスク
+JobHandle tickJob; // ティックのシミュレーションの完了
+Task frameTask; // 実行中 (または最後に実行した) 描画データの準備のタスク
+JobHandle frameJob; // 描画データの準備の完了
+LanternInstance* frameInstances = nullptr; // 今回のフレームの書き込み先の区画 (インスタンス描画でなければnull)
+
+// 生成済みのセクター変更を反映するタスク
+Task sectorUpdatesTask() {
+    applySectorUpdates();
+    co_return;
+}
+
+// ティックを進めて天井を越えたランタンを再出現させるタスク
+// (ランタンの位置はティックから求まるので、進めるのは再出現だけ)
+Task respawnTask() {
+    ++simTick;
+    respawnLanterns();
+    co_return;
+}
+
+// 1ティック分のシミュレーションのタスク (セクターを反映してから再出現)
+Task simulationTask() {
+    co_await sectorUpdatesTask();
+    co_await respawnTask();
+}
+
+// 描画データを準備するタスク (dst がnullならBVHだけ)
+Task prepareFrameTask(LanternInstance* dst) {
+    co_await tickJob; // このフレームが表示するティックを待つ
+    Task work[2] = { updateLanternBvhTask(lanternBvh), dst ? publishLanternInstancesTask(dst) : Task() };
+    co_await WhenAll(work, dst ? 2 : 1);
+}
+
+// ティックのシミュレーションをジョブとして起動する関数 (完了は finishTickJobs で待つ)
+void startTickJobs() {
+    tickTask = simulationTask();
+    jobSystem.launch(tickTask, tickJob);
+}
+
+// 実行中のティックのジョブを待つ関数 (ランタンやセクターに触れる前に呼ぶ)
+void finishTickJobs() {
+    jobSystem.wait(tickJob);
+}
+
+// 描画データの準備をジョブとして起動する関数 (カメラを合わせた後に呼ぶ)
+void startFrameJobs() {
+    camera.frustum(); // 行列はここで作り直しておき、ジョブからは読むだけにする
+    frameInstances = instancedLanterns ? beginInstanceWrite(instanceRing) : nullptr;
+    frameTask = prepareFrameTask(frameInstances);
+    jobSystem.launch(frameTask, frameJob);
+}
+
+// 描画データの準備を (タスクを手伝いながら) 待ち、書き込んだインスタンスを描画に使えるようにする関数
+void finishFrameJobs() {
+    jobSystem.wait(frameJob);
+    if (frameInstances) {
+        endInstanceWrite(instanceRing, publishedNearCount, publishedFarCount);
+        frameInstances = nullptr;
+    }
+}
+
+// 呼び出し元スレッドを除いたコア数だけワーカーを起動する関数
+void startJobSystem() {
+    unsigned int cores = std::thread::hardware_concurrency();
+    jobSystem.start(cores > 1 ? std::min(static_cast<int>(cores) - 1, MAX_JOB_THREADS - 1) : 0);
+}
+
+// ランタンの一括描画用のメッシュ、バッファ、シェーダー、ワーカーを準備する関数 (炎の形状の初期化後に呼び出す)
+void initLanternBatching() {
+    if (!hasInstancing) {
+        return;
+    }
+    lanternProgram = linkProgram(LANTERN_VERTEX_SHADER, LANTERN_FRAGMENT_SHADER,
+        { "position", "normal", "color", "pulseWeight", "instance" });
+    if (!lanternProgram) {
+        return;
+    }
+    lanternPartUniform = pglGetUniformLocation(lanternProgram, "part");
+    lanternFlameTimeUniform = pglGetUniformLocation(lanternProgram, "flameTime");
+
+    // 部位ごとのメッシュを一つの頂点バッファにまとめる
+    void (*builders[LANTERN_PART_COUNT])(MeshVertices&) = { buildLanternBodyMesh, buildLanternCoreMesh, buildLanternFlameMesh, buildLanternFlameQuadMesh };
+    for (int part = 0; part < LANTERN_PART_COUNT; ++part) {
+        lanternMeshRanges[part].first = static_cast<GLint>(lanternMeshVertices.size());
+        builders[part](lanternMeshVertices);
+        lanternMeshRanges[part].count = static_cast<GLsizei>(lanternMeshVertices.size()) - lanternMeshRanges[part].first;
+    }
+    pglGenBuffers(1, &lanternMeshBuffer);
+    pglBindBuffer(GL_ARRAY_BUFFER, lanternMeshBuffer);
+    pglBufferData(GL_ARRAY_BUFFER, sizeof(MeshVertex) * lanternMeshVertices.size(), lanternMeshVertices.data(), GL_STATIC_DRAW);
+
+    pglBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    // インスタンスデータは最大ランタン数分の区画を一度だけ確保し、毎ティック書き換える
+    initInstanceRing(instanceRing, lanternPool.capacity);
+    instancedLanterns = true;
+}
+
+// ランタンのシェーダー、メッシュ、最後に書き終えたインスタンスの区画 (の firstInstance 番目以降) を頂点属性に設定する関数
+void bindLanternInstances(size_t firstInstance) {
+    pglUseProgram(lanternProgram);
+    pglBindBuffer(GL_ARRAY_BUFFER, lanternMeshBuffer);
+    pglEnableVertexAttribArray(ATTRIB_POSITION);
+    pglEnableVertexAttribArray(ATTRIB_NORMAL);
+    pglEnableVertexAttribArray(ATTRIB_COLOR);
+    pglEnableVertexAttribArray(ATTRIB_PULSE_WEIGHT);
+    pglVertexAttribPointer(ATTRIB_POSITION, 3, GL_FLOAT, GL_FALSE, sizeof(MeshVertex), (const void*)offsetof(MeshVertex, x));
+    pglVertexAttribPointer(ATTRIB_NORMAL, 3, GL_FLOAT, GL_FALSE, sizeof(MeshVertex), (const void*)offsetof(MeshVertex, nx));
+    pglVertexAttribPointer(ATTRIB_COLOR, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(MeshVertex), (const void*)offsetof(MeshVertex, r));
+    pglVertexAttribPointer(ATTRIB_PULSE_WEIGHT, 1, GL_FLOAT, GL_FALSE, sizeof(MeshVertex), (const void*)offsetof(MeshVertex, pulseWeight));
+
+    // 最後に書き終えた区画を読む
+    pglBindBuffer(GL_ARRAY_BUFFER, instanceRing.buffer);
+    pglEnableVertexAttribArray(ATTRIB_INSTANCE);
+    size_t regionOffset = sizeof(LanternInstance) * (instanceRing.regionCapacity * instanceRing.readyRegion + firstInstance);
+    pglVertexAttribPointer(ATTRIB_INSTANCE, 4, GL_FLOAT, GL_FALSE, sizeof(LanternInstance), reinterpret_cast<const void*>(regionOffset));
+    pglVertexAttribDivisor(ATTRIB_INSTANCE, 1);
+    pglBindBuffer(GL_ARRAY_BUFFER, 0);
+    pglUniform1f(lanternFlameTimeUniform, flameTime());
+}
+
+// 部位を1回のインスタンス描画で全ランタン分描く関数 (bindLanternInstances の後に呼び出す)
+void drawLanternPart(int part, size_t count) {
+    pglUniform1i(lanternPartUniform, part);
+    pglDrawArraysInstanced(GL_TRIANGLES, lanternMeshRanges[part].first, lanternMeshRanges[part].count, static_cast<GLsizei>(count));
+}
+
+// bindLanternInstances で設定した頂点属性とシェーダーを外す関数
+void unbindLanternInstances() {
+    pglVertexAttribDivisor(ATTRIB_INSTANCE, 0);
+    for (int attrib = ATTRIB_POSITION; attrib <= ATTRIB_INSTANCE; ++attrib) {
+        pglDisableVertexAttribArray(attrib);
+    }
+    pglUseProgram(0);
+}
+
+// 全てのランタンを描画する関数
+void drawLanterns() {
+    if (!instancedLanterns) {
+        // インスタンス描画が使えない環境では、見えるブロックのランタンを1個ずつディスプレイリストと即時モードで描画する
+        ensureLanternDisplayList();
+        finishFrameJobs();
+        collectVisibleLanternBlocks();
+        for (size_t block : visibleLanternBlocks) {
+            size_t last = std::min((block + 1) * LANTERNS_PER_SECTOR, lanternPool.count);
+            for (size_t i = block * LANTERNS_PER_SECTOR; i < last; ++i) {
+                drawSingleLantern(loadLantern(i));
+            }
+        }
+        return;
+    }
+    finishFrameJobs(); // 見えるランタンだけをインスタンスバッファに書き込み終えるのを待つ
+    size_t count = instanceRing.readyCount;
+    size_t farCount = instanceRing.readyFarCount;
+    size_t farFirst = instanceRing.regionCapacity - farCount;
+    if (count + farCount == 0) {
+        return;
+    }
+
+    // 遠くのランタンは1枚の四角形のインポスターで描く (本体と核の数千頂点の代わりに6頂点)
+    if (farCount > 0) {
+        drawLanternImpostors(farFirst, farCount);
+    }
+
+    bindLanternInstances(0);
+
+    // 本体と核は不透明なのでデプスに書き込む
+    glDepthMask(GL_TRUE);
+    drawLanternPart(PART_BODY, count);
+    drawLanternPart(PART_CORE, count);
+
+    // 炎は全ての不透明な部位の後に、デプス書き込みなしの加算ブレンドで描画する
+    // (グローを使う場合は重ねた三角形の束の代わりに1枚の四角形で描き、光の広がりは縮小したバッファのぼかしに任せる)
+    bool glow = lanternGlowActive();
+    glDepthMask(GL_FALSE);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+    drawLanternPart(glow ? PART_FLAME_QUAD : PART_FLAME, count);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glDepthMask(GL_TRUE);
+
+    unbindLanternInstances();
+    if (glow) {
+        renderLanternGlow(count, farFirst, farCount);
+    }
+    fenceInstanceRead(instanceRing);
+}
+
+// --- 動的解像度と時間方向のアップスケール ---
+// シーンはウィンドウと同じ大きさのFBOの左下の一部 (縦横 scale 倍) に描画し、GPUの処理時間が目標に収まるよう scale を毎フレーム調整する。
+// 投影をフレームごとにサブピクセルずらして描画し、前フレームまでの結果 (履歴) に再投影して混ぜることで、
+// 低い解像度でも複数フレーム分の標本からウィンドウの解像度の画像を組み立てる
+const float DYNAMIC_RESOLUTION_MIN_SCALE = 0.5f; // 描画解像度の下限 (ウィンドウに対する縦横の比)
+const float DYNAMIC_RESOLUTION_MAX_SCALE = 1.0f; // 描画解像度の上限
+const float DYNAMIC_RESOLUTION_RESPONSE = 0.25f; // 目標の解像度へ1フレームで近づく割合 (小さいほど揺れにくい)
+const float TEMPORAL_CURRENT_WEIGHT = 0.1f; // 履歴に混ぜる現在のフレームの重み
+const int TIMER_QUERY_FRAMES = 3; // 結果の到着を待たずに済むよう、計測中のクエリを循環させる数
+
+struct DynamicResolution {
+    bool enabled = false; // FBOに描画しているか
+    int windowWidth = 0, windowHeight = 0; // ウィンドウ (とFBO) の大きさ
+    int renderWidth = 0, renderHeight = 0; // このフレームで描画する大きさ
+    float scale = DYNAMIC_RESOLUTION_MAX_SCALE; // 描画解像度の比
+    float targetMs = 16.0f; // 目標とするシーン描画のGPU時間 (ミリ秒)
+    float lastGpuMs = 0.0f; // 最後に計測したシーン描画のGPU時間
+    bool fixedScale = false; // trueならGPU時間を測らず、scale のまま描く (--golden で毎回同じ画像にするため)
+    GLuint sceneFramebuffer = 0, sceneColor = 0, sceneDepth = 0; // シーンの描画先
+    GLuint historyFramebuffers[2] = {}, historyColors[2] = {}; // 履歴 (読む側と書く側を交互に使う)
+    int historyIndex = 0; // 次に書き込む履歴
+    bool historyValid = false; // 履歴に前のフレームの結果が入っているか
+    GLuint queries[TIMER_QUERY_FRAMES] = {}; // シーン描画のGPU時間のクエリ
+    bool queryPending[TIMER_QUERY_FRAMES] = {}; // 結果を読んでいないクエリ
+    int nextQuery = 0; // 次に使うクエリ
+    int activeQuery = -1; // このフレームで計測中のクエリ (なければ-1)
+    uint32_t frameIndex = 0; // サブピクセルのずれの番号
+    float jitterX = 0.0f, jitterY = 0.0f; // このフレームのずれ (描画ピクセル単位、-0.5〜0.5)
+    Mat4 previousViewProjection = Mat4::identity(); // 前フレームのビュー投影行列 (ずれなし)
+    GLuint resolveProgram = 0; // 履歴に混ぜるシェーダー
+    GLint sceneScaleUniform = -1, sceneTexelUniform = -1, jitterUniform = -1;
+    GLint reprojectionUniform = -1, currentWeightUniform = -1;
+};
+
+DynamicResolution dynamicResolution; // 動的解像度の状態
+bool nativeResolution = false; // trueならFBOを使わずウィンドウに直接描画する (--native-resolution)
+
+// 全画面の四角形用の頂点シェーダー (座標はそのままクリップ座標として使う)
+const char* FULLSCREEN_VERTEX_SHADER = R"(
+#version 120
+void main() {
+    gl_TexCoord[0] = gl_MultiTexCoord0;
+    gl_Position = gl_Vertex;
+}
+)";
+
+// 履歴に混ぜるシェーダー (全画面の四角形に対して実行する)
+const char* RESOLVE_FRAGMENT_SHADER = R"(
+#version 120
+uniform sampler2D sceneColor;
+uniform sampler2D sceneDepth;
+uniform sampler2D history;
+uniform vec2 sceneScale; // シーンのテクスチャのうち描画した範囲 (0〜1)
+uniform vec2 sceneTexel; // シーンのテクスチャの1ピクセルの大きさ
+uniform vec2 jitter; // このフレームの投影のずれ (描画ピクセル単位)
+uniform mat4 reprojection; // 現在のクリップ座標から前フレームのクリップ座標への変換
+uniform float currentWeight; // 現在のフレームの重み
+
+void main() {
+    vec2 uv = gl_TexCoord[0].xy; // ウィンドウ内の位置 (0〜1)
+    vec2 sceneUv = uv * sceneScale - jitter * sceneTexel; // ずれを打ち消した位置
+    vec3 current = texture2D(sceneColor, sceneUv).rgb;
+
+    // 周囲3x3の色の範囲に履歴を収め、動いた物や現れた物の残像を抑える
+    vec3 lo = current, hi = current;
+    for (int y = -1; y <= 1; ++y) {
+        for (int x = -1; x <= 1; ++x) {
+            vec3 c = texture2D(sceneColor, sceneUv + vec2(x, y) * sceneTexel).rgb;
+            lo = min(lo, c);
+            hi = max(hi, c);
+        }
+    }
+
+    // デプスから前フレームでの画面上の位置を求めて履歴を読む
+    float depth = texture2D(sceneDepth, sceneUv).r;
+    vec4 previous = reprojection * vec4(uv * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
+    vec2 historyUv = previous.xy / previous.w * 0.5 + 0.5;
+    float weight = currentWeight;
+    if (any(lessThan(historyUv, vec2(0.0))) || any(greaterThan(historyUv, vec2(1.0)))) {
+        weight = 1.0; // 前フレームでは画面外だった
+    }
+    vec3 past = clamp(texture2D(history, historyUv).rgb, lo, hi);
+    gl_FragColor = vec4(mix(past, current, weight), 1.0);
+}
+)";
+
+// ビューポート全体を覆う四角形を描く関数 (テクスチャ座標は 0〜maxU, 0〜maxV)
+void drawFullscreenQuad(float maxU, float maxV) {
+    glBegin(GL_QUADS);
+    glTexCoord2f(0.0f, 0.0f); glVertex2f(-1.0f, -1.0f);
+    glTexCoord2f(maxU, 0.0f); glVertex2f(1.0f, -1.0f);
+    glTexCoord2f(maxU, maxV); glVertex2f(1.0f, 1.0f);
+    glTexCoord2f(0.0f, maxV); glVertex2f(-1.0f, 1.0f);
+    glEnd();
+}
+
+// 底 base のHalton列の index 番目 (0〜1。サブピクセルのずれを偏りなく散らす)
+float haltonSequence(uint32_t index, uint32_t base) {
+    float result = 0.0f, f = 1.0f;
+    while (index > 0) {
+        f /= base;
+        result += f * (index % base);
+        index /= base;
+    }
+    return result;
+}
+
+// テクスチャを作成する関数 (format は内部形式、データなし)
+GLuint createRenderTexture(GLint internalFormat, GLenum format, GLenum type, GLint filter, int width, int height) {
+    GLuint texture = 0;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, nullptr);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return texture;
+}
+
+// 色 (とデプス) のテクスチャをFBOに取り付ける関数 (完全でなければfalse)
+bool attachRenderTextures(GLuint framebuffer, GLuint color, GLuint depth) {
+    pglBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    pglFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, color, 0);
+    if (depth) {
+        pglFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth, 0);
+    }
+    bool complete = pglCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    pglBindFramebuffer(GL_FRAMEBUFFER, 0);
+    return complete;
+}
+
+// 描画先のテクスチャを破棄する関数
+void releaseDynamicResolutionTargets(DynamicResolution& dr) {
+    GLuint textures[] = { dr.sceneColor, dr.sceneDepth, dr.historyColors[0], dr.historyColors[1] };
+    glDeleteTextures(4, textures);
+    GLuint framebuffers[] = { dr.sceneFramebuffer, dr.historyFramebuffers[0], dr.historyFramebuffers[1] };
+    pglDeleteFramebuffers(3, framebuffers);
+    dr.sceneColor = dr.sceneDepth = dr.sceneFramebuffer = 0;
+    dr.historyColors[0] = dr.historyColors[1] = dr.historyFramebuffers[0] = dr.historyFramebuffers[1] = 0;
+}
+
+// ウィンドウの大きさに合わせてシーンと履歴の描画先を作り直す関数 (reshape から呼び出す)
+void resizeDynamicResolution(DynamicResolution& dr, int width, int height) {
+    if (!dr.resolveProgram || width <= 0 || height <= 0) {
+        return;
+    }
+    releaseDynamicResolutionTargets(dr);
+    dr.windowWidth = width;
+    dr.windowHeight = height;
+    dr.sceneColor = createRenderTexture(GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, GL_LINEAR, width, height);
+    dr.sceneDepth = createRenderTexture(GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, GL_NEAREST, width, height);
+    pglGenFramebuffers(1, &dr.sceneFramebuffer);
+    bool complete = attachRenderTextures(dr.sceneFramebuffer, dr.sceneColor, dr.sceneDepth);
+    for (int i = 0; i < 2; ++i) {
+        dr.historyColors[i] = createRenderTexture(GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, GL_LINEAR, width, height);
+        pglGenFramebuffers(1, &dr.historyFramebuffers[i]);
+        complete = attachRenderTextures(dr.historyFramebuffers[i], dr.historyColors[i], 0) && complete;
+    }
+    dr.enabled = complete;
+    dr.historyValid = false;
+    if (!complete) {
+        std::cout << "FBOを作成できないため、ウィンドウの解像度で直接描画します" << std::endl;
+        releaseDynamicResolutionTargets(dr);
+    }
+}
+
+// 動的解像度のシェーダーとクエリを準備する関数 (init から呼び出す。描画先は最初の reshape で作る)
+void initDynamicResolution(DynamicResolution& dr) {
+    if (nativeResolution || !hasFramebuffers) {
+        return;
+    }
+    dr.resolveProgram = linkProgram(FULLSCREEN_VERTEX_SHADER, RESOLVE_FRAGMENT_SHADER, {});
+    if (!dr.resolveProgram) {
+        return;
+    }
+    pglUseProgram(dr.resolveProgram);
+    pglUniform1i(pglGetUniformLocation(dr.resolveProgram, "sceneColor"), 0);
+    pglUniform1i(pglGetUniformLocation(dr.resolveProgram, "sceneDepth"), 1);
+    pglUniform1i(pglGetUniformLocation(dr.resolveProgram, "history"), 2);
+    pglUseProgram(0);
+    dr.sceneScaleUniform = pglGetUniformLocation(dr.resolveProgram, "sceneScale");
+    dr.sceneTexelUniform = pglGetUniformLocation(dr.resolveProgram, "sceneTexel");
+    dr.jitterUniform = pglGetUniformLocation(dr.resolveProgram, "jitter");
+    dr.reprojectionUniform = pglGetUniformLocation(dr.resolveProgram, "reprojection");
+    dr.currentWeightUniform = pglGetUniformLocation(dr.resolveProgram, "currentWeight");
+    if (hasTimerQueries) {
+        pglGenQueries(TIMER_QUERY_FRAMES, dr.queries);
+    }
+}
+
+// 届いている計測結果から次のフレームの描画解像度を決める関数 (結果を待たない)
+void updateDynamicResolutionScale(DynamicResolution& dr) {
+    if (!hasTimerQueries || dr.fixedScale) {
+        return;
+    }
+    for (int i = 0; i < TIMER_QUERY_FRAMES; ++i) {
+        if (!dr.queryPending[i]) {
+            continue;
+        }
+        GLint available = 0;
+        pglGetQueryObjectiv(dr.queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) {
+            continue;
+        }
+        GLuint64 nanoseconds = 0;
+        pglGetQueryObjectui64v(dr.queries[i], GL_QUERY_RESULT, &nanoseconds);
+        dr.queryPending[i] = false;
+        dr.lastGpuMs = static_cast<float>(nanoseconds) * 1e-6f;
+        if (dr.lastGpuMs <= 0.0f) {
+            continue;
+        }
+        // 描画の負荷はおおむね面積 (scale の2乗) に比例するとみなして、目標に収まる比へ少しずつ近づける
+        float desired = dr.scale * std::sqrt(dr.targetMs / dr.lastGpuMs);
+        desired = std::min(std::max(desired, DYNAMIC_RESOLUTION_MIN_SCALE), DYNAMIC_RESOLUTION_MAX_SCALE);
+        dr.scale += (desired - dr.scale) * DYNAMIC_RESOLUTION_RESPONSE;
+    }
+}
+
+// シーンの描画を始める関数 (FBOと縮小したビューポートを設定し、サブピクセルずらした投影を読み込む)
+void beginSceneFrame(DynamicResolution& dr) {
+    if (!dr.enabled) {
+        return;
+    }
+    updateDynamicResolutionScale(dr);
+    dr.renderWidth = std::max(1, static_cast<int>(dr.windowWidth * dr.scale + 0.5f));
+    dr.renderHeight = std::max(1, static_cast<int>(dr.windowHeight * dr.scale + 0.5f));
+
+    // 同じ点を繰り返し標本化しないよう、ずれはHalton列 (底2と3) で決める
+    ++dr.frameIndex;
+    dr.jitterX = haltonSequence(dr.frameIndex % 16 + 1, 2) - 0.5f;
+    dr.jitterY = haltonSequence(dr.frameIndex % 16 + 1, 3) - 0.5f;
+    Mat4 projection = camera.projection();
+    projection.m[8] += dr.jitterX * 2.0f / dr.renderWidth;
+    projection.m[9] += dr.jitterY * 2.0f / dr.renderHeight;
+    glMatrixMode(GL_PROJECTION);
+    glLoadMatrixf(projection.m);
+    glMatrixMode(GL_MODELVIEW);
+
+    pglBindFramebuffer(GL_FRAMEBUFFER, dr.sceneFramebuffer);
+    glViewport(0, 0, dr.renderWidth, dr.renderHeight);
+    // 結果を読み終えたクエリが空いていなければ、このフレームは計測しない
+    dr.activeQuery = -1;
+    if (hasTimerQueries && !dr.fixedScale && !dr.queryPending[dr.nextQuery]) {
+        dr.activeQuery = dr.nextQuery;
+        dr.nextQuery = (dr.nextQuery + 1) % TIMER_QUERY_FRAMES;
+        pglBeginQuery(GL_TIME_ELAPSED, dr.queries[dr.activeQuery]);
+        dr.queryPending[dr.activeQuery] = true;
+    }
+}
+
+// 描画したシーンを履歴に混ぜてウィンドウの解像度に拡大し、画面に写す関数
+void resolveSceneFrame(DynamicResolution& dr) {
+    if (!dr.enabled) {
+        return;
+    }
+    if (dr.activeQuery >= 0) {
+        pglEndQuery(GL_TIME_ELAPSED);
+    }
+
+    // 現在のクリップ座標 → ワールド → 前フレームのクリップ座標
+    const Mat4& viewProjection = camera.viewProjection();
+    Mat4 reprojection = dr.previousViewProjection * inverse(viewProjection);
+    dr.previousViewProjection = viewProjection;
+
+    int write = dr.historyIndex;
+    int read = 1 - write;
+    pglBindFramebuffer(GL_FRAMEBUFFER, dr.historyFramebuffers[write]);
+    glViewport(0, 0, dr.windowWidth, dr.windowHeight);
+    glPushAttrib(GL_ENABLE_BIT | GL_DEPTH_BUFFER_BIT);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_BLEND);
+    glDisable(GL_LIGHTING);
+    glDepthMask(GL_FALSE);
+
+    pglActiveTexture(GL_TEXTURE0 + 2);
+    glBindTexture(GL_TEXTURE_2D, dr.historyColors[read]);
+    pglActiveTexture(GL_TEXTURE0 + 1);
+    glBindTexture(GL_TEXTURE_2D, dr.sceneDepth);
+    pglActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, dr.sceneColor);
+
+    pglUseProgram(dr.resolveProgram);
+    pglUniform2f(dr.sceneScaleUniform, static_cast<float>(dr.renderWidth) / dr.windowWidth, static_cast<float>(dr.renderHeight) / dr.windowHeight);
+    pglUniform2f(dr.sceneTexelUniform, 1.0f / dr.windowWidth, 1.0f / dr.windowHeight);
+    pglUniform2f(dr.jitterUniform, dr.jitterX, dr.jitterY);
+    pglUniformMatrix4fv(dr.reprojectionUniform, 1, GL_FALSE, reprojection.m);
+    pglUniform1f(dr.currentWeightUniform, dr.historyValid ? TEMPORAL_CURRENT_WEIGHT : 1.0f);
+    drawFullscreenQuad(1.0f, 1.0f);
+    pglUseProgram(0);
+
+    pglActiveTexture(GL_TEXTURE0 + 2);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    pglActiveTexture(GL_TEXTURE0 + 1);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    pglActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glPopAttrib();
+
+    // 履歴をそのまま画面に写す
+    pglBindFramebuffer(GL_READ_FRAMEBUFFER, dr.historyFramebuffers[write]);
+    pglBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    pglBlitFramebuffer(0, 0, dr.windowWidth, dr.windowHeight, 0, 0, dr.windowWidth, dr.windowHeight, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    pglBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    dr.historyIndex = read;
+    dr.historyValid = true;
+}
+
+// --- 炎のグロー ---
+// 炎の四角形と核を縦横半分の解像度のバッファに描き、縦横に分けたガウスぼかしをかけてからシーンに加算する。
+// 光の広がりを重ねた半透明の三角形ではなく縮小したバッファのぼかしで作るので、描画するピクセル数が少なく済む。
+// デプスはシーンの描画先から縮小してコピーし、手前の物に隠れた炎は光らせない (描画先がシーンのFBOのときだけ使う)
+const int GLOW_RESOLUTION_DIVISOR = 2; // グローのバッファの縮小率 (縦横)
+const float GLOW_INTENSITY = 1.5f; // ぼかした光をシーンに足すときの強さ
+
+struct LanternGlow {
+    bool enabled = false; // グローのバッファがあるか
+    int width = 0, height = 0; // バッファの大きさ (ウィンドウの縮小)
+    GLuint framebuffers[2] = {}, colors[2] = {}; // ぼかしの入力と出力を交互に使う
+    GLuint depth = 0; // シーンから縮小したデプス (framebuffers[0] に取り付ける)
+    GLuint blurProgram = 0; // 1方向のぼかし
+    GLint blurStepUniform = -1, blurLimitUniform = -1;
+    GLuint compositeProgram = 0; // シーンへの加算
+    GLint compositeIntensityUniform = -1;
+};
+
+LanternGlow lanternGlow; // 炎のグローの状態
+bool disableGlow = false; // trueならグローを使わず、重ねた三角形の炎を描く (--no-glow)
+
+// 1方向の9タップのガウスぼかし (線形補間を使って5回の読み込みで済ませる)
+const char* GLOW_BLUR_FRAGMENT_SHADER = R"(
+#version 120
+uniform sampler2D source;
+uniform vec2 step; // ぼかす方向の1ピクセル
+uniform vec2 limit; // 描画した範囲の端 (範囲外の古い内容を読まない)
+
+vec3 fetch(vec2 uv) {
+    return texture2D(source, min(max(uv, vec2(0.0)), limit)).rgb;
+}
+
+void main() {
+    vec2 uv = gl_TexCoord[0].xy;
+    vec3 c = fetch(uv) * 0.2270270270;
+    c += (fetch(uv + step * 1.3846153846) + fetch(uv - step * 1.3846153846)) * 0.3162162162;
+    c += (fetch(uv + step * 3.2307692308) + fetch(uv - step * 3.2307692308)) * 0.0702702703;
+    gl_FragColor = vec4(c, 1.0);
+}
+)";
+
+const char* GLOW_COMPOSITE_FRAGMENT_SHADER = R"(
+#version 120
+uniform sampler2D glow;
+uniform float intensity;
+
+void main() {
+    gl_FragColor = vec4(texture2D(glow, gl_TexCoord[0].xy).rgb * intensity, 1.0);
+}
+)";
+
+// グローのバッファを破棄する関数
+void releaseLanternGlowTargets(LanternGlow& glow) {
+    GLuint textures[] = { glow.colors[0], glow.colors[1], glow.depth };
+    glDeleteTextures(3, textures);
+    pglDeleteFramebuffers(2, glow.framebuffers);
+    glow.colors[0] = glow.colors[1] = glow.depth = 0;
+    glow.framebuffers[0] = glow.framebuffers[1] = 0;
+}
+
+// ウィンドウの大きさに合わせてグローのバッファを作り直す関数 (シーンの描画先を作り直した後に呼び出す)
+void resizeLanternGlow(LanternGlow& glow, int width, int height) {
+    if (!glow.blurProgram || !dynamicResolution.enabled) {
+        return;
+    }
+    releaseLanternGlowTargets(glow);
+    glow.width = std::max(1, width / GLOW_RESOLUTION_DIVISOR);
+    glow.height = std::max(1, height / GLOW_RESOLUTION_DIVISOR);
+    glow.depth = createRenderTexture(GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, GL_NEAREST, glow.width, glow.height);
+    bool complete = true;
+    for (int i = 0; i < 2; ++i) {
+        glow.colors[i] = createRenderTexture(GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, GL_LINEAR, glow.width, glow.height);
+        pglGenFramebuffers(1, &glow.framebuffers[i]);
+        complete = attachRenderTextures(glow.framebuffers[i], glow.colors[i], i == 0 ? glow.depth : 0) && complete;
+    }
+    glow.enabled = complete;
+    if (!complete) {
+        releaseLanternGlowTargets(glow);
+    }
+}
+
+// グローのシェーダーを準備する関数 (動的解像度の準備の後に呼び出す。バッファは最初の reshape で作る)
+void initLanternGlow(LanternGlow& glow) {
+    if (disableGlow || !instancedLanterns || !dynamicResolution.resolveProgram) {
+        return;
+    }
+    glow.blurProgram = linkProgram(FULLSCREEN_VERTEX_SHADER, GLOW_BLUR_FRAGMENT_SHADER, {});
+    glow.compositeProgram = linkProgram(FULLSCREEN_VERTEX_SHADER, GLOW_COMPOSITE_FRAGMENT_SHADER, {});
+    if (!glow.blurProgram || !glow.compositeProgram) {
+        glow.blurProgram = 0;
+        return;
+    }
+    glow.blurStepUniform = pglGetUniformLocation(glow.blurProgram, "step");
+    glow.blurLimitUniform = pglGetUniformLocation(glow.blurProgram, "limit");
+    glow.compositeIntensityUniform = pglGetUniformLocation(glow.compositeProgram, "intensity");
+}
+
+bool lanternGlowActive() {
+    return lanternGlow.enabled && dynamicResolution.enabled;
+}
+
+// グローのバッファの from を to へ1方向にぼかす関数 (width × height の範囲だけ)
+void blurLanternGlow(const LanternGlow& glow, int from, int to, float stepX, float stepY, int width, int height) {
+    pglBindFramebuffer(GL_FRAMEBUFFER, glow.framebuffers[to]);
+    glBindTexture(GL_TEXTURE_2D, glow.colors[from]);
+    pglUniform2f(glow.blurStepUniform, stepX / glow.width, stepY / glow.height);
+    drawFullscreenQuad(static_cast<float>(width) / glow.width, static_cast<float>(height) / glow.height);
+}
+
+// 炎の四角形と核を縮小したバッファに描き、ぼかしてシーンの描画先に加算する関数
+// (drawLanterns から、インスタンスの区画を読み終える前に呼び出す。遠くのランタンは炎の四角形だけを光源にする)
+void renderLanternGlow(size_t count, size_t farFirst, size_t farCount) {
+    const DynamicResolution& dr = dynamicResolution;
+    LanternGlow& glow = lanternGlow;
+    int width = std::max(1, dr.renderWidth / GLOW_RESOLUTION_DIVISOR);
+    int height = std::max(1, dr.renderHeight / GLOW_RESOLUTION_DIVISOR);
+
+    // シーンのデプスを縮小してコピーし、隠れた炎を除く
+    pglBindFramebuffer(GL_READ_FRAMEBUFFER, dr.sceneFramebuffer);
+    pglBindFramebuffer(GL_DRAW_FRAMEBUFFER, glow.framebuffers[0]);
+    pglBlitFramebuffer(0, 0, dr.renderWidth, dr.renderHeight, 0, 0, width, height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+    pglBindFramebuffer(GL_FRAMEBUFFER, glow.framebuffers[0]);
+    glViewport(0, 0, width, height);
+    glPushAttrib(GL_ENABLE_BIT | GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    // 光源になる核と炎を加算で描く (核は自分自身のデプスと重なるので手前にずらす)
+    glDepthMask(GL_FALSE);
+    glDepthFunc(GL_LEQUAL);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+    glEnable(GL_POLYGON_OFFSET_FILL);
+    glPolygonOffset(-1.0f, -4.0f);
+    bindLanternInstances(0);
+    drawLanternPart(PART_CORE, count);
+    drawLanternPart(PART_FLAME_QUAD, count);
+    if (farCount > 0) {
+        bindLanternInstances(farFirst);
+        drawLanternPart(PART_FLAME_QUAD, farCount);
+    }
+    unbindLanternInstances();
+
+    // 横、縦の順にぼかす (結果は colors[0])
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_BLEND);
+    glDisable(GL_LIGHTING);
+    pglUseProgram(glow.blurProgram);
+    pglUniform2f(glow.blurLimitUniform, (width - 0.5f) / glow.width, (height - 0.5f) / glow.height);
+    blurLanternGlow(glow, 0, 1, 1.0f, 0.0f, width, height);
+    blurLanternGlow(glow, 1, 0, 0.0f, 1.0f, width, height);
+
+    // シーンに加算する
+    pglBindFramebuffer(GL_FRAMEBUFFER, dr.sceneFramebuffer);
+    glViewport(0, 0, dr.renderWidth, dr.renderHeight);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE);
+    pglUseProgram(glow.compositeProgram);
+    pglUniform1f(glow.compositeIntensityUniform, GLOW_INTENSITY);
+    glBindTexture(GL_TEXTURE_2D, glow.colors[0]);
+    drawFullscreenQuad(static_cast<float>(width) / glow.width, static_cast<float>(height) / glow.height);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    pglUseProgram(0);
+    glPopAttrib();
+}
+
+// --- 遠くのランタンのインポスター ---
+// 起動時にランタン1個を仰角と炎の位相を変えながら描画してアトラス (テクスチャ) に並べておき、
+// 遠くのランタンは視点を向く四角形にアトラスの1コマを貼って描く。ランタンはY軸対称なので、方位角は考えなくてよい
+const int IMPOSTOR_PHASES = 8; // アトラスの列数 (炎の位相)
+const int IMPOSTOR_ELEVATIONS = 6; // アトラスの行数 (ランタンを見上げる角度)
+const float IMPOSTOR_MIN_ELEVATION = -15.0f; // 最初の行の仰角 (度)
+const float IMPOSTOR_ELEVATION_STEP = 15.0f; // 行ごとの仰角の間隔 (度)
+const int IMPOSTOR_TILE_WIDTH = 64, IMPOSTOR_TILE_HEIGHT = 128; // 1コマのピクセル数
+const float IMPOSTOR_HALF_WIDTH = 0.4f, IMPOSTOR_HALF_HEIGHT = 0.8f; // 1コマに写すランタンのローカル座標の範囲 (中心から)
+
+struct ImpostorAtlas {
+    GLuint texture = 0; // アトラス (乗算済みアルファ)
+    GLuint program = 0; // インポスターを描くシェーダー
+    GLint flameTimeUniform = -1, cameraPositionUniform = -1;
+};
+
+ImpostorAtlas impostorAtlas; // 遠くのランタン用のアトラス
+bool disableImpostors = false; // trueなら遠くのランタンも形状で描く (--no-impostors)
+
+// インポスター用の頂点シェーダー (頂点属性はランタンのシェーダーと同じ番号を使い、炎の四角形のメッシュを流用する)
+const char* IMPOSTOR_VERTEX_SHADER = R"(
+#version 120
+attribute vec3 position;
+attribute vec3 normal; // xy: 四角形の角 (-1〜1)
+attribute vec4 color;
+attribute float pulseWeight;
+attribute vec4 instance; // xyz: ランタンの位置, w: 炎アニメーションの位相
+uniform float flameTime;
+uniform vec3 cameraPosition;
+uniform vec4 layout; // x: 列数, y: 行数, z: 最初の行の仰角, w: 行の間隔 (ラジアン)
+uniform vec2 halfSize; // 四角形の半分の大きさ
+varying vec2 vUv;
+
+void main() {
+    // 見上げる角度で行を、炎の位相で列を選ぶ
+    vec3 d = instance.xyz - cameraPosition;
+    float elevation = atan(d.y, length(d.xz));
+    float row = clamp(floor((elevation - layout.z) / layout.w + 0.5), 0.0, layout.y - 1.0);
+    float phase = mod(instance.w + flameTime, 6.2831853);
+    float column = mod(floor(phase / 6.2831853 * layout.x + 0.5), layout.x);
+
+    vec4 eye = gl_ModelViewMatrix * vec4(instance.xyz, 1.0);
+    eye.xy += normal.xy * halfSize;
+    gl_Position = gl_ProjectionMatrix * eye;
+    vUv = (vec2(column, row) + normal.xy * 0.5 + 0.5) / layout.xy;
+}
+)";
+
+const char* IMPOSTOR_FRAGMENT_SHADER = R"(
+#version 120
+uniform sampler2D atlas;
+varying vec2 vUv;
+
+void main() {
+    vec4 c = texture2D(atlas, vUv);
+    if (c.a < 0.02 && max(c.r, max(c.g, c.b)) < 0.02) {
+        discard; // 何も写っていない部分はデプスにも書かない
+    }
+    gl_FragColor = c;
+}
+)";
+
+// ランタンを全ての仰角と炎の位相から描いてアトラスを作る関数 (表示リストと炎の形状の準備後に呼び出す)
+void buildImpostorAtlas(ImpostorAtlas& atlas) {
+    ensureLanternDisplayList();
+    int width = IMPOSTOR_TILE_WIDTH * IMPOSTOR_PHASES;
+    int height = IMPOSTOR_TILE_HEIGHT * IMPOSTOR_ELEVATIONS;
+    atlas.texture = createRenderTexture(GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, GL_LINEAR, width, height);
+    GLuint depth = createRenderTexture(GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, GL_NEAREST, width, height);
+    GLuint framebuffer = 0;
+    pglGenFramebuffers(1, &framebuffer);
+    bool complete = attachRenderTextures(framebuffer, atlas.texture, depth);
+    if (complete) {
+        pglBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glPushAttrib(GL_COLOR_BUFFER_BIT | GL_VIEWPORT_BIT);
+        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+        glMatrixMode(GL_PROJECTION);
+        glPushMatrix();
+        glLoadIdentity();
+        glOrtho(-IMPOSTOR_HALF_WIDTH, IMPOSTOR_HALF_WIDTH, -IMPOSTOR_HALF_HEIGHT, IMPOSTOR_HALF_HEIGHT, -2.0, 2.0);
+        glMatrixMode(GL_MODELVIEW);
+        glPushMatrix();
+        for (int row = 0; row < IMPOSTOR_ELEVATIONS; ++row) {
+            float elevation = IMPOSTOR_MIN_ELEVATION + row * IMPOSTOR_ELEVATION_STEP;
+            for (int column = 0; column < IMPOSTOR_PHASES; ++column) {
+                float phase = 2.0f * static_cast<float>(M_PI) * column / IMPOSTOR_PHASES;
+                glViewport(column * IMPOSTOR_TILE_WIDTH, row * IMPOSTOR_TILE_HEIGHT, IMPOSTOR_TILE_WIDTH, IMPOSTOR_TILE_HEIGHT);
+                glClear(GL_DEPTH_BUFFER_BIT);
+                // 見上げるカメラから見た向き (カメラのピッチの逆回転)
+                glLoadIdentity();
+                glRotatef(-elevation, 1.0f, 0.0f, 0.0f);
+                glCallList(lanternDisplayList);
+                drawFlame(phase, (std::sin(phase) + 1.0f) * 0.5f);
+            }
+        }
+        glPopMatrix();
+        glMatrixMode(GL_PROJECTION);
+        glPopMatrix();
+        glMatrixMode(GL_MODELVIEW);
+        glPopAttrib();
+        pglBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+        // 遠くで小さく描くのでミップマップを作る (コマの境界をまたいでにじまない段数まで)
+        glBindTexture(GL_TEXTURE_2D, atlas.texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 4);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        pglGenerateMipmap(GL_TEXTURE_2D);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+    pglDeleteFramebuffers(1, &framebuffer);
+    glDeleteTextures(1, &depth);
+    if (!complete) {
+        glDeleteTextures(1, &atlas.texture);
+        atlas.texture = 0;
+    }
+}
+
+// インポスターのアトラスとシェーダーを準備する関数 (ランタンの一括描画の準備後に呼び出す)
+void initLanternImpostors(ImpostorAtlas& atlas) {
+    if (disableImpostors || !instancedLanterns || !hasFramebuffers) {
+        return;
+    }
+    atlas.program = linkProgram(IMPOSTOR_VERTEX_SHADER, IMPOSTOR_FRAGMENT_SHADER,
+        { "position", "normal", "color", "pulseWeight", "instance" });
+    if (!atlas.program) {
+        return;
+    }
+    buildImpostorAtlas(atlas);
+    if (!atlas.texture) {
+        atlas.program = 0;
+        return;
+    }
+    const float degrees = static_cast<float>(M_PI) / 180.0f;
+    pglUseProgram(atlas.program);
+    pglUniform1i(pglGetUniformLocation(atlas.program, "atlas"), 0);
+    pglUniform4f(pglGetUniformLocation(atlas.program, "layout"), static_cast<float>(IMPOSTOR_PHASES), static_cast<float>(IMPOSTOR_ELEVATIONS),
+        IMPOSTOR_MIN_ELEVATION * degrees, IMPOSTOR_ELEVATION_STEP * degrees);
+    pglUniform2f(pglGetUniformLocation(atlas.program, "halfSize"), IMPOSTOR_HALF_WIDTH, IMPOSTOR_HALF_HEIGHT);
+    pglUseProgram(0);
+    atlas.flameTimeUniform = pglGetUniformLocation(atlas.program, "flameTime");
+    atlas.cameraPositionUniform = pglGetUniformLocation(atlas.program, "cameraPosition");
+}
+
+bool lanternImpostorsActive() {
+    return impostorAtlas.program != 0;
+}
+
+// インスタンスの区画の [firstInstance, firstInstance + count) をインポスターで描く関数
+void drawLanternImpostors(size_t firstInstance, size_t count) {
+    const ImpostorAtlas& atlas = impostorAtlas;
+    bindLanternInstances(firstInstance);
+    pglUseProgram(atlas.program);
+    pglUniform1f(atlas.flameTimeUniform, flameTime());
+    const Vec3& eye = camera.position();
+    pglUniform3f(atlas.cameraPositionUniform, eye.x, eye.y, eye.z);
+    glBindTexture(GL_TEXTURE_2D, atlas.texture);
+    // アトラスは乗算済みアルファ (炎の部分は加算として働く)
+    glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+    glDepthMask(GL_TRUE);
+    pglDrawArraysInstanced(GL_TRIANGLES, lanternMeshRanges[PART_FLAME_QUAD].first, lanternMeshRanges[PART_FLAME_QUAD].count, static_cast<GLsizei>(count));
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    unbindLanternInstances();
+}
+
+// 地面チャンクの頂点を生成し、VBOに書き込む関数 (色のばらつきはここで一度だけ焼き込む)
+void buildGroundChunk(GroundChunk& chunk, int cx, int cz) {
+    chunk.cx = cx;
+    chunk.cz = cz;
+
+    // 夜空に合うように暗い緑色に調整し、わずかなバリエーションを加える
+    float r_base = 0.08f; // 暗い緑の赤成分
+    float g_base = 0.15f; // 暗い緑の緑成分
+    float b_base = 0.08f; // 暗い緑の青成分
+
+    static TrackedVector<GroundVertex, MEMORY_WORLD> scratch(GROUND_CHUNK_VERTS); // 再構築ごとの確保を避けるための作業領域
+    TrackedVector<GroundVertex, MEMORY_WORLD>& verts = chunk.vbo ? scratch : chunk.vertices;
+    verts.resize(GROUND_CHUNK_VERTS);
+
+    float step = GROUND_CHUNK_SIZE / GROUND_CHUNK_RES;
+    for (int j = 0; j <= GROUND_CHUNK_RES; ++j) {
+        for (int i = 0; i <= GROUND_CHUNK_RES; ++i) {
+            // 世界全体での格子座標でハッシュすることで、チャンク境界の頂点色が一致する
+            int gx = cx * GROUND_CHUNK_RES + i;
+            int gz = cz * GROUND_CHUNK_RES + j;
+
+            // 色のランダムなばらつきを非常に小さくして、統一感を出す
+            float r_offset = hashToRange(hashCoords(gx, gz, 1), -0.01f, 0.01f);
+            float g_offset = hashToRange(hashCoords(gx, gz, 2), -0.01f, 0.01f);
+            float b_offset = hashToRange(hashCoords(gx, gz, 3), -0.01f, 0.01f);
+
+            GroundVertex& v = verts[j * (GROUND_CHUNK_RES + 1) + i];
+            v.x = i * step;
+            v.y = 0.0f;
+            v.z = j * step;
+            v.r = static_cast<GLubyte>((r_base + r_offset) * 255.0f + 0.5f);
+            v.g = static_cast<GLubyte>((g_base + g_offset) * 255.0f + 0.5f);
+            v.b = static_cast<GLubyte>((b_base + b_offset) * 255.0f + 0.5f);
+            v.a = 255;
+        }
+    }
+
+    if (chunk.vbo) {
+        pglBindBuffer(GL_ARRAY_BUFFER, chunk.vbo);
+        pglBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(GroundVertex) * verts.size(), verts.data());
+        pglBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+}
+
+// 地面チャンクのプールと共通インデックスバッファを作成する関数
+void initGround() {
+    // 全チャンクで共有する三角形リストのインデックス
+    for (int j = 0; j < GROUND_CHUNK_RES; ++j) {
+        for (int i = 0; i < GROUND_CHUNK_RES; ++i) {
+            GLushort i0 = static_cast<GLushort>(j * (GROUND_CHUNK_RES + 1) + i);
+            GLushort i1 = static_cast<GLushort>(i0 + 1);
+            GLushort i2 = static_cast<GLushort>(i0 + GROUND_CHUNK_RES + 1);
+            GLushort i3 = static_cast<GLushort>(i2 + 1);
+            // 上から見て反時計回り (法線が上向き)
+            groundIndices.insert(groundIndices.end(), { i0, i2, i1, i1, i2, i3 });
+        }
+    }
+
+    int side = GROUND_CHUNK_RADIUS * 2 + 1;
+    groundChunks.resize(side * side);
+    for (auto& chunk : groundChunks) {
+        chunk.cx = INT_MIN; // まだどの位置にも割り当てられていない
+        chunk.cz = INT_MIN;
+        chunk.vbo = 0;
+    }
+
+    if (hasVertexBuffers) {
+        pglGenBuffers(1, &groundIndexBuffer);
+        pglBindBuffer(GL_ELEMENT_ARRAY_BUFFER, groundIndexBuffer);
+        pglBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLushort) * groundIndices.size(), groundIndices.data(), GL_STATIC_DRAW);
+        pglBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+        for (auto& chunk : groundChunks) {
+            pglGenBuffers(1, &chunk.vbo);
+            pglBindBuffer(GL_ARRAY_BUFFER, chunk.vbo);
+            pglBufferData(GL_ARRAY_BUFFER, sizeof(GroundVertex) * GROUND_CHUNK_VERTS, nullptr, GL_STATIC_DRAW);
+        }
+        pglBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+}
+
+// カメラの移動に合わせて地面チャンクをストリーミングする関数
+// 範囲外に出たチャンクを新しく範囲に入った位置へ再割り当てするので、確保は発生しない
+void updateGroundChunks(float centerX, float centerZ) {
+    int centerCX = static_cast<int>(std::floor(centerX / GROUND_CHUNK_SIZE));
+    int centerCZ = static_cast<int>(std::floor(centerZ / GROUND_CHUNK_SIZE));
+    if (centerCX == groundCenterX && centerCZ == groundCenterZ) {
+        return; // カメラが同じチャンク内にいる間は何もしない
+    }
+    groundCenterX = centerCX;
+    groundCenterZ = centerCZ;
+
+    const int side = GROUND_CHUNK_RADIUS * 2 + 1; // プールのチャンク数は side * side で固定なので、作業領域はスタックに置く
+    bool covered[side * side] = {}; // 新しい範囲のうち既にチャンクがある位置
+    GroundChunk* freeChunks[side * side]; // 範囲外に出て再利用できるチャンク
+    int freeCount = 0;
+
+    for (auto& chunk : groundChunks) {
+        int dx = chunk.cx - centerCX;
+        int dz = chunk.cz - centerCZ;
+        if (chunk.cx != INT_MIN && std::abs(dx) <= GROUND_CHUNK_RADIUS && std::abs(dz) <= GROUND_CHUNK_RADIUS) {
+            covered[(dz + GROUND_CHUNK_RADIUS) * side + (dx + GROUND_CHUNK_RADIUS)] = true;
+        }
+        else {
+            freeChunks[freeCount++] = &chunk;
+        }
+    }
+
+    for (int dz = -GROUND_CHUNK_RADIUS; dz <= GROUND_CHUNK_RADIUS; ++dz) {
+        for (int dx = -GROUND_CHUNK_RADIUS; dx <= GROUND_CHUNK_RADIUS; ++dx) {
+            if (!covered[(dz + GROUND_CHUNK_RADIUS) * side + (dx + GROUND_CHUNK_RADIUS)]) {
+                buildGroundChunk(*freeChunks[--freeCount], centerCX + dx, centerCZ + dz);
+            }
+        }
+    }
+}
+
+// 地面を描画する関数 (カメラ周辺のチャンクのうち視錐台と交わるものを頂点配列で描画)
+void drawGround() {
+    glEnable(GL_LIGHTING); // 地面はシーンのライティングの影響を受ける
+
+    updateGroundChunks(cameraX, cameraZ);
+
+    // 法線は常に上向き
+    glNormal3f(0.0f, 1.0f, 0.0f);
+
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    if (hasVertexBuffers) {
+        pglBindBuffer(GL_ELEMENT_ARRAY_BUFFER, groundIndexBuffer);
+    }
+    const GLvoid* indices = hasVertexBuffers ? nullptr : groundIndices.data();
+
+    for (const auto& chunk : groundChunks) {
+        Vec3 lo = { chunk.cx * GROUND_CHUNK_SIZE, GROUND_Y, chunk.cz * GROUND_CHUNK_SIZE };
+        Vec3 hi = { lo.x + GROUND_CHUNK_SIZE, GROUND_Y, lo.z + GROUND_CHUNK_SIZE };
+        if (chunk.cx == INT_MIN || !camera.frustum().intersectsBox(lo, hi)) {
+            continue; // 視錐台の外のチャンクは送らない (背後や側方の半分以上が外れる)
+        }
+
+        glPushMatrix();
+        // 地面をカメラの初期Y座標より下に配置
+        glTranslatef(chunk.cx * GROUND_CHUNK_SIZE, GROUND_Y, chunk.cz * GROUND_CHUNK_SIZE);
+
+        const GLubyte* base = nullptr; // VBO使用時はバッファ先頭からのオフセット
+        if (hasVertexBuffers) {
+            pglBindBuffer(GL_ARRAY_BUFFER, chunk.vbo);
+        }
+        else {
+            base = reinterpret_cast<const GLubyte*>(chunk.vertices.data());
+        }
+        glVertexPointer(3, GL_FLOAT, sizeof(GroundVertex), base + offsetof(GroundVertex, x));
+        glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(GroundVertex), base + offsetof(GroundVertex, r));
+        glDrawElements(GL_TRIANGLES, static_cast<GLsizei>(groundIndices.size()), GL_UNSIGNED_SHORT, indices);
+        glPopMatrix();
+    }
+
+    if (hasVertexBuffers) {
+        pglBindBuffer(GL_ARRAY_BUFFER, 0);
+        pglBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    }
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+}
+
+// --- 星空 ---
+// 星は単位球上の向きの配列 (Star) をVBOに置き、回転だけのビュー行列と投影を掛けた1つの行列で無限遠に投影する。
+// --sky-cubemap では起動後に星をキューブマップに描いておき、毎フレームは星の数によらず全画面の1パスで描く
+const float STAR_POINT_SIZE = 1.5f; // 星のサイズ (ピクセル)
+const float STAR_CUBEMAP_POINT_SIZE = 2.0f; // キューブマップに描く星のサイズ (面の1ピクセルは画面の1ピクセルより小さい角度で、拡大のぼけで暗くならないよう大きめにする)
+const int SKY_CUBEMAP_SIZE = 1024; // キューブマップの1面の大きさ
+
+struct Sky {
+    GLuint starBuffer = 0; // 星の向きのVBO (0ならクライアント側の配列から描く)
+    GLuint starProgram = 0; // 星を無限遠に投影するシェーダー (0なら固定機能で単位距離の点として描く)
+    GLuint cubemap = 0; // 星を描いたキューブマップ (0なら毎フレーム星を点で描く)
+    GLuint cubemapProgram = 0; // キューブマップを全画面に貼るシェーダー
+};
+
+Sky sky; // 星空の描画の状態
+bool skyCubemap = false; // trueなら星をキューブマップに描いておき、全画面の1パスで描く (--sky-cubemap)
+
+// 星の頂点シェーダー (頂点を w = 0 の向きとして回転と投影を掛ける。深さは中央に固定して遠方クリップ面で切られないようにする)
+const char* STAR_VERTEX_SHADER = R"(
+#version 120
+void main() {
+    vec4 p = gl_ModelViewProjectionMatrix * vec4(gl_Vertex.xyz, 0.0);
+    gl_Position = vec4(p.xy, 0.0, p.w);
+    gl_FrontColor = gl_Color;
+}
+)";
+
+const char* STAR_FRAGMENT_SHADER = R"(
+#version 120
+void main() {
+    gl_FragColor = gl_Color;
+}
+)";
+
+// キューブマップを全画面に貼る頂点シェーダー (遠方クリップ面上の点を回転と投影の逆行列で戻すと、画素の向きになる)
+const char* SKY_CUBEMAP_VERTEX_SHADER = R"(
+#version 120
+varying vec3 direction;
+
+void main() {
+    vec4 p = gl_ModelViewProjectionMatrixInverse * vec4(gl_Vertex.xy, 1.0, 1.0);
+    direction = p.xyz / p.w;
+    gl_Position = gl_Vertex;
+}
+)";
+
+const char* SKY_CUBEMAP_FRAGMENT_SHADER = R"(
+#version 120
+uniform samplerCube sky;
+varying vec3 direction;
+
+void main() {
+    gl_FragColor = textureCube(sky, direction);
+}
+)";
+
+// 星のVBOとシェーダーを準備する関数 (星の生成かスナップショットの読み込みの後に呼び出す)
+void initSky(Sky& s) {
+    if (hasVertexBuffers && !stars.empty()) {
+        pglGenBuffers(1, &s.starBuffer);
+        pglBindBuffer(GL_ARRAY_BUFFER, s.starBuffer);
+        pglBufferData(GL_ARRAY_BUFFER, sizeof(Star) * stars.size(), stars.data(), GL_STATIC_DRAW);
+        pglBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    if (hasShaders) {
+        s.starProgram = linkProgram(STAR_VERTEX_SHADER, STAR_FRAGMENT_SHADER, {});
+    }
+}
+
+// 星を点で描く関数 (モデルビューは回転だけのビュー行列。ライティングとデプスは呼び出し元で切る)
+void drawStarPoints(const Sky& s, float pointSize) {
+    glPointSize(pointSize);
+    glColor3f(0.8f, 0.8f, 1.0f); // 白から薄い青色の星
+    if (s.starProgram) {
+        pglUseProgram(s.starProgram);
+    }
+    if (s.starBuffer) {
+        pglBindBuffer(GL_ARRAY_BUFFER, s.starBuffer);
+    }
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glVertexPointer(4, GL_SHORT, sizeof(Star), s.starBuffer ? nullptr : stars.data());
+    glDrawArrays(GL_POINTS, 0, static_cast<GLsizei>(stars.size()));
+    glDisableClientState(GL_VERTEX_ARRAY);
+    if (s.starBuffer) {
+        pglBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    if (s.starProgram) {
+        pglUseProgram(0);
+    }
+}
+
+// 星をキューブマップの6面に描く関数 (各面は90度の視野で、OpenGLの決まりの面ごとの上方向から見る)
+void buildSkyCubemap(Sky& s) {
+    static const Vec3 faceForward[6] = { { 1, 0, 0 }, { -1, 0, 0 }, { 0, 1, 0 }, { 0, -1, 0 }, { 0, 0, 1 }, { 0, 0, -1 } };
+    static const Vec3 faceUp[6] = { { 0, -1, 0 }, { 0, -1, 0 }, { 0, 0, 1 }, { 0, 0, -1 }, { 0, -1, 0 }, { 0, -1, 0 } };
+    glGenTextures(1, &s.cubemap);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, s.cubemap);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    for (int face = 0; face < 6; ++face) {
+        glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, 0, GL_RGBA8, SKY_CUBEMAP_SIZE, SKY_CUBEMAP_SIZE, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    }
+    glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+
+    GLuint framebuffer = 0;
+    pglGenFramebuffers(1, &framebuffer);
+    pglBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glPushAttrib(GL_COLOR_BUFFER_BIT | GL_VIEWPORT_BIT | GL_ENABLE_BIT);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_LIGHTING);
+    glDisable(GL_BLEND); // 透明な背景に不透明な星を描き、乗算済みアルファにする
+    glViewport(0, 0, SKY_CUBEMAP_SIZE, SKY_CUBEMAP_SIZE);
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadMatrixf(perspectiveMatrix(90.0f, 1.0f, 0.1f, 10.0f).m);
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    bool complete = true;
+    for (int face = 0; face < 6 && complete; ++face) {
+        pglFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, s.cubemap, 0);
+        complete = pglCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+        if (complete) {
+            glClear(GL_COLOR_BUFFER_BIT);
+            glLoadMatrixf(lookDirectionMatrix(faceForward[face], faceUp[face]).m);
+            drawStarPoints(s, STAR_CUBEMAP_POINT_SIZE);
+        }
+    }
+    glPopMatrix();
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+    glPopAttrib();
+    pglBindFramebuffer(GL_FRAMEBUFFER, 0);
+    pglDeleteFramebuffers(1, &framebuffer);
+    if (!complete) {
+        glDeleteTextures(1, &s.cubemap);
+        s.cubemap = 0;
+    }
+}
+
+// 星空のキューブマップとシェーダーを準備する関数 (できるまでは星を点で描く)
+void initSkyCubemap(Sky& s) {
+    if (!skyCubemap || !hasShaders || !hasFramebuffers) {
+        return;
+    }
+    s.cubemapProgram = linkProgram(SKY_CUBEMAP_VERTEX_SHADER, SKY_CUBEMAP_FRAGMENT_SHADER, {});
+    if (!s.cubemapProgram) {
+        return;
+    }
+    pglUseProgram(s.cubemapProgram);
+    pglUniform1i(pglGetUniformLocation(s.cubemapProgram, "sky"), 0);
+    pglUseProgram(0);
+    buildSkyCubemap(s);
+}
+
+// 星空を描画する関数 (モデルビューは回転だけのビュー行列)
+void drawStars() {
+    glDisable(GL_LIGHTING); // 星は自己発光
+    glDisable(GL_DEPTH_TEST); // 星は「背景」なのでデプスを読み書きしない
+    glDepthMask(GL_FALSE);
+    if (sky.cubemap) {
+        pglUseProgram(sky.cubemapProgram);
+        glBindTexture(GL_TEXTURE_CUBE_MAP, sky.cubemap);
+        glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA); // キューブマップは乗算済みアルファ
+        drawFullscreenQuad(1.0f, 1.0f);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+        pglUseProgram(0);
+    }
+    else {
+        drawStarPoints(sky, STAR_POINT_SIZE);
+    }
+    glDepthMask(GL_TRUE); // デプス書き込みを再有効化
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_LIGHTING); // ライティングを再有効化
+}
+
+// 世界座標からセクター座標を求める関数
+int sectorCoord(float worldPos) {
+    return static_cast<int>(std::floor(worldPos / SECTOR_SIZE));
+}
+
+// セクター内のスロットごとのシードを求める関数 (世界シードとセクター座標から決定的に決まる)
+uint32_t lanternSlotSeed(int sx, int sz, int slot) {
+    return hashUint(hashCoords(sx, sz, worldSeed) + static_cast<uint32_t>(slot) * 0x9e3779b9U);
+}
+
+// スロットの上昇速度 (スロットごとに固定なので、打ち上げ周期の長さも固定になる)
+float lanternSlotVelY(uint32_t seed) {
+    return hashToRange(hashUint(seed ^ 0x1U), LANTERN_MIN_RISE_SPEED, LANTERN_MAX_RISE_SPEED);
+}
+
+// 指定した打ち上げ周期の出現位置から age ティック経過した状態にランタンを配置する関数
+void placeLanternCycle(KomLoyLantern& l, int sx, int sz, uint32_t seed, uint32_t cycle, float age) {
+    uint32_t cycleSeed = hashUint(seed + cycle * 0x85ebca6bU);
+    float spawnX = (sx + hashToRange(hashUint(cycleSeed ^ 0x3U), 0.0f, 1.0f)) * SECTOR_SIZE;
+    float spawnZ = (sz + hashToRange(hashUint(cycleSeed ^ 0x4U), 0.0f, 1.0f)) * SECTOR_SIZE;
+
+    l.velX = hashToRange(hashUint(cycleSeed ^ 0x5U), -LANTERN_MAX_DRIFT_SPEED, LANTERN_MAX_DRIFT_SPEED);
+    l.velY = lanternSlotVelY(seed);
+    l.velZ = hashToRange(hashUint(cycleSeed ^ 0x6U), -LANTERN_MAX_DRIFT_SPEED, LANTERN_MAX_DRIFT_SPEED);
+    l.x = spawnX + l.velX * age;
+    l.y = LANTERN_LAUNCH_Y + l.velY * age;
+    l.z = spawnZ + l.velZ * age;
+    l.cycle = cycle;
+}
+
+// セクター内のスロットについて、指定ティックにおけるランタンの状態を求める関数
+// 状態はシードとティックだけで決まるので、どのタイミングで有効化しても同じ結果になる
+void evaluateLantern(KomLoyLantern& l, int sx, int sz, int slot, uint64_t tick) {
+    uint32_t seed = lanternSlotSeed(sx, sz, slot);
+    float velY = lanternSlotVelY(seed);
+    double period = (LANTERN_CEILING_Y - LANTERN_LAUNCH_Y) / velY; // 打ち上げ周期 (ティック)
+    double phase = hashToRange(hashUint(seed ^ 0x2U), 0.0f, 1.0f) * period; // スロットごとの周期のずれ
+    double cycles = (static_cast<double>(tick) + phase) / period;
+    double cycle = std::floor(cycles);
+
+    placeLanternCycle(l, sx, sz, seed, static_cast<uint32_t>(cycle), static_cast<float>((cycles - cycle) * period));
+
+    // 各ランタンは独自の炎アニメーションの位相を持つ (時間による変化は描画時に共通の時刻から求める)
+    double flameOffset = hashToRange(hashUint(seed ^ 0x7U), 0.0f, 100.0f);
+    l.flamePhase = static_cast<float>(std::fmod(flameOffset, 2.0 * M_PI));
+}
+
+// ランタンを dt ティック進める関数 (天井を越えたら同じセクター内の次の出現位置へ)
+void advanceLantern(KomLoyLantern& l, int sx, int sz, int slot, float dt) {
+    l.x += l.velX * dt;
+    l.y += l.velY * dt;
+    l.z += l.velZ * dt;
+
+    // 天井を越えたランタンは、同じセクターの地面から次の周期で打ち上がる
+    if (l.y > LANTERN_CEILING_Y) {
+        float overshoot = (l.y - LANTERN_CEILING_Y) / l.velY; // 天井を越えてから経過したティック
+        placeLanternCycle(l, sx, sz, lanternSlotSeed(sx, sz, slot), l.cycle + 1, overshoot);
+    }
+}
+
+// セクターの有効化・無効化をバックグラウンドスレッドで計画し、ランタンを生成するクラス
+class SectorStreamer {
+public:
+    ~SectorStreamer() { stop(); }
+
+    // ワーカースレッドを開始する
+    void start() {
+        worker = std::thread(&SectorStreamer::workerLoop, this);
+    }
+
+    // ワーカースレッドを停止する (終了時に呼ばれる)
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    // カメラのいるセクターを通知する (変化したときだけワーカーを起こす)
+    void requestCenter(int sx, int sz, uint64_t tick) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (sx == requestSX && sz == requestSZ) {
+            return;
+        }
+        requestSX = sx;
+        requestSZ = sz;
+        requestTick = tick;
+        hasRequest = true;
+        wake.notify_one();
+    }
+
+    // 呼び出したスレッドで同期的に計画と生成を行う (初期化時など、ワーカー開始前に使用)。
+    // parallel なら生成をワーカープールに分ける (ワーカープールを使うメインスレッドからだけ指定できる)
+    void syncCenter(int sx, int sz, uint64_t tick, bool parallel = false) {
+        if (sx == requestSX && sz == requestSZ) {
+            return;
+        }
+        requestSX = sx;
+        requestSZ = sz;
+        plan(sx, sz, tick, parallel);
+    }
+
+    // スナップショットから復元したセクターを、ワーカーが有効化済みのセクターとして引き継ぐ (ワーカー開始前に使用)
+    void adoptSectors(const SectorList& sectors, int sx, int sz) {
+        known = sectors;
+        requestSX = sx;
+        requestSZ = sz;
+    }
+
+    // 生成済みの変更を受け取る (ワーカーが作業中なら待たずに次のティックへ回す)
+    void takeUpdates(TrackedVector<SectorUpdate, MEMORY_WORLD>& out) {
+        std::unique_lock<std::mutex> lock(readyMutex, std::try_to_lock);
+        if (lock.owns_lock()) {
+            out.swap(ready);
+        }
+    }
+
+private:
+    // ワーカースレッドの本体
+    void workerLoop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [this] { return stopping || hasRequest; });
+            if (stopping) {
+                return;
+            }
+            hasRequest = false;
+            int sx = requestSX, sz = requestSZ;
+            uint64_t tick = requestTick;
+            lock.unlock();
+            plan(sx, sz, tick, false);
+            lock.lock();
+        }
+    }
+
+    // 新しい中心に対して、範囲外のセクターを無効化し、範囲内の足りないセクターを近い順に生成する
+    void plan(int centerSX, int centerSZ, uint64_t tick, bool parallel) {
+        for (size_t i = 0; i < known.size();) {
+            if (std::abs(known[i].sx - centerSX) > SECTOR_KEEP_RADIUS || std::abs(known[i].sz - centerSZ) > SECTOR_KEEP_RADIUS) {
+                publish({ false, known[i].sx, known[i].sz, tick, {} });
+                known[i] = known.back();
+                known.pop_back();
+            }
+            else {
+                ++i;
+            }
+        }
+
+        SectorList missing;
+        for (int dz = -SECTOR_ACTIVE_RADIUS; dz <= SECTOR_ACTIVE_RADIUS; ++dz) {
+            for (int dx = -SECTOR_ACTIVE_RADIUS; dx <= SECTOR_ACTIVE_RADIUS; ++dx) {
+                Sector s = { centerSX + dx, centerSZ + dz };
+                bool isKnown = false;
+                for (const auto& k : known) {
+                    if (k.sx == s.sx && k.sz == s.sz) {
+                        isKnown = true;
+                        break;
+                    }
+                }
+                if (!isKnown) {
+                    missing.push_back(s);
+                }
+            }
+        }
+        // カメラに近いセクターから順に生成する
+        std::sort(missing.begin(), missing.end(), [&](const Sector& a, const Sector& b) {
+            int da = std::max(std::abs(a.sx - centerSX), std::abs(a.sz - centerSZ));
+            int db = std::max(std::abs(b.sx - centerSX), std::abs(b.sz - centerSZ));
+            return da < db;
+        });
+
+        if (parallel) {
+            // ランタンはスロットごとのシードだけで決まるので、どう分けて並列に生成しても結果は同じ
+            TrackedVector<SectorUpdate, MEMORY_WORLD> updates;
+            for (const auto& s : missing) {
+                updates.push_back({ true, s.sx, s.sz, tick, SectorLanterns(LANTERNS_PER_SECTOR) });
+            }
+            jobSystem.parallelFor(updates.size() * LANTERNS_PER_SECTOR, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i) {
+                    SectorUpdate& update = updates[i / LANTERNS_PER_SECTOR];
+                    int slot = static_cast<int>(i % LANTERNS_PER_SECTOR);
+                    evaluateLantern(update.block[slot], update.sx, update.sz, slot, tick);
+                }
+            });
+            for (auto& update : updates) {
+                known.push_back({ update.sx, update.sz });
+                publish(std::move(update));
+            }
+            return;
+        }
+        for (const auto& s : missing) {
+            SectorUpdate update = { true, s.sx, s.sz, tick, SectorLanterns(LANTERNS_PER_SECTOR) };
+            for (int slot = 0; slot < LANTERNS_PER_SECTOR; ++slot) {
+                evaluateLantern(update.block[slot], s.sx, s.sz, slot, tick);
+            }
+            known.push_back(s);
+            publish(std::move(update));
+        }
+    }
+
+    // 生成結果をメインスレッド向けのキューに積む
+    void publish(SectorUpdate&& update) {
+        std::lock_guard<std::mutex> lock(readyMutex);
+        ready.push_back(std::move(update));
+    }
+
+    std::thread worker; // セクター生成用のワーカースレッド
+    std::mutex mutex; // 要求の受け渡し用
+    std::condition_variable wake; // ワーカーの起床通知
+    bool stopping = false; // 終了要求
+    bool hasRequest = false; // 未処理の要求があるか
+    int requestSX = INT_MIN, requestSZ = INT_MIN; // 最後に要求された中心セクター
+    uint64_t requestTick = 0; // 要求時のティック
+    std::mutex readyMutex; // 生成済みキュー用
+    TrackedVector<SectorUpdate, MEMORY_WORLD> ready; // 生成済みでメインスレッドに未反映の変更
+    SectorList known; // ワーカーが有効化を指示したセクター
+};
+
+SectorStreamer sectorStreamer; // セクターのストリーミング担当
+
+// 配列の先頭をアライメント境界に切り上げる関数
+size_t alignUp(size_t value, size_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+// 一つの領域の中にSoA配列を固定の間隔で割り当てる関数
+void bindLanternPool(LanternPool& pool, void* base, size_t capacity) {
+    pool.capacity = capacity;
+    pool.stride = alignUp(capacity * sizeof(float), LANTERN_ARRAY_ALIGNMENT);
+    char* bytes = static_cast<char*>(base);
+    float* arrays[LANTERN_ARRAY_COUNT];
+    for (int a = 0; a < LANTERN_ARRAY_COUNT; ++a) {
+        arrays[a] = reinterpret_cast<float*>(bytes + a * pool.stride);
+    }
+    pool.x = arrays[LANTERN_X];
+    pool.y = arrays[LANTERN_Y];
+    pool.z = arrays[LANTERN_Z];
+    pool.velX = arrays[LANTERN_VEL_X];
+    pool.velY = arrays[LANTERN_VEL_Y];
+    pool.velZ = arrays[LANTERN_VEL_Z];
+    pool.flamePhase = arrays[LANTERN_FLAME_PHASE];
+    pool.cycle = reinterpret_cast<uint32_t*>(arrays[LANTERN_CYCLE]);
+    pool.baseTick = reinterpret_cast<uint32_t*>(arrays[LANTERN_BASE_TICK]);
+}
+
+// ランタン配列用の領域をアライメントを揃えて確保する関数
+void allocateLanternPool(LanternPool& pool, size_t capacity) {
+    trackedFree(pool.allocation);
+    size_t stride = alignUp(capacity * sizeof(float), LANTERN_ARRAY_ALIGNMENT);
+    pool.allocation = trackedAlloc(MEMORY_SIM, stride * LANTERN_ARRAY_COUNT + LANTERN_ARRAY_ALIGNMENT);
+    uintptr_t aligned = alignUp(reinterpret_cast<uintptr_t>(pool.allocation), LANTERN_ARRAY_ALIGNMENT);
+    bindLanternPool(pool, reinterpret_cast<void*>(aligned), capacity);
+    pool.count = 0;
+}
+
+// 単精度を半精度のビット列に変換する関数 (ランタンの値の範囲では無限大・NaNは扱わない)
+// 2^-112 を掛けると指数が半精度のバイアスに揃い、非正規化数も含めて上位ビットがそのまま半精度になる
+uint16_t floatToHalf(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000U;
+    bits &= 0x7fffffffU;
+    float magnitude;
+    memcpy(&magnitude, &bits, sizeof(magnitude));
+    magnitude *= 1.925929944e-34f; // 2^-112
+    memcpy(&bits, &magnitude, sizeof(bits));
+    bits = std::min((bits + 0x1000U) >> 13, 0x7bffU); // 仮数を10ビットに丸め、半精度の最大値で飽和
+    return static_cast<uint16_t>(sign | bits);
+}
+
+// 半精度のビット列を単精度に変換する関数 (floatToHalf の逆)
+float halfToFloat(uint16_t half) {
+    uint32_t bits = static_cast<uint32_t>(half & 0x7fffU) << 13;
+    float magnitude;
+    memcpy(&magnitude, &bits, sizeof(magnitude));
+    magnitude *= 5.192296859e33f; // 2^112
+    memcpy(&bits, &magnitude, sizeof(bits));
+    bits |= static_cast<uint32_t>(half & 0x8000U) << 16;
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+#ifdef USE_SSE2
+// 半精度4つを単精度4つに変換する (halfToFloat と同じ手順をSSE2で)
+inline __m128 halfToFloat4(const uint16_t* src) {
+    __m128i halves = _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src)), _mm_setzero_si128());
+    __m128i magnitude = _mm_slli_epi32(_mm_and_si128(halves, _mm_set1_epi32(0x7fff)), 13);
+    __m128 value = _mm_mul_ps(_mm_castsi128_ps(magnitude), _mm_set1_ps(5.192296859e33f));
+    __m128i sign = _mm_slli_epi32(_mm_and_si128(halves, _mm_set1_epi32(0x8000)), 16);
+    return _mm_or_ps(value, _mm_castsi128_ps(sign));
+}
+
+// 単精度4つを半精度4つに変換する (floatToHalf と同じ手順をSSE2で)
+inline void floatToHalf4(__m128 value, uint16_t* dst) {
+    __m128i bits = _mm_castps_si128(value);
+    __m128i sign = _mm_and_si128(_mm_srli_epi32(bits, 16), _mm_set1_epi32(0x8000));
+    __m128 magnitude = _mm_mul_ps(_mm_and_ps(value, _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff))), _mm_set1_ps(1.925929944e-34f));
+    __m128i halves = _mm_srli_epi32(_mm_add_epi32(_mm_castps_si128(magnitude), _mm_set1_epi32(0x1000)), 13);
+    halves = _mm_min_epi16(_mm_packs_epi32(halves, halves), _mm_set1_epi16(0x7bff));
+    halves = _mm_or_si128(halves, _mm_packs_epi32(sign, sign));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(dst), halves);
+}
+#endif
+
+// 単精度の配列を半精度の配列にまとめて変換する関数
+void floatsToHalves(const float* src, uint16_t* dst, size_t count) {
+    size_t i = 0;
+#ifdef USE_SSE2
+    for (; i + 4 <= count; i += 4) {
+        floatToHalf4(_mm_loadu_ps(src + i), dst + i);
+    }
+#endif
+    for (; i < count; ++i) {
+        dst[i] = floatToHalf(src[i]);
+    }
+}
+
+// コンパクトなランタン配列用の領域を確保する関数 (lanternPool.count はそのまま)
+void allocateCompactLanternPool(size_t capacity) {
+    CompactLanternPool& pool = compactLanternPool;
+    trackedFree(pool.allocation);
+    pool.stride = alignUp(capacity * sizeof(uint16_t), LANTERN_ARRAY_ALIGNMENT);
+    size_t cycleBytes = alignUp(capacity * sizeof(uint32_t), LANTERN_ARRAY_ALIGNMENT);
+    pool.allocation = trackedAlloc(MEMORY_SIM, pool.stride * COMPACT_ARRAY_COUNT + cycleBytes + LANTERN_ARRAY_ALIGNMENT);
+    char* bytes = reinterpret_cast<char*>(alignUp(reinterpret_cast<uintptr_t>(pool.allocation), LANTERN_ARRAY_ALIGNMENT));
+    pool.spawnX = reinterpret_cast<int16_t*>(bytes + COMPACT_SPAWN_X * pool.stride);
+    pool.spawnZ = reinterpret_cast<int16_t*>(bytes + COMPACT_SPAWN_Z * pool.stride);
+    pool.velX = reinterpret_cast<uint16_t*>(bytes + COMPACT_VEL_X * pool.stride);
+    pool.velY = reinterpret_cast<uint16_t*>(bytes + COMPACT_VEL_Y * pool.stride);
+    pool.velZ = reinterpret_cast<uint16_t*>(bytes + COMPACT_VEL_Z * pool.stride);
+    pool.baseTime = reinterpret_cast<uint16_t*>(bytes + COMPACT_BASE_TIME * pool.stride);
+    pool.phase = reinterpret_cast<uint16_t*>(bytes + COMPACT_PHASE * pool.stride);
+    pool.cycle = reinterpret_cast<uint32_t*>(bytes + COMPACT_ARRAY_COUNT * pool.stride);
+}
+
+// ティックをコンパクト形式の時刻に変換する関数 (16ビットで折り返す)
+uint16_t compactTime(uint64_t tick) {
+    return static_cast<uint16_t>(tick * static_cast<uint64_t>(COMPACT_TIME_SCALE));
+}
+
+// i番目のランタンの現在のティックでの状態を値として取り出す関数 (保存形式によらない)
+KomLoyLantern loadLantern(size_t i) {
+    if (!compactLanterns) {
+        return lanternPool.get(i, simTick);
+    }
+    const CompactLanternPool& pool = compactLanternPool;
+    const Sector& sector = activeSectors[i / LANTERNS_PER_SECTOR];
+    float age = static_cast<uint16_t>(compactTime(simTick) - pool.baseTime[i]) / COMPACT_TIME_SCALE;
+    KomLoyLantern l;
+    l.velX = halfToFloat(pool.velX[i]);
+    l.velY = halfToFloat(pool.velY[i]);
+    l.velZ = halfToFloat(pool.velZ[i]);
+    l.x = sector.sx * SECTOR_SIZE + pool.spawnX[i] / COMPACT_POSITION_SCALE + l.velX * age;
+    l.y = LANTERN_LAUNCH_Y + l.velY * age;
+    l.z = sector.sz * SECTOR_SIZE + pool.spawnZ[i] / COMPACT_POSITION_SCALE + l.velZ * age;
+    l.flamePhase = pool.phase[i] / COMPACT_PHASE_SCALE;
+    l.cycle = pool.cycle[i];
+    return l;
+}
+
+// i番目のランタンに現在のティックでの状態を書き込む関数
+// (保存形式によらない。コンパクト形式では activeSectors[i / LANTERNS_PER_SECTOR] が所有者)
+void storeLantern(size_t i, const KomLoyLantern& l) {
+    if (!compactLanterns) {
+        lanternPool.set(i, l, simTick);
+        return;
+    }
+    CompactLanternPool& pool = compactLanternPool;
+    const Sector& sector = activeSectors[i / LANTERNS_PER_SECTOR];
+    // 現在の高さから出現からの経過時間を逆算し、そこから出現時刻と出現位置を求める
+    uint16_t velY = floatToHalf(l.velY);
+    float age = std::max(l.y - LANTERN_LAUNCH_Y, 0.0f) / halfToFloat(velY);
+    uint16_t ageUnits = static_cast<uint16_t>(std::min(age * COMPACT_TIME_SCALE + 0.5f, 65535.0f));
+    pool.baseTime[i] = static_cast<uint16_t>(compactTime(simTick) - ageUnits);
+    age = ageUnits / COMPACT_TIME_SCALE;
+    pool.velX[i] = floatToHalf(l.velX);
+    pool.velY[i] = velY;
+    pool.velZ[i] = floatToHalf(l.velZ);
+    float spawnX = l.x - halfToFloat(pool.velX[i]) * age - sector.sx * SECTOR_SIZE;
+    float spawnZ = l.z - halfToFloat(pool.velZ[i]) * age - sector.sz * SECTOR_SIZE;
+    pool.spawnX[i] = static_cast<int16_t>(std::lround(spawnX * COMPACT_POSITION_SCALE));
+    pool.spawnZ[i] = static_cast<int16_t>(std::lround(spawnZ * COMPACT_POSITION_SCALE));
+    float phase = std::fmod(l.flamePhase, 2.0f * static_cast<float>(M_PI)) * COMPACT_PHASE_SCALE;
+    pool.phase[i] = static_cast<uint16_t>(static_cast<uint32_t>(phase));
+    pool.cycle[i] = l.cycle;
+}
+
+// i番目のランタンの打ち上げ回数 (保存形式によらない)
+uint32_t lanternCycle(size_t i) {
+    return compactLanterns ? compactLanternPool.cycle[i] : lanternPool.cycle[i];
+}
+
+// i番目のランタンが天井を越える最初のティックを予測し、再出現を予約する関数
+void scheduleRespawn(size_t i) {
+    KomLoyLantern l = loadLantern(i);
+    double remaining = std::floor((LANTERN_CEILING_Y - l.y) / l.velY); // 天井に届くまでの整数ティック
+    const Sector& sector = activeSectors[i / LANTERNS_PER_SECTOR];
+    RespawnEvent event;
+    event.tick = simTick + static_cast<uint64_t>(std::max(remaining, -1.0) + 1.0);
+    event.sx = sector.sx;
+    event.sz = sector.sz;
+    event.index = static_cast<uint32_t>(i);
+    event.cycle = l.cycle;
+    respawnWheel.schedule(event);
+}
+
+// ブロック内の全ランタンの再出現を予約する関数 (セクターの有効化やブロックの移動の後に呼び出す)
+void scheduleLanternBlock(size_t block) {
+    for (size_t i = block * LANTERNS_PER_SECTOR; i < (block + 1) * LANTERNS_PER_SECTOR; ++i) {
+        scheduleRespawn(i);
+    }
+}
+
+// 現在のティックまでに天井を越えたランタンを、同じセクターの地面から次の周期で打ち上げ直す関数
+// 予約はティックごとの枠から取り出すので、処理量は再出現するランタンの数だけで全体のランタン数によらない
+void respawnLanterns() {
+    respawnWheel.advance(simTick, [](const RespawnEvent& event) {
+        // 予約後にセクターが無効化・移動された場合や、既に再出現済みの場合は古い予約なので捨てる
+        size_t i = event.index;
+        if (i >= lanternPool.count) {
+            return;
+        }
+        const Sector& sector = activeSectors[i / LANTERNS_PER_SECTOR];
+        if (sector.sx != event.sx || sector.sz != event.sz || lanternCycle(i) != event.cycle) {
+            return;
+        }
+        KomLoyLantern l = loadLantern(i);
+        float overshoot = std::max((l.y - LANTERN_CEILING_Y) / l.velY, 0.0f); // 天井を越えてから経過したティック
+        int slot = static_cast<int>(i % LANTERNS_PER_SECTOR);
+        placeLanternCycle(l, sector.sx, sector.sz, lanternSlotSeed(sector.sx, sector.sz, slot), l.cycle + 1, overshoot);
+        storeLantern(i, l);
+        scheduleRespawn(i);
+    });
+}
+
+// 現在のティックのランタンの位置と炎の位相をインスタンスデータに書き込む関数 (通常の形式。instances は begin 番目の書き込み先)
+void evaluateLanternInstances(size_t begin, size_t end, LanternInstance* instances) {
+    const LanternPool& pool = lanternPool;
+    uint32_t tick = static_cast<uint32_t>(simTick);
+    for (size_t i = begin; i < end; ++i) {
+        float age = static_cast<float>(tick - pool.baseTick[i]);
+        LanternInstance& out = instances[i - begin];
+        out.x = pool.x[i] + pool.velX[i] * age;
+        out.y = pool.y[i] + pool.velY[i] * age;
+        out.z = pool.z[i] + pool.velZ[i] * age;
+        out.phase = pool.flamePhase[i];
+    }
+}
+
+// コンパクトなランタンの現在位置と炎の位相をインスタンスデータに展開する関数 (セクターのブロックごとに原点を足す。instances は begin 番目の書き込み先)
+void unpackCompactLanterns(size_t begin, size_t end, LanternInstance* instances) {
+    const size_t first = begin;
+    const CompactLanternPool& pool = compactLanternPool;
+    const float positionScale = 1.0f / COMPACT_POSITION_SCALE;
+    const float ageScale = 1.0f / COMPACT_TIME_SCALE;
+    const uint16_t now = compactTime(simTick);
+    const float phaseScale = 1.0f / COMPACT_PHASE_SCALE;
+    while (begin < end) {
+        const Sector& sector = activeSectors[begin / LANTERNS_PER_SECTOR];
+        size_t blockEnd = std::min(end, (begin / LANTERNS_PER_SECTOR + 1) * LANTERNS_PER_SECTOR);
+        float originX = sector.sx * SECTOR_SIZE;
+        float originZ = sector.sz * SECTOR_SIZE;
+        size_t i = begin;
+#ifdef USE_SSE2
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 4 <= blockEnd; i += 4) {
+            __m128i ages = _mm_sub_epi16(_mm_set1_epi16(static_cast<short>(now)), _mm_loadl_epi64(reinterpret_cast<const __m128i*>(pool.baseTime + i)));
+            __m128 age = _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(ages, zero)), _mm_set1_ps(ageScale));
+            // 符号付き16ビットは上位に置いてから算術シフトで32ビットに広げる
+            __m128i spawnX = _mm_srai_epi32(_mm_unpacklo_epi16(zero, _mm_loadl_epi64(reinterpret_cast<const __m128i*>(pool.spawnX + i))), 16);
+            __m128i spawnZ = _mm_srai_epi32(_mm_unpacklo_epi16(zero, _mm_loadl_epi64(reinterpret_cast<const __m128i*>(pool.spawnZ + i))), 16);
+            __m128 x = _mm_add_ps(_mm_add_ps(_mm_set1_ps(originX), _mm_mul_ps(_mm_cvtepi32_ps(spawnX), _mm_set1_ps(positionScale))),
+                _mm_mul_ps(halfToFloat4(pool.velX + i), age));
+            __m128 y = _mm_add_ps(_mm_set1_ps(LANTERN_LAUNCH_Y), _mm_mul_ps(halfToFloat4(pool.velY + i), age));
+            __m128 z = _mm_add_ps(_mm_add_ps(_mm_set1_ps(originZ), _mm_mul_ps(_mm_cvtepi32_ps(spawnZ), _mm_set1_ps(positionScale))),
+                _mm_mul_ps(halfToFloat4(pool.velZ + i), age));
+            __m128 phase = _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(
+                _mm_loadl_epi64(reinterpret_cast<const __m128i*>(pool.phase + i)), zero)), _mm_set1_ps(phaseScale));
+            // SoAの4ランタン分をAoSのインスタンス4つに並べ替える
+            _MM_TRANSPOSE4_PS(x, y, z, phase);
+            float* dst = &instances[i - first].x;
+            _mm_storeu_ps(dst, x);
+            _mm_storeu_ps(dst + 4, y);
+            _mm_storeu_ps(dst + 8, z);
+            _mm_storeu_ps(dst + 12, phase);
+        }
+#endif
+        for (; i < blockEnd; ++i) {
+            float age = static_cast<uint16_t>(now - pool.baseTime[i]) * ageScale;
+            LanternInstance& out = instances[i - first];
+            out.x = originX + pool.spawnX[i] * positionScale + halfToFloat(pool.velX[i]) * age;
+            out.y = LANTERN_LAUNCH_Y + halfToFloat(pool.velY[i]) * age;
+            out.z = originZ + pool.spawnZ[i] * positionScale + halfToFloat(pool.velZ[i]) * age;
+            out.phase = pool.phase[i] * phaseScale;
+        }
+        begin = blockEnd;
+    }
+}
+
+// ランタンのブロックを別のブロックの位置へ移す関数 (無効化したセクターを詰めるため)
+void moveLanternBlock(size_t to, size_t from) {
+    if (!compactLanterns) {
+        char* base = reinterpret_cast<char*>(lanternPool.x);
+        for (int a = 0; a < LANTERN_ARRAY_COUNT; ++a) {
+            char* array = base + a * lanternPool.stride;
+            memcpy(array + to * LANTERNS_PER_SECTOR * sizeof(float),
+                array + from * LANTERNS_PER_SECTOR * sizeof(float),
+                LANTERNS_PER_SECTOR * sizeof(float));
+        }
+        return;
+    }
+    char* base = reinterpret_cast<char*>(compactLanternPool.spawnX);
+    for (int a = 0; a < COMPACT_ARRAY_COUNT; ++a) {
+        char* array = base + a * compactLanternPool.stride;
+        memcpy(array + to * LANTERNS_PER_SECTOR * sizeof(uint16_t),
+            array + from * LANTERNS_PER_SECTOR * sizeof(uint16_t),
+            LANTERNS_PER_SECTOR * sizeof(uint16_t));
+    }
+    memcpy(compactLanternPool.cycle + to * LANTERNS_PER_SECTOR, compactLanternPool.cycle + from * LANTERNS_PER_SECTOR,
+        LANTERNS_PER_SECTOR * sizeof(uint32_t));
+}
+
+// バックグラウンドで生成されたセクターの変更をランタン配列に反映する関数
+void applySectorUpdates() {
+    static TrackedVector<SectorUpdate, MEMORY_WORLD> updates;
+    updates.clear();
+    sectorStreamer.takeUpdates(updates);
+
+    for (auto& u : updates) {
+        if (u.activate) {
+            if (lanternPool.count + LANTERNS_PER_SECTOR > lanternPool.capacity) {
+                std::cout << "ランタン配列が一杯のため、セクターを追加できません" << std::endl;
+                continue;
+            }
+            // 生成時点から経過したティック分だけ進めてから追加する
+            float dt = static_cast<float>(simTick - u.tick);
+            activeSectors.push_back({ u.sx, u.sz });
+            for (int slot = 0; slot < LANTERNS_PER_SECTOR; ++slot) {
+                if (dt > 0.0f) {
+                    advanceLantern(u.block[slot], u.sx, u.sz, slot, dt);
+                }
+                storeLantern(lanternPool.count + slot, u.block[slot]);
+            }
+            lanternPool.count += LANTERNS_PER_SECTOR;
+            scheduleLanternBlock(activeSectors.size() - 1);
+        }
+        else {
+            // 無効化するセクターのブロックを最後のブロックで上書きして詰める
+            for (size_t i = 0; i < activeSectors.size(); ++i) {
+                if (activeSectors[i].sx == u.sx && activeSectors[i].sz == u.sz) {
+                    size_t last = activeSectors.size() - 1;
+                    if (i != last) {
+                        activeSectors[i] = activeSectors[last];
+                        moveLanternBlock(i, last);
+                        scheduleLanternBlock(i); // 移動したブロックの予約は番号が変わったので取り直す
+                    }
+                    activeSectors.pop_back();
+                    lanternPool.count -= LANTERNS_PER_SECTOR;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// スナップショットのセクションをアライメントを揃えて書き出すためのヘルパー
+struct SnapshotWriter {
+    FILE* file;
+    uint64_t offset;
+    bool failed; // どこかの書き込みが途中で失敗した (ディスクが一杯など)
+
+    // 現在位置を指定の境界まで0で埋める
+    void pad(size_t alignment) {
+        static const char zeros[SNAPSHOT_PAGE_ALIGNMENT] = { 0 };
+        size_t target = alignUp(static_cast<size_t>(offset), alignment);
+        size_t count = target - offset;
+        if (fwrite(zeros, 1, count, file) != count) {
+            failed = true;
+        }
+        offset = target;
+    }
+
+    // データを書き出し、その先頭オフセットを返す
+    uint64_t write(const void* data, size_t size, size_t alignment) {
+        pad(alignment);
+        uint64_t start = offset;
+        if (size > 0 && fwrite(data, 1, size, file) != size) {
+            failed = true;
+        }
+        offset += size;
+        return start;
+    }
+};
+
+// 現在のシミュレーション全体の状態をスナップショットとして保存する関数
+bool saveSnapshot(const std::string& path) {
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file) {
+        std::cout << "スナップショットを保存できません: " << path << std::endl;
+        return false;
+    }
+
+    SnapshotHeader header = {};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.endianTag = SNAPSHOT_ENDIAN_TAG;
+    header.cameraX = cameraX;
+    header.cameraY = cameraY;
+    header.cameraZ = cameraZ;
+    header.cameraRotationY = cameraRotationY;
+    header.cameraAngleX = cameraAngleX;
+    header.worldSeed = worldSeed;
+    header.simTick = simTick;
+    header.sectorSize10 = static_cast<uint32_t>(SECTOR_SIZE * 10.0f);
+    header.lanternsPerSector = LANTERNS_PER_SECTOR;
+
+    // ヘッダーは最後に書き直すので、まず場所だけ確保する
+    SnapshotWriter writer = { file, 0, false };
+    writer.write(&header, sizeof(header), 1);
+
+    std::ostringstream rngState;
+    rngState << rng;
+    std::string rngText = rngState.str();
+    header.rngStateOffset = writer.write(rngText.data(), rngText.size(), 8);
+    header.rngStateSize = rngText.size();
+
+    std::vector<int32_t> sectorCoords;
+    for (const auto& sector : activeSectors) {
+        sectorCoords.push_back(sector.sx);
+        sectorCoords.push_back(sector.sz);
+    }
+    header.sectorOffset = writer.write(sectorCoords.data(), sectorCoords.size() * sizeof(int32_t), 8);
+    header.sectorCount = activeSectors.size();
+    header.starOffset = writer.write(stars.data(), stars.size() * sizeof(Star), 8);
+    header.starCount = stars.size();
+    header.flamePolygonOffset = writer.write(flamePolygons.data(), flamePolygons.size() * sizeof(FlamePolygon), 8);
+    header.flamePolygonCount = flamePolygons.size();
+
+    // ランタン配列はメモリ上と同じく、容量分の間隔で全配列を並べる
+    // (コンパクト形式で動いている場合は通常の形式に展開してから書き出す)
+    LanternPool expanded;
+    const LanternPool* source = &lanternPool;
+    if (compactLanterns) {
+        allocateLanternPool(expanded, lanternPool.capacity);
+        for (size_t i = 0; i < lanternPool.count; ++i) {
+            expanded.set(i, loadLantern(i), simTick);
+        }
+        expanded.count = lanternPool.count;
+        source = &expanded;
+    }
+    header.lanternOffset = writer.write(source->x, source->stride * LANTERN_ARRAY_COUNT, SNAPSHOT_PAGE_ALIGNMENT);
+    header.lanternCount = source->count;
+    header.lanternCapacity = source->capacity;
+    header.lanternStride = source->stride;
+    header.fileSize = writer.offset;
+    trackedFree(expanded.allocation);
+
+    bool ok = !writer.failed &&
+        fseek(file, 0, SEEK_SET) == 0 &&
+        fwrite(&header, sizeof(header), 1, file) == 1 &&
+        fflush(file) == 0 &&
+        ferror(file) == 0;
+    ok = fclose(file) == 0 && ok; // 閉じるときに残りを書き出すので、失敗しても必ず閉じる
+    if (!ok) {
+        std::cout << "スナップショットを書き出せません (ディスクの空きなどを確認してください): " << path << std::endl;
+        remove(path.c_str()); // 途中までのファイルを残すと、読み込み時に壊れたファイルとして見つかるだけになる
+        return false;
+    }
+
+    std::cout << "スナップショットを保存しました: " << path << " (" << lanternPool.count << " ランタン)" << std::endl;
+    return true;
+}
+
+// ファイルをコピーオンライトでマップする関数 (書き込んでもファイルは変更されない)
+void* mapFileCopyOnWrite(const std::string& path, size_t& size) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return nullptr;
+    }
+    LARGE_INTEGER fileSize;
+    GetFileSizeEx(file, &fileSize);
+    size = static_cast<size_t>(fileSize.QuadPart);
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+    CloseHandle(file);
+    if (!mapping) {
+        return nullptr;
+    }
+    void* view = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+    CloseHandle(mapping); // ビューが残っている間はマッピングも維持される
+    return view;
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return nullptr;
+    }
+    size = static_cast<size_t>(st.st_size);
+    void* view = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd); // マップはファイルを閉じても有効
+    return view == MAP_FAILED ? nullptr : view;
+#endif
+}
+
+// マップしたファイルを解放する関数
+void unmapFile(void* view, size_t size) {
+#ifdef _WIN32
+    (void)size;
+    UnmapViewOfFile(view);
+#else
+    munmap(view, size);
+#endif
+}
+
+// ヘッダーの示すセクション (offset から count 個の要素) がファイルに収まり、要素の型に合った位置から始まるか調べる関数
+// 壊れたファイルの値で掛け算や足し算があふれないよう、残りのバイト数と比べる
+bool snapshotSectionFits(uint64_t offset, uint64_t count, uint64_t elementSize, uint64_t alignment, uint64_t fileSize) {
+    if (offset > fileSize || offset % alignment != 0) {
+        return false;
+    }
+    return elementSize == 0 || count <= (fileSize - offset) / elementSize;
+}
+
+// スナップショットを読み込み、シミュレーション全体の状態を置き換える関数
+bool loadSnapshot(const std::string& path) {
+    auto startTime = std::chrono::steady_clock::now();
+
+    size_t size = 0;
+    void* view = mapFileCopyOnWrite(path, size);
+    if (!view) {
+        std::cout << "スナップショットを開けません: " << path << std::endl;
+        return false;
+    }
+    const char* bytes = static_cast<const char*>(view);
+    SnapshotHeader header;
+    bool valid = size >= sizeof(header);
+    if (valid) {
+        memcpy(&header, bytes, sizeof(header));
+        valid = memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) == 0 &&
+            header.endianTag == SNAPSHOT_ENDIAN_TAG &&
+            header.fileSize == size &&
+            snapshotSectionFits(header.rngStateOffset, header.rngStateSize, 1, 1, size) &&
+            snapshotSectionFits(header.sectorOffset, header.sectorCount, sizeof(int32_t) * 2, alignof(int32_t), size) &&
+            snapshotSectionFits(header.starOffset, header.starCount, sizeof(Star), alignof(Star), size) &&
+            snapshotSectionFits(header.flamePolygonOffset, header.flamePolygonCount, sizeof(FlamePolygon), alignof(FlamePolygon), size) &&
+            snapshotSectionFits(header.lanternOffset, LANTERN_ARRAY_COUNT, header.lanternStride, LANTERN_ARRAY_ALIGNMENT, size) &&
+            header.lanternCount <= header.lanternStride / sizeof(float) &&
+            header.lanternCapacity <= header.lanternStride / sizeof(float) &&
+            header.lanternCount == header.sectorCount * LANTERNS_PER_SECTOR;
+    }
+    if (!valid || header.version != SNAPSHOT_VERSION) {
+        std::cout << "スナップショットの形式が正しくありません: " << path << std::endl;
+        unmapFile(view, size);
+        return false;
+    }
+    if (header.sectorSize10 != static_cast<uint32_t>(SECTOR_SIZE * 10.0f) || header.lanternsPerSector != LANTERNS_PER_SECTOR) {
+        std::cout << "スナップショットのセクター設定が現在のビルドと異なります: " << path << std::endl;
+        unmapFile(view, size);
+        return false;
+    }
+
+    cameraX = header.cameraX;
+    cameraY = header.cameraY;
+    cameraZ = header.cameraZ;
+    cameraRotationY = header.cameraRotationY;
+    cameraAngleX = header.cameraAngleX;
+    worldSeed = header.worldSeed;
+    simTick = header.simTick;
+
+    std::istringstream rngState(std::string(bytes + header.rngStateOffset, header.rngStateSize));
+    rngState >> rng;
+
+    const int32_t* sectorCoords = reinterpret_cast<const int32_t*>(bytes + header.sectorOffset);
+    activeSectors.clear();
+    for (uint64_t i = 0; i < header.sectorCount; ++i) {
+        activeSectors.push_back({ sectorCoords[i * 2], sectorCoords[i * 2 + 1] });
+    }
+    const Star* starData = reinterpret_cast<const Star*>(bytes + header.starOffset);
+    stars.assign(starData, starData + header.starCount);
+    const FlamePolygon* flameData = reinterpret_cast<const FlamePolygon*>(bytes + header.flamePolygonOffset);
+    flamePolygons.assign(flameData, flameData + header.flamePolygonCount);
+
+    // ランタン配列: 容量が足りていればマップした領域をそのまま使い、足りなければコピーする
+    size_t requiredCapacity = static_cast<size_t>(MAX_ACTIVE_SECTORS) * LANTERNS_PER_SECTOR;
+    bool zeroCopy = header.lanternCapacity >= requiredCapacity &&
+        header.lanternStride == alignUp(header.lanternCapacity * sizeof(float), LANTERN_ARRAY_ALIGNMENT);
+    if (zeroCopy) {
+        trackedFree(lanternPool.allocation);
+        lanternPool.allocation = nullptr;
+        bindLanternPool(lanternPool, const_cast<char*>(bytes) + header.lanternOffset, static_cast<size_t>(header.lanternCapacity));
+    }
+    else {
+        allocateLanternPool(lanternPool, std::max(requiredCapacity, static_cast<size_t>(header.lanternCount)));
+        for (int a = 0; a < LANTERN_ARRAY_COUNT; ++a) {
+            memcpy(reinterpret_cast<char*>(lanternPool.x) + a * lanternPool.stride,
+                bytes + header.lanternOffset + a * header.lanternStride,
+                static_cast<size_t>(header.lanternCount) * sizeof(float));
+        }
+    }
+    lanternPool.count = static_cast<size_t>(header.lanternCount);
+
+    // 以前にマップしていたスナップショットを解放し、新しいマップを保持する
+    if (snapshotMapping) {
+        unmapFile(snapshotMapping, snapshotMappingSize);
+    }
+    snapshotMapping = zeroCopy ? view : nullptr;
+    snapshotMappingSize = zeroCopy ? size : 0;
+    if (!zeroCopy) {
+        unmapFile(view, size);
+    }
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+    std::cout << "スナップショットを読み込みました: " << path << " (" << lanternPool.count << " ランタン, "
+        << (zeroCopy ? "ゼロコピー" : "コピー") << ", " << ms << " ms)" << std::endl;
+    return true;
+}
+
+// 入力ジャーナルの記録を開始する関数 (シミュレーションの初期化後に呼び出す)
+bool startJournalRecording(const std::string& path) {
+    inputJournal.file = fopen(path.c_str(), "wb");
+    if (!inputJournal.file) {
+        std::cout << "入力ジャーナルを作成できません: " << path << std::endl;
+        return false;
+    }
+    JournalHeader header = {};
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    header.version = JOURNAL_VERSION;
+    header.rngSeed = rngSeed;
+    header.worldSeed = worldSeed;
+    header.startTick = simTick;
+    header.cameraX = cameraX;
+    header.cameraY = cameraY;
+    header.cameraZ = cameraZ;
+    header.cameraRotationY = cameraRotationY;
+    header.cameraAngleX = cameraAngleX;
+    fwrite(&header, sizeof(header), 1, inputJournal.file);
+    inputJournal.lastRotationY = cameraRotationY;
+    inputJournal.lastAngleX = cameraAngleX;
+    std::cout << "入力を記録します: " << path << " (シード " << rngSeed << ")" << std::endl;
+    return true;
+}
+
+// このティックの入力状態をジャーナルに書き出す関数
+void recordTickInput() {
+    if (!inputJournal.file) {
+        return;
+    }
+    uint8_t flags = 0;
+    if (specialKeyStates[GLUT_KEY_UP]) flags |= JOURNAL_KEY_UP;
+    if (specialKeyStates[GLUT_KEY_DOWN]) flags |= JOURNAL_KEY_DOWN;
+    if (specialKeyStates[GLUT_KEY_LEFT]) flags |= JOURNAL_KEY_LEFT;
+    if (specialKeyStates[GLUT_KEY_RIGHT]) flags |= JOURNAL_KEY_RIGHT;
+    bool anglesChanged = cameraRotationY != inputJournal.lastRotationY || cameraAngleX != inputJournal.lastAngleX;
+    if (anglesChanged) {
+        flags |= JOURNAL_ANGLES;
+    }
+    fwrite(&flags, 1, 1, inputJournal.file);
+    if (anglesChanged) {
+        float angles[2] = { cameraRotationY, cameraAngleX };
+        fwrite(angles, sizeof(angles), 1, inputJournal.file);
+        inputJournal.lastRotationY = cameraRotationY;
+        inputJournal.lastAngleX = cameraAngleX;
+    }
+}
+
+// シミュレーション状態のチェックサム (再生結果の決定性の確認用, FNV-1a)
+uint64_t simulationChecksum() {
+    uint64_t hash = 1469598103934665603ULL;
+    auto mix = [&hash](const void* data, size_t size) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; ++i) {
+            hash = (hash ^ bytes[i]) * 1099511628211ULL;
+        }
+    };
+    float camera[5] = { cameraX, cameraY, cameraZ, cameraRotationY, cameraAngleX };
+    mix(camera, sizeof(camera));
+    mix(&simTick, sizeof(simTick));
+    if (compactLanterns) {
+        for (int a = 0; a < COMPACT_ARRAY_COUNT; ++a) {
+            mix(reinterpret_cast<const char*>(compactLanternPool.spawnX) + a * compactLanternPool.stride, lanternPool.count * sizeof(uint16_t));
+        }
+        mix(compactLanternPool.cycle, lanternPool.count * sizeof(uint32_t));
+        return hash;
+    }
+    for (int a = 0; a < LANTERN_ARRAY_COUNT; ++a) {
+        mix(reinterpret_cast<const char*>(lanternPool.x) + a * lanternPool.stride, lanternPool.count * sizeof(float));
+    }
+    return hash;
+}
+
+// 記録の終わりを書き、最後のティックの後の状態チェックサムを添えてジャーナルを閉じる関数 (終了時に呼ぶ)
+void finishJournalRecording() {
+    if (!inputJournal.file) {
+        return;
+    }
+    finishTickJobs(); // 最後のティックを終えた状態のチェックサムにする
+    uint8_t flags = JOURNAL_END;
+    uint64_t checksum = simulationChecksum();
+    fwrite(&flags, 1, 1, inputJournal.file);
+    fwrite(&checksum, sizeof(checksum), 1, inputJournal.file);
+    fclose(inputJournal.file);
+    inputJournal.file = nullptr;
+}
+
+// ジャーナルをウィンドウなしで再生し、ティックの処理時間を計測する関数
+int runReplay(const std::string& path) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+        std::cout << "入力ジャーナルを開けません: " << path << std::endl;
+        return 1;
+    }
+    JournalHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0 || header.version != JOURNAL_VERSION) {
+        std::cout << "入力ジャーナルの形式が正しくありません: " << path << std::endl;
+        fclose(file);
+        return 1;
+    }
+
+    // 記録時と同じシードで初期化し、セクターはティック内で同期的に生成する
+    rngSeed = header.rngSeed;
+    synchronousStreaming = true;
+    initSimulation();
+    if (worldSeed != header.worldSeed || simTick != header.startTick) {
+        std::cout << "警告: 初期状態が記録時と異なります (記録時に使ったスナップショットを --load-snapshot で指定してください)" << std::endl;
+    }
+    cameraX = header.cameraX;
+    cameraY = header.cameraY;
+    cameraZ = header.cameraZ;
+    cameraRotationY = header.cameraRotationY;
+    cameraAngleX = header.cameraAngleX;
+
+    uint64_t ticks = 0;
+    double totalMs = 0.0, maxMs = 0.0;
+    bool hasRecordedChecksum = false;
+    uint64_t recordedChecksum = 0;
+    uint8_t flags;
+    while (fread(&flags, 1, 1, file) == 1) {
+        if (flags & JOURNAL_END) {
+            hasRecordedChecksum = fread(&recordedChecksum, sizeof(recordedChecksum), 1, file) == 1;
+            break;
+        }
+        // 記録された入力をキーの状態とカメラに戻してから、タイマーと同じ処理を実行
+        specialKeyStates[GLUT_KEY_UP] = (flags & JOURNAL_KEY_UP) != 0;
+        specialKeyStates[GLUT_KEY_DOWN] = (flags & JOURNAL_KEY_DOWN) != 0;
+        specialKeyStates[GLUT_KEY_LEFT] = (flags & JOURNAL_KEY_LEFT) != 0;
+        specialKeyStates[GLUT_KEY_RIGHT] = (flags & JOURNAL_KEY_RIGHT) != 0;
+        if (flags & JOURNAL_ANGLES) {
+            float angles[2];
+            if (fread(angles, sizeof(angles), 1, file) != 1) {
+                break;
+            }
+            cameraRotationY = angles[0];
+            cameraAngleX = angles[1];
+        }
+
+        auto tickStart = std::chrono::steady_clock::now();
+        simulateTick();
+        finishTickJobs(); // ティックの時間にジョブの完了までを含める
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - tickStart).count();
+        totalMs += ms;
+        maxMs = std::max(maxMs, ms);
+        ++ticks;
+    }
+    fclose(file);
+
+    std::cout << "再生完了: " << ticks << " ティック, 合計 " << totalMs << " ms, 平均 "
+        << (ticks ? totalMs / ticks : 0.0) << " ms/ティック, 最大 " << maxMs << " ms" << std::endl;
+    std::cout << "最終カメラ位置: (" << cameraX << ", " << cameraY << ", " << cameraZ << "), ランタン数 " << lanternPool.count << std::endl;
+    uint64_t checksum = simulationChecksum();
+    std::cout << "状態チェックサム: " << std::hex << checksum << std::dec << std::endl;
+    if (!hasRecordedChecksum) {
+        std::cout << "記録時のチェックサムがありません (記録が途中で終わったジャーナル)" << std::endl;
+        return 0;
+    }
+    if (checksum != recordedChecksum) {
+        std::cout << "記録時の状態と一致しません (記録時のチェックサム " << std::hex << recordedChecksum << std::dec << ")" << std::endl;
+        return 1;
+    }
+    std::cout << "記録時の状態と一致しました" << std::endl;
+    return 0;
+}
+
+// ベンチマーク用に、原点の周りの正方形に count 個以上のランタンが入るだけのセクターを並べる関数 (ブロック数を返す)
+size_t layoutBenchmarkSectors(size_t count) {
+    size_t blocks = std::max<size_t>((count + LANTERNS_PER_SECTOR - 1) / LANTERNS_PER_SECTOR, 1);
+    int side = static_cast<int>(std::ceil(std::sqrt(static_cast<double>(blocks))));
+    worldSeed = rngSeed;
+    activeSectors.clear();
+    for (size_t b = 0; b < blocks; ++b) {
+        activeSectors.push_back({ static_cast<int>(b % side) - side / 2, static_cast<int>(b / side) - side / 2 });
+    }
+    return blocks;
+}
+
+// 並べたセクターのランタンを現在のティックの状態で生成し、再出現を予約する関数 (配列は確保済みであること)
+void spawnBenchmarkLanterns(size_t blocks) {
+    for (size_t b = 0; b < blocks; ++b) {
+        for (int slot = 0; slot < LANTERNS_PER_SECTOR; ++slot) {
+            KomLoyLantern l;
+            evaluateLantern(l, activeSectors[b].sx, activeSectors[b].sz, slot, simTick);
+            storeLantern(b * LANTERNS_PER_SECTOR + slot, l);
+        }
+    }
+    lanternPool.count = blocks * LANTERNS_PER_SECTOR;
+    respawnWheel.reset(simTick + 1, lanternPool.capacity);
+    for (size_t b = 0; b < blocks; ++b) {
+        scheduleLanternBlock(b);
+    }
+}
+
+// 通常の形式とコンパクトな形式で、大量のランタンのティック処理とインスタンスデータへの展開を計測する関数 (ウィンドウなし)
+// 各形式で同じランタン群を作り、ティック (再出現) と展開それぞれの時間と、展開でランタン状態 + インスタンスデータを何バイト流したかを表示する
+int runCompactBenchmark(size_t count) {
+    const int warmupTicks = 10;
+    const int measuredTicks = 100;
+    size_t blocks = layoutBenchmarkSectors(count);
+    count = blocks * LANTERNS_PER_SECTOR;
+    startJobSystem();
+    std::vector<LanternInstance> instances(count);
+
+    std::cout << "ランタン " << count << " 個, " << measuredTicks << " ティックを計測" << std::endl;
+    for (int compact = 0; compact <= 1; ++compact) {
+        compactLanterns = compact != 0;
+        if (compactLanterns) {
+            allocateCompactLanternPool(count);
+            lanternPool.capacity = count;
+        }
+        else {
+            allocateLanternPool(lanternPool, count);
+        }
+        spawnBenchmarkLanterns(blocks);
+
+        double tickMs = 0.0, ms = 0.0;
+        for (int t = 0; t < warmupTicks + measuredTicks; ++t) {
+            auto start = std::chrono::steady_clock::now();
+            ++simTick;
+            respawnLanterns();
+            auto ticked = std::chrono::steady_clock::now();
+            jobSystem.parallelFor(count, [&](size_t begin, size_t end) {
+                if (compactLanterns) {
+                    unpackCompactLanterns(begin, end, instances.data() + begin);
+                }
+                else {
+                    evaluateLanternInstances(begin, end, instances.data() + begin);
+                }
+            });
+            auto evaluated = std::chrono::steady_clock::now();
+            if (t >= warmupTicks) {
+                tickMs += std::chrono::duration<double, std::milli>(ticked - start).count() / measuredTicks;
+                ms += std::chrono::duration<double, std::milli>(evaluated - ticked).count() / measuredTicks;
+            }
+        }
+
+        size_t stateBytes = compactLanterns
+            ? COMPACT_ARRAY_COUNT * sizeof(uint16_t) + sizeof(uint32_t)
+            : LANTERN_ARRAY_COUNT * sizeof(float);
+        double stateMB = static_cast<double>(stateBytes * count) / (1024.0 * 1024.0);
+        double instanceMB = static_cast<double>(sizeof(LanternInstance) * count) / (1024.0 * 1024.0);
+        std::cout << (compactLanterns ? "コンパクト" : "通常") << ": " << stateBytes << " バイト/ランタン, 状態 "
+            << stateMB << " MB + インスタンス " << instanceMB << " MB, ティック " << tickMs << " ms, 展開 " << ms << " ms ("
+            << (stateMB + instanceMB) / 1024.0 / (ms / 1000.0) << " GB/s)" << std::endl;
+    }
+    jobSystem.stop();
+    return 0;
+}
+
+// count 個のランタンでBVHの構築・箱の作り直し・選択・範囲・近傍の問い合わせの時間を計測する関数 (--bench-bvh)
+int runBvhBenchmark(size_t count) {
+    const int measuredTicks = 100;
+    const int queries = 10000;
+    size_t blocks = layoutBenchmarkSectors(count);
+    count = blocks * LANTERNS_PER_SECTOR;
+    startJobSystem();
+    allocateLanternPool(lanternPool, count);
+    spawnBenchmarkLanterns(blocks);
+    std::cout << "ランタン " << count << " 個" << std::endl;
+
+    auto elapsedMs = [](std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    };
+    auto start = std::chrono::steady_clock::now();
+    updateLanternBvh(lanternBvh);
+    double buildMs = elapsedMs(start);
+
+    start = std::chrono::steady_clock::now();
+    for (int t = 0; t < measuredTicks; ++t) {
+        ++simTick;
+        respawnLanterns();
+        updateLanternBvh(lanternBvh);
+    }
+    double refitMs = elapsedMs(start) / measuredTicks;
+
+    // 問い合わせの位置はランタンのいる範囲から乱数で選ぶ (選択は地上の視点から上空へ向けて撃つ)
+    std::mt19937 queryRng(rngSeed);
+    float extent = static_cast<float>(std::ceil(std::sqrt(static_cast<double>(blocks)))) * SECTOR_SIZE * 0.5f;
+    std::uniform_real_distribution<float> across(-extent, extent), height(LANTERN_LAUNCH_Y, LANTERN_CEILING_Y), unit(-1.0f, 1.0f);
+    size_t hits = 0;
+    start = std::chrono::steady_clock::now();
+    for (int q = 0; q < queries; ++q) {
+        Vec3 origin = { across(queryRng), 1.75f, across(queryRng) };
+        Vec3 direction = normalize({ unit(queryRng), std::fabs(unit(queryRng)) + 0.05f, unit(queryRng) });
+        hits += pickLantern(lanternBvh, origin, direction, 500.0f) >= 0;
+    }
+    double pickUs = elapsedMs(start) * 1000.0 / queries;
+
+    std::vector<size_t> result;
+    size_t found = 0;
+    start = std::chrono::steady_clock::now();
+    for (int q = 0; q < queries; ++q) {
+        queryLanternsInRange(lanternBvh, { across(queryRng), height(queryRng), across(queryRng) }, 5.0f, result);
+        found += result.size();
+    }
+    double rangeUs = elapsedMs(start) * 1000.0 / queries;
+
+    start = std::chrono::steady_clock::now();
+    for (int q = 0; q < queries; ++q) {
+        queryNearestLanterns(lanternBvh, { across(queryRng), height(queryRng), across(queryRng) }, 16, result);
+    }
+    double nearestUs = elapsedMs(start) * 1000.0 / queries;
+
+    std::cout << "構築 " << buildMs << " ms, 箱の作り直し " << refitMs << " ms/ティック" << std::endl;
+    std::cout << "選択 " << pickUs << " us/回 (命中 " << hits << "/" << queries << "), 範囲 (半径5) " << rangeUs
+        << " us/回 (平均 " << static_cast<double>(found) / queries << " 個), 近傍16個 " << nearestUs << " us/回" << std::endl;
+    jobSystem.stop();
+    return 0;
+}
+
+// --- 起動時間の内訳 ---
+// 起動から最初のフレームを表示するまでの段階ごとの時間を記録し、最初のフレームの後に表示する
+struct StartupTimer {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now(); // プロセスの開始 (グローバル変数の初期化時)
+    std::chrono::steady_clock::time_point last = start; // 直前の段階の終わり
+    std::vector<std::pair<std::string, double>> phases; // 段階の名前と時間 (ミリ秒)
+    bool reported = false; // 内訳を表示済みか
+
+    // 直前の段階の終わりからの時間を name の段階として記録する
+    void mark(const std::string& name) {
+        auto now = std::chrono::steady_clock::now();
+        phases.emplace_back(name, std::chrono::duration<double, std::milli>(now - last).count());
+        last = now;
+    }
+
+    // 内訳と、開始から最後の段階までの合計を表示する
+    void report() {
+        reported = true;
+        std::cout << "起動時間:";
+        for (const auto& phase : phases) {
+            std::cout << " " << phase.first << " " << phase.second << " ms,";
+        }
+        std::cout << " 合計 " << std::chrono::duration<double, std::milli>(last - start).count() << " ms" << std::endl;
+    }
+};
+
+StartupTimer startupTimer; // 起動時間の内訳
+
+// 最初のフレームに必要ないGPU資源の準備。最初のフレームを表示した後、1フレームに1つずつ実行する
+struct DeferredStartupTask {
+    const char* name; // 起動時間の表示に使う名前
+    void (*run)(); // 準備する関数
+};
+std::vector<DeferredStartupTask> deferredStartupTasks; // 未実行の準備 (先頭から実行する)
+
+// 遅らせた準備を1つ実行し、かかった時間を表示する関数 (最初のフレームより後の display から呼ぶ)
+void runDeferredStartupTask() {
+    if (deferredStartupTasks.empty()) {
+        return;
+    }
+    DeferredStartupTask task = deferredStartupTasks.front();
+    deferredStartupTasks.erase(deferredStartupTasks.begin());
+    auto start = std::chrono::steady_clock::now();
+    task.run();
+    std::cout << "遅延準備: " << task.name << " " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count()
+        << " ms" << std::endl;
+}
+
+// sin の近似 (-π〜π。π/2 より外側は sin(π - x) に折り返して9次のテイラー多項式で求める。誤差は 4e-6 以下で、
+// 星の向きを詰める16ビットの刻みより十分小さい。SIMD版と同じ式にして、余りの星も同じ値になるようにする)
+inline float starSin(float x) {
+    const float halfPi = static_cast<float>(M_PI) * 0.5f;
+    if (std::fabs(x) > halfPi) {
+        x = std::copysign(static_cast<float>(M_PI), x) - x;
+    }
+    float x2 = x * x;
+    return x * (1.0f + x2 * (-1.0f / 6.0f + x2 * (1.0f / 120.0f + x2 * (-1.0f / 5040.0f + x2 * (1.0f / 362880.0f)))));
+}
+
+// 星 i の向きを求める関数 (2つのハッシュ値から高さと方位角を一様に選ぶと、単位球上で一様な向きになる)
+inline Star starDirection(uint32_t seed, uint32_t i) {
+    const float unit = 1.0f / 16777216.0f;
+    float u = static_cast<float>(hashUint(seed + 2 * i) >> 8) * unit;
+    float v = static_cast<float>(hashUint(seed + 2 * i + 1) >> 8) * unit;
+    float y = 1.0f - 2.0f * u;
+    float phi = (2.0f * v - 1.0f) * static_cast<float>(M_PI);
+    float cosPhi = phi + static_cast<float>(M_PI) * 0.5f;
+    if (cosPhi > static_cast<float>(M_PI)) {
+        cosPhi -= 2.0f * static_cast<float>(M_PI);
+    }
+    float r = std::sqrt(std::max(0.0f, 1.0f - y * y));
+    const float scale = static_cast<float>(STAR_W_ONE);
+    return { static_cast<int16_t>(std::lrint(r * starSin(cosPhi) * scale)), static_cast<int16_t>(std::lrint(y * scale)),
+        static_cast<int16_t>(std::lrint(r * starSin(phi) * scale)), STAR_W_ONE };
+}
+
+#ifdef USE_SSE2
+// 32ビット整数の下位の積 (SSE2には _mm_mullo_epi32 がないので、偶数と奇数の要素を64ビットの積で求めて組み合わせる)
+inline __m128i mulloEpi32(__m128i a, __m128i b) {
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+// hashUint の4要素版
+inline __m128i hashUint4(__m128i h) {
+    h = _mm_xor_si128(h, _mm_srli_epi32(h, 16));
+    h = mulloEpi32(h, _mm_set1_epi32(0x7feb352d));
+    h = _mm_xor_si128(h, _mm_srli_epi32(h, 15));
+    h = mulloEpi32(h, _mm_set1_epi32(static_cast<int>(0x846ca68bU)));
+    return _mm_xor_si128(h, _mm_srli_epi32(h, 16));
+}
+
+// starSin の4要素版
+inline __m128 starSin4(__m128 x) {
+    const __m128 signMask = _mm_set1_ps(-0.0f);
+    __m128 sign = _mm_and_ps(x, signMask);
+    __m128 folded = _mm_or_ps(_mm_sub_ps(_mm_set1_ps(static_cast<float>(M_PI)), _mm_andnot_ps(signMask, x)), sign);
+    __m128 outside = _mm_cmpgt_ps(_mm_andnot_ps(signMask, x), _mm_set1_ps(static_cast<float>(M_PI) * 0.5f));
+    x = _mm_or_ps(_mm_and_ps(outside, folded), _mm_andnot_ps(outside, x));
+    __m128 x2 = _mm_mul_ps(x, x);
+    __m128 p = _mm_add_ps(_mm_set1_ps(1.0f / 120.0f), _mm_mul_ps(x2, _mm_add_ps(_mm_set1_ps(-1.0f / 5040.0f), _mm_mul_ps(x2, _mm_set1_ps(1.0f / 362880.0f)))));
+    p = _mm_add_ps(_mm_set1_ps(1.0f), _mm_mul_ps(x2, _mm_add_ps(_mm_set1_ps(-1.0f / 6.0f), _mm_mul_ps(x2, p))));
+    return _mm_mul_ps(x, p);
+}
+
+// 星 [i, i + 4) の向きを求めて dst に詰める関数 (starDirection の4要素版)
+inline void starDirections4(uint32_t seed, uint32_t i, Star* dst) {
+    const __m128 unit = _mm_set1_ps(1.0f / 16777216.0f);
+    const __m128 pi = _mm_set1_ps(static_cast<float>(M_PI));
+    const __m128 one = _mm_set1_ps(1.0f);
+    __m128i index = _mm_add_epi32(_mm_set1_epi32(static_cast<int>(seed + 2 * i)), _mm_setr_epi32(0, 2, 4, 6));
+    __m128 u = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(hashUint4(index), 8)), unit);
+    __m128 v = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(hashUint4(_mm_add_epi32(index, _mm_set1_epi32(1))), 8)), unit);
+    __m128 y = _mm_sub_ps(one, _mm_add_ps(u, u));
+    __m128 phi = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(v, v), one), pi);
+    __m128 cosPhi = _mm_add_ps(phi, _mm_set1_ps(static_cast<float>(M_PI) * 0.5f));
+    cosPhi = _mm_sub_ps(cosPhi, _mm_and_ps(_mm_cmpgt_ps(cosPhi, pi), _mm_set1_ps(2.0f * static_cast<float>(M_PI))));
+    __m128 r = _mm_sqrt_ps(_mm_max_ps(_mm_setzero_ps(), _mm_sub_ps(one, _mm_mul_ps(y, y))));
+    const __m128 scale = _mm_set1_ps(static_cast<float>(STAR_W_ONE));
+    __m128i x4 = _mm_cvtps_epi32(_mm_mul_ps(_mm_mul_ps(r, starSin4(cosPhi)), scale));
+    __m128i y4 = _mm_cvtps_epi32(_mm_mul_ps(y, scale));
+    __m128i z4 = _mm_cvtps_epi32(_mm_mul_ps(_mm_mul_ps(r, starSin4(phi)), scale));
+    __m128i w4 = _mm_set1_epi32(STAR_W_ONE);
+    // x0..x3 y0..y3 と z0..z3 w0..w3 に詰めてから、星ごとの x y z w に並べ替える
+    __m128i xy = _mm_packs_epi32(x4, y4), zw = _mm_packs_epi32(z4, w4);
+    xy = _mm_unpacklo_epi16(xy, _mm_srli_si128(xy, 8));
+    zw = _mm_unpacklo_epi16(zw, _mm_srli_si128(zw, 8));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_unpacklo_epi32(xy, zw));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 2), _mm_unpackhi_epi32(xy, zw));
+}
+#endif
+
+// count 個の星を seed から生成する関数。星ごとに番号とシードのハッシュから向きを決めるので、
+// ワーカープールでどう分割しても (SIMDで4個ずつ求めても) 結果は同じになる
+void generateStars(uint32_t seed, int count) {
+    stars.resize(count);
+    jobSystem.parallelFor(static_cast<size_t>(count), [&](size_t begin, size_t end) {
+        size_t i = begin;
+#ifdef USE_SSE2
+        for (; i + 4 <= end; i += 4) {
+            starDirections4(seed, static_cast<uint32_t>(i), &stars[i]);
+        }
+#endif
+        for (; i < end; ++i) {
+            stars[i] = starDirection(seed, static_cast<uint32_t>(i));
+        }
+    });
+}
+
+// シミュレーションの状態 (炎の形状、星、ランタン) を準備する関数 (GLを使わないのでヘッドレスでも呼べる)
+void initSimulation() {
+    rng.seed(rngSeed);
+
+    if (!snapshotLoadPath.empty() && loadSnapshot(snapshotLoadPath)) {
+        if (compactLanterns) {
+            // スナップショットは通常の形式なので、コンパクト形式に詰め直して元の配列は手放す
+            allocateCompactLanternPool(lanternPool.capacity);
+            for (size_t i = 0; i < lanternPool.count; ++i) {
+                storeLantern(i, lanternPool.get(i, simTick));
+            }
+            trackedFree(lanternPool.allocation);
+            lanternPool.allocation = nullptr;
+        }
+        respawnWheel.reset(simTick + 1, lanternPool.capacity);
+        for (size_t block = 0; block < activeSectors.size(); ++block) {
+            scheduleLanternBlock(block);
+        }
+        // スナップショットから復元したセクターをワーカーに引き継ぐ
+        sectorStreamer.adoptSectors(activeSectors, sectorCoord(cameraX), sectorCoord(cameraZ));
+        startupTimer.mark("スナップショット");
+    }
+    else {
+        // 炎のポリゴンをユニークなアニメーションオフセットで初期化
+        for (int i = 0; i < 5; ++i) {
+            flamePolygons.push_back({ 1.0f, 1.0f, 0.0f, 1.0f, getRandomFloat(0.0f, 100.0f) }); // カスタム乱数オフセットを使用
+        }
+
+        // 世界のシードは以前に星の生成で使っていた分だけ乱数を進めてから決める (同じシードで同じ世界とジャーナルの再生結果になるように)
+        rng.discard(3 * NUM_STARS);
+        worldSeed = static_cast<uint32_t>(rng());
+
+        // 星を世界のシードから並列に生成する
+        generateStars(hashUint(worldSeed ^ 0x5354u), starCount);
+        startupTimer.mark("星");
+
+        // カメラ周辺のセクターを同期的に (ワーカープールで並列に) 生成する
+        size_t capacity = static_cast<size_t>(MAX_ACTIVE_SECTORS) * LANTERNS_PER_SECTOR;
+        if (compactLanterns) {
+            allocateCompactLanternPool(capacity);
+            lanternPool.capacity = capacity;
+            lanternPool.count = 0;
+        }
+        else {
+            allocateLanternPool(lanternPool, capacity);
+        }
+        respawnWheel.reset(simTick + 1, lanternPool.capacity);
+        sectorStreamer.syncCenter(sectorCoord(cameraX), sectorCoord(cameraZ), simTick, true);
+        applySectorUpdates();
+        startupTimer.mark("セクター");
+    }
+    // 以降のセクターはバックグラウンドで生成する (同期モードではティックごとに呼び出し元で生成)
+    if (!synchronousStreaming) {
+        sectorStreamer.start();
+    }
+}
+
+// 描画の固定状態 (背景色、デプス、ブレンド、ライト、投影行列) を設定する関数
+void initRenderState() {
+    glClearColor(0.0f, 0.0f, 0.1f, 1.0f); // 夜空用の濃い青色の背景
+    glEnable(GL_DEPTH_TEST); // 正しい3Dレンダリングのためのデプステストを有効化
+    camera.setPerspective(45.0f, 800.0f / 600.0f, 0.1f, 500.0f); // 遠くのランタンのために遠方クリッピング面を拡大
+    glMatrixMode(GL_PROJECTION);
+    glLoadMatrixf(camera.projection().m);
+    glMatrixMode(GL_MODELVIEW);
 
     // 透明効果のためのブレンドを有効化
     glEnable(GL_BLEND);
@@ -425,87 +5496,760 @@ void init() {
     glLightfv(GL_LIGHT0, GL_AMBIENT, light_ambient);
     glLightfv(GL_LIGHT0, GL_DIFFUSE, light_diffuse);
     glLightfv(GL_LIGHT0, GL_SPECULAR, light_specular);
+}
+
+// 初期化関数
+void init() {
+    initRenderState();
+
+    // 拡張関数を取得し、地面チャンクを準備
+    loadGLExtensions();
+    initGround();
+    startupTimer.mark("GL拡張・地面");
+
+    startJobSystem(); // 星とセクターの生成から使う
+    initSimulation(); // シミュレーションの状態を準備
+    initSky(sky); // 星の向きをVBOに置く
+    initLanternBatching(); // ランタンの一括描画を準備 (炎の形状が決まった後)
+    startupTimer.mark("ランタンのメッシュ");
+    initDynamicResolution(dynamicResolution); // 描画先は最初の reshape で作る
+    startupTimer.mark("動的解像度");
+
+    // グローとインポスターがなくても (重ねた三角形の炎と、形状で描く遠くのランタンで) 描けるので、最初のフレームの後に準備する
+    deferredStartupTasks.push_back({ "グロー", [] {
+        initLanternGlow(lanternGlow);
+        resizeLanternGlow(lanternGlow, dynamicResolution.windowWidth, dynamicResolution.windowHeight);
+    } });
+    deferredStartupTasks.push_back({ "インポスター", [] {
+        initLanternImpostors(impostorAtlas); // 遠くのランタン用のアトラスを描いておく
+    } });
+    deferredStartupTasks.push_back({ "星空のキューブマップ", [] {
+        initSkyCubemap(sky); // --sky-cubemap のときだけ作る
+    } });
+}
+
+// --- メモリの報告 ---
+// タグごとの確保中・最大のバイト数とフレームあたりの確保回数、GPUに置いたバッファとテクスチャの見積もりを集計する。
+// 'm' キーで画面に重ねて表示し、--memory-report [個数] でランタン数を増やしたときの上限をヘッドレスで調べる
+const int64_t TEXEL_BYTES = 4; // 描画先とアトラスのテクセルの大きさ (RGBA8 と DEPTH_COMPONENT24 のどちらも4バイトとして数える)
+const int64_t DISPLAY_LIST_VERTEX_BYTES = 40; // 表示リストの頂点1個の見積もり (位置・法線・色の浮動小数点)
+const int MEMORY_REPORT_WARMUP_TICKS = 10; // 確保回数を数え始める前のティック数 (作業領域が育ちきるまで)
+const int MEMORY_REPORT_TICKS = 100; // 定常状態の確保回数を数えるティック数
 
-    // 炎のポリゴンをユニークなアニメーションオフセットで初期化
-    for (int i = 0; i < 5; ++i) {
-        flamePolygons.push_back({ 1.0f, 1.0f, 0.0f, 1.0f, getRandomFloat(0.0f, 100.0f) }); // カスタム乱数オフセットを使用
+struct MemoryFrameStats {
+    uint64_t allocations[MEMORY_TAG_COUNT] = {}; // 直前のフレームの確保回数
+    uint64_t previousTotals[MEMORY_TAG_COUNT] = {}; // 前のフレームの終わりまでの確保回数
+};
+
+MemoryFrameStats memoryFrameStats; // フレームごとの確保回数
+bool showMemoryOverlay = false; // メモリの集計を画面に重ねて表示するか ('m' キー)
+size_t memoryReportLanterns = 0; // 0以外なら、この個数のランタンでメモリの上限を調べて終了する (--memory-report)
+
+// フレームの終わりに、このフレームの確保回数をタグごとに求める関数 (前回の呼び出しからのティックと描画を含む)
+void endMemoryFrame(MemoryFrameStats& stats) {
+    for (int t = 0; t < MEMORY_TAG_COUNT; ++t) {
+        uint64_t total = memoryCounters[t].allocations.load(std::memory_order_relaxed);
+        stats.allocations[t] = total - stats.previousTotals[t];
+        stats.previousTotals[t] = total;
     }
+}
 
-    // 星を初期化
-    for (int i = 0; i < NUM_STARS; ++i) {
-        stars.push_back({ getRandomFloat(-200.0f, 200.0f), getRandomFloat(-200.0f, 200.0f), getRandomFloat(-200.0f, 200.0f) });
+// GLのバッファ・テクスチャ・表示リストの大きさをタグごとに見積もる関数 (ドライバ内部の余白や整列は含まない)
+void estimateGpuMemory(int64_t bytes[MEMORY_TAG_COUNT]) {
+    for (int t = 0; t < MEMORY_TAG_COUNT; ++t) {
+        bytes[t] = 0;
+    }
+    if (instanceRing.buffer) {
+        int regions = instanceRing.persistent ? INSTANCE_RING_REGIONS : 1;
+        bytes[MEMORY_RENDER] += static_cast<int64_t>(sizeof(LanternInstance) * instanceRing.regionCapacity) * regions;
+    }
+    if (lanternMeshBuffer) {
+        bytes[MEMORY_RENDER] += static_cast<int64_t>(sizeof(MeshVertex) * lanternMeshVertices.size());
+    }
+    bytes[MEMORY_RENDER] += static_cast<int64_t>(lanternDisplayListVertices) * DISPLAY_LIST_VERTEX_BYTES;
+    if (dynamicResolution.enabled) {
+        // シーンの色とデプス、2枚の履歴
+        bytes[MEMORY_RENDER] += 4 * TEXEL_BYTES * dynamicResolution.windowWidth * dynamicResolution.windowHeight;
+    }
+    if (lanternGlow.enabled) {
+        // 縮小したデプスと、ぼかし用の2枚
+        bytes[MEMORY_RENDER] += 3 * TEXEL_BYTES * lanternGlow.width * lanternGlow.height;
     }
+    if (impostorAtlas.texture) {
+        // ミップマップの分として4/3倍
+        bytes[MEMORY_RENDER] += TEXEL_BYTES * IMPOSTOR_TILE_WIDTH * IMPOSTOR_PHASES * IMPOSTOR_TILE_HEIGHT * IMPOSTOR_ELEVATIONS * 4 / 3;
+    }
+    if (sky.starBuffer) {
+        bytes[MEMORY_STARS] += static_cast<int64_t>(sizeof(Star) * stars.size());
+    }
+    if (sky.cubemap) {
+        bytes[MEMORY_STARS] += 6 * TEXEL_BYTES * SKY_CUBEMAP_SIZE * SKY_CUBEMAP_SIZE;
+    }
+    for (const GroundChunk& chunk : groundChunks) {
+        if (chunk.vbo) {
+            bytes[MEMORY_WORLD] += static_cast<int64_t>(sizeof(GroundVertex) * GROUND_CHUNK_VERTS);
+        }
+    }
+    if (groundIndexBuffer) {
+        bytes[MEMORY_WORLD] += static_cast<int64_t>(sizeof(GLushort) * groundIndices.size());
+    }
+}
 
-    // --- ランタンの静的パーツ用のディスプレイリストを作成 ---
-    lanternDisplayList = glGenLists(1); // ディスプレイリストの一意なIDを生成
-    glNewList(lanternDisplayList, GL_COMPILE); // コマンドのリストへのコンパイルを開始
-    // 単一のランタンの静的コンポーネントをローカル原点 (0,0,0) で描画
-    drawLanternFrame();
-    drawLanternCover();
-    drawLanternRoof();
-    drawHook();
-    glEndList(); // ディスプレイリストのコンパイルを終了
+// メモリの集計を画面の左上に重ねて描く関数 (表示中も確保しないよう、文字列は固定長のバッファに書く)
+void drawMemoryOverlay() {
+    if (!showMemoryOverlay) {
+        return;
+    }
+    int64_t gpu[MEMORY_TAG_COUNT];
+    estimateGpuMemory(gpu);
+    const double MB = 1024.0 * 1024.0;
+    char lines[MEMORY_TAG_COUNT + 3][96];
+    snprintf(lines[0], sizeof(lines[0]), "%-8s %10s %10s %13s %10s", "memory", "live MB", "peak MB", "allocs/frame", "gpu MB");
+    int64_t liveTotal = 0, peakTotal = 0, gpuTotal = 0;
+    uint64_t allocationTotal = 0;
+    for (int t = 0; t < MEMORY_TAG_COUNT; ++t) {
+        int64_t live = memoryCounters[t].liveBytes.load(std::memory_order_relaxed);
+        int64_t peak = memoryCounters[t].peakBytes.load(std::memory_order_relaxed);
+        snprintf(lines[t + 1], sizeof(lines[t + 1]), "%-8s %10.2f %10.2f %13llu %10.2f", MEMORY_TAG_NAMES[t], live / MB, peak / MB,
+            static_cast<unsigned long long>(memoryFrameStats.allocations[t]), gpu[t] / MB);
+        liveTotal += live;
+        peakTotal += peak;
+        gpuTotal += gpu[t];
+        allocationTotal += memoryFrameStats.allocations[t];
+    }
+    snprintf(lines[MEMORY_TAG_COUNT + 1], sizeof(lines[0]), "%-8s %10.2f %10.2f %13llu %10.2f", "total", liveTotal / MB, peakTotal / MB,
+        static_cast<unsigned long long>(allocationTotal), gpuTotal / MB);
+    // 入力のキューが溢れていれば、キーを離すイベント以外 (視点の回転は次に持ち越す) を捨てている
+    snprintf(lines[MEMORY_TAG_COUNT + 2], sizeof(lines[0]), "%-8s %10u dropped", "input", inputQueue.dropped.load(std::memory_order_relaxed));
+
+    int width = glutGet(GLUT_WINDOW_WIDTH), height = glutGet(GLUT_WINDOW_HEIGHT);
+    glPushAttrib(GL_ENABLE_BIT | GL_CURRENT_BIT);
+    glDisable(GL_LIGHTING);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_TEXTURE_2D);
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    glOrtho(0.0, width, 0.0, height, -1.0, 1.0);
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glLoadIdentity();
+    // 明るいランタンの上でも読めるように、半透明の黒い背景を敷く
+    const int rows = MEMORY_TAG_COUNT + 3;
+    int right = 10 + 8 * static_cast<int>(strlen(lines[0])) + 6;
+    glColor4f(0.0f, 0.0f, 0.0f, 0.6f);
+    glRecti(4, height - 24 - 15 * (rows - 1) - 6, right, height - 4);
+    glColor3f(1.0f, 0.95f, 0.6f);
+    for (int row = 0; row < rows; ++row) {
+        glRasterPos2i(10, height - 20 - 15 * row);
+        for (const char* c = lines[row]; *c; ++c) {
+            glutBitmapCharacter(GLUT_BITMAP_8_BY_13, *c);
+        }
+    }
+    glPopMatrix();
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+    glPopAttrib();
+}
+
+// count 個のランタンを並べたときのタグごとのメモリと、ティックを繰り返したときの確保回数を表示する関数 (--memory-report)
+// ランタンの状態・BVH・インスタンスの作業領域は実際の描画と同じ関数で作り、GPUの分はインスタンスのリングバッファを
+// count 個分確保したとして見積もる (それ以外のGPU資源はランタン数によらない)
+int runMemoryReport(size_t count) {
+    size_t blocks = layoutBenchmarkSectors(count);
+    count = blocks * LANTERNS_PER_SECTOR;
+    startJobSystem();
+    if (compactLanterns) {
+        allocateCompactLanternPool(count);
+        lanternPool.capacity = count;
+    }
+    else {
+        allocateLanternPool(lanternPool, count);
+    }
+    spawnBenchmarkLanterns(blocks);
+    TrackedVector<LanternInstance, MEMORY_RENDER> instances(count); // 永続マップが使えないときの作業領域と同じ大きさ
 
-    // ランタンを初期化
-    for (int i = 0; i < NUM_LANTERNS; ++i) {
-        KomLoyLantern newLantern;
-        newLantern.x = getRandomFloat(-50.0f, 50.0f);
-        newLantern.y = getRandomFloat(0.0f, 35.0f); // ランダムな初期Y座標に新しい分布を使用
-        newLantern.z = getRandomFloat(-50.0f, 50.0f);
-        newLantern.velX = getRandomFloat(-0.005f, 0.005f);
-        newLantern.velY = getRandomFloat(0.01f, 0.03f);
-        newLantern.velZ = getRandomFloat(-0.005f, 0.005f);
-        newLantern.currentFlameAnimation = getRandomFloat(0.0f, 100.0f); // 各ランタンは独自の炎アニメーション時間を持つ
-        newLantern.corePulsation = 0.0f; // フレームごとに計算される
+    auto tick = [&]() {
+        ++simTick;
+        respawnLanterns();
+        updateLanternBvh(lanternBvh);
+        jobSystem.parallelFor(count, [&](size_t begin, size_t end) {
+            if (compactLanterns) {
+                unpackCompactLanterns(begin, end, instances.data() + begin);
+            }
+            else {
+                evaluateLanternInstances(begin, end, instances.data() + begin);
+            }
+        });
+    };
+    for (int t = 0; t < MEMORY_REPORT_WARMUP_TICKS; ++t) {
+        tick();
+    }
+    MemoryFrameStats stats;
+    endMemoryFrame(stats);
+    uint64_t steadyAllocations[MEMORY_TAG_COUNT] = {};
+    for (int t = 0; t < MEMORY_REPORT_TICKS; ++t) {
+        tick();
+        endMemoryFrame(stats);
+        for (int tag = 0; tag < MEMORY_TAG_COUNT; ++tag) {
+            steadyAllocations[tag] += stats.allocations[tag];
+        }
+    }
 
-        lanterns.push_back(newLantern);
+    int64_t gpu[MEMORY_TAG_COUNT] = {};
+    gpu[MEMORY_RENDER] = static_cast<int64_t>(sizeof(LanternInstance) * count) * INSTANCE_RING_REGIONS;
+    const double MB = 1024.0 * 1024.0;
+    std::cout << "ランタン " << count << " 個 (" << (compactLanterns ? "コンパクト" : "通常") << "の形式)" << std::endl;
+    printf("%-8s %12s %12s %16s %12s\n", "タグ", "確保中 MB", "最大 MB", "確保回数/ティック", "GPU MB");
+    int64_t liveTotal = 0, peakTotal = 0, gpuTotal = 0;
+    uint64_t allocationTotal = 0;
+    for (int t = 0; t < MEMORY_TAG_COUNT; ++t) {
+        int64_t live = memoryCounters[t].liveBytes.load(std::memory_order_relaxed);
+        int64_t peak = memoryCounters[t].peakBytes.load(std::memory_order_relaxed);
+        printf("%-8s %12.2f %12.2f %16.2f %12.2f\n", MEMORY_TAG_NAMES[t], live / MB, peak / MB,
+            static_cast<double>(steadyAllocations[t]) / MEMORY_REPORT_TICKS, gpu[t] / MB);
+        liveTotal += live;
+        peakTotal += peak;
+        gpuTotal += gpu[t];
+        allocationTotal += steadyAllocations[t];
     }
+    printf("%-8s %12.2f %12.2f %16.2f %12.2f\n", "合計", liveTotal / MB, peakTotal / MB,
+        static_cast<double>(allocationTotal) / MEMORY_REPORT_TICKS, gpuTotal / MB);
+    printf("ランタン1個あたり: CPU %.1f バイト, GPU %.1f バイト\n", static_cast<double>(liveTotal) / count, static_cast<double>(gpuTotal) / count);
+    fflush(stdout);
+    jobSystem.stop();
+    return 0;
 }
 
-// ディスプレイコールバック関数
-void display() {
+// --- マイクロベンチマーク (--bench) ---
+// 描画ヘルパーとランタンの更新処理を1つずつ繰り返し実行して時間を測る。ウィンドウを開かず、EGLのヘッドレスなコンテキスト
+// (ソフトウェアのGLでも可) に描く。各項目は合計が BENCH_MIN_TIME_MS 以上になるまで回数を増やしてから BENCH_REPETITIONS 回測り、
+// 中央値から1回・ランタン1個・頂点1個あたりの時間を求める。結果は Google Benchmark と同じ形式のJSONにも書き出せる
+// (scripts/bench_compare.py で2つのビルドの結果を比べる)
+const double BENCH_MIN_TIME_MS = 200.0; // 1回の計測の最短時間
+const int BENCH_REPETITIONS = 3; // 計測の繰り返し数 (中央値を使う)
+const int BENCH_WIDTH = 800, BENCH_HEIGHT = 600; // 描画先の大きさ (ウィンドウの初期サイズと同じ)
+const size_t BENCH_LANTERNS = 100000; // 更新処理の計測に使うランタン数
+
+struct MicroBenchmark {
+    const char* name; // 項目名
+    double lanternsPerIteration; // 1回の実行で扱うランタン数 (0ならランタンあたりの時間を出さない)
+    bool draws; // 描画を伴うか (計測の終わりに glFinish で完了を待ち、頂点数を数える)
+    void (*run)(size_t iterations); // iterations 回実行する
+};
+
+struct MicroBenchmarkResult {
+    const char* name;
+    size_t iterations; // 1回の計測あたりの実行回数
+    double realNs, cpuNs; // 1回の実行あたりの経過時間とCPU時間 (中央値)
+    double lanterns; // 1回の実行あたりのランタン数
+    double vertices; // 1回の実行あたりの頂点数 (数えられなければ0)
+};
+
+std::string benchFilter; // この文字列を名前に含む項目だけを測る (--bench-filter)
+std::string benchJsonPath; // 結果のJSONの書き出し先 (--bench-json)
+bool runMicroBenchmarksOnly = false; // ウィンドウを開かずにマイクロベンチマークだけを実行する (--bench)
+volatile float benchmarkSink = 0.0f; // 乱数の計測が最適化で消えないようにする
+
+#ifdef KOMLOY_HAVE_EGL
+// ウィンドウのないオフスクリーンのGLコンテキストを作る関数 (表示のないサーバーでも、Mesaならソフトウェアで描ける)
+bool createHeadlessContext(int width, int height) {
+    // 表示がなくても使えるサーフェスレスのプラットフォームを優先し、なければ既定のディスプレイを使う
+    EGLDisplay display = EGL_NO_DISPLAY;
+    auto getPlatformDisplay = reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(eglGetProcAddress("eglGetPlatformDisplayEXT"));
+#ifdef EGL_PLATFORM_SURFACELESS_MESA
+    if (getPlatformDisplay) {
+        display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+    }
+#endif
+    EGLint major = 0, minor = 0;
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor)) {
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+        if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor)) {
+            return false;
+        }
+    }
+    if (!eglBindAPI(EGL_OPENGL_API)) {
+        return false;
+    }
+    const EGLint configAttributes[] = { EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_DEPTH_SIZE, 24, EGL_NONE };
+    EGLConfig config;
+    EGLint configCount = 0;
+    if (!eglChooseConfig(display, configAttributes, &config, 1, &configCount) || configCount == 0) {
+        return false;
+    }
+    // 固定機能の描画を使うので互換プロファイルを要求する
+    const EGLint contextAttributes[] = { EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT, EGL_NONE };
+    EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttributes);
+    const EGLint surfaceAttributes[] = { EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE };
+    EGLSurface surface = eglCreatePbufferSurface(display, config, surfaceAttributes);
+    if (context == EGL_NO_CONTEXT || surface == EGL_NO_SURFACE || !eglMakeCurrent(display, surface, surface, context)) {
+        return false;
+    }
+    headlessContext = true; // 拡張関数はGLUTではなくEGLから取得する
+    return true;
+}
+#endif
+
+// 1つの項目を測る関数
+MicroBenchmarkResult runMicroBenchmark(const MicroBenchmark& bench) {
+    auto measure = [&](size_t iterations, double& cpuMs) {
+        std::clock_t cpuStart = std::clock();
+        auto start = std::chrono::steady_clock::now();
+        bench.run(iterations);
+        if (bench.draws) {
+            glFinish();
+        }
+        cpuMs = 1000.0 * (std::clock() - cpuStart) / CLOCKS_PER_SEC;
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    // 最短時間に届くまで回数を増やす (初回はキャッシュやシェーダーの準備も兼ねる)
+    size_t iterations = 1;
+    double cpuMs = 0.0;
+    for (double ms = measure(iterations, cpuMs); ms < BENCH_MIN_TIME_MS; ms = measure(iterations, cpuMs)) {
+        double growth = ms > 0.0 ? BENCH_MIN_TIME_MS * 1.4 / ms : 10.0;
+        iterations = static_cast<size_t>(iterations * std::min(std::max(growth, 2.0), 10.0));
+    }
+    std::vector<double> realNs, cpuNs;
+    for (int r = 0; r < BENCH_REPETITIONS; ++r) {
+        realNs.push_back(measure(iterations, cpuMs) * 1e6 / iterations);
+        cpuNs.push_back(cpuMs * 1e6 / iterations);
+    }
+    std::sort(realNs.begin(), realNs.end());
+    std::sort(cpuNs.begin(), cpuNs.end());
+
+    // 1回の実行で送られる頂点数
+    double vertices = bench.draws ? static_cast<double>(countSubmittedVertices([&] { bench.run(1); })) : 0.0;
+    return { bench.name, iterations, realNs[BENCH_REPETITIONS / 2], cpuNs[BENCH_REPETITIONS / 2], bench.lanternsPerIteration, vertices };
+}
+
+// 結果を Google Benchmark と同じ形式のJSONで書き出す関数 (追加の値はユーザーカウンタと同じく各項目の直下に置く)
+bool writeMicroBenchmarkJson(const std::string& path, const std::vector<MicroBenchmarkResult>& results) {
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file) {
+        return false;
+    }
+    const char* renderer = reinterpret_cast<const char*>(glGetString(GL_RENDERER));
+    fprintf(file, "{\n  \"context\": {\n");
+    fprintf(file, "    \"executable\": \"komloy\",\n    \"num_cpus\": %u,\n", std::thread::hardware_concurrency());
+    fprintf(file, "    \"gl_renderer\": \"%s\",\n", renderer ? renderer : "");
+#ifdef NDEBUG
+    fprintf(file, "    \"library_build_type\": \"release\"\n  },\n");
+#else
+    fprintf(file, "    \"library_build_type\": \"debug\"\n  },\n");
+#endif
+    fprintf(file, "  \"benchmarks\": [\n");
+    for (size_t i = 0; i < results.size(); ++i) {
+        const MicroBenchmarkResult& r = results[i];
+        fprintf(file, "    {\n      \"name\": \"%s\",\n      \"run_name\": \"%s\",\n      \"run_type\": \"iteration\",\n", r.name, r.name);
+        fprintf(file, "      \"repetitions\": %d,\n      \"iterations\": %zu,\n", BENCH_REPETITIONS, r.iterations);
+        fprintf(file, "      \"real_time\": %.3f,\n      \"cpu_time\": %.3f,\n      \"time_unit\": \"ns\"", r.realNs, r.cpuNs);
+        if (r.lanterns > 0.0) {
+            fprintf(file, ",\n      \"ns_per_lantern\": %.4f", r.realNs / r.lanterns);
+        }
+        if (r.vertices > 0.0) {
+            fprintf(file, ",\n      \"vertices_per_iteration\": %.0f,\n      \"ns_per_vertex\": %.4f", r.vertices, r.realNs / r.vertices);
+        }
+        fprintf(file, "\n    }%s\n", i + 1 < results.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+    return true;
+}
+
+// 描画ヘルパーの計測用に、視点から3離れた正面にランタンの原点を置いたモデルビュー行列を設定する関数
+void loadBenchmarkModelView() {
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+    glTranslatef(0.0f, 0.0f, -3.0f);
+}
+
+// マイクロベンチマークを実行する関数 (--bench)
+int runMicroBenchmarks() {
+#ifdef KOMLOY_HAVE_EGL
+    if (!createHeadlessContext(BENCH_WIDTH, BENCH_HEIGHT)) {
+        std::cout << "ヘッドレスのGLコンテキストを作れません" << std::endl;
+        return 1;
+    }
+#else
+    std::cout << "このビルドはEGLなしでビルドされているため、--bench を実行できません" << std::endl;
+    return 1;
+#endif
+    std::cout << "GL: " << glGetString(GL_RENDERER) << " (" << glGetString(GL_VERSION) << ")" << std::endl;
+    glViewport(0, 0, BENCH_WIDTH, BENCH_HEIGHT);
+    initRenderState();
+    loadGLExtensions();
+    synchronousStreaming = true; // セクターの生成スレッドを起動しない
+    startJobSystem();
+    initSimulation(); // 炎の形状と星
+    initSky(sky);
+    initSkyCubemap(sky); // --sky-cubemap なら drawStars は全画面の1パスを測る
+    ensureLanternDisplayList();
+
+    // 更新処理は実際と同じセクターの並びのランタンで測る
+    static std::vector<LanternInstance> instances;
+    size_t blocks = layoutBenchmarkSectors(BENCH_LANTERNS);
+    allocateLanternPool(lanternPool, blocks * LANTERNS_PER_SECTOR);
+    spawnBenchmarkLanterns(blocks);
+    instances.resize(lanternPool.count);
+    const double lanterns = static_cast<double>(lanternPool.count);
+
+    const MicroBenchmark benchmarks[] = {
+        { "getRandomFloat", 0.0, false, [](size_t n) {
+            float sum = 0.0f;
+            for (size_t i = 0; i < n; ++i) {
+                sum += getRandomFloat(0.0f, 1.0f);
+            }
+            benchmarkSink = sum;
+        } },
+        { "drawFlame", 1.0, true, [](size_t n) {
+            loadBenchmarkModelView();
+            for (size_t i = 0; i < n; ++i) {
+                drawFlame(static_cast<float>(i) * 0.1f, 0.5f);
+            }
+        } },
+        { "drawHook", 1.0, true, [](size_t n) {
+            loadBenchmarkModelView();
+            for (size_t i = 0; i < n; ++i) {
+                drawHook();
+            }
+        } },
+        { "drawLanternFrame", 1.0, true, [](size_t n) {
+            loadBenchmarkModelView();
+            for (size_t i = 0; i < n; ++i) {
+                drawLanternFrame();
+            }
+        } },
+        { "drawLanternCover", 1.0, true, [](size_t n) {
+            loadBenchmarkModelView();
+            for (size_t i = 0; i < n; ++i) {
+                drawLanternCover();
+            }
+        } },
+        { "drawLanternRoof", 1.0, true, [](size_t n) {
+            loadBenchmarkModelView();
+            for (size_t i = 0; i < n; ++i) {
+                drawLanternRoof();
+            }
+        } },
+        { "drawSingleLantern", 1.0, true, [](size_t n) {
+            loadBenchmarkModelView();
+            KomLoyLantern l = {};
+            for (size_t i = 0; i < n; ++i) {
+                l.flamePhase = static_cast<float>(i) * 0.1f;
+                drawSingleLantern(l);
+            }
+        } },
+        { "drawStars", 0.0, true, [](size_t n) {
+            glMatrixMode(GL_MODELVIEW);
+            glLoadIdentity();
+            for (size_t i = 0; i < n; ++i) {
+                drawStars();
+            }
+        } },
+        { "respawnLanterns", lanterns, false, [](size_t n) {
+            for (size_t i = 0; i < n; ++i) {
+                ++simTick;
+                respawnLanterns();
+            }
+        } },
+        { "evaluateLanternInstances", lanterns, false, [](size_t n) {
+            for (size_t i = 0; i < n; ++i) {
+                evaluateLanternInstances(0, lanternPool.count, instances.data());
+            }
+        } },
+    };
+
+    std::vector<MicroBenchmarkResult> results;
+    printf("%-26s %12s %14s %14s %12s %12s\n", "項目", "回数", "時間/回 (ns)", "CPU/回 (ns)", "ns/ランタン", "ns/頂点");
+    for (const MicroBenchmark& bench : benchmarks) {
+        if (!benchFilter.empty() && std::string(bench.name).find(benchFilter) == std::string::npos) {
+            continue;
+        }
+        MicroBenchmarkResult r = runMicroBenchmark(bench);
+        results.push_back(r);
+        printf("%-26s %12zu %14.1f %14.1f", r.name, r.iterations, r.realNs, r.cpuNs);
+        if (r.lanterns > 0.0) {
+            printf(" %12.3f", r.realNs / r.lanterns);
+        }
+        else {
+            printf(" %12s", "-");
+        }
+        if (r.vertices > 0.0) {
+            printf(" %12.3f\n", r.realNs / r.vertices);
+        }
+        else {
+            printf(" %12s\n", "-");
+        }
+    }
+    fflush(stdout);
+    if (!benchJsonPath.empty() && !writeMicroBenchmarkJson(benchJsonPath, results)) {
+        std::cout << "JSONを書き出せません: " << benchJsonPath << std::endl;
+        return 1;
+    }
+    jobSystem.stop();
+    return 0;
+}
+
+// --- 基準画像との比較 (--golden) ---
+// 固定のシードと視点で決まったティックのシーンをウィンドウなし (Mesaのllvmpipeなどのソフトウェア描画) で描き、
+// 保存しておいた基準画像と比べる。画素の差は明るさと色差 (YIQ) の重み付きの距離で測り、しきい値を超える画素が
+// 一定の割合を超えたら失敗とする (描画順やスレッド数による丸めの差は許す)。失敗したシーンは描いた画像と、
+// 違う画素を赤く示した差分の画像を基準画像の隣に書き出す。各シーンの描画時間も測り、正しさと速さを1回の実行で確かめる
+//
+// 基準画像はリポジトリの golden/ にあり (Mesaのllvmpipeでウィンドウなしで描いたもの)、ctest の golden テストが比べる
+//
+//   komloy --golden-update golden/   基準画像を作り直す (描画を意図して変えたとき。変えたことを確かめてからコミットする)
+//   komloy --golden golden/          基準画像と比べる (--bench-json で描画時間を書き出せる)
+const int GOLDEN_WIDTH = 400, GOLDEN_HEIGHT = 300; // 描画の大きさ (ウィンドウと同じ縦横比)
+const uint32_t GOLDEN_SEED = 20231125; // 世界と星のシード
+const float GOLDEN_PIXEL_THRESHOLD = 0.1f; // 画素が違うとみなす距離 (0〜1, YIQの最大の距離に対する割合)
+const double GOLDEN_MAX_DIFF_RATIO = 0.005; // 違う画素がこの割合を超えたら失敗 (コンパクトな形式の量子化による差も許す)
+const int GOLDEN_TIMED_FRAMES = 5; // 描画時間を測るフレーム数 (中央値を使う)
+const double YIQ_MAX_DELTA = 35215.0; // YIQの距離の二乗の最大値 (黒と白の差)
+
+// 基準画像のシーン (ティックは起動からの通し番号で、前のシーンより後にする)
+// resolutionScale が0のシーンはウィンドウに直接描き、0より大きいシーンはその固定の比で動的解像度の描画先に描いて
+// グローを加え、履歴と混ぜて拡大する。履歴は前のフレームに依存するので、動的解像度のシーンは最後に並べる
+struct GoldenScene {
+    const char* name; // 画像のファイル名と描画時間の項目名
+    uint64_t tick; // 描くティック
+    float x, z; // カメラの位置
+    float yaw, pitch; // カメラの向き (度)
+    float resolutionScale; // 動的解像度の比 (0ならウィンドウに直接描く)
+};
+
+const GoldenScene GOLDEN_SCENES[] = {
+    { "golden_launch", 120, 0.0f, 0.0f, 0.0f, 15.0f, 0.0f }, // 地面から上がり始めたランタン
+    { "golden_overhead", 240, 0.0f, 0.0f, 30.0f, 55.0f, 0.0f }, // 見上げた空と星
+    { "golden_horizon", 360, 0.0f, 0.0f, 135.0f, 2.0f, 0.0f }, // 遠くのランタン (インポスター)
+    { "golden_streamed", 480, 40.0f, -60.0f, -30.0f, 10.0f, 0.0f }, // 移動して生成したセクター
+    { "golden_glow", 600, 0.0f, 0.0f, 0.0f, 20.0f, 0.75f }, // 縮小した描画とグロー、履歴との混合と拡大
+};
+
+std::string goldenDirectory; // 基準画像のディレクトリ (--golden, --golden-update)
+bool goldenUpdate = false; // 比べずに基準画像を書き出す (--golden-update)
+
+// RGBの画像を上の行から順にPPM (P6) で書き出す関数
+bool writePpm(const std::string& path, const std::vector<uint8_t>& rgb, int width, int height) {
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+    fprintf(file, "P6\n%d %d\n255\n", width, height);
+    bool ok = fwrite(rgb.data(), 1, rgb.size(), file) == rgb.size();
+    fclose(file);
+    return ok;
+}
+
+// PPM (P6, 最大値255) を読み込む関数
+bool readPpm(const std::string& path, std::vector<uint8_t>& rgb, int& width, int& height) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+    int maxValue = 0;
+    bool ok = fscanf(file, "P6 %d %d %d", &width, &height, &maxValue) == 3 && maxValue == 255 && width > 0 && height > 0
+        && fgetc(file) != EOF; // ヘッダーの後の1文字の空白
+    if (ok) {
+        rgb.resize(static_cast<size_t>(width) * height * 3);
+        ok = fread(rgb.data(), 1, rgb.size(), file) == rgb.size();
+    }
+    fclose(file);
+    return ok;
+}
+
+// 画素の色をYIQに変換する関数 (Y は明るさ、I と Q は色差)
+void rgbToYiq(const uint8_t* p, float& y, float& i, float& q) {
+    float r = p[0], g = p[1], b = p[2];
+    y = r * 0.29889531f + g * 0.58662247f + b * 0.11448223f;
+    i = r * 0.59597799f - g * 0.27417610f - b * 0.32180189f;
+    q = r * 0.21147017f - g * 0.52261711f + b * 0.31114694f;
+}
+
+// 2つの画像の違う画素を数え、差分の画像 (薄くした基準画像に、違う画素を赤で重ねたもの) を作る関数
+size_t compareGoldenImages(const std::vector<uint8_t>& expected, const std::vector<uint8_t>& actual, std::vector<uint8_t>& diff) {
+    const float maxDelta = static_cast<float>(YIQ_MAX_DELTA) * GOLDEN_PIXEL_THRESHOLD * GOLDEN_PIXEL_THRESHOLD;
+    size_t differing = 0;
+    diff.resize(expected.size());
+    for (size_t p = 0; p < expected.size(); p += 3) {
+        float y1, i1, q1, y2, i2, q2;
+        rgbToYiq(&expected[p], y1, i1, q1);
+        rgbToYiq(&actual[p], y2, i2, q2);
+        float dy = y1 - y2, di = i1 - i2, dq = q1 - q2;
+        float delta = 0.5053f * dy * dy + 0.299f * di * di + 0.1957f * dq * dq; // 明るさの差を色差より重く見る
+        if (delta > maxDelta) {
+            ++differing;
+            diff[p] = 255;
+            diff[p + 1] = 0;
+            diff[p + 2] = 0;
+        }
+        else {
+            uint8_t faded = static_cast<uint8_t>(255.0f - (255.0f - y1) * 0.1f);
+            diff[p] = diff[p + 1] = diff[p + 2] = faded;
+        }
+    }
+    return differing;
+}
+
+// 描画先の画像を上の行から順のRGBで読み出す関数
+void readFramePixels(std::vector<uint8_t>& rgb, int width, int height) {
+    std::vector<uint8_t> rows(static_cast<size_t>(width) * height * 3);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, rows.data());
+    rgb.resize(rows.size());
+    size_t stride = static_cast<size_t>(width) * 3;
+    for (int y = 0; y < height; ++y) {
+        memcpy(&rgb[y * stride], &rows[(height - 1 - y) * stride], stride);
+    }
+}
+
+// 基準画像のシーンを描いて比べる (または書き出す) 関数 (--golden, --golden-update)
+int runGoldenTests(const std::string& directory) {
+#ifdef KOMLOY_HAVE_EGL
+    if (!createHeadlessContext(GOLDEN_WIDTH, GOLDEN_HEIGHT)) {
+        std::cout << "ヘッドレスのGLコンテキストを作れません" << std::endl;
+        return 1;
+    }
+#else
+    std::cout << "このビルドはEGLなしでビルドされているため、--golden を実行できません" << std::endl;
+    return 1;
+#endif
+    std::cout << "GL: " << glGetString(GL_RENDERER) << " (" << glGetString(GL_VERSION) << ")" << std::endl;
+    rngSeed = GOLDEN_SEED;
+    synchronousStreaming = true; // セクターの生成をティックに同期させ、毎回同じ世界にする
+    init();
+    reshape(GOLDEN_WIDTH, GOLDEN_HEIGHT);
+    // 動的解像度はGPU時間で比を変えず、シーンごとの固定の比で描く (描画先を作れなかったら全てのシーンを直接描く)
+    const bool dynamicAvailable = dynamicResolution.enabled;
+    dynamicResolution.fixedScale = true;
+    while (!deferredStartupTasks.empty()) {
+        runDeferredStartupTask(); // グローとインポスターも最初のシーンから使う
+    }
+
+    std::vector<MicroBenchmarkResult> timings;
+    std::vector<uint8_t> actual, expected, diff;
+    int failures = 0;
+    printf("%-18s %10s %8s %12s %12s\n", "シーン", "違う画素", "判定", "描画 (ms)", "CPU (ms)");
+    for (const GoldenScene& scene : GOLDEN_SCENES) {
+        cameraX = scene.x;
+        cameraZ = scene.z;
+        cameraRotationY = scene.yaw;
+        cameraAngleX = scene.pitch;
+        dynamicResolution.enabled = dynamicAvailable && scene.resolutionScale > 0.0f;
+        dynamicResolution.scale = scene.resolutionScale;
+        while (simTick < scene.tick) {
+            simulateTick();
+        }
+        finishTickJobs();
+
+        // 最初のフレームは遮蔽物の記録を揃えるために捨て、残りで描画時間を測る
+        renderScene();
+        std::vector<double> realMs, cpuMs;
+        for (int f = 0; f < GOLDEN_TIMED_FRAMES; ++f) {
+            std::clock_t cpuStart = std::clock();
+            auto start = std::chrono::steady_clock::now();
+            renderScene();
+            glFinish();
+            realMs.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+            cpuMs.push_back(1000.0 * (std::clock() - cpuStart) / CLOCKS_PER_SEC);
+        }
+        std::sort(realMs.begin(), realMs.end());
+        std::sort(cpuMs.begin(), cpuMs.end());
+        double frameMs = realMs[GOLDEN_TIMED_FRAMES / 2], frameCpuMs = cpuMs[GOLDEN_TIMED_FRAMES / 2];
+        timings.push_back({ scene.name, static_cast<size_t>(GOLDEN_TIMED_FRAMES), frameMs * 1e6, frameCpuMs * 1e6,
+            static_cast<double>(lanternPool.count), 0.0 });
+        readFramePixels(actual, GOLDEN_WIDTH, GOLDEN_HEIGHT);
+
+        std::string path = directory + "/" + scene.name + ".ppm";
+        if (goldenUpdate) {
+            bool written = writePpm(path, actual, GOLDEN_WIDTH, GOLDEN_HEIGHT);
+            failures += written ? 0 : 1;
+            printf("%-18s %10s %8s %12.2f %12.2f\n", scene.name, "-", written ? "更新" : "書込失敗", frameMs, frameCpuMs);
+            continue;
+        }
+        int width = 0, height = 0;
+        if (!readPpm(path, expected, width, height) || width != GOLDEN_WIDTH || height != GOLDEN_HEIGHT) {
+            ++failures;
+            writePpm(directory + "/" + scene.name + ".actual.ppm", actual, GOLDEN_WIDTH, GOLDEN_HEIGHT);
+            printf("%-18s %10s %8s %12.2f %12.2f\n", scene.name, "-", "基準なし", frameMs, frameCpuMs);
+            continue;
+        }
+        size_t differing = compareGoldenImages(expected, actual, diff);
+        double ratio = static_cast<double>(differing) / (static_cast<double>(GOLDEN_WIDTH) * GOLDEN_HEIGHT);
+        bool passed = ratio <= GOLDEN_MAX_DIFF_RATIO;
+        if (!passed) {
+            ++failures;
+            writePpm(directory + "/" + scene.name + ".actual.ppm", actual, GOLDEN_WIDTH, GOLDEN_HEIGHT);
+            writePpm(directory + "/" + scene.name + ".diff.ppm", diff, GOLDEN_WIDTH, GOLDEN_HEIGHT);
+        }
+        printf("%-18s %9.3f%% %8s %12.2f %12.2f\n", scene.name, ratio * 100.0, passed ? "一致" : "不一致", frameMs, frameCpuMs);
+    }
+    fflush(stdout);
+    if (!benchJsonPath.empty() && !writeMicroBenchmarkJson(benchJsonPath, timings)) {
+        std::cout << "JSONを書き出せません: " << benchJsonPath << std::endl;
+        return 1;
+    }
+    if (failures > 0) {
+        std::cout << (goldenUpdate ? "書き出せなかった基準画像: " : "基準画像と一致しなかったシーン: ") << failures
+            << " (描いた画像と差分は " << directory << " に書き出しました)" << std::endl;
+    }
+    jobSystem.stop();
+    return failures > 0 ? 1 : 0;
+}
+
+// シーンを描画する関数 (バッファの入れ替えは呼び出し元で行う。--golden はウィンドウなしで呼ぶ)
+void renderScene() {
+    syncCamera(); // マウスで向きが変わっていれば行列を作り直す
+    startFrameJobs(); // ティックの完了を待ってBVHとランタンの描画データを作るジョブを起動 (星と地面を描く間に進む)
+    beginSceneFrame(dynamicResolution); // GPU時間に合わせて縮小した描画先に切り替える
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); // カラーバッファとデプスバッファをクリア
-    glLoadIdentity(); // モデルビュー行列をリセット
 
-    // --- 星を描画 (遠方効果のためにカメラ変換前) ---
-    glPushMatrix();
+    // --- 星を描画 (遠方効果のためにカメラの平行移動なし) ---
     // 星にはカメラの回転のみを適用し、平行移動は適用しないことで、無限遠にあるように見せる
-    glRotatef(-cameraAngleX, 1.0f, 0.0f, 0.0f); // ピッチ
-    glRotatef(-cameraRotationY, 0.0f, 1.0f, 0.0f); // ヨー
+    glLoadMatrixf(camera.skyView().m);
     drawStars();
-    glPopMatrix();
 
     // カメラ設定 (常に一人称視点)
-    float eyeHeight = cameraY; // カメラの現在のY位置が視点の高さ
-    float yawRad = cameraRotationY * M_PI / 180.0f;
-    float pitchRad = cameraAngleX * M_PI / 180.0f; // cameraAngleXをピッチとして使用
-
-    float lookDirX = cos(pitchRad) * sin(yawRad);
-    float lookDirY = sin(pitchRad);
-    float lookDirZ = -cos(pitchRad) * cos(yawRad); // OpenGLのフォワードは-Z方向
-
-    gluLookAt(cameraX, eyeHeight, cameraZ, // カメラ位置
-        cameraX + lookDirX, eyeHeight + lookDirY, cameraZ + lookDirZ, // 注視点
-        0.0f, 1.0f, 0.0f);           // アップベクトル
+    glLoadMatrixf(camera.view().m);
 
     // 地面を描画
     drawGround();
 
     // 全てのランタンを描画
-    for (const auto& l : lanterns) {
-        drawSingleLantern(l);
-    }
+    drawLanterns();
 
+    resolveSceneFrame(dynamicResolution); // ウィンドウの解像度に拡大して画面に写す
+}
+
+// ディスプレイコールバック関数
+void display() {
+    renderScene();
+    drawMemoryOverlay(); // 'm' キーで表示するメモリの集計
     glutSwapBuffers(); // フロントバッファとバックバッファをスワップ
+
+    if (!startupTimer.reported) {
+        startupTimer.mark("最初のフレーム");
+        startupTimer.report();
+    }
+    else {
+        runDeferredStartupTask(); // 最初のフレームに必要なかったGPU資源を1つずつ準備する
+    }
+    endMemoryFrame(memoryFrameStats); // このフレーム (と前回からのティック) の確保回数を締める
 }
 
 // リシェイプコールバック関数
 void reshape(int w, int h) {
     glViewport(0, 0, w, h); // 新しいウィンドウサイズにビューポートを設定
+    camera.setPerspective(45.0f, static_cast<float>(w) / static_cast<float>(h > 0 ? h : 1), 0.1f, 500.0f); // パースペクティブ投影を更新
     glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    gluPerspective(45.0, (double)w / (double)h, 0.1, 500.0); // パースペクティブ投影を更新
+    glLoadMatrixf(camera.projection().m);
     glMatrixMode(GL_MODELVIEW);
+    resizeDynamicResolution(dynamicResolution, w, h);
+    resizeLanternGlow(lanternGlow, w, h);
 }
 
 // マウスコールバック関数
@@ -515,134 +6259,1356 @@ void mouse(int button, int state, int x, int y) {
             mouseDragging = true;
             lastMouseX = x;
             lastMouseY = y;
+            mousePressX = x;
+            mousePressY = y;
         }
         else {
             mouseDragging = false;
+            // ドラッグせずにクリックした場合はカーソルの下のランタンを選ぶ
+            if (std::abs(x - mousePressX) + std::abs(y - mousePressY) <= 3) {
+                float distance = 0.0f;
+                finishTickJobs(); // 実行中のティックがランタンを書き換えている間はBVHを合わせない
+                long picked = pickLanternAt(x, y, &distance);
+                if (picked >= 0) {
+                    const Vec3& p = lanternBvh.points[picked];
+                    std::cout << "ランタン " << picked << " を選択 (距離 " << distance << "): 位置 (" << p.x << ", " << p.y << ", " << p.z << ")" << std::endl;
+                }
+            }
         }
     }
 }
 
+// 入力イベントをキューに積む関数 (GLUTのコールバックから呼ぶ)
+// 積めなかった視点の回転は捨てずに持ち越し、次の回転のイベントにまとめる
+void pushInputEvent(InputEventType type, int key, float yaw = 0.0f, float pitch = 0.0f) {
+    if (type == INPUT_LOOK) {
+        yaw += pendingLookYaw;
+        pitch += pendingLookPitch;
+    }
+    InputEvent event = { static_cast<uint8_t>(type), static_cast<uint8_t>(key), yaw, pitch };
+    bool pushed = inputQueue.push(event);
+    if (type == INPUT_LOOK) {
+        pendingLookYaw = pushed ? 0.0f : yaw;
+        pendingLookPitch = pushed ? 0.0f : pitch;
+    }
+}
+
 // マウスモーションコールバック関数
 void motion(int x, int y) {
     if (mouseDragging) {
         float deltaX = (float)(x - lastMouseX); // floatに明示的にキャスト
         float deltaY = (float)(y - lastMouseY); // floatに明示的にキャスト
 
-        cameraRotationY += deltaX * 0.5f; // マウスXでカメラのヨーを回転
-
-        // 上下方向の動きを統一 (マウスを上に動かせば視点も上を向くように)
-        // cameraAngleX はピッチを表す。マウスを上に動かすと deltaY は負になる。
-        // 視点を上に向けるには cameraAngleX の値を増やす必要がある。
-        // よって、deltaY が負の時に cameraAngleX が増えるように、 -= を使う。
-        // これで、マウスを上に動かすと視点も上に動く (Y軸反転なし)
-        cameraAngleX -= deltaY * 0.5f;
-
-        // カメラのピッチを制限して反転を防ぐ
-        if (cameraAngleX > 60.0f) cameraAngleX = 60.0f; // 上限を60度に設定
-        if (cameraAngleX < -89.0f) cameraAngleX = -89.0f; // 下限は-89度のまま
+        // マウスXでカメラのヨーを回転し、上下方向の動きを統一する (マウスを上に動かせば視点も上を向くように)
+        // ピッチはマウスを上に動かすと deltaY が負になるので、符号を反転して渡す (Y軸反転なし)
+        pushInputEvent(INPUT_LOOK, 0, deltaX * 0.5f, -deltaY * 0.5f);
 
         lastMouseX = x;
         lastMouseY = y;
-
-        glutPostRedisplay(); // 再描画を要求
     }
 }
 
 // キーボードキーダウンコールバック関数 (通常キー用)
 void keyboard(unsigned char key, int x, int y) {
-    keyStates[key] = true; // キーが押されたらキーの状態をtrueに設定
+    pushInputEvent(INPUT_KEY_DOWN, key); // キーの状態は次のティックで反映する
+
+    if (key == 'm') {
+        showMemoryOverlay = !showMemoryOverlay; // メモリの集計の表示を切り替え
+    }
 }
 
 // キーボードキーアップコールバック関数 (通常キー用)
 void keyboardUp(unsigned char key, int x, int y) {
-    keyStates[key] = false; // キーが離されたらキーの状態をfalseに設定
+    pushInputEvent(INPUT_KEY_UP, key);
 }
 
 // 特殊キーボードキーダウンコールバック関数 (矢印キー用)
 void specialKeyboard(int key, int x, int y) {
-    specialKeyStates[key] = true; // 特殊キーが押されたら特殊キーの状態をtrueに設定
+    pushInputEvent(INPUT_SPECIAL_DOWN, key);
 }
 
 // 特殊キーボードキーアップコールバック関数 (矢印キー用)
 void specialKeyboardUp(int key, int x, int y) {
-    specialKeyStates[key] = false; // 特殊キーが離されたら特殊キーの状態をfalseに設定
+    pushInputEvent(INPUT_SPECIAL_UP, key);
 }
 
-// アニメーション更新のためのタイマー関数
-void timer(int value) {
+// キューに溜まった入力イベントを起きた順に反映する関数 (ティックの始めに、シミュレーションの側で呼ぶ)
+void consumeInputEvents() {
+    InputEvent event;
+    while (inputQueue.pop(event)) {
+        switch (event.type) {
+        case INPUT_KEY_DOWN:
+            keyStates[event.key] = true;
+            if (event.key == 'k') {
+                saveSnapshot(snapshotSavePath); // ティックの区切りの状態をスナップショットとして保存
+            }
+            break;
+        case INPUT_KEY_UP:
+            keyStates[event.key] = false;
+            break;
+        case INPUT_SPECIAL_DOWN:
+            specialKeyStates[event.key] = true;
+            break;
+        case INPUT_SPECIAL_UP:
+            specialKeyStates[event.key] = false;
+            break;
+        case INPUT_LOOK:
+            cameraRotationY += event.yaw;
+            cameraAngleX += event.pitch;
+            // カメラのピッチを制限して反転を防ぐ
+            if (cameraAngleX > 60.0f) cameraAngleX = 60.0f; // 上限を60度に設定
+            if (cameraAngleX < -89.0f) cameraAngleX = -89.0f; // 下限は-89度のまま
+            break;
+        }
+    }
+}
+
+// 1ティック分のシミュレーションを進める関数 (カメラ移動、セクターのストリーミング、ランタン更新)
+void simulateTick() {
+    finishTickJobs(); // 前のティックを終えてから入力を反映する
+    consumeInputEvents(); // 前のティックから届いた入力をキーの状態とカメラの向きに反映
+    recordTickInput(); // 記録中なら、このティックの入力をジャーナルに書き出す
+
     float moveSpeed = 0.7f; // カメラの移動速度を増加
 
-    // カメラのY軸回転 (向いている方向) に基づいて移動方向を計算
-    float cameraFacingRad = cameraRotationY * M_PI / 180.0; // カメラ自身の回転を移動方向に使用
+    // カメラのY軸回転 (向いている方向) に基づいて移動方向を決める (向きが変わったときだけカメラが求め直す)
+    syncCamera();
+    const Vec3& forward = camera.groundForward();
+    const Vec3& right = camera.groundRight();
 
     float deltaMoveX = 0.0f;
     float deltaMoveZ = 0.0f;
 
     // 前方/後方移動
     if (specialKeyStates[GLUT_KEY_UP]) {
-        deltaMoveX += sin(cameraFacingRad) * moveSpeed;
-        deltaMoveZ -= cos(cameraFacingRad) * moveSpeed;
+        deltaMoveX += forward.x * moveSpeed;
+        deltaMoveZ += forward.z * moveSpeed;
     }
     if (specialKeyStates[GLUT_KEY_DOWN]) {
-        deltaMoveX -= sin(cameraFacingRad) * moveSpeed;
-        deltaMoveZ += cos(cameraFacingRad) * moveSpeed;
+        deltaMoveX -= forward.x * moveSpeed;
+        deltaMoveZ -= forward.z * moveSpeed;
     }
     // 左右への平行移動 (カメラの向きに対して相対的)
     if (specialKeyStates[GLUT_KEY_LEFT]) {
-        // 左への平行移動は向いている方向から反時計回りに90度
-        deltaMoveX -= cos(cameraFacingRad) * moveSpeed;
-        deltaMoveZ -= sin(cameraFacingRad) * moveSpeed;
+        deltaMoveX -= right.x * moveSpeed;
+        deltaMoveZ -= right.z * moveSpeed;
     }
     if (specialKeyStates[GLUT_KEY_RIGHT]) {
-        // 右への平行移動は向いている方向から時計回りに90度
-        deltaMoveX += cos(cameraFacingRad) * moveSpeed;
-        deltaMoveZ += sin(cameraFacingRad) * moveSpeed;
+        deltaMoveX += right.x * moveSpeed;
+        deltaMoveZ += right.z * moveSpeed;
     }
 
     cameraX += deltaMoveX;
     cameraZ += deltaMoveZ;
+    syncCamera();
 
-    // 定義されたカリングボックス (カメラの位置を基準)
-    float cull_min_y = cameraY - 1.0f;
-    float cull_max_y = cameraY + 37.5f;
-    float cull_horizontal_radius = 50.0f;
-
-    // 全てのランタンを更新
-    for (auto& l : lanterns) {
-        l.x += l.velX;
-        l.y += l.velY;
-        l.z += l.velZ;
-        // 各ランタンの炎を個別にアニメーション
-        l.currentFlameAnimation += 0.05f;
-        l.corePulsation = (sin(l.currentFlameAnimation * 1.0f) + 1.0f) * 0.5f;
-
-        // ランタンがカリングボックス外に出たらリセット
-        if (l.y < cull_min_y || l.y > cull_max_y ||
-            std::abs(l.x - cameraX) > cull_horizontal_radius ||
-            std::abs(l.z - cameraZ) > cull_horizontal_radius)
-        {
-            // ランダムな位置に再出現 (カメラの現在位置を基準)
-            l.y = cameraY + getRandomFloat(0.0f, 35.0f);
-            l.x = cameraX + getRandomFloat(-50.0f, 50.0f);
-            l.z = cameraZ + getRandomFloat(-50.0f, 50.0f);
-
-            l.velX = getRandomFloat(-0.005f, 0.005f);
-            l.velY = getRandomFloat(0.01f, 0.03f);
-            l.velZ = getRandomFloat(-0.005f, 0.005f);
+    // カメラが一定距離動いたときだけ、いるセクターをワーカーに知らせる (水平方向の範囲の確認)
+    // 確認の遅れは保持範囲の余裕 (SECTOR_KEEP_RADIUS) に収まる
+    if (std::fabs(cameraX - sectorCheckX) >= SECTOR_RECHECK_DISTANCE || std::fabs(cameraZ - sectorCheckZ) >= SECTOR_RECHECK_DISTANCE) {
+        sectorCheckX = cameraX;
+        sectorCheckZ = cameraZ;
+        if (synchronousStreaming) {
+            sectorStreamer.syncCenter(sectorCoord(cameraX), sectorCoord(cameraZ), simTick);
+        }
+        else {
+            sectorStreamer.requestCenter(sectorCoord(cameraX), sectorCoord(cameraZ), simTick);
         }
     }
+    startTickJobs(); // セクターの反映と再出現はジョブで進め、完了は描画データの準備と次のティックが待つ
+}
+
+// アニメーション更新のためのタイマー関数
+void timer(int value) {
+    simulateTick();
 
     glutPostRedisplay(); // 再描画を要求
     glutTimerFunc(16, timer, 0); // 約60 FPSでタイマーを再呼び出し
 }
 
+// --- CPUのラスタライザ (--cpu-render) ---
+// GPUのないサーバーで、GLを使わずに全コアでシーンを描いて画像に書き出す。画面を64x64ピクセルのタイルに分け、
+// まず地面のチャンク1つ・ランタン64個・星4096個ずつのバッチごとに、頂点の変換・クリッピング・三角形の準備とタイルへの振り分けを並列に行う。
+// 次にタイルごとに全バッチの振り分け分をバッチの順に描く (1つのタイルは1つのスレッドだけが書くので、結果はスレッド数によらない)。
+// 三角形は固定小数点の辺関数を SSE2 で4ピクセルずつ評価し、デプスバッファ (GL_LESS) で隠面を消す。
+// タイルの中は 星 → 不透明な三角形 → 炎 (デプスに書かない加算) の順に描く。
+// ランタンは画面上の大きさで形状を選び (近くは全形状と核、中くらいは8角柱、遠くは視点を向く四角形)、手前から順に並べて奥の三角形をデプスで早く捨てる。
+// 炎はグローを使うときと同じしずく形の四角形で描き、1ピクセルほどのものはその明るさの合計を1ピクセルに足す。
+// グローもGLと同じく、見えている核と炎の光を縦横半分に縮めてガウスぼかしをかけ、最後に画像に加算する (--no-glow で省く)
+//
+//   komloy --cpu-render out/ [--cpu-frames 10] [--cpu-size 1920x1080] [--cpu-lanterns 1000000]
+const int CPU_TILE_SIZE = 64; // タイルの1辺のピクセル数 (4の倍数)
+const int CPU_TILE_PIXELS = CPU_TILE_SIZE * CPU_TILE_SIZE;
+const int CPU_SUBPIXEL_SCALE = 16; // 頂点の位置の固定小数点の1ピクセル (4ビットのサブピクセル)
+const float CPU_GUARD_BAND = 8192.0f; // 画面の外にこのピクセル数まではクリッピングせずに辺関数で切る (辺関数がタイル内で32ビットに収まる範囲)
+const int CPU_MAX_SIZE = 8192; // 描画の大きさの上限 (ガードバンドと合わせて固定小数点の桁に収まる)
+const int32_t CPU_EDGE_LIMIT = 1 << 30; // タイルで評価し始める辺関数の値の範囲 (タイル内の変化はこれより小さい)
+const size_t CPU_LANTERNS_PER_BATCH = 64; // 1つのバッチのランタン数
+const size_t CPU_STARS_PER_BATCH = 4096; // 1つのバッチの星の数
+const float CPU_FULL_DETAIL_PIXELS = 48.0f; // 境界球の投影の半径がこれ以上のランタンは全形状と核で描く
+const float CPU_LOW_DETAIL_PIXELS = 12.0f; // これ以上は8角柱で、これ未満は視点を向く四角形で描く
+const float CPU_FLAME_SPLAT_PIXELS = 1.5f; // 炎の四角形の縦の半分がこれ未満なら、明るさの合計を1ピクセルに足す
+const float CPU_CLEAR_COLOR[3] = { 0.0f, 0.0f, 0.1f }; // 背景色 (initRenderState と同じ)
+const float CPU_STAR_COLOR[3] = { 0.8f, 0.8f, 1.0f }; // 星の色 (drawStars と同じ)
+
+// 変換した頂点 (クリップ座標と色)
+struct CpuVertex {
+    float x, y, z, w; // クリップ座標 (メッシュの共通の変換ではランタンの位置を除いた向きの分)
+    float r, g, b; // 色
+};
+
+// 準備した三角形。辺関数は反時計回りにそろえたサブピクセル単位の E = a * x + b * y + c で、0以上なら内側 (左上規則の分を c に含む)。
+// 奥行きと色は範囲の左下のピクセルからの平面 (値 = v[0] * dx + v[1] * dy + v[2]) で持つ
+struct CpuTriangle {
+    int32_t edgeA[3], edgeB[3]; // 辺関数の x, y の係数
+    int64_t edgeC[3]; // 辺関数の定数項
+    int32_t x0, y0, x1, y1; // 中心が三角形に入りうるピクセルの範囲 [x0, x1) × [y0, y1)
+    float depth[3], red[3], green[3], blue[3]; // 奥行き (0〜1) と色の平面
+    float emissive; // 炎の核なら1 (見えている部分がグローの光源になる)
+};
+
+// 炎の四角形 (視点を向くので、画面上の中心と半分の大きさで持つ)
+struct CpuFlame {
+    float x, y; // 中心 (ピクセル)
+    float halfX, halfY; // 半分の大きさ (ピクセル)
+    float depth; // 奥行き (0〜1)
+    float green; // 基点の色の緑成分 (赤は1、青は0.1。核の脈動で明るくなる)
+    int32_t x0, y0, x1, y1; // 覆うピクセルの範囲 (1ピクセルにまとめる場合はその1ピクセル)
+};
+
+// 星 (2x2ピクセルの点の左下のピクセル)
+struct CpuStar {
+    int32_t x, y;
+};
+
+// タイルごとに振り分けた要素の番号 (items[start[t]] から items[start[t + 1]] の前までがタイル t の分)
+struct CpuBins {
+    TrackedVector<uint32_t, MEMORY_RENDER> start;
+    TrackedVector<uint32_t, MEMORY_RENDER> items;
+};
+
+enum CpuBatchKind { CPU_BATCH_GROUND, CPU_BATCH_LANTERNS, CPU_BATCH_STARS };
+
+// 並列に準備する単位 (フレームをまたいで使い回し、作業領域の確保を毎フレーム繰り返さない)
+struct CpuBatch {
+    CpuBatchKind kind = CPU_BATCH_GROUND;
+    size_t first = 0, count = 0; // 地面のチャンクの番号、またはランタン・星の範囲
+    TrackedVector<CpuTriangle, MEMORY_RENDER> triangles; // 不透明な三角形
+    TrackedVector<CpuFlame, MEMORY_RENDER> flames; // 炎
+    TrackedVector<CpuStar, MEMORY_RENDER> stars; // 星
+    CpuBins triangleBins, flameBins, starBins;
+    TrackedVector<CpuVertex, MEMORY_RENDER> vertices; // 地面のチャンクの変換した頂点
+};
+
+struct CpuRenderer {
+    int width = 0, height = 0; // 描画の大きさ
+    int tilesX = 0, tilesY = 0; // タイルの数
+    Mat4 view, projection, viewProjection, skyViewProjection; // このフレームの行列
+    float guardX = 1.0f, guardY = 1.0f; // ガードバンドの端 (正規化デバイス座標)
+    float time = 0.0f; // 炎の時刻
+    float flameMeanAlpha = 0.0f, flameMeanAlphaTip = 0.0f; // 炎の四角形の不透明度 (a^2) と、それに先端への割合を掛けたものの平均
+    MeshVertices bodyMesh, coreMesh, lowMesh; // 全形状の本体、核、8角柱の本体 (三角形リスト)
+    TrackedVector<CpuVertex, MEMORY_RENDER> bodyDirections, lowDirections; // 本体のメッシュの頂点をビュー投影行列で向きとして変換したもの
+    TrackedVector<LanternInstance, MEMORY_RENDER> instances; // 見えるランタン (手前から順)
+    size_t instanceCount = 0;
+    TrackedVector<CpuBatch, MEMORY_RENDER> batches; // バッチ (batchCount 個まで使う)
+    size_t batchCount = 0;
+    std::vector<uint8_t> image; // 描いた画像 (RGB、上の行から)
+    bool glow = false; // グローを加えるか
+    int glowWidth = 0, glowHeight = 0; // グローのバッファの大きさ (縦横 GLOW_RESOLUTION_DIVISOR 分の1)
+    TrackedVector<float, MEMORY_RENDER> glowLight, glowScratch; // 縮小した光 (RGB、下の行から) と、横にぼかした途中の結果
+};
+
+CpuRenderer cpuRenderer; // CPUのラスタライザの状態
+std::string cpuRenderDirectory; // 画像を書き出すディレクトリ (--cpu-render)
+int cpuRenderFrames = 1; // 描くフレーム数 (--cpu-frames)
+int cpuRenderWidth = 1920, cpuRenderHeight = 1080; // 描画の大きさ (--cpu-size)
+size_t cpuRenderLanterns = 0; // 0以外なら、この個数のランタンを並べたベンチマーク用の世界を描く (--cpu-lanterns)
+
+// タイルの色とデプス (SoA。行の途中から4ピクセル単位で読み書きしても、次の行か末尾の余白に収まる)
+struct CpuTile {
+    int x0, y0, width, height; // 画面上の範囲
+    alignas(16) float depth[CPU_TILE_PIXELS + 4];
+    alignas(16) float red[CPU_TILE_PIXELS + 4];
+    alignas(16) float green[CPU_TILE_PIXELS + 4];
+    alignas(16) float blue[CPU_TILE_PIXELS + 4];
+    alignas(16) float emissive[CPU_TILE_PIXELS + 4]; // 見えている面が炎の核なら1
+    float light[CPU_TILE_PIXELS * 3]; // グローの光源 (見えている核の色と炎の加算。RGB)
+};
+
+// 遠くのランタンの本体を8角柱と屋根で近似したメッシュを作る関数 (全形状の紙のカバーと屋根と同じ大きさ)
+void buildLanternLowDetailMesh(MeshVertices& mesh) {
+    const float paperColor[4] = { 1.0f, 0.9f, 0.7f, 1.0f };
+    addMeshCylinder(mesh, 0.34f, 0.33f, -0.6f, 0.6f, 8, paperColor);
+    addMeshDisc(mesh, 0.35f, 0.6f + 0.02f, 8, paperColor);
+}
+
+// 行列で (x, y, z, w) を変換する関数
+CpuVertex transformCpuVertex(const Mat4& matrix, float x, float y, float z, float w) {
+    const float* m = matrix.m;
+    return { m[0] * x + m[4] * y + m[8] * z + m[12] * w, m[1] * x + m[5] * y + m[9] * z + m[13] * w,
+        m[2] * x + m[6] * y + m[10] * z + m[14] * w, m[3] * x + m[7] * y + m[11] * z + m[15] * w, 0.0f, 0.0f, 0.0f };
+}
+
+// メッシュの頂点を向き (w = 0) として変換し、色を付けておく関数 (ランタンの位置の変換を足せばクリップ座標になる)
+void transformCpuMeshDirections(const MeshVertices& mesh, const Mat4& matrix, TrackedVector<CpuVertex, MEMORY_RENDER>& out) {
+    out.resize(mesh.size());
+    for (size_t i = 0; i < mesh.size(); ++i) {
+        const MeshVertex& v = mesh[i];
+        out[i] = transformCpuVertex(matrix, v.x, v.y, v.z, 0.0f);
+        out[i].r = v.r / 255.0f;
+        out[i].g = v.g / 255.0f;
+        out[i].b = v.b / 255.0f;
+    }
+}
+
+// CPUのラスタライザの形状と炎の平均値を準備する関数
+void initCpuRenderer(CpuRenderer& cr, int width, int height) {
+    cr.width = width;
+    cr.height = height;
+    cr.tilesX = (width + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE;
+    cr.tilesY = (height + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE;
+    cr.guardX = 1.0f + 2.0f * CPU_GUARD_BAND / width;
+    cr.guardY = 1.0f + 2.0f * CPU_GUARD_BAND / height;
+    cr.image.resize(static_cast<size_t>(width) * height * 3);
+    cr.glow = !disableGlow;
+    cr.glowWidth = std::max(1, width / GLOW_RESOLUTION_DIVISOR);
+    cr.glowHeight = std::max(1, height / GLOW_RESOLUTION_DIVISOR);
+    if (cr.glow) {
+        cr.glowLight.assign(static_cast<size_t>(cr.glowWidth) * cr.glowHeight * 3, 0.0f);
+        cr.glowScratch.assign(cr.glowLight.size(), 0.0f);
+    }
+    buildLanternBodyMesh(cr.bodyMesh);
+    buildLanternCoreMesh(cr.coreMesh);
+    buildLanternLowDetailMesh(cr.lowMesh);
+    cr.instances.resize(lanternPool.capacity);
+    instanceRing.regionCapacity = lanternPool.capacity; // 見えるランタンの書き込み先の大きさ (GLのバッファは作らない)
+
+    // 炎の四角形の a^2 と a^2 * t (t は基点0 → 先端1) の平均を数値的に求めておく (LANTERN_FRAGMENT_SHADER と同じ形)
+    const int samples = 256;
+    double alpha = 0.0, alphaTip = 0.0;
+    for (int j = 0; j < samples; ++j) {
+        float qy = (j + 0.5f) / samples * 2.0f - 1.0f;
+        float t = qy * 0.5f + 0.5f;
+        float flameWidth = 1.0f + (0.15f - 1.0f) * t * t;
+        for (int i = 0; i < samples; ++i) {
+            float qx = (i + 0.5f) / samples * 2.0f - 1.0f;
+            float a = std::max(1.0f - std::sqrt(qx * qx / (flameWidth * flameWidth) + qy * qy), 0.0f);
+            alpha += a * a;
+            alphaTip += a * a * t;
+        }
+    }
+    cr.flameMeanAlpha = static_cast<float>(alpha / (samples * samples));
+    cr.flameMeanAlphaTip = static_cast<float>(alphaTip / (samples * samples));
+}
+
+// クリップ座標の三角形を画面の三角形として準備してバッチに加える関数 (頂点は全て手前の面より奥でガードバンドの内側にあること)
+void setupCpuTriangle(const CpuRenderer& cr, CpuBatch& batch, const CpuVertex& v0, const CpuVertex& v1, const CpuVertex& v2, float emissive) {
+    const CpuVertex* v[3] = { &v0, &v1, &v2 };
+    int32_t px[3], py[3];
+    float depth[3];
+    for (int k = 0; k < 3; ++k) {
+        float inv = 1.0f / v[k]->w;
+        px[k] = static_cast<int32_t>(lrintf((v[k]->x * inv * 0.5f + 0.5f) * cr.width * CPU_SUBPIXEL_SCALE));
+        py[k] = static_cast<int32_t>(lrintf((v[k]->y * inv * 0.5f + 0.5f) * cr.height * CPU_SUBPIXEL_SCALE));
+        depth[k] = v[k]->z * inv * 0.5f + 0.5f;
+    }
+    int64_t area = static_cast<int64_t>(px[1] - px[0]) * (py[2] - py[0]) - static_cast<int64_t>(px[2] - px[0]) * (py[1] - py[0]);
+    if (area == 0) {
+        return;
+    }
+    int order[3] = { 0, 1, 2 };
+    if (area < 0) {
+        std::swap(order[1], order[2]); // 裏向きも描くので、反時計回りに並べ替える
+    }
+
+    // 中心 (i * 16 + 8) が頂点の範囲に入るピクセル
+    const int half = CPU_SUBPIXEL_SCALE / 2;
+    int32_t minX = std::min({ px[0], px[1], px[2] }), maxX = std::max({ px[0], px[1], px[2] });
+    int32_t minY = std::min({ py[0], py[1], py[2] }), maxY = std::max({ py[0], py[1], py[2] });
+    CpuTriangle t;
+    t.x0 = std::max(0, (minX - half + CPU_SUBPIXEL_SCALE - 1) >> 4);
+    t.x1 = std::min(cr.width, ((maxX - half) >> 4) + 1);
+    t.y0 = std::max(0, (minY - half + CPU_SUBPIXEL_SCALE - 1) >> 4);
+    t.y1 = std::min(cr.height, ((maxY - half) >> 4) + 1);
+    if (t.x0 >= t.x1 || t.y0 >= t.y1) {
+        return;
+    }
+    for (int e = 0; e < 3; ++e) {
+        int p = order[e], q = order[(e + 1) % 3];
+        t.edgeA[e] = py[p] - py[q];
+        t.edgeB[e] = px[q] - px[p];
+        t.edgeC[e] = static_cast<int64_t>(px[p]) * py[q] - static_cast<int64_t>(py[p]) * px[q];
+        bool topLeft = t.edgeA[e] > 0 || (t.edgeA[e] == 0 && t.edgeB[e] < 0); // 左の辺と上の辺の上のピクセルだけを含める
+        if (!topLeft) {
+            t.edgeC[e] -= 1;
+        }
+    }
+
+    // 丸めた位置から、範囲の左下のピクセルの中心を原点とする平面を求める
+    double sx[3], sy[3];
+    for (int k = 0; k < 3; ++k) {
+        sx[k] = static_cast<double>(px[k]) / CPU_SUBPIXEL_SCALE - (t.x0 + 0.5);
+        sy[k] = static_cast<double>(py[k]) / CPU_SUBPIXEL_SCALE - (t.y0 + 0.5);
+    }
+    double dx1 = sx[1] - sx[0], dy1 = sy[1] - sy[0], dx2 = sx[2] - sx[0], dy2 = sy[2] - sy[0];
+    double inv = 1.0 / (dx1 * dy2 - dx2 * dy1);
+    auto plane = [&](float a0, float a1, float a2, float out[3]) {
+        double d1 = a1 - a0, d2 = a2 - a0;
+        double gx = (d1 * dy2 - d2 * dy1) * inv, gy = (d2 * dx1 - d1 * dx2) * inv;
+        out[0] = static_cast<float>(gx);
+        out[1] = static_cast<float>(gy);
+        out[2] = static_cast<float>(a0 - gx * sx[0] - gy * sy[0]);
+    };
+    plane(depth[0], depth[1], depth[2], t.depth);
+    plane(v0.r, v1.r, v2.r, t.red);
+    plane(v0.g, v1.g, v2.g, t.green);
+    plane(v0.b, v1.b, v2.b, t.blue);
+    t.emissive = emissive;
+    batch.triangles.push_back(t);
+}
+
+// クリップ座標の平面 (手前, 奥, ガードバンドの左右下上) に対する頂点の距離 (0以上なら内側)
+float cpuClipDistance(const CpuRenderer& cr, const CpuVertex& v, int plane) {
+    switch (plane) {
+    case 0: return v.z + v.w;
+    case 1: return v.w - v.z;
+    case 2: return v.x + cr.guardX * v.w;
+    case 3: return cr.guardX * v.w - v.x;
+    case 4: return v.y + cr.guardY * v.w;
+    default: return cr.guardY * v.w - v.y;
+    }
+}
+
+// 視錐台の外側にある平面のビット (0〜3: 左右下上, 4, 5: 手前と奥) と、ガードバンドの外側なら6のビットを返す関数
+int cpuOutcode(const CpuRenderer& cr, const CpuVertex& v) {
+    int code = 0;
+    code |= (v.x < -v.w) ? 1 : 0;
+    code |= (v.x > v.w) ? 2 : 0;
+    code |= (v.y < -v.w) ? 4 : 0;
+    code |= (v.y > v.w) ? 8 : 0;
+    code |= (v.z < -v.w) ? 16 : 0;
+    code |= (v.z > v.w) ? 32 : 0;
+    if (v.x < -cr.guardX * v.w || v.x > cr.guardX * v.w || v.y < -cr.guardY * v.w || v.y > cr.guardY * v.w) {
+        code |= 64;
+    }
+    return code;
+}
+
+// クリップ座標の三角形を視錐台で捨てるか、手前・奥の面とガードバンドで切ってから準備する関数
+void emitCpuTriangle(const CpuRenderer& cr, CpuBatch& batch, const CpuVertex& v0, const CpuVertex& v1, const CpuVertex& v2, float emissive = 0.0f) {
+    int c0 = cpuOutcode(cr, v0), c1 = cpuOutcode(cr, v1), c2 = cpuOutcode(cr, v2);
+    if (c0 & c1 & c2 & 63) {
+        return; // 全ての頂点が同じ面の外側
+    }
+    if (((c0 | c1 | c2) & (16 | 32 | 64)) == 0) {
+        setupCpuTriangle(cr, batch, v0, v1, v2, emissive);
+        return;
+    }
+    // 手前・奥の面とガードバンドの6平面で多角形を順に切り (Sutherland-Hodgman)、扇形の三角形に分ける
+    CpuVertex polygon[2][9];
+    int count = 3;
+    polygon[0][0] = v0;
+    polygon[0][1] = v1;
+    polygon[0][2] = v2;
+    int current = 0;
+    for (int plane = 0; plane < 6 && count > 0; ++plane) {
+        const CpuVertex* in = polygon[current];
+        CpuVertex* out = polygon[1 - current];
+        int outCount = 0;
+        for (int i = 0; i < count; ++i) {
+            const CpuVertex& a = in[i];
+            const CpuVertex& b = in[(i + 1) % count];
+            float da = cpuClipDistance(cr, a, plane), db = cpuClipDistance(cr, b, plane);
+            if (da >= 0.0f) {
+                out[outCount++] = a;
+            }
+            if ((da >= 0.0f) != (db >= 0.0f)) {
+                float s = da / (da - db);
+                out[outCount++] = { a.x + (b.x - a.x) * s, a.y + (b.y - a.y) * s, a.z + (b.z - a.z) * s, a.w + (b.w - a.w) * s,
+                    a.r + (b.r - a.r) * s, a.g + (b.g - a.g) * s, a.b + (b.b - a.b) * s };
+            }
+        }
+        count = outCount;
+        current = 1 - current;
+    }
+    for (int i = 1; i + 1 < count; ++i) {
+        setupCpuTriangle(cr, batch, polygon[current][0], polygon[current][i], polygon[current][i + 1], emissive);
+    }
+}
+
+// 地面のチャンクを変換して三角形をバッチに加える関数 (drawGround と同じ、視点座標系で真上からの光のライティング)
+void emitCpuGroundChunk(const CpuRenderer& cr, CpuBatch& batch, const GroundChunk& chunk) {
+    float diffuse = std::max(cr.view.m[5], 0.0f);
+    const float light[3] = { 0.3f + 0.3f * diffuse, 0.3f + 0.3f * diffuse, 0.35f + 0.4f * diffuse };
+    float ox = chunk.cx * GROUND_CHUNK_SIZE, oz = chunk.cz * GROUND_CHUNK_SIZE;
+    batch.vertices.resize(chunk.vertices.size());
+    for (size_t i = 0; i < chunk.vertices.size(); ++i) {
+        const GroundVertex& g = chunk.vertices[i];
+        CpuVertex& v = batch.vertices[i];
+        v = transformCpuVertex(cr.viewProjection, ox + g.x, GROUND_Y + g.y, oz + g.z, 1.0f);
+        v.r = std::min(g.r / 255.0f * light[0], 1.0f);
+        v.g = std::min(g.g / 255.0f * light[1], 1.0f);
+        v.b = std::min(g.b / 255.0f * light[2], 1.0f);
+    }
+    for (size_t i = 0; i + 2 < groundIndices.size(); i += 3) {
+        emitCpuTriangle(cr, batch, batch.vertices[groundIndices[i]], batch.vertices[groundIndices[i + 1]], batch.vertices[groundIndices[i + 2]]);
+    }
+}
+
+// 向きとして変換したメッシュをランタンの位置 (クリップ座標) に置いて三角形をバッチに加える関数
+void emitCpuLanternMesh(const CpuRenderer& cr, CpuBatch& batch, const TrackedVector<CpuVertex, MEMORY_RENDER>& directions, const CpuVertex& base) {
+    for (size_t i = 0; i + 2 < directions.size(); i += 3) {
+        CpuVertex v[3];
+        for (int k = 0; k < 3; ++k) {
+            const CpuVertex& d = directions[i + k];
+            v[k] = { base.x + d.x, base.y + d.y, base.z + d.z, base.w + d.w, d.r, d.g, d.b };
+        }
+        emitCpuTriangle(cr, batch, v[0], v[1], v[2]);
+    }
+}
+
+// 炎の核を脈動の大きさで変換し、LANTERN_VERTEX_SHADER と同じ発光 + 真上からの光で色を付けて加える関数
+void emitCpuLanternCore(const CpuRenderer& cr, CpuBatch& batch, const CpuVertex& base, float pulse) {
+    float s = 0.1f + pulse * 0.05f;
+    const float scale[3] = { s, s * 1.5f, s };
+    const float core[3] = { 1.0f, 0.4f + pulse * 0.6f, 0.1f };
+    const float emission[3] = { core[0], core[1] * 0.7f, core[2] * 0.5f };
+    const float* m = cr.view.m;
+    CpuVertex v[3];
+    for (size_t i = 0; i < cr.coreMesh.size(); ++i) {
+        const MeshVertex& mv = cr.coreMesh[i];
+        CpuVertex& out = v[i % 3];
+        out = transformCpuVertex(cr.viewProjection, mv.x * scale[0], mv.y * scale[1] - 0.65f, mv.z * scale[2], 0.0f);
+        out.x += base.x;
+        out.y += base.y;
+        out.z += base.z;
+        out.w += base.w;
+        float nx = mv.nx / scale[0], ny = mv.ny / scale[1], nz = mv.nz / scale[2];
+        float ex = m[0] * nx + m[4] * ny + m[8] * nz, ey = m[1] * nx + m[5] * ny + m[9] * nz, ez = m[2] * nx + m[6] * ny + m[10] * nz;
+        float diffuse = std::max(ey / std::sqrt(ex * ex + ey * ey + ez * ez), 0.0f);
+        out.r = std::min(emission[0] + core[0] * (0.3f + 0.3f * diffuse), 1.0f);
+        out.g = std::min(emission[1] + core[1] * (0.3f + 0.3f * diffuse), 1.0f);
+        out.b = std::min(emission[2] + core[2] * (0.35f + 0.4f * diffuse), 1.0f);
+        if (i % 3 == 2) {
+            emitCpuTriangle(cr, batch, v[0], v[1], v[2], 1.0f);
+        }
+    }
+}
+
+// ランタン1個を画面上の大きさに合った形状と炎の四角形でバッチに加える関数
+void emitCpuLantern(const CpuRenderer& cr, CpuBatch& batch, const LanternInstance& l) {
+    const float* v = cr.view.m;
+    const float* p = cr.projection.m;
+    float ex = v[0] * l.x + v[4] * l.y + v[8] * l.z + v[12];
+    float ey = v[1] * l.x + v[5] * l.y + v[9] * l.z + v[13];
+    float ez = v[2] * l.x + v[6] * l.y + v[10] * l.z + v[14];
+    float distance = -ez;
+    float nearZ = p[14] / (p[10] - 1.0f), farZ = p[14] / (p[10] + 1.0f); // 投影行列から手前と奥の面の距離を戻す
+    if (distance + LANTERN_BOUNDING_RADIUS <= nearZ || distance - LANTERN_BOUNDING_RADIUS >= farZ) {
+        return;
+    }
+    float pulse = flameCorePulsation(l.phase, cr.time);
+    float pixels = distance > LANTERN_BOUNDING_RADIUS ? LANTERN_BOUNDING_RADIUS * p[5] * 0.5f * cr.height / distance : FLT_MAX;
+    CpuVertex base = transformCpuVertex(cr.viewProjection, l.x, l.y, l.z, 1.0f);
+    if (distance < IMPOSTOR_DISTANCE) {
+        emitCpuLanternCore(cr, batch, base, pulse); // GLと同じく、インポスターにしない距離のランタンだけ核を描く (グローの光源にもなる)
+    }
+    if (pixels >= CPU_FULL_DETAIL_PIXELS) {
+        emitCpuLanternMesh(cr, batch, cr.bodyDirections, base);
+    }
+    else if (pixels >= CPU_LOW_DETAIL_PIXELS) {
+        emitCpuLanternMesh(cr, batch, cr.lowDirections, base);
+    }
+    else {
+        // 本体の横から見た輪郭の四角形を、中の炎の四角形より半径の分だけ手前に置く
+        const float paper[3] = { 1.0f, 0.9f, 0.7f };
+        float z = ez + 0.34f;
+        CpuVertex corners[4] = {
+            transformCpuVertex(cr.projection, ex - 0.34f, ey - 0.6f, z, 1.0f),
+            transformCpuVertex(cr.projection, ex + 0.34f, ey - 0.6f, z, 1.0f),
+            transformCpuVertex(cr.projection, ex + 0.34f, ey + 0.62f, z, 1.0f),
+            transformCpuVertex(cr.projection, ex - 0.34f, ey + 0.62f, z, 1.0f),
+        };
+        for (CpuVertex& c : corners) {
+            c.r = paper[0];
+            c.g = paper[1];
+            c.b = paper[2];
+        }
+        emitCpuTriangle(cr, batch, corners[0], corners[1], corners[2]);
+        emitCpuTriangle(cr, batch, corners[0], corners[2], corners[3]);
+    }
+
+    // 炎の四角形 (LANTERN_VERTEX_SHADER の part 3 と同じ、中心を視点座標系に移して画面に平行に広げる)
+    float fx = ex - 0.35f * v[4], fy = ey - 0.35f * v[5], fz = ez - 0.35f * v[6];
+    CpuVertex center = transformCpuVertex(cr.projection, fx, fy, fz, 1.0f);
+    if (-fz <= nearZ || center.z > center.w) {
+        return;
+    }
+    float inv = 1.0f / center.w;
+    CpuFlame f;
+    f.x = (center.x * inv * 0.5f + 0.5f) * cr.width;
+    f.y = (center.y * inv * 0.5f + 0.5f) * cr.height;
+    f.halfX = 0.22f * p[0] * inv * 0.5f * cr.width;
+    f.halfY = 0.4f * p[5] * inv * 0.5f * cr.height;
+    f.depth = center.z * inv * 0.5f + 0.5f;
+    f.green = 0.4f + pulse * 0.3f;
+    if (f.halfY < CPU_FLAME_SPLAT_PIXELS) {
+        f.x0 = static_cast<int32_t>(std::floor(f.x));
+        f.y0 = static_cast<int32_t>(std::floor(f.y));
+        f.x1 = f.x0 + 1;
+        f.y1 = f.y0 + 1;
+    }
+    else {
+        f.x0 = static_cast<int32_t>(std::max(std::ceil(f.x - f.halfX - 0.5f), 0.0f));
+        f.y0 = static_cast<int32_t>(std::max(std::ceil(f.y - f.halfY - 0.5f), 0.0f));
+        f.x1 = static_cast<int32_t>(std::min(std::floor(f.x + f.halfX - 0.5f) + 1.0f, static_cast<float>(cr.width)));
+        f.y1 = static_cast<int32_t>(std::min(std::floor(f.y + f.halfY - 0.5f) + 1.0f, static_cast<float>(cr.height)));
+    }
+    if (f.x0 < 0 || f.y0 < 0 || f.x0 >= f.x1 || f.y0 >= f.y1 || f.x1 > cr.width || f.y1 > cr.height) {
+        return;
+    }
+    batch.flames.push_back(f);
+}
+
+// 星を回転だけのビュー行列で無限遠に投影し、画面内のものをバッチに加える関数
+void emitCpuStars(const CpuRenderer& cr, CpuBatch& batch) {
+    for (size_t i = batch.first; i < batch.first + batch.count; ++i) {
+        const Star& s = stars[i];
+        CpuVertex c = transformCpuVertex(cr.skyViewProjection, s.x, s.y, s.z, 0.0f);
+        if (c.w <= 0.0f || std::fabs(c.x) > c.w || std::fabs(c.y) > c.w) {
+            continue;
+        }
+        // 大きさ2の点は、中心から縦横1ピクセル以内に中心のあるピクセルを塗る
+        float x = (c.x / c.w * 0.5f + 0.5f) * cr.width, y = (c.y / c.w * 0.5f + 0.5f) * cr.height;
+        batch.stars.push_back({ static_cast<int32_t>(std::ceil(x - 1.5f)), static_cast<int32_t>(std::ceil(y - 1.5f)) });
+    }
+}
+
+// 要素を覆うタイルに振り分ける関数 (rect(i, x0, y0, x1, y1) は i 番目の要素が覆いうるピクセルの範囲 [x0, x1) × [y0, y1) を返す)
+template <typename Rect>
+void binCpuPrimitives(const CpuRenderer& cr, CpuBins& bins, size_t count, const Rect& rect) {
+    bins.items.clear();
+    if (count == 0) {
+        return;
+    }
+    size_t tiles = static_cast<size_t>(cr.tilesX) * cr.tilesY;
+    bins.start.assign(tiles + 1, 0);
+    auto visit = [&](auto&& fn) {
+        for (size_t i = 0; i < count; ++i) {
+            int x0, y0, x1, y1;
+            rect(i, x0, y0, x1, y1);
+            x0 = std::max(x0, 0);
+            y0 = std::max(y0, 0);
+            x1 = std::min(x1, cr.width);
+            y1 = std::min(y1, cr.height);
+            if (x0 >= x1 || y0 >= y1) {
+                continue;
+            }
+            for (int ty = y0 / CPU_TILE_SIZE; ty <= (y1 - 1) / CPU_TILE_SIZE; ++ty) {
+                for (int tx = x0 / CPU_TILE_SIZE; tx <= (x1 - 1) / CPU_TILE_SIZE; ++tx) {
+                    fn(static_cast<size_t>(ty) * cr.tilesX + tx, static_cast<uint32_t>(i));
+                }
+            }
+        }
+    };
+    // タイルごとの数を数えて先頭の位置にし、詰めながら進めた位置を1つずらして戻す
+    visit([&](size_t tile, uint32_t) { ++bins.start[tile + 1]; });
+    for (size_t t = 0; t < tiles; ++t) {
+        bins.start[t + 1] += bins.start[t];
+    }
+    bins.items.resize(bins.start[tiles]);
+    visit([&](size_t tile, uint32_t i) { bins.items[bins.start[tile]++] = i; });
+    for (size_t t = tiles; t > 0; --t) {
+        bins.start[t] = bins.start[t - 1];
+    }
+    bins.start[0] = 0;
+}
+
+// バッチの三角形・炎・星を作ってタイルに振り分ける関数 (バッチごとに並列に呼び出せる)
+void buildCpuBatch(const CpuRenderer& cr, CpuBatch& batch) {
+    batch.triangles.clear();
+    batch.flames.clear();
+    batch.stars.clear();
+    switch (batch.kind) {
+    case CPU_BATCH_GROUND:
+        emitCpuGroundChunk(cr, batch, groundChunks[batch.first]);
+        break;
+    case CPU_BATCH_LANTERNS:
+        for (size_t i = batch.first; i < batch.first + batch.count; ++i) {
+            emitCpuLantern(cr, batch, cr.instances[i]);
+        }
+        break;
+    case CPU_BATCH_STARS:
+        emitCpuStars(cr, batch);
+        break;
+    }
+    binCpuPrimitives(cr, batch.triangleBins, batch.triangles.size(), [&](size_t i, int& x0, int& y0, int& x1, int& y1) {
+        const CpuTriangle& t = batch.triangles[i];
+        x0 = t.x0; y0 = t.y0; x1 = t.x1; y1 = t.y1;
+    });
+    binCpuPrimitives(cr, batch.flameBins, batch.flames.size(), [&](size_t i, int& x0, int& y0, int& x1, int& y1) {
+        const CpuFlame& f = batch.flames[i];
+        x0 = f.x0; y0 = f.y0; x1 = f.x1; y1 = f.y1;
+    });
+    binCpuPrimitives(cr, batch.starBins, batch.stars.size(), [&](size_t i, int& x0, int& y0, int& x1, int& y1) {
+        const CpuStar& s = batch.stars[i];
+        x0 = s.x; y0 = s.y; x1 = s.x + 2; y1 = s.y + 2;
+    });
+}
+
+// 三角形のタイル内の部分を塗る関数 (辺関数を行ごと・4ピクセルごとに足し進め、内側で手前のピクセルだけ奥行きと色を書く)
+void rasterizeCpuTriangle(CpuTile& tile, const CpuTriangle& t) {
+    int x0 = std::max(t.x0, tile.x0), x1 = std::min(t.x1, tile.x0 + tile.width);
+    int y0 = std::max(t.y0, tile.y0), y1 = std::min(t.y1, tile.y0 + tile.height);
+    if (x0 >= x1 || y0 >= y1) {
+        return;
+    }
+    // 行の始めをタイル内で4の倍数にそろえる (三角形の範囲の左の余分なピクセルは辺関数で外側になる)
+    x0 = tile.x0 + ((x0 - tile.x0) & ~3);
+
+    // 始めのピクセルの中心での辺関数。タイル内の変化より大きい値は常に内側として固定し、小さい値は常に外側なので描かない
+    const int half = CPU_SUBPIXEL_SCALE / 2;
+    int32_t edge[3], stepX[3], stepY[3];
+    for (int e = 0; e < 3; ++e) {
+        int64_t value = static_cast<int64_t>(t.edgeA[e]) * (static_cast<int64_t>(x0) * CPU_SUBPIXEL_SCALE + half)
+            + static_cast<int64_t>(t.edgeB[e]) * (static_cast<int64_t>(y0) * CPU_SUBPIXEL_SCALE + half) + t.edgeC[e];
+        stepX[e] = t.edgeA[e] * CPU_SUBPIXEL_SCALE;
+        stepY[e] = t.edgeB[e] * CPU_SUBPIXEL_SCALE;
+        if (value >= CPU_EDGE_LIMIT) {
+            value = CPU_EDGE_LIMIT;
+            stepX[e] = stepY[e] = 0;
+        }
+        else if (value < -CPU_EDGE_LIMIT) {
+            return;
+        }
+        edge[e] = static_cast<int32_t>(value);
+    }
+    float dx = static_cast<float>(x0 - t.x0), dy = static_cast<float>(y0 - t.y0);
+    float depthRow = t.depth[0] * dx + t.depth[1] * dy + t.depth[2];
+    float redRow = t.red[0] * dx + t.red[1] * dy + t.red[2];
+    float greenRow = t.green[0] * dx + t.green[1] * dy + t.green[2];
+    float blueRow = t.blue[0] * dx + t.blue[1] * dy + t.blue[2];
+#ifdef USE_SSE2
+    __m128i rowEdge[3], groupStep[3];
+    for (int e = 0; e < 3; ++e) {
+        rowEdge[e] = _mm_setr_epi32(edge[e], edge[e] + stepX[e], edge[e] + 2 * stepX[e], edge[e] + 3 * stepX[e]);
+        groupStep[e] = _mm_set1_epi32(4 * stepX[e]);
+    }
+    const __m128 lane = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+    const __m128i laneBits = _mm_setr_epi32(1, 2, 4, 8);
+    for (int y = y0; y < y1; ++y) {
+        __m128i w0 = rowEdge[0], w1 = rowEdge[1], w2 = rowEdge[2];
+        __m128 offset = lane;
+        int row = (y - tile.y0) * CPU_TILE_SIZE + (x0 - tile.x0);
+        for (int x = x0; x < x1; x += 4, row += 4) {
+            // 3つの辺関数の符号ビットのどれかが立っていれば外側
+            int inside = ~_mm_movemask_ps(_mm_castsi128_ps(_mm_or_si128(_mm_or_si128(w0, w1), w2))) & 0xF;
+            if (x1 - x < 4) {
+                inside &= (1 << (x1 - x)) - 1;
+            }
+            if (inside) {
+                __m128 coverage = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(inside), laneBits), laneBits));
+                __m128 z = _mm_add_ps(_mm_set1_ps(depthRow), _mm_mul_ps(_mm_set1_ps(t.depth[0]), offset));
+                __m128 stored = _mm_load_ps(tile.depth + row);
+                __m128 pass = _mm_and_ps(coverage, _mm_cmplt_ps(z, stored));
+                if (_mm_movemask_ps(pass)) {
+                    __m128 r = _mm_add_ps(_mm_set1_ps(redRow), _mm_mul_ps(_mm_set1_ps(t.red[0]), offset));
+                    __m128 g = _mm_add_ps(_mm_set1_ps(greenRow), _mm_mul_ps(_mm_set1_ps(t.green[0]), offset));
+                    __m128 b = _mm_add_ps(_mm_set1_ps(blueRow), _mm_mul_ps(_mm_set1_ps(t.blue[0]), offset));
+                    _mm_store_ps(tile.depth + row, _mm_or_ps(_mm_and_ps(pass, z), _mm_andnot_ps(pass, stored)));
+                    _mm_store_ps(tile.red + row, _mm_or_ps(_mm_and_ps(pass, r), _mm_andnot_ps(pass, _mm_load_ps(tile.red + row))));
+                    _mm_store_ps(tile.green + row, _mm_or_ps(_mm_and_ps(pass, g), _mm_andnot_ps(pass, _mm_load_ps(tile.green + row))));
+                    _mm_store_ps(tile.blue + row, _mm_or_ps(_mm_and_ps(pass, b), _mm_andnot_ps(pass, _mm_load_ps(tile.blue + row))));
+                    _mm_store_ps(tile.emissive + row, _mm_or_ps(_mm_and_ps(pass, _mm_set1_ps(t.emissive)), _mm_andnot_ps(pass, _mm_load_ps(tile.emissive + row))));
+                }
+            }
+            w0 = _mm_add_epi32(w0, groupStep[0]);
+            w1 = _mm_add_epi32(w1, groupStep[1]);
+            w2 = _mm_add_epi32(w2, groupStep[2]);
+            offset = _mm_add_ps(offset, _mm_set1_ps(4.0f));
+        }
+        for (int e = 0; e < 3; ++e) {
+            rowEdge[e] = _mm_add_epi32(rowEdge[e], _mm_set1_epi32(stepY[e]));
+        }
+        depthRow += t.depth[1];
+        redRow += t.red[1];
+        greenRow += t.green[1];
+        blueRow += t.blue[1];
+    }
+#else
+    for (int y = y0; y < y1; ++y) {
+        int32_t w0 = edge[0], w1 = edge[1], w2 = edge[2];
+        int row = (y - tile.y0) * CPU_TILE_SIZE + (x0 - tile.x0);
+        for (int x = x0; x < x1; ++x, ++row) {
+            if ((w0 | w1 | w2) >= 0) {
+                float offset = static_cast<float>(x - x0);
+                float z = depthRow + t.depth[0] * offset;
+                if (z < tile.depth[row]) {
+                    tile.depth[row] = z;
+                    tile.red[row] = redRow + t.red[0] * offset;
+                    tile.green[row] = greenRow + t.green[0] * offset;
+                    tile.blue[row] = blueRow + t.blue[0] * offset;
+                    tile.emissive[row] = t.emissive;
+                }
+            }
+            w0 += stepX[0];
+            w1 += stepX[1];
+            w2 += stepX[2];
+        }
+        for (int e = 0; e < 3; ++e) {
+            edge[e] += stepY[e];
+        }
+        depthRow += t.depth[1];
+        redRow += t.red[1];
+        greenRow += t.green[1];
+        blueRow += t.blue[1];
+    }
+#endif
+}
+
+// 炎の四角形のタイル内の部分を、デプスに書かずに加算する関数 (LANTERN_FRAGMENT_SHADER の part 3 と GL_SRC_ALPHA, GL_ONE のブレンド)
+void rasterizeCpuFlame(const CpuRenderer& cr, CpuTile& tile, const CpuFlame& f) {
+    int x0 = std::max(f.x0, tile.x0), x1 = std::min(f.x1, tile.x0 + tile.width);
+    int y0 = std::max(f.y0, tile.y0), y1 = std::min(f.y1, tile.y0 + tile.height);
+    if (f.halfY < CPU_FLAME_SPLAT_PIXELS) {
+        // 四角形全体の明るさ (面積 × 平均) を1ピクセルに足す
+        if (x0 >= x1 || y0 >= y1) {
+            return;
+        }
+        int index = (y0 - tile.y0) * CPU_TILE_SIZE + (x0 - tile.x0);
+        if (f.depth >= tile.depth[index]) {
+            return;
+        }
+        float area = 4.0f * f.halfX * f.halfY * 0.9f;
+        float base = cr.flameMeanAlpha - cr.flameMeanAlphaTip;
+        float light[3] = { area * (base + cr.flameMeanAlphaTip), area * (f.green * base + cr.flameMeanAlphaTip),
+            area * (0.1f * base + 0.5f * cr.flameMeanAlphaTip) };
+        for (int c = 0; c < 3; ++c) {
+            tile.light[index * 3 + c] += light[c];
+        }
+        tile.red[index] += light[0];
+        tile.green[index] += light[1];
+        tile.blue[index] += light[2];
+        return;
+    }
+    float invX = 1.0f / f.halfX, invY = 1.0f / f.halfY;
+    for (int y = y0; y < y1; ++y) {
+        float qy = (y + 0.5f - f.y) * invY;
+        float t = qy * 0.5f + 0.5f; // 基点0 → 先端1
+        float flameWidth = 1.0f + (0.15f - 1.0f) * t * t;
+        float invWidth = 1.0f / flameWidth;
+        float red = 1.0f, green = f.green + (1.0f - f.green) * t, blue = 0.1f + (0.5f - 0.1f) * t;
+        int row = (y - tile.y0) * CPU_TILE_SIZE - tile.x0;
+        for (int x = x0; x < x1; ++x) {
+            float qx = (x + 0.5f - f.x) * invX * invWidth;
+            float d2 = qx * qx + qy * qy;
+            if (d2 >= 1.0f || f.depth >= tile.depth[row + x]) {
+                continue;
+            }
+            float a = 1.0f - std::sqrt(d2);
+            float alpha = a * a * 0.9f;
+            float* light = &tile.light[(row + x) * 3];
+            light[0] += red * alpha;
+            light[1] += green * alpha;
+            light[2] += blue * alpha;
+            tile.red[row + x] += red * alpha;
+            tile.green[row + x] += green * alpha;
+            tile.blue[row + x] += blue * alpha;
+        }
+    }
+}
+
+// タイルを描いて画像に書き込む関数 (タイルごとに並列に呼び出せる)
+void renderCpuTile(CpuRenderer& cr, size_t tileIndex) {
+    CpuTile tile;
+    tile.x0 = static_cast<int>(tileIndex % cr.tilesX) * CPU_TILE_SIZE;
+    tile.y0 = static_cast<int>(tileIndex / cr.tilesX) * CPU_TILE_SIZE;
+    tile.width = std::min(CPU_TILE_SIZE, cr.width - tile.x0);
+    tile.height = std::min(CPU_TILE_SIZE, cr.height - tile.y0);
+    std::fill(tile.depth, tile.depth + CPU_TILE_PIXELS + 4, 1.0f);
+    std::fill(tile.red, tile.red + CPU_TILE_PIXELS + 4, CPU_CLEAR_COLOR[0]);
+    std::fill(tile.green, tile.green + CPU_TILE_PIXELS + 4, CPU_CLEAR_COLOR[1]);
+    std::fill(tile.blue, tile.blue + CPU_TILE_PIXELS + 4, CPU_CLEAR_COLOR[2]);
+    std::fill(tile.emissive, tile.emissive + CPU_TILE_PIXELS + 4, 0.0f);
+
+    // 星 (デプスを使わない) → 不透明な三角形 → 炎の順に、全バッチのこのタイルの分を描く
+    auto each = [&](const CpuBins& bins, auto&& fn) {
+        if (bins.items.empty()) {
+            return;
+        }
+        for (uint32_t k = bins.start[tileIndex]; k < bins.start[tileIndex + 1]; ++k) {
+            fn(bins.items[k]);
+        }
+    };
+    for (size_t b = 0; b < cr.batchCount; ++b) {
+        const CpuBatch& batch = cr.batches[b];
+        each(batch.starBins, [&](uint32_t i) {
+            const CpuStar& s = batch.stars[i];
+            for (int y = std::max(s.y, tile.y0); y < std::min(s.y + 2, tile.y0 + tile.height); ++y) {
+                for (int x = std::max(s.x, tile.x0); x < std::min(s.x + 2, tile.x0 + tile.width); ++x) {
+                    int index = (y - tile.y0) * CPU_TILE_SIZE + (x - tile.x0);
+                    tile.red[index] = CPU_STAR_COLOR[0];
+                    tile.green[index] = CPU_STAR_COLOR[1];
+                    tile.blue[index] = CPU_STAR_COLOR[2];
+                }
+            }
+        });
+    }
+    for (size_t b = 0; b < cr.batchCount; ++b) {
+        const CpuBatch& batch = cr.batches[b];
+        each(batch.triangleBins, [&](uint32_t i) { rasterizeCpuTriangle(tile, batch.triangles[i]); });
+    }
+    for (int i = 0; i < CPU_TILE_PIXELS; ++i) {
+        tile.light[i * 3] = tile.red[i] * tile.emissive[i];
+        tile.light[i * 3 + 1] = tile.green[i] * tile.emissive[i];
+        tile.light[i * 3 + 2] = tile.blue[i] * tile.emissive[i];
+    }
+    for (size_t b = 0; b < cr.batchCount; ++b) {
+        const CpuBatch& batch = cr.batches[b];
+        each(batch.flameBins, [&](uint32_t i) { rasterizeCpuFlame(cr, tile, batch.flames[i]); });
+    }
+
+    // 0〜1に収めて8ビットにし、画像の上の行から順に書き込む
+    for (int y = 0; y < tile.height; ++y) {
+        uint8_t* out = &cr.image[(static_cast<size_t>(cr.height - 1 - (tile.y0 + y)) * cr.width + tile.x0) * 3];
+        const int row = y * CPU_TILE_SIZE;
+        for (int x = 0; x < tile.width; ++x) {
+            out[x * 3] = static_cast<uint8_t>(std::min(std::max(tile.red[row + x], 0.0f), 1.0f) * 255.0f + 0.5f);
+            out[x * 3 + 1] = static_cast<uint8_t>(std::min(std::max(tile.green[row + x], 0.0f), 1.0f) * 255.0f + 0.5f);
+            out[x * 3 + 2] = static_cast<uint8_t>(std::min(std::max(tile.blue[row + x], 0.0f), 1.0f) * 255.0f + 0.5f);
+        }
+    }
+
+    // グローの光源を縦横半分に縮める (タイルの原点は偶数なので、縮めた画素の元のピクセルは全てこのタイルにある)
+    if (!cr.glow) {
+        return;
+    }
+    const int d = GLOW_RESOLUTION_DIVISOR;
+    int gx0 = tile.x0 / d, gy0 = tile.y0 / d;
+    int gx1 = std::min((tile.x0 + tile.width) / d, cr.glowWidth), gy1 = std::min((tile.y0 + tile.height) / d, cr.glowHeight);
+    const float weight = 1.0f / (d * d);
+    for (int gy = gy0; gy < gy1; ++gy) {
+        for (int gx = gx0; gx < gx1; ++gx) {
+            float sum[3] = { 0.0f, 0.0f, 0.0f };
+            for (int sy = 0; sy < d; ++sy) {
+                const float* light = &tile.light[((gy * d + sy - tile.y0) * CPU_TILE_SIZE + (gx * d - tile.x0)) * 3];
+                for (int sx = 0; sx < d * 3; ++sx) {
+                    sum[sx % 3] += light[sx];
+                }
+            }
+            float* out = &cr.glowLight[(static_cast<size_t>(gy) * cr.glowWidth + gx) * 3];
+            for (int c = 0; c < 3; ++c) {
+                out[c] = sum[c] * weight;
+            }
+        }
+    }
+}
+
+// 縮小した光を1方向に9タップのガウスぼかしをかける関数 (GLOW_BLUR_FRAGMENT_SHADER と同じ重み。端の外は端の画素を繰り返す)
+void blurCpuGlowLine(const float* source, float* destination, int length, size_t stride) {
+    const float weights[5] = { 0.2270270270f, 0.1945945946f, 0.1216216216f, 0.0540540541f, 0.0162162162f };
+    for (int i = 0; i < length; ++i) {
+        float sum[3] = { 0.0f, 0.0f, 0.0f };
+        for (int k = -4; k <= 4; ++k) {
+            const float* p = source + std::min(std::max(i + k, 0), length - 1) * stride;
+            float w = weights[k < 0 ? -k : k];
+            sum[0] += p[0] * w;
+            sum[1] += p[1] * w;
+            sum[2] += p[2] * w;
+        }
+        float* out = destination + i * stride;
+        out[0] = sum[0];
+        out[1] = sum[1];
+        out[2] = sum[2];
+    }
+}
+
+// 縮小した光を横、縦の順にぼかし、画像に拡大 (双線形補間) して加算する関数
+void compositeCpuGlow(CpuRenderer& cr) {
+    const size_t rowStride = static_cast<size_t>(cr.glowWidth) * 3;
+    jobSystem.parallelForEach(static_cast<size_t>(cr.glowHeight), [&](size_t y) {
+        blurCpuGlowLine(&cr.glowLight[y * rowStride], &cr.glowScratch[y * rowStride], cr.glowWidth, 3);
+    });
+    jobSystem.parallelForEach(static_cast<size_t>(cr.glowWidth), [&](size_t x) {
+        blurCpuGlowLine(&cr.glowScratch[x * 3], &cr.glowLight[x * 3], cr.glowHeight, rowStride);
+    });
+    const float scale = 1.0f / GLOW_RESOLUTION_DIVISOR;
+    auto composite = [&](size_t y) {
+        float gy = std::min(std::max((y + 0.5f) * scale - 0.5f, 0.0f), static_cast<float>(cr.glowHeight - 1));
+        int y0 = static_cast<int>(gy), y1 = std::min(y0 + 1, cr.glowHeight - 1);
+        float fy = gy - y0;
+        uint8_t* out = &cr.image[static_cast<size_t>(cr.height - 1 - y) * cr.width * 3];
+        for (int x = 0; x < cr.width; ++x) {
+            float gx = std::min(std::max((x + 0.5f) * scale - 0.5f, 0.0f), static_cast<float>(cr.glowWidth - 1));
+            int x0 = static_cast<int>(gx), x1 = std::min(x0 + 1, cr.glowWidth - 1);
+            float fx = gx - x0;
+            const float* p00 = &cr.glowLight[(y0 * rowStride) + x0 * 3];
+            const float* p10 = &cr.glowLight[(y0 * rowStride) + x1 * 3];
+            const float* p01 = &cr.glowLight[(y1 * rowStride) + x0 * 3];
+            const float* p11 = &cr.glowLight[(y1 * rowStride) + x1 * 3];
+            for (int c = 0; c < 3; ++c) {
+                float g = (p00[c] + (p10[c] - p00[c]) * fx) * (1.0f - fy) + (p01[c] + (p11[c] - p01[c]) * fx) * fy;
+                float value = out[x * 3 + c] / 255.0f + g * GLOW_INTENSITY;
+                out[x * 3 + c] = static_cast<uint8_t>(std::min(value, 1.0f) * 255.0f + 0.5f);
+            }
+        }
+    };
+    jobSystem.parallelForEach(static_cast<size_t>(cr.height), composite);
+}
+
+// 次のバッチを (前のフレームの作業領域を使い回して) 用意する関数
+CpuBatch& addCpuBatch(CpuRenderer& cr, CpuBatchKind kind, size_t first, size_t count) {
+    if (cr.batchCount == cr.batches.size()) {
+        cr.batches.emplace_back();
+    }
+    CpuBatch& batch = cr.batches[cr.batchCount++];
+    batch.kind = kind;
+    batch.first = first;
+    batch.count = count;
+    return batch;
+}
+
+// 1フレームの所要時間と描いた数
+struct CpuFrameStats {
+    double lanternMs = 0.0; // 見えるランタンの収集と並べ替え
+    double setupMs = 0.0; // バッチの変換・準備・振り分け
+    double tileMs = 0.0; // タイルの描画とグローの加算
+    size_t lanterns = 0, triangles = 0, flames = 0, stars = 0;
+};
+
+// 現在のカメラとティックのシーンを cr.image に描く関数 (syncCamera の後、実行中のティックのジョブが終わってから呼び出す)
+CpuFrameStats renderCpuFrame(CpuRenderer& cr) {
+    CpuFrameStats stats;
+    auto start = std::chrono::steady_clock::now();
+    cr.view = camera.view();
+    cr.projection = camera.projection();
+    cr.viewProjection = camera.viewProjection();
+    cr.skyViewProjection = camera.projection() * camera.skyView();
+    cr.time = flameTime();
+
+    // 見えるランタンを (GLの描画と同じ視錐台・遮蔽カリングで) 集め、手前から順に並べる (順序をスレッド数によらず決める)
+    jobSystem.run(publishLanternInstancesTask(cr.instances.data()));
+    cr.instanceCount = publishedNearCount;
+    const float* v = cr.view.m;
+    auto depthOf = [v](const LanternInstance& l) { return -(v[2] * l.x + v[6] * l.y + v[10] * l.z + v[14]); };
+    std::sort(cr.instances.begin(), cr.instances.begin() + cr.instanceCount, [&](const LanternInstance& a, const LanternInstance& b) {
+        float da = depthOf(a), db = depthOf(b);
+        if (da != db) {
+            return da < db;
+        }
+        return std::tie(a.x, a.y, a.z, a.phase) < std::tie(b.x, b.y, b.z, b.phase);
+    });
+    auto lanternsDone = std::chrono::steady_clock::now();
+
+    // メッシュの頂点はランタンによらないので、向きとしての変換はフレームに1回にする
+    transformCpuMeshDirections(cr.bodyMesh, cr.viewProjection, cr.bodyDirections);
+    transformCpuMeshDirections(cr.lowMesh, cr.viewProjection, cr.lowDirections);
+    cr.batchCount = 0;
+    for (size_t c = 0; c < groundChunks.size(); ++c) {
+        const GroundChunk& chunk = groundChunks[c];
+        Vec3 lo = { chunk.cx * GROUND_CHUNK_SIZE, GROUND_Y, chunk.cz * GROUND_CHUNK_SIZE };
+        Vec3 hi = { lo.x + GROUND_CHUNK_SIZE, GROUND_Y, lo.z + GROUND_CHUNK_SIZE };
+        if (chunk.cx != INT_MIN && camera.frustum().intersectsBox(lo, hi)) {
+            addCpuBatch(cr, CPU_BATCH_GROUND, c, 1);
+        }
+    }
+    for (size_t first = 0; first < cr.instanceCount; first += CPU_LANTERNS_PER_BATCH) {
+        addCpuBatch(cr, CPU_BATCH_LANTERNS, first, std::min(CPU_LANTERNS_PER_BATCH, cr.instanceCount - first));
+    }
+    for (size_t first = 0; first < stars.size(); first += CPU_STARS_PER_BATCH) {
+        addCpuBatch(cr, CPU_BATCH_STARS, first, std::min(CPU_STARS_PER_BATCH, stars.size() - first));
+    }
+    jobSystem.parallelForEach(cr.batchCount, [&](size_t b) { buildCpuBatch(cr, cr.batches[b]); });
+    auto setupDone = std::chrono::steady_clock::now();
+
+    jobSystem.parallelForEach(static_cast<size_t>(cr.tilesX) * cr.tilesY, [&](size_t tile) { renderCpuTile(cr, tile); });
+    if (cr.glow) {
+        compositeCpuGlow(cr);
+    }
+    auto tilesDone = std::chrono::steady_clock::now();
+
+    stats.lanternMs = std::chrono::duration<double, std::milli>(lanternsDone - start).count();
+    stats.setupMs = std::chrono::duration<double, std::milli>(setupDone - lanternsDone).count();
+    stats.tileMs = std::chrono::duration<double, std::milli>(tilesDone - setupDone).count();
+    stats.lanterns = cr.instanceCount;
+    for (size_t b = 0; b < cr.batchCount; ++b) {
+        stats.triangles += cr.batches[b].triangles.size();
+        stats.flames += cr.batches[b].flames.size();
+        stats.stars += cr.batches[b].stars.size();
+    }
+    return stats;
+}
+
+// GLを使わずにCPUでシーンを描き、フレームごとの画像を書き出す関数 (--cpu-render)
+int runCpuRender(const std::string& directory) {
+    synchronousStreaming = true; // セクターの生成をティックに同期させ、毎回同じ世界にする
+    startJobSystem();
+    initGround(); // GLの拡張を読まないので、地面の頂点はクライアント側の配列に作る
+    initSimulation();
+    if (cpuRenderLanterns > 0) {
+        // 原点の周りに並べたセクターのランタンに置き換える (以降はストリーミングせず、再出現だけ進める)
+        size_t blocks = layoutBenchmarkSectors(cpuRenderLanterns);
+        size_t count = blocks * LANTERNS_PER_SECTOR;
+        if (compactLanterns) {
+            allocateCompactLanternPool(count);
+            lanternPool.capacity = count;
+        }
+        else {
+            allocateLanternPool(lanternPool, count);
+        }
+        spawnBenchmarkLanterns(blocks);
+    }
+    camera.setPerspective(45.0f, static_cast<float>(cpuRenderWidth) / static_cast<float>(cpuRenderHeight), 0.1f, 500.0f);
+    initCpuRenderer(cpuRenderer, cpuRenderWidth, cpuRenderHeight);
+    std::cout << "CPUで描画: " << cpuRenderWidth << "x" << cpuRenderHeight << ", タイル " << cpuRenderer.tilesX * cpuRenderer.tilesY
+        << ", スレッド " << jobSystem.threadCount() << ", ランタン " << lanternPool.count << " 個" << std::endl;
+
+    int failures = 0;
+    double totalMs = 0.0;
+    printf("%-6s %10s %10s %10s %10s %10s %10s %10s\n", "フレーム", "ランタン", "三角形", "炎", "収集 (ms)", "準備 (ms)", "タイル (ms)", "合計 (ms)");
+    for (int frame = 0; frame < cpuRenderFrames; ++frame) {
+        if (cpuRenderLanterns > 0) {
+            ++simTick;
+            respawnLanterns();
+        }
+        else {
+            simulateTick();
+            finishTickJobs();
+        }
+        syncCamera();
+        updateGroundChunks(cameraX, cameraZ);
+        CpuFrameStats stats = renderCpuFrame(cpuRenderer);
+        double frameMs = stats.lanternMs + stats.setupMs + stats.tileMs;
+        totalMs += frameMs;
+        printf("%-6d %10zu %10zu %10zu %10.2f %10.2f %10.2f %10.2f\n", frame, stats.lanterns, stats.triangles, stats.flames,
+            stats.lanternMs, stats.setupMs, stats.tileMs, frameMs);
+
+        char name[32];
+        snprintf(name, sizeof(name), "frame_%04d.ppm", frame);
+        if (!writePpm(directory + "/" + name, cpuRenderer.image, cpuRenderWidth, cpuRenderHeight)) {
+            ++failures;
+        }
+    }
+    printf("平均 %.2f ms/フレーム\n", cpuRenderFrames > 0 ? totalMs / cpuRenderFrames : 0.0);
+    fflush(stdout);
+    if (failures > 0) {
+        std::cout << "書き出せなかった画像: " << failures << " (" << directory << ")" << std::endl;
+    }
+    jobSystem.stop();
+    return failures > 0 ? 1 : 0;
+}
+
+// --- FPSの計測 (--fps-benchmark) ---
+// タイマーの代わりにアイドル時にティックと描画を交互に繰り返し、一定の道のりを前進しながら平均FPSを測る
+// (ビルド構成の比較用。表示の垂直同期は環境変数で切っておく)
+const int FPS_BENCHMARK_WARMUP_FRAMES = 30; // 遅延準備とシェーダーのコンパイルを除くため、計測前に描くフレーム数
+int fpsBenchmarkFrames = 0; // 0以外なら、このフレーム数を計測して結果を表示して終了する
+int fpsBenchmarkFrame = 0; // 描いたフレーム数 (準備のフレームを含む)
+std::chrono::steady_clock::time_point fpsBenchmarkStart, fpsBenchmarkLast; // 計測の開始と直前のフレームの終わり
+double fpsBenchmarkWorstMs = 0.0; // 最も長かったフレーム時間
+
+void fpsBenchmarkIdle() {
+    specialKeyStates[GLUT_KEY_UP] = true; // 毎回同じ道のりになるよう前進し続ける
+    simulateTick();
+    display();
+    glFinish(); // GPUの処理の終わりまでをフレーム時間に含める
+
+    auto now = std::chrono::steady_clock::now();
+    ++fpsBenchmarkFrame;
+    if (fpsBenchmarkFrame == FPS_BENCHMARK_WARMUP_FRAMES) {
+        fpsBenchmarkStart = now;
+    }
+    else if (fpsBenchmarkFrame > FPS_BENCHMARK_WARMUP_FRAMES) {
+        fpsBenchmarkWorstMs = std::max(fpsBenchmarkWorstMs, std::chrono::duration<double, std::milli>(now - fpsBenchmarkLast).count());
+    }
+    fpsBenchmarkLast = now;
+    if (fpsBenchmarkFrame < FPS_BENCHMARK_WARMUP_FRAMES + fpsBenchmarkFrames) {
+        return;
+    }
+    double totalMs = std::chrono::duration<double, std::milli>(now - fpsBenchmarkStart).count();
+    std::cout << "FPS: " << fpsBenchmarkFrames * 1000.0 / totalMs << " (フレーム " << fpsBenchmarkFrames << ", 平均 "
+        << totalMs / fpsBenchmarkFrames << " ms, 最長 " << fpsBenchmarkWorstMs << " ms)" << std::endl;
+    std::exit(0);
+}
+
+// コマンドライン引数の数値を読む関数 (数値として読めない・余分な文字がある・型の範囲外なら引数名を表示してfalse)
+// 整数は負の値を受け付けない (個数・フレーム数・シードのみ)
+template <typename T>
+bool parseNumberArgument(const char* flag, const char* text, T& value) {
+    char* end = nullptr;
+    errno = 0;
+    bool ok = false;
+    if constexpr (std::is_floating_point<T>::value) {
+        float parsed = strtof(text, &end);
+        ok = errno == 0 && std::isfinite(parsed);
+        value = parsed;
+    }
+    else {
+        unsigned long long parsed = strtoull(text, &end, 10);
+        ok = errno == 0 && text[0] != '-' && parsed <= static_cast<unsigned long long>(std::numeric_limits<T>::max());
+        value = static_cast<T>(parsed);
+    }
+    if (!ok || end == text || *end != '\0') {
+        std::cout << "引数 " << flag << " の値が正しくありません: " << text << std::endl;
+        return false;
+    }
+    return true;
+}
+
 int main(int argc, char** argv) {
+    // 独自のコマンドライン引数を解釈 (GLUTの引数は glutInit が処理する)
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--load-snapshot" && i + 1 < argc) {
+            snapshotLoadPath = argv[++i]; // 起動時にこのスナップショットから再開する
+        }
+        else if (arg == "--save-snapshot" && i + 1 < argc) {
+            snapshotSavePath = argv[++i]; // 'k'キーでの保存先
+        }
+        else if (arg == "--seed" && i + 1 < argc) {
+            if (!parseNumberArgument("--seed", argv[++i], rngSeed)) { // 乱数のシードを固定
+                return 1;
+            }
+        }
+        else if (arg == "--record" && i + 1 < argc) {
+            journalRecordPath = argv[++i]; // 入力をジャーナルに記録する
+        }
+        else if (arg == "--replay" && i + 1 < argc) {
+            journalReplayPath = argv[++i]; // ジャーナルをヘッドレスで再生する
+        }
+        else if (arg == "--frame-target" && i + 1 < argc) {
+            if (!parseNumberArgument("--frame-target", argv[++i], dynamicResolution.targetMs)) { // シーン描画のGPU時間の目標 (ミリ秒)
+                return 1;
+            }
+        }
+        else if (arg == "--native-resolution") {
+            nativeResolution = true; // 動的解像度を使わない
+        }
+        else if (arg == "--stars" && i + 1 < argc) {
+            if (!parseNumberArgument("--stars", argv[++i], starCount)) { // 生成する星の数
+                return 1;
+            }
+        }
+        else if (arg == "--sky-cubemap") {
+            skyCubemap = true; // 星をキューブマップに描いておき、全画面の1パスで描く
+        }
+        else if (arg == "--no-occlusion") {
+            disableOcclusion = true; // 遮蔽カリングを行わない
+        }
+        else if (arg == "--no-impostors") {
+            disableImpostors = true; // 遠くのランタンも形状で描く
+        }
+        else if (arg == "--no-glow") {
+            disableGlow = true; // 炎のグローを使わない
+        }
+        else if (arg == "--compact-lanterns") {
+            compactLanterns = true; // ランタンの状態をコンパクトな形式で持つ
+        }
+        else if (arg == "--bench-compact") {
+            // 通常とコンパクトな形式の比較 (個数を省略すると100万個)
+            size_t count = 1000000;
+            if (i + 1 < argc && argv[i + 1][0] != '-' && !parseNumberArgument("--bench-compact", argv[++i], count)) {
+                return 1;
+            }
+            return runCompactBenchmark(count);
+        }
+        else if (arg == "--fps-benchmark") {
+            // ウィンドウを開いて一定の道のりを描き、平均FPSを表示して終了する (フレーム数を省略すると600)
+            fpsBenchmarkFrames = 600;
+            if (i + 1 < argc && argv[i + 1][0] != '-' && !parseNumberArgument("--fps-benchmark", argv[++i], fpsBenchmarkFrames)) {
+                return 1;
+            }
+            fpsBenchmarkFrames = std::max(1, fpsBenchmarkFrames);
+        }
+        else if (arg == "--bench-bvh") {
+            // BVHの更新と問い合わせの時間 (個数を省略すると100万個)
+            size_t count = 1000000;
+            if (i + 1 < argc && argv[i + 1][0] != '-' && !parseNumberArgument("--bench-bvh", argv[++i], count)) {
+                return 1;
+            }
+            return runBvhBenchmark(count);
+        }
+        else if (arg == "--memory-report") {
+            // ランタン数を増やしたときのメモリの上限と定常状態の確保回数 (個数を省略すると100万個)
+            size_t count = 1000000;
+            if (i + 1 < argc && argv[i + 1][0] != '-' && !parseNumberArgument("--memory-report", argv[++i], count)) {
+                return 1;
+            }
+            memoryReportLanterns = std::max<size_t>(count, 1);
+        }
+        else if (arg == "--bench") {
+            runMicroBenchmarksOnly = true; // 描画ヘルパーと更新処理のマイクロベンチマーク
+        }
+        else if (arg == "--bench-filter" && i + 1 < argc) {
+            benchFilter = argv[++i]; // 名前にこの文字列を含む項目だけを測る
+        }
+        else if (arg == "--bench-json" && i + 1 < argc) {
+            benchJsonPath = argv[++i]; // 結果をJSONで書き出す
+        }
+        else if (arg == "--golden" && i + 1 < argc) {
+            goldenDirectory = argv[++i]; // 基準画像と比べる
+        }
+        else if (arg == "--golden-update" && i + 1 < argc) {
+            goldenDirectory = argv[++i]; // 基準画像を書き出す
+            goldenUpdate = true;
+        }
+        else if (arg == "--cpu-render" && i + 1 < argc) {
+            cpuRenderDirectory = argv[++i]; // GLを使わずにCPUで描いた画像を書き出す
+        }
+        else if (arg == "--cpu-frames" && i + 1 < argc) {
+            if (!parseNumberArgument("--cpu-frames", argv[++i], cpuRenderFrames)) { // CPUで描くフレーム数
+                return 1;
+            }
+            cpuRenderFrames = std::max(1, cpuRenderFrames);
+        }
+        else if (arg == "--cpu-size" && i + 1 < argc) {
+            // CPUで描く大きさ (幅x高さ)
+            int width = 0, height = 0;
+            char extra = 0;
+            if (sscanf(argv[++i], "%dx%d%c", &width, &height, &extra) != 2 || width <= 0 || height <= 0) {
+                std::cout << "引数 --cpu-size の値が正しくありません: " << argv[i] << std::endl;
+                return 1;
+            }
+            cpuRenderWidth = std::min(width, CPU_MAX_SIZE);
+            cpuRenderHeight = std::min(height, CPU_MAX_SIZE);
+        }
+        else if (arg == "--cpu-lanterns" && i + 1 < argc) {
+            if (!parseNumberArgument("--cpu-lanterns", argv[++i], cpuRenderLanterns)) { // この個数のランタンを並べた世界をCPUで描く
+                return 1;
+            }
+        }
+    }
+    if (runMicroBenchmarksOnly) {
+        return runMicroBenchmarks();
+    }
+    if (memoryReportLanterns) {
+        return runMemoryReport(memoryReportLanterns);
+    }
+    if (!goldenDirectory.empty()) {
+        return runGoldenTests(goldenDirectory);
+    }
+    if (!cpuRenderDirectory.empty()) {
+        return runCpuRender(cpuRenderDirectory);
+    }
+
+    // 再生モードはウィンドウを作らずにシミュレーションだけを実行する
+    if (!journalReplayPath.empty()) {
+        return runReplay(journalReplayPath);
+    }
+
     glutInit(&argc, argv); // GLUTを初期化
     glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH); // ダブルバッファ、RGBカラー、デプスバッファ
     glutInitWindowSize(800, 600); // 初期ウィンドウサイズを設定
     glutCreateWindow("Kom Loy Festival Simulation"); // ウィンドウを作成
+    startupTimer.mark("ウィンドウ作成");
 
+    if (!journalRecordPath.empty()) {
+        synchronousStreaming = true; // 再生と同じティックでセクターを反映しないと、再生が記録したセッションを再現しない
+    }
     init(); // カスタム初期化関数を呼び出し
+    if (!journalRecordPath.empty() && startJournalRecording(journalRecordPath)) {
+        std::atexit(finishJournalRecording); // 下で登録する finishTickJobs より後に呼ばれる (自分でも最後のティックを待つ)
+    }
 
     // コールバック関数を登録
     glutDisplayFunc(display);
@@ -653,8 +7619,14 @@ int main(int argc, char** argv) {
     glutKeyboardUpFunc(keyboardUp);
     glutSpecialFunc(specialKeyboard);
     glutSpecialUpFunc(specialKeyboardUp);
-    glutTimerFunc(0, timer, 0); // タイマーをすぐに開始
+    if (fpsBenchmarkFrames > 0) {
+        glutIdleFunc(fpsBenchmarkIdle); // 計測中はタイマーを待たずに描き続ける
+    }
+    else {
+        glutTimerFunc(0, timer, 0); // タイマーをすぐに開始
+    }
 
+    std::atexit(finishTickJobs); // ウィンドウを閉じて終了するときは、実行中のティックのジョブを待ってからタスクを破棄する
     glutMainLoop(); // GLUTイベント処理ループに入る
     return 0;
 }
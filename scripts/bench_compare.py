@@ -0,0 +1,68 @@
+#!/usr/bin/env python3
+# 2つのビルドの --bench の結果 (Google Benchmark と同じ形式のJSON) を項目ごとに比べ、しきい値より遅くなった項目を示す。
+#
+# 使い方: scripts/bench_compare.py <基準.json> <比較.json> [--threshold 0.05] [--metric real_time]
+#   --threshold  遅くなったとみなす割合 (既定 0.05 = 5%)
+#   --metric     比べる値 (real_time, cpu_time, ns_per_lantern, ns_per_vertex。既定 real_time)
+# 遅くなった項目があれば終了コード1を返す (CIやビルド構成の比較から使う)。
+# Google Benchmark 本体の出力も読めるよう、繰り返しの集計 (aggregate) があれば中央値を使う。
+import argparse
+import json
+import sys
+
+
+def load_results(path, metric):
+    with open(path, encoding="utf-8") as f:
+        data = json.load(f)
+    results = {}
+    medians = {}
+    for bench in data.get("benchmarks", []):
+        if metric not in bench:
+            continue
+        if bench.get("run_type") == "aggregate":
+            if bench.get("aggregate_name") == "median":
+                medians[bench.get("run_name", bench["name"])] = float(bench[metric])
+            continue
+        results.setdefault(bench.get("run_name", bench["name"]), float(bench[metric]))
+    results.update(medians)
+    return results
+
+
+def main():
+    parser = argparse.ArgumentParser(description="2つのビルドのベンチマーク結果を比べる")
+    parser.add_argument("baseline", help="基準のJSON")
+    parser.add_argument("contender", help="比較するJSON")
+    parser.add_argument("--threshold", type=float, default=0.05, help="遅くなったとみなす割合 (既定 0.05)")
+    parser.add_argument("--metric", default="real_time", help="比べる値 (既定 real_time)")
+    args = parser.parse_args()
+
+    baseline = load_results(args.baseline, args.metric)
+    contender = load_results(args.contender, args.metric)
+
+    regressions = 0
+    print(f"{'項目':<28} {'基準':>14} {'比較':>14} {'変化':>9}")
+    for name, base in baseline.items():
+        if name not in contender:
+            print(f"{name:<28} {base:>14.3f} {'-':>14} {'(なし)':>9}")
+            continue
+        value = contender[name]
+        change = (value - base) / base if base > 0.0 else 0.0
+        mark = ""
+        if change > args.threshold:
+            mark = "  <-- 遅くなった"
+            regressions += 1
+        elif change < -args.threshold:
+            mark = "  速くなった"
+        print(f"{name:<28} {base:>14.3f} {value:>14.3f} {change * 100.0:>+8.1f}%{mark}")
+    for name in contender:
+        if name not in baseline:
+            print(f"{name:<28} {'-':>14} {contender[name]:>14.3f} {'(新規)':>9}")
+
+    if regressions:
+        print(f"{args.metric} が {args.threshold * 100.0:.1f}% より遅くなった項目: {regressions}")
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,97 @@
+#!/usr/bin/env bash
+# ビルド構成ごとの速度を比較する。
+#   Release / RelWithDebInfo / Release+LTO / Release+PGO / Release+LTO+PGO をビルドし、
+#   PGOは 計測用ビルド → ヘッドレスのベンチマーク (と表示があればFPSの計測) で学習 → プロファイルを使って再ビルド の順に行う。
+#   各構成で --fps-benchmark の平均FPS (表示がある場合) と、ヘッドレスのベンチマークの時間を測り、
+#   Markdown の表を標準出力と $BUILD_ROOT/report.md に書き出す。
+#
+# 使い方: scripts/build_configurations.sh [ビルド先 (既定: build-configurations)]
+# 環境変数: FPS_FRAMES (計測フレーム数、既定600), BENCH_LANTERNS (ヘッドレスのベンチマークのランタン数、既定1000000),
+#           CMAKE_ARGS (全ての構成に追加するCMakeの引数)
+set -euo pipefail
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+BUILD_ROOT=$(mkdir -p "${1:-$ROOT/build-configurations}" && cd "${1:-$ROOT/build-configurations}" && pwd)
+FPS_FRAMES=${FPS_FRAMES:-600}
+BENCH_LANTERNS=${BENCH_LANTERNS:-1000000}
+PROFILE_DIR="$BUILD_ROOT/pgo-profiles"
+read -r -a EXTRA_ARGS <<< "${CMAKE_ARGS:-}"
+
+# 表示があるときだけウィンドウを開いてFPSを測る (垂直同期は Mesa と NVIDIA の環境変数で切る)
+HAVE_DISPLAY=0
+if [[ -n "${DISPLAY:-}" || -n "${WAYLAND_DISPLAY:-}" ]]; then
+    HAVE_DISPLAY=1
+fi
+
+build() { # build <名前> <CMakeの引数...>
+    local name=$1
+    shift
+    echo "== ビルド: $name" >&2
+    cmake -S "$ROOT" -B "$BUILD_ROOT/$name" "$@" ${EXTRA_ARGS[@]+"${EXTRA_ARGS[@]}"} > "$BUILD_ROOT/$name.configure.log"
+    cmake --build "$BUILD_ROOT/$name" -j"$(nproc)" > "$BUILD_ROOT/$name.build.log"
+}
+
+fps() { # fps <実行ファイル> → 平均FPS (表示がなければ "-")
+    if [[ $HAVE_DISPLAY == 0 ]]; then
+        echo "-"
+        return
+    fi
+    vblank_mode=0 __GL_SYNC_TO_VBLANK=0 "$1" --seed 1 --fps-benchmark "$FPS_FRAMES" | sed -n 's/^FPS: \([0-9.]*\).*/\1/p'
+}
+
+unpack_ms() { # unpack_ms <実行ファイル> → ランタンの位置の展開 (通常の形式) のミリ秒
+    "$1" --seed 1 --bench-compact "$BENCH_LANTERNS" | sed -n 's/^通常:.*展開 \([0-9.e+-]*\) ms.*/\1/p'
+}
+
+refit_ms() { # refit_ms <実行ファイル> → BVHの箱の作り直しのミリ秒
+    "$1" --seed 1 --bench-bvh "$BENCH_LANTERNS" | sed -n 's/.*箱の作り直し \([0-9.e+-]*\) ms.*/\1/p'
+}
+
+# --- PGO: 計測用ビルド → 学習 → (プロファイルを使う構成は下でビルド) ---
+rm -rf "$PROFILE_DIR"
+mkdir -p "$PROFILE_DIR"
+build pgo-generate -DCMAKE_BUILD_TYPE=Release -DKOMLOY_PGO=GENERATE -DKOMLOY_PGO_DIR="$PROFILE_DIR"
+echo "== PGOの学習" >&2
+TRAINER="$BUILD_ROOT/pgo-generate/komloy"
+"$TRAINER" --seed 1 --bench-compact 200000 > /dev/null
+"$TRAINER" --seed 1 --bench-bvh 200000 > /dev/null
+if [[ $HAVE_DISPLAY == 1 ]]; then
+    vblank_mode=0 __GL_SYNC_TO_VBLANK=0 "$TRAINER" --seed 1 --fps-benchmark 300 > /dev/null
+fi
+if compgen -G "$PROFILE_DIR/*.profraw" > /dev/null; then
+    llvm-profdata merge -o "$PROFILE_DIR/default.profdata" "$PROFILE_DIR"/*.profraw # Clangの場合
+fi
+
+CONFIGS=(release relwithdebinfo lto pgo lto-pgo)
+build release -DCMAKE_BUILD_TYPE=Release
+build relwithdebinfo -DCMAKE_BUILD_TYPE=RelWithDebInfo
+build lto -DCMAKE_BUILD_TYPE=Release -DKOMLOY_LTO=ON
+build pgo -DCMAKE_BUILD_TYPE=Release -DKOMLOY_PGO=USE -DKOMLOY_PGO_DIR="$PROFILE_DIR"
+build lto-pgo -DCMAKE_BUILD_TYPE=Release -DKOMLOY_LTO=ON -DKOMLOY_PGO=USE -DKOMLOY_PGO_DIR="$PROFILE_DIR"
+
+# --- 計測とレポート (Release との比) ---
+REPORT="$BUILD_ROOT/report.md"
+{
+    echo "# ビルド構成の比較"
+    echo
+    echo "$(uname -srm), $(cmake --version | head -n 1), ランタン $BENCH_LANTERNS 個, FPSは $FPS_FRAMES フレームの平均"
+    echo
+    echo "| 構成 | FPS | FPS比 | 位置の展開 (ms) | BVHの作り直し (ms) | 実行ファイル (KB) |"
+    echo "|---|---:|---:|---:|---:|---:|"
+} > "$REPORT"
+BASE_FPS=""
+for name in "${CONFIGS[@]}"; do
+    echo "== 計測: $name" >&2
+    exe="$BUILD_ROOT/$name/komloy"
+    f=$(fps "$exe")
+    u=$(unpack_ms "$exe")
+    r=$(refit_ms "$exe")
+    size=$(( $(stat -c %s "$exe") / 1024 ))
+    [[ -z $BASE_FPS ]] && BASE_FPS=$f
+    ratio=$(awk -v f="$f" -v b="$BASE_FPS" 'BEGIN { if (f == "-" || b == "-" || b == 0) print "-"; else printf "%.2f", f / b }')
+    echo "| $name | $f | $ratio | $u | $r | $size |" >> "$REPORT"
+done
+if [[ $HAVE_DISPLAY == 0 ]]; then
+    printf '\n表示がないためFPSは測っていない (ヘッドレスのベンチマークのみ)。\n' >> "$REPORT"
+fi
+cat "$REPORT"